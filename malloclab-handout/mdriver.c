@@ -18,11 +18,15 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef THREAD_SAFE
+#include <pthread.h>
+#endif
 
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "clock.h"
 #include "config.h"
 
 /**********************
@@ -177,7 +181,17 @@ static void eval_libc_speed(void *ptr);
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum);
+static int replay_trace(const trace_t *trace, char **blocks);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_latency(trace_t *trace, double *mean, double *worst);
+static void run_latency(int num_tracefiles, const char *tracedir,
+                        char **tracefiles, const stats_t *mm_stats);
+#ifdef THREAD_SAFE
+static double eval_mm_speed_mt(trace_t *trace, int nthreads);
+static void run_scaling(int num_tracefiles, const char *tracedir,
+                        char **tracefiles, const stats_t *mm_stats,
+                        int max_threads);
+#endif
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
@@ -266,6 +280,10 @@ int main(int argc, char **argv)
     speed_t speed_params;      /* input parameters to the xx_speed routines */
 
     int run_libc = 0;     /* If set, run libc malloc (set by -l) */
+    int run_lat = 0;      /* If set, time each request (set by -L) */
+#ifdef THREAD_SAFE
+    int max_threads = 0;  /* If set, run the scaling test (set by -T) */
+#endif
     int autograder = 0;   /* if set then called by autograder (-A) */
 
     /* temporaries used to compute the performance index */
@@ -280,7 +298,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hVAlD")) != EOF) {
+    while ((c = getopt(argc, argv, "d:f:c:s:t:v:T:hVAlLD")) != EOF) {
         switch (c) {
 
         case 'A': /* Hidden Autolab driver argument */
@@ -318,6 +336,10 @@ int main(int argc, char **argv)
             run_libc = 1;
             break;
 
+        case 'L': /* Time each request of the mm package */
+            run_lat = 1;
+            break;
+
         case 'V': /* Increase verbosity level */
             verbose += 1;
             break;
@@ -338,6 +360,17 @@ int main(int argc, char **argv)
             set_timeout = atoi(optarg);
             break;
 
+        case 'T': /* Replay the traces on up to <n> threads */
+#ifdef THREAD_SAFE
+            max_threads = atoi(optarg);
+            if (max_threads < 1)
+                app_error("-T needs at least 1 thread");
+#else
+            app_error("-T needs an mm package built with THREAD_SAFE "
+                      "(mdriver-mt)");
+#endif
+            break;
+
         case 'h': /* Print this message */
             usage();
             exit(0);
@@ -433,6 +466,15 @@ int main(int argc, char **argv)
         }
     }
 
+    if (run_lat && !onetime_flag)
+        run_latency(num_tracefiles, tracedir, tracefiles, mm_stats);
+
+#ifdef THREAD_SAFE
+    if (max_threads > 0 && !onetime_flag)
+        run_scaling(num_tracefiles, tracedir, tracefiles, mm_stats,
+                    max_threads);
+#endif
+
     /*
      * Accumulate the aggregate statistics for the student's mm package
      */
@@ -1070,20 +1112,14 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 
 
 /*
- * eval_mm_speed - This is the function that is used by fcyc()
- *    to measure the running time of the mm malloc package.
+ * replay_trace - run the requests of the trace, keeping the blocks in
+ *    blocks, which must be all NULL to start with. Return -1, or the
+ *    opnum of the mm_malloc or mm_realloc that failed.
  */
-static void eval_mm_speed(void *ptr)
+static int replay_trace(const trace_t *trace, char **blocks)
 {
     int i, index, size, newsize;
     char *p, *newp, *oldp, *block;
-    trace_t *trace = ((speed_t *)ptr)->trace;
-    reinit_trace(trace);
-
-    /* Reset the heap and initialize the mm package */
-    mem_reset_brk();
-    if (mm_init() < 0)
-        app_error("mm_init failed in eval_mm_speed");
 
     /* Interpret each trace request */
     for (i = 0;  i < trace->num_ops;  i++)
@@ -1093,17 +1129,17 @@ static void eval_mm_speed(void *ptr)
             index = trace->ops[i].index;
             size = trace->ops[i].size;
             if ((p = mm_malloc(size)) == NULL)
-                app_error("mm_malloc error in eval_mm_speed");
-            trace->blocks[index] = p;
+                return i;
+            blocks[index] = p;
             break;
 
         case REALLOC: /* mm_realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
-            oldp = trace->blocks[index];
+            oldp = blocks[index];
             if ((newp = mm_realloc(oldp,newsize)) == NULL && newsize != 0)
-                app_error("mm_realloc error in eval_mm_speed");
-            trace->blocks[index] = newp;
+                return i;
+            blocks[index] = newp;
             break;
 
         case FREE: /* mm_free */
@@ -1111,16 +1147,314 @@ static void eval_mm_speed(void *ptr)
             if(index < 0) {
                 block = 0;
             } else {
-                block = trace->blocks[index];
+                block = blocks[index];
             }
             mm_free(block);
             break;
 
         default:
-            app_error("Nonexistent request type in eval_mm_speed");
+            app_error("Nonexistent request type in replay_trace");
+        }
+    return -1;
+}
+
+/*
+ * eval_mm_speed - This is the function that is used by fcyc()
+ *    to measure the running time of the mm malloc package.
+ */
+static void eval_mm_speed(void *ptr)
+{
+    int i;
+    trace_t *trace = ((speed_t *)ptr)->trace;
+    reinit_trace(trace);
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0)
+        app_error("mm_init failed in eval_mm_speed");
+
+    if ((i = replay_trace(trace, trace->blocks)) >= 0)
+        app_error("%s error in eval_mm_speed",
+                  trace->ops[i].type == ALLOC ? "mm_malloc" : "mm_realloc");
+}
+
+/*
+ * eval_mm_latency - Time each request of the trace with the cycle
+ *    counter and return the mean and the worst cycles per request. A
+ *    request counts with the least it took in LAT_REPS runs, so that
+ *    the worst case is the allocator's and not a timer interrupt's.
+ */
+#define LAT_REPS 5
+static void eval_mm_latency(trace_t *trace, double *mean, double *worst)
+{
+    int i, rep, index;
+    double *cycles, c, overhead = DBL_MAX;
+    char *p;
+
+    /* what reading the counter costs by itself */
+    for (i = 0; i < 1000; i++) {
+        start_counter();
+        c = get_counter();
+        if (c < overhead)
+            overhead = c;
+    }
+
+    if ((cycles = (double *)malloc(trace->num_ops * sizeof(double))) == NULL)
+        unix_error("malloc in eval_mm_latency failed");
+    for (i = 0; i < trace->num_ops; i++)
+        cycles[i] = DBL_MAX;
+
+    for (rep = 0; rep < LAT_REPS; rep++) {
+        reinit_trace(trace);
+        mem_reset_brk();
+        if (mm_init() < 0)
+            app_error("mm_init failed in eval_mm_latency");
+
+        for (i = 0; i < trace->num_ops; i++) {
+            index = trace->ops[i].index;
+            switch (trace->ops[i].type) {
+            case ALLOC: /* mm_malloc */
+                start_counter();
+                p = mm_malloc(trace->ops[i].size);
+                c = get_counter();
+                if (p == NULL)
+                    app_error("mm_malloc error in eval_mm_latency");
+                trace->blocks[index] = p;
+                break;
+
+            case REALLOC: /* mm_realloc */
+                start_counter();
+                p = mm_realloc(trace->blocks[index], trace->ops[i].size);
+                c = get_counter();
+                if (p == NULL && trace->ops[i].size != 0)
+                    app_error("mm_realloc error in eval_mm_latency");
+                trace->blocks[index] = p;
+                break;
+
+            case FREE: /* mm_free */
+                p = index < 0 ? NULL : trace->blocks[index];
+                start_counter();
+                mm_free(p);
+                c = get_counter();
+                break;
+
+            default:
+                app_error("Nonexistent request type in eval_mm_latency");
+            }
+            c -= overhead;
+            if (c < cycles[i])
+                cycles[i] = c < 0 ? 0 : c;
+        }
+    }
+
+    *mean = 0;
+    *worst = 0;
+    for (i = 0; i < trace->num_ops; i++) {
+        *mean += cycles[i];
+        if (cycles[i] > *worst)
+            *worst = cycles[i];
+    }
+    *mean /= trace->num_ops;
+    free(cycles);
+}
+
+/*
+ * run_latency - Print the mean and worst cycles per request of each
+ *    trace the mm package ran correctly, and of all of them.
+ */
+static void run_latency(int num_tracefiles, const char *tracedir,
+                        char **tracefiles, const stats_t *mm_stats)
+{
+    int i;
+    double mean, worst, sumcycles = 0, sumops = 0, maxworst = 0;
+    stats_t stats;
+    trace_t *trace;
+
+    printf("Cycles per request of mm malloc:\n");
+    printf("%8s%10s  %s\n", "mean", "worst", "trace");
+    for (i = 0; i < num_tracefiles; i++) {
+        if (!mm_stats[i].valid)
+            continue;
+        mem_init();
+        trace = read_trace(&stats, tracedir, tracefiles[i]);
+        eval_mm_latency(trace, &mean, &worst);
+        printf("%8.0f%10.0f  %s\n", mean, worst, trace->filename);
+        sumcycles += mean * trace->num_ops;
+        sumops += trace->num_ops;
+        if (worst > maxworst)
+            maxworst = worst;
+        free_trace(trace);
+        mem_deinit();
+    }
+    printf("%8.0f%10.0f  Total\n\n", sumops ? sumcycles / sumops : 0,
+           maxworst);
+}
+
+#ifdef THREAD_SAFE
+/* Holds the params of one thread of eval_mm_speed_mt */
+typedef struct {
+    const trace_t *trace;
+    char **blocks;               /* the blocks of this thread */
+    pthread_barrier_t *start;    /* lets all the threads go at once */
+    struct timespec t0, t1;      /* when the thread started and ended */
+    int failed;                  /* the heap ran out */
+} replay_t;
+
+static void *replay_thread(void *vargp)
+{
+    replay_t *r = (replay_t *)vargp;
+
+    pthread_barrier_wait(r->start);
+    clock_gettime(CLOCK_MONOTONIC, &r->t0);
+    r->failed = replay_trace(r->trace, r->blocks) >= 0;
+    clock_gettime(CLOCK_MONOTONIC, &r->t1);
+    return NULL;
+}
+
+/* timespec_secs - t as secs */
+static double timespec_secs(const struct timespec *t)
+{
+    return t->tv_sec + t->tv_nsec / 1e9;
+}
+
+/*
+ * eval_mm_speed_mt - Replay the trace on nthreads threads at once, on
+ *    one heap, and return the secs from the first thread starting to
+ *    the last one ending, or -1 if the heap ran out. Each thread has
+ *    its own blocks, so every thread runs the whole trace. Like fcyc,
+ *    it keeps the best of MT_REPS runs.
+ */
+#define MT_REPS 5
+static double eval_mm_speed_mt(trace_t *trace, int nthreads)
+{
+    pthread_t *tids;
+    replay_t *replays;
+    pthread_barrier_t start;
+    double t0, t1, secs, best = DBL_MAX;
+    int i, rep;
+
+    tids = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+    replays = (replay_t *)calloc(nthreads, sizeof(replay_t));
+    if (tids == NULL || replays == NULL)
+        unix_error("calloc in eval_mm_speed_mt failed");
+    for (i = 0; i < nthreads; i++) {
+        replays[i].trace = trace;
+        replays[i].start = &start;
+        if ((replays[i].blocks =
+             (char **)calloc(trace->num_ids, sizeof(char *))) == NULL)
+            unix_error("calloc in eval_mm_speed_mt failed");
+    }
+
+    for (rep = 0; rep < MT_REPS; rep++) {
+        /* Reset the heap and initialize the mm package */
+        mem_reset_brk();
+        if (mm_init() < 0)
+            app_error("mm_init failed in eval_mm_speed_mt");
+
+        pthread_barrier_init(&start, NULL, nthreads + 1);
+        for (i = 0; i < nthreads; i++) {
+            memset(replays[i].blocks, 0, trace->num_ids * sizeof(char *));
+            if (pthread_create(&tids[i], NULL, replay_thread, &replays[i]))
+                app_error("pthread_create failed in eval_mm_speed_mt");
+        }
+        pthread_barrier_wait(&start);
+        t0 = DBL_MAX;
+        t1 = 0;
+        for (i = 0; i < nthreads; i++) {
+            pthread_join(tids[i], NULL);
+            if (replays[i].failed)
+                best = -1;
+            if (timespec_secs(&replays[i].t0) < t0)
+                t0 = timespec_secs(&replays[i].t0);
+            if (timespec_secs(&replays[i].t1) > t1)
+                t1 = timespec_secs(&replays[i].t1);
         }
+        pthread_barrier_destroy(&start);
+        if (best < 0)
+            break;
+
+        secs = t1 - t0;
+        if (secs < best)
+            best = secs;
+    }
+
+    for (i = 0; i < nthreads; i++)
+        free(replays[i].blocks);
+    free(replays);
+    free(tids);
+    return best;
 }
 
+/*
+ * run_scaling - Replay each trace the mm package ran correctly on 1, 2,
+ *    4, ... up to max_threads threads and print the throughput of all
+ *    the threads together, and how it scales from 1 thread. A trace
+ *    that runs out of heap on some number of threads is left out of
+ *    the totals.
+ */
+static void run_scaling(int num_tracefiles, const char *tracedir,
+                        char **tracefiles, const stats_t *mm_stats,
+                        int max_threads)
+{
+    int i, t, n, nthreads[32];
+    double *sumops, *sumsecs, *secs;
+    stats_t stats;
+    trace_t *trace;
+
+    for (n = 0, t = 1; t < max_threads && n < 31; t *= 2)
+        nthreads[n++] = t;
+    nthreads[n++] = max_threads;
+    sumops = (double *)calloc(n, sizeof(double));
+    sumsecs = (double *)calloc(n, sizeof(double));
+    secs = (double *)calloc(n, sizeof(double));
+    if (sumops == NULL || sumsecs == NULL || secs == NULL)
+        unix_error("calloc in run_scaling failed");
+
+    printf("Scaling of mm malloc (Kops of all the threads):\n");
+    printf("%8s", "threads");
+    for (t = 0; t < n; t++)
+        printf("%8d", nthreads[t]);
+    printf("  trace\n");
+    for (i = 0; i < num_tracefiles; i++) {
+        if (!mm_stats[i].valid)
+            continue;
+        mem_init();
+        trace = read_trace(&stats, tracedir, tracefiles[i]);
+        printf("%8s", "");
+        for (t = 0; t < n; t++) {
+            secs[t] = eval_mm_speed_mt(trace, nthreads[t]);
+            if (secs[t] < 0)
+                printf("%8s", "--");
+            else
+                printf("%8.0f", trace->num_ops * nthreads[t] / 1e3 / secs[t]);
+        }
+        printf("  %s\n", trace->filename);
+        /* only a trace that ran on every number of threads counts */
+        for (t = 0; t < n && secs[t] >= 0; t++)
+            ;
+        if (t == n) {
+            for (t = 0; t < n; t++) {
+                sumops[t] += (double)trace->num_ops * nthreads[t];
+                sumsecs[t] += secs[t];
+            }
+        }
+        free_trace(trace);
+        mem_deinit();
+    }
+
+    printf("%8s", "Total");
+    for (t = 0; t < n; t++)
+        printf("%8.0f", sumops[t] / 1e3 / sumsecs[t]);
+    printf("\n%8s", "speedup");
+    for (t = 0; t < n; t++)
+        printf("%8.2f", (sumops[t] / sumsecs[t]) / (sumops[0] / sumsecs[0]));
+    printf("\n\n");
+    free(sumops);
+    free(sumsecs);
+    free(secs);
+}
+#endif
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1375,7 +1709,7 @@ void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
  */
 static void usage(void)
 {
-    fprintf(stderr, "Usage: mdriver [-hlVdD] [-f <file>]\n");
+    fprintf(stderr, "Usage: mdriver [-hlLVdD] [-f <file>] [-T <n>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
     fprintf(stderr, "\t-D         Equivalent to -d2.\n");
@@ -1383,8 +1717,10 @@ static void usage(void)
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L         Report the mean and worst cycles per request.\n");
     fprintf(stderr, "\t-V         Print diagnostics as each trace is run.\n");
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-T <n>     Replay the traces on 1 to <n> threads (mdriver-mt).\n");
 }
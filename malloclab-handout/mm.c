@@ -10,6 +10,9 @@
 #include <string.h>
 #include <unistd.h>
 #include <limits.h>
+#ifdef THREAD_SAFE
+#include <pthread.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
@@ -70,6 +73,10 @@
  * a predecessor. 
  * We store the successor as the offset from the beginning of the whole heap*
  * As the heap's max size is 2^31, we can store it in WSIZE bytes.
+ *
+ * An allocated block has a header but no footer: only coalesce looks at
+ * the footer of the block before, and it only needs to when that block
+ * is free. Whether it is free is in the PREV_ALLOC bit of every header.
  */
 #define MIN_FREE_BLOCK_SIZE (2*DSIZE)
 #define MIN_BLOCK_SIZE (2*DSIZE)
@@ -79,9 +86,19 @@
 #define ALIGN(p) (((size_t)(p) + (ALIGNMENT-1)) & ~0x7)
 
 #define PACK(size, alloc) ((size) | (alloc))
-
+/* header bit: the block before this one is allocated */
+#define PREV_ALLOC 0x2
+
+#ifdef THREAD_SAFE
+/* free reads the header of its block without the lock, while a thread
+ * holding it may set the PREV_ALLOC bit in that header. Relaxed atomics
+ * are plain loads and stores on x86, and make that well defined */
+#define GET(p)  __atomic_load_n((unsigned int *)(p), __ATOMIC_RELAXED)
+#define PUT(p, val) __atomic_store_n((unsigned int *)(p), (val), __ATOMIC_RELAXED)
+#else
 #define GET(p)  (*(unsigned int*)(p))
 #define PUT(p, val) (*(unsigned int *)(p) = (val))
+#endif
 
 /* GET_SIZE return the whole size(including header/footer) of the block */
 #define GET_SIZE(p) (GET(p) & ~0x7)
@@ -90,15 +107,20 @@
  * */
 // #define GET_USABLE_SIZE(p) (GET_SIZE(p)-DSIZE)
 #define GET_ALLOC(p) (GET(p) & 0x1)
+#define GET_PREV_ALLOC(p) (GET(p) & PREV_ALLOC)
+#define SET_PREV_ALLOC(p) PUT(p, GET(p) | PREV_ALLOC)
+#define CLEAR_PREV_ALLOC(p) PUT(p, GET(p) & ~PREV_ALLOC)
 /* get offset of this ptr */
 #define GET_OFFSET(p) ((char *)(p) - free_listp)
 
 #define HDRP(bp) ((char *)(bp) - WSIZE)
+/* only free blocks (and the prologue) have a footer */
 #define FTRP(bp) ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
 #define PRED(bp) (bp)
 #define SUCC(bp) ((char *)(bp) + WSIZE)
 
 #define NEXT_BLKP(bp) ((char *)(bp) + GET_SIZE(((char *)(bp) - WSIZE)))
+/* only if the block before is free */
 #define PREV_BLKP(bp) ((char *)(bp) - GET_SIZE(((char *)(bp) - DSIZE)))
 /*
  * Note PRED_BLKP/SUCC_BLKP may return the free list ptr.
@@ -110,7 +132,7 @@
 #define END_CLASS_PTR (free_listp + FREE_LIST_LEN * FREE_LIST_SENTINEL_SIZE)
 
 /* bp points to epilogue block */
-#define IS_EPILOGUE(bp) (GET(HDRP(bp)) == 1)
+#define IS_EPILOGUE(bp) ((GET(HDRP(bp)) & ~PREV_ALLOC) == 1)
 #define IS_FREE(bp) (GET_ALLOC(HDRP(bp)) == 0)
 
 /*
@@ -132,6 +154,9 @@
 #define for_each_free_list(ptr) \
     for_range_free_list(free_listp, END_CLASS_PTR, (ptr))
 
+/* blocks find_fit looks at in the class of the size */
+#define FIT_SCAN 8
+
 static char *heap_listp;  // point to the first block
 static char *free_listp;  // pointer to free list
 static void *extend_heap(size_t words);
@@ -139,41 +164,215 @@ static void *coalesce(void *bp);
 static void place(void *bp, size_t size);
 static void *find_fit(size_t size);
 static void *split_block(void *bp, size_t pack_v1, size_t pack_v2);
+static void *heap_malloc(size_t asize);
+static void heap_free(void *bp);
+static void *slab_malloc(size_t size);
+inline static int is_slab_slot(const void *p);
+
+
+/*
+ * Thread safety.
+ *
+ * Built with THREAD_SAFE, the heap, its free lists and mem_sbrk are
+ * shared by all the threads behind heap_lock. Small blocks do not go
+ * through the lock one at a time: each thread keeps a cache of them
+ * (tcache), one LIFO list per block size, and moves them from and to the
+ * free lists TCACHE_BATCH at a time. A cached block stays marked as
+ * allocated in the heap, so it is never coalesced; any thread may free
+ * any block, into its own cache.
+ *
+ * mm_init starts a new heap generation, and a cache of an older one is
+ * dropped on its next use. mm_init must not run with other threads
+ * inside the allocator.
+ */
+#ifdef THREAD_SAFE
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK_HEAP() pthread_mutex_lock(&heap_lock)
+#define UNLOCK_HEAP() pthread_mutex_unlock(&heap_lock)
+
+/* blocks of up to TCACHE_MAX_SIZE bytes are cached, one bin per size */
+#define TCACHE_MAX_SIZE 256
+#define TCACHE_BINS (TCACHE_MAX_SIZE / DSIZE - 1)
+#define TCACHE_BIN(size) ((size) / DSIZE - 2)
+/* blocks moved per refill or flush */
+#define TCACHE_BATCH 8
+/* a bin holding more blocks than this is flushed */
+#define TCACHE_FILL (2*TCACHE_BATCH)
+/* a cached block links to the next one in its payload */
+#define TCACHE_NEXT(bp) (*(char **)(bp))
+
+typedef struct {
+    unsigned int gen;            /* heap generation of the blocks */
+    char *head[TCACHE_BINS];
+    int count[TCACHE_BINS];
+} tcache_t;
+
+static __thread tcache_t tcache;
+static pthread_key_t tcache_key;  /* flushes the cache of an exiting thread */
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+#else
+#define LOCK_HEAP()
+#define UNLOCK_HEAP()
+#endif
 
 
-/* segregated free list */
-#define FREE_LIST_LEN 10
+/*
+ * Segregated free lists, indexed in two levels as in TLSF.
+ *
+ * Blocks under SMALL_SIZE bytes have one class per size. A bigger block
+ * is classed by the power of two below its size (the first level) and
+ * the next SL_BITS bits of its size (the second level), so a class is
+ * 1/SL_COUNT of its power of two wide. A bitmap of the non-empty
+ * classes of each first level, and one of the non-empty first levels,
+ * sit in front of the sentinels: finding the smallest non-empty class
+ * above a size takes two __builtin_ctz, however many blocks are free.
+ */
+#define SL_BITS 2
+#define SL_COUNT (1 << SL_BITS)
+#define SMALL_SIZE (SL_COUNT * DSIZE)
+/* first levels, up to 2MB blocks. The sentinels are in the heap, so
+ * more classes cost utilization; the last class also holds every block
+ * too big for it, and with MAX_HEAP at 100MB there are at most 57 */
+#define FL_COUNT 17
+#define FREE_LIST_LEN (FL_COUNT * SL_COUNT)
 /* sentinel size(PREV | SUCC) */
 #define FREE_LIST_SENTINEL_SIZE DSIZE
 /* get the ith free list */
 #define FREE_LIST_REF(k) (free_listp + (k) * FREE_LIST_SENTINEL_SIZE)
 /* return the index of the free list pointer */
 #define FREE_LIST_IDX(p) (((char*)p - free_listp) / FREE_LIST_SENTINEL_SIZE)
-/* get free list class ptr
+/* bitmap of the non-empty classes of first level fl, one word each */
+#define SL_BITMAP(fl) (*(unsigned int *)(free_listp - (FL_COUNT - (fl)) * WSIZE))
+/* size of the bitmaps, kept a multiple of DSIZE */
+#define SL_BITMAPS_SIZE ALIGN(FL_COUNT * WSIZE)
+
+static unsigned int fl_bitmap;  // bit fl is set if SL_BITMAP(fl) is not 0
+static unsigned int heap_gen;  // bumped by mm_init
+
+
+/*
+ * Slab pages.
+ *
+ * Requests of up to SLAB_MAX_SIZE bytes do not get a block of their
+ * own. They get a slot in a slab page: an allocated block whose payload
+ * starts on a SLAB_PAGE_SIZE boundary and is cut into equal slots of
+ * one size class, with no header or footer per slot:
+ *
+ * [ PRED | SUCC | unused | SLOT SIZE, USED | BITMAP | SLOT | SLOT | ... ]
+ *
+ * The page of a slot is found by masking its address, and the bitmap
+ * marks the slots in use. While a page has free slots it is on the list
+ * of its class; these lists have sentinels after those of the free
+ * lists. The header of a page block has SLAB_BIT set. Free tells a slot
+ * from a block by the slab map, one bit per page of the heap: a word in
+ * the page could be user data that looks like a page header, the map is
+ * only written by the allocator. The map is a block of the heap, moved
+ * to a bigger one when a page is cut past its end. A page leaves it when
+ * it is freed, which it is once empty unless it is the last page of its
+ * class with free slots.
+ */
+#ifdef THREAD_SAFE
+/* free looks for the tcache bin without the lock, and the word a page
+ * header would be at may be another block's, written by another thread.
+ * The tcache serves the small sizes instead */
+#define SLAB_MAX_SIZE 0
+#else
+#define SLAB_MAX_SIZE 64
+#endif
+#define SLAB_CLASSES (SLAB_MAX_SIZE / DSIZE)
+#define SLAB_PAGE_SIZE 512
+#define SLAB_BIT 0x4
+/* one bit per slot, in 64 bit words */
+#define SLAB_BITMAP_WORDS ((SLAB_PAGE_SIZE / DSIZE + 63) / 64)
+#define SLAB_HDR_SIZE (4*WSIZE + SLAB_BITMAP_WORDS * DSIZE)
+/* a page block is as big as a page, so the next page can start right
+ * after it; the next header takes the page's last WSIZE */
+#define SLAB_BLOCK_SIZE SLAB_PAGE_SIZE
+#define SLAB_SLOTS(slot_size) \
+    ((SLAB_PAGE_SIZE - WSIZE - SLAB_HDR_SIZE) / (slot_size))
+
+#define SLAB_PAGE(p) ((char *)((size_t)(p) & ~(size_t)(SLAB_PAGE_SIZE - 1)))
+#define SLAB_SLOT_SIZE(page) (*(unsigned short *)((char *)(page) + 3*WSIZE))
+#define SLAB_USED(page) (*(unsigned short *)((char *)(page) + 3*WSIZE + 2))
+#define SLAB_BITMAP(page) ((unsigned long *)((char *)(page) + 4*WSIZE))
+/* the list of pages with free slots of slot_size */
+#define SLAB_LIST_REF(slot_size) \
+    (END_CLASS_PTR + ((slot_size) / DSIZE - 1) * FREE_LIST_SENTINEL_SIZE)
+#define SLAB_LISTS_SIZE (SLAB_CLASSES * FREE_LIST_SENTINEL_SIZE)
+/* the bit of a page in the slab map. Pages count from the one the heap
+ * starts in */
+#define SLAB_INDEX(page) \
+    ((size_t)((char *)(page) - SLAB_PAGE(free_listp)) / SLAB_PAGE_SIZE)
+
+static unsigned char *slab_map;  // NULL until the first slab page
+static size_t slab_map_pages;  // pages the map has a bit for
+
+/* get the index of the free list of blocks of "size"
  * size: size of the free block.
  * assert (size >= MIN_BLOCK_SIZE)
  * */
+inline static int get_class_index(size_t size)
+{
+    int m, fl, sl;
+    if (size < SMALL_SIZE) {
+        return size / DSIZE;
+    }
+    /* m is the top bit; the SL_BITS bits under it are the second level */
+    m = 63 - __builtin_clzl(size);
+    fl = m - (SL_BITS + 3) + 1;
+    if (fl >= FL_COUNT) {
+        return FREE_LIST_LEN - 1;
+    }
+    sl = (size >> (m - SL_BITS)) - SL_COUNT;
+    return fl * SL_COUNT + sl;
+}
+
+/* get free list class ptr */
 inline static void *get_class_ptr(size_t size)
 {
-    /*
-     * size is a multiple of 8. size = k * 8. 
-     * We have k >= 2 since MIN_FREE_BLOCK_SIZE is 2*DSIZE
-     * {2}, {3-4}, ..., {257, 512}, {513, +inf}
-     * 2^1, 2^2, 2^3, ...., 2^9, ...
-     */
+    return FREE_LIST_REF(get_class_index(size));
+}
 
-    int offset;
-    // TODO: remove this assert
-    // assert(size % 8 == 0);
-    // assert(size/8 >= 2);
-    if (size > 4096) {
-        offset = FREE_LIST_LEN - 1;
-    } else {
-        // k >= 2
-        size_t k = size >> 3;
-        offset = 31 - __builtin_clz(k-1);
+/*
+ * find_class_from  - the first non-empty free list with index >= k, or
+ *      NULL if they are all empty
+ */
+inline static void *find_class_from(int k)
+{
+    int fl = k / SL_COUNT;
+    unsigned int bits;
+    if (fl >= FL_COUNT) {
+        return NULL;
+    }
+    bits = SL_BITMAP(fl) & (~0u << (k % SL_COUNT));
+    if (!bits) {
+        /* none left at this first level, take the next non-empty one */
+        bits = fl_bitmap & (~0u << (fl + 1));
+        if (!bits) {
+            return NULL;
+        }
+        fl = __builtin_ctz(bits);
+        bits = SL_BITMAP(fl);
+    }
+    return FREE_LIST_REF(fl * SL_COUNT + __builtin_ctz(bits));
+}
+
+/* mark the free list class_ptr non-empty */
+inline static void set_class_bit(void *class_ptr)
+{
+    int k = FREE_LIST_IDX(class_ptr);
+    SL_BITMAP(k / SL_COUNT) |= 1u << (k % SL_COUNT);
+    fl_bitmap |= 1u << (k / SL_COUNT);
+}
+
+/* mark the free list class_ptr empty */
+inline static void clear_class_bit(void *class_ptr)
+{
+    int k = FREE_LIST_IDX(class_ptr);
+    SL_BITMAP(k / SL_COUNT) &= ~(1u << (k % SL_COUNT));
+    if (!SL_BITMAP(k / SL_COUNT)) {
+        fl_bitmap &= ~(1u << (k / SL_COUNT));
     }
-    return FREE_LIST_REF(offset);
 }
 
 
@@ -200,6 +399,7 @@ inline static void insert_free_block_fifo(void *bp)
     void *tail_bp = PRED_BLKP(class_ptr);
 
     insert_free_block_after(tail_bp, bp);
+    set_class_bit(class_ptr);
 }
 
 
@@ -219,6 +419,7 @@ inline static void insert_free_block_address_order(void *bp)
         }
     }
     insert_free_block_after(PRED_BLKP(cur_bp), bp);
+    set_class_bit(class_ptr);
 }
 
 /*
@@ -229,6 +430,7 @@ inline static void insert_free_block_lifo(void *bp)
     size_t size = GET_SIZE(HDRP(bp));
     void *class_ptr = get_class_ptr(size);
     insert_free_block_after(class_ptr, bp);
+    set_class_bit(class_ptr);
 }
 
 
@@ -248,13 +450,13 @@ inline static void insert_free_block_size_order(void *bp)
         }
     }
     insert_free_block_after(PRED_BLKP(cur_bp), bp);
+    set_class_bit(class_ptr);
 }
 
 /*
- * remove free block from free list
- * assert bp is not a class_ptr
+ * unlink bp from the list it is on
  */
-inline static void remove_free_block(void *bp)
+inline static void unlink_block(void *bp)
 {
     void *pred_bp = PRED_BLKP(bp),
          *succ_bp = SUCC_BLKP(bp);
@@ -262,6 +464,20 @@ inline static void remove_free_block(void *bp)
     PUT(PRED(succ_bp), GET_OFFSET(pred_bp));
 }
 
+/*
+ * remove free block from free list
+ * assert bp is not a class_ptr
+ */
+inline static void remove_free_block(void *bp)
+{
+    void *pred_bp = PRED_BLKP(bp);
+    unlink_block(bp);
+    /* only the sentinel is left */
+    if (SUCC_BLKP(pred_bp) == pred_bp) {
+        clear_class_bit(pred_bp);
+    }
+}
+
 
 
 /*
@@ -272,15 +488,23 @@ int mm_init(void)
     /*
      * Generally structure of the heap is:
      *
-     * [ FREE LIST POINTERS | PRELOGUE BLOCK | HEAP MEMORY | EPILOGUE BLOCK ]
+     * [ CLASS BITMAPS | FREE LIST POINTERS | PRELOGUE BLOCK | HEAP MEMORY |
+     *   EPILOGUE BLOCK ]
      */
     int i;
 
-    /* allocate memory for free block pointers */
-    if ((free_listp = mem_sbrk(
-                    FREE_LIST_LEN*FREE_LIST_SENTINEL_SIZE)) == (void*)-1) {
+    /* allocate memory for the bitmaps, the free block pointers and the
+     * slab page lists */
+    if ((free_listp = mem_sbrk(SL_BITMAPS_SIZE +
+                    FREE_LIST_LEN*FREE_LIST_SENTINEL_SIZE +
+                    SLAB_LISTS_SIZE)) == (void*)-1) {
         return -1;
     }
+    free_listp += SL_BITMAPS_SIZE;
+    for (i = 0; i < FL_COUNT; i++) {
+        SL_BITMAP(i) = 0;
+    }
+    fl_bitmap = 0;
 
     /* prologue and epilogue */
     if ((heap_listp = mem_sbrk(4*WSIZE)) == (void*) - 1) {
@@ -308,18 +532,26 @@ int mm_init(void)
         PUT(PRED(FREE_LIST_REF(i)), i * FREE_LIST_SENTINEL_SIZE);
         PUT(SUCC(FREE_LIST_REF(i)), i * FREE_LIST_SENTINEL_SIZE);
     }
+    for (i = 1; i <= SLAB_CLASSES; i++) {
+        char *class_ptr = SLAB_LIST_REF(i * DSIZE);
+        PUT(PRED(class_ptr), GET_OFFSET(class_ptr));
+        PUT(SUCC(class_ptr), GET_OFFSET(class_ptr));
+    }
 
 
     // initialize prologue and epilogue
     PUT(heap_listp, 0);
     PUT(heap_listp + (1*WSIZE), PACK(DSIZE, 1));
     PUT(heap_listp + (2*WSIZE), PACK(DSIZE, 1));
-    PUT(heap_listp + (3*WSIZE), PACK(0, 1));
+    PUT(heap_listp + (3*WSIZE), PACK(0, 1) | PREV_ALLOC);
     heap_listp += (2*WSIZE);
+    slab_map = NULL;
+    slab_map_pages = 0;
 
     if (extend_heap(CHUNKSIZE/WSIZE) == NULL) {
         return -1;
     }
+    heap_gen++;
     mm_checkheap(__LINE__);
     return 0;
 }
@@ -337,7 +569,8 @@ static void *extend_heap(size_t words)
     if ((long)(bp = mem_sbrk(size)) == -1)
         return NULL;
 
-    PUT(HDRP(bp), PACK(size, 0));
+    /* the old epilogue header becomes the header of the new block */
+    PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp))));
     PUT(FTRP(bp), PACK(size, 0));
 
     // HDRP(NEXT_BLKP(bp)) points to the new epilogue header
@@ -355,35 +588,39 @@ static void *extend_heap(size_t words)
  */
 static void *coalesce(void *bp)
 {
-    // previous block
-    void *prev_bp = PREV_BLKP(bp);
-    size_t prev_alloc = GET_ALLOC(FTRP(prev_bp));
+    // previous block, whose footer is there only if it is free
+    size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
     // next block
     void *next_bp = NEXT_BLKP(bp);
     size_t next_alloc = GET_ALLOC(HDRP(next_bp));
     size_t size = GET_SIZE(HDRP(bp));
+    void *prev_bp;
 
+    /* the block before a free block is allocated, so every header
+     * written here has PREV_ALLOC set */
     if (prev_alloc && next_alloc) {
         // pass
     } else if (prev_alloc && !next_alloc) {
         size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
         remove_free_block(next_bp);
-        PUT(HDRP(bp), PACK(size, 0));
+        PUT(HDRP(bp), PACK(size, 0) | PREV_ALLOC);
         PUT(FTRP(bp), PACK(size, 0));
     } else if (!prev_alloc && next_alloc) {
-        size += GET_SIZE(HDRP(PREV_BLKP(bp)));
+        prev_bp = PREV_BLKP(bp);
+        size += GET_SIZE(HDRP(prev_bp));
         remove_free_block(prev_bp);
         PUT(FTRP(bp), PACK(size, 0));
-        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
-        bp = PREV_BLKP(bp);
+        PUT(HDRP(prev_bp), PACK(size, 0) | PREV_ALLOC);
+        bp = prev_bp;
     } else {
-        size += GET_SIZE(HDRP(PREV_BLKP(bp))) +
+        prev_bp = PREV_BLKP(bp);
+        size += GET_SIZE(HDRP(prev_bp)) +
             GET_SIZE(FTRP(NEXT_BLKP(bp)));
         remove_free_block(prev_bp);
         remove_free_block(next_bp);
-        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
+        PUT(HDRP(prev_bp), PACK(size, 0) | PREV_ALLOC);
         PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
-        bp = PREV_BLKP(bp);
+        bp = prev_bp;
     }
     // insert the new free block
     insert_free_block(bp);
@@ -392,31 +629,22 @@ static void *coalesce(void *bp)
 
 /*
  * Generally, the allocated size is larger than the size we want since
- * we need to store the header and footer. This function return
- * the real size we need to allocate.
+ * we need to store the header. This function return the real size we
+ * need to allocate, which is enough for a free block when it is freed.
  */
 inline size_t get_real_malloc_size(size_t size)
 {
-    size_t asize;
-    if (size <= DSIZE) {
-        asize = 2*DSIZE;
-    } else {
-        asize = DSIZE * ((size + DSIZE + DSIZE - 1) / DSIZE);
-    }
-    return asize;
+    return MAX(MIN_BLOCK_SIZE, ALIGN(size + WSIZE));
 }
 
 /*
- * malloc
+ * heap_malloc  - allocate a block of asize bytes from the free lists,
+ *      extending the heap if none fits. The heap must be locked
  */
-void *malloc (size_t size)
+static void *heap_malloc(size_t asize)
 {
-    size_t asize;
     char *bp;
     size_t extendsize;
-    if (size <= 0) return NULL;
-
-    asize = get_real_malloc_size(size);
 
     if ((bp = find_fit(asize)) != NULL) {
         place(bp, asize);
@@ -434,6 +662,348 @@ void *malloc (size_t size)
     return bp;
 }
 
+/*
+ * is_slab_slot  - whether p is a slot of a slab page rather than the
+ *      payload of a block
+ */
+inline static int is_slab_slot(const void *p)
+{
+    char *page = SLAB_PAGE(p);
+    size_t i = SLAB_INDEX(page);
+    return SLAB_MAX_SIZE && (const char *)p != page && i < slab_map_pages &&
+        (slab_map[i / 8] >> (i % 8) & 1);
+}
+
+/*
+ * slab_map_set  - set or clear the bit of page in the slab map. A page
+ *      past the end of the map gets a map twice as big, at least.
+ *      Return -1 if there is no room for it
+ */
+static int slab_map_set(const char *page, int on)
+{
+    size_t i = SLAB_INDEX(page), size;
+    unsigned char *map;
+
+    if (i >= slab_map_pages) {
+        if (!on) {
+            return 0;
+        }
+        size = ALIGN((MAX(2 * slab_map_pages, i + 1) + 7) / 8);
+        if ((map = heap_malloc(get_real_malloc_size(size))) == NULL) {
+            return -1;
+        }
+        memset(map, 0, size);
+        if (slab_map) {
+            memcpy(map, slab_map, slab_map_pages / 8);
+            heap_free(slab_map);
+        }
+        slab_map = map;
+        slab_map_pages = size * 8;
+    }
+    if (on) {
+        slab_map[i / 8] |= 1 << (i % 8);
+    } else {
+        slab_map[i / 8] &= ~(1 << (i % 8));
+    }
+    return 0;
+}
+
+/*
+ * slab_page_in  - the page a slab page cut from the free block bp would
+ *      start at, leaving nothing or a free block before it
+ */
+inline static char *slab_page_in(char *bp)
+{
+    char *page = SLAB_PAGE(bp + SLAB_PAGE_SIZE - 1);
+    if (page != bp && page - bp < MIN_FREE_BLOCK_SIZE) {
+        page += SLAB_PAGE_SIZE;
+    }
+    return page;
+}
+
+/*
+ * slab_extend_heap  - extend the heap just enough for its last block to
+ *      hold a page, if it needs to, and return that free block
+ */
+static void *slab_extend_heap(void)
+{
+    char *end = (char *)mem_heap_hi() + 1;
+    char *start = end, *page;
+
+    /* end is the payload of the epilogue */
+    if (!GET_PREV_ALLOC(HDRP(end))) {
+        start = PREV_BLKP(end);
+    }
+    page = slab_page_in(start);
+    /* slab_find_fit does not look at every block, this one may have
+     * enough as it is */
+    if (page + SLAB_BLOCK_SIZE <= end) {
+        return start;
+    }
+    return extend_heap((page + SLAB_BLOCK_SIZE - end) / WSIZE);
+}
+
+/*
+ * slab_find_fit  - a free block that holds an aligned page. find_fit
+ *      would ask for a page's worth of room to align in, and miss the
+ *      holes of exactly a page that freed pages leave, so this looks at
+ *      FIT_SCAN blocks of each class from that of a page up
+ */
+static void *slab_find_fit(void)
+{
+    int k = get_class_index(SLAB_BLOCK_SIZE), n;
+    char *class_ptr, *bp;
+
+    for (; (class_ptr = find_class_from(k)) != NULL; k++) {
+        k = FREE_LIST_IDX(class_ptr);
+        n = 0;
+        for_each_free_block(class_ptr, bp) {
+            if (slab_page_in(bp) + SLAB_BLOCK_SIZE <= FTRP(bp) + DSIZE) {
+                return bp;
+            }
+            if (++n == FIT_SCAN) break;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * slab_new_page  - allocate a page for slots of slot_size. The free
+ *      block it is cut from must leave a free block or nothing on
+ *      either side of it
+ */
+static void *slab_new_page(size_t slot_size)
+{
+    char *bp, *page;
+    size_t size, lead, trail, block_size = SLAB_BLOCK_SIZE;
+    int i, n = SLAB_SLOTS(slot_size);
+
+    bp = slab_find_fit();
+    if (bp == NULL && (bp = slab_extend_heap()) == NULL) {
+        return NULL;
+    }
+    page = slab_page_in(bp);
+
+    remove_free_block(bp);
+    size = GET_SIZE(HDRP(bp));
+    lead = page - bp;
+    trail = size - lead - block_size;
+    if (trail < MIN_FREE_BLOCK_SIZE) {
+        block_size += trail;
+        trail = 0;
+    }
+    if (lead) {
+        PUT(HDRP(bp), PACK(lead, 0) | PREV_ALLOC);
+        PUT(FTRP(bp), PACK(lead, 0));
+        insert_free_block(bp);
+    }
+    PUT(HDRP(page), PACK(block_size, 1) | SLAB_BIT |
+            (lead ? 0 : PREV_ALLOC));
+    if (trail) {
+        bp = NEXT_BLKP(page);
+        PUT(HDRP(bp), PACK(trail, 0) | PREV_ALLOC);
+        PUT(FTRP(bp), PACK(trail, 0));
+        insert_free_block(bp);
+    } else {
+        SET_PREV_ALLOC(HDRP(NEXT_BLKP(page)));
+    }
+    if (slab_map_set(page, 1) < 0) {
+        heap_free(page);
+        return NULL;
+    }
+
+    SLAB_SLOT_SIZE(page) = slot_size;
+    SLAB_USED(page) = 0;
+    /* the bits past the last slot are set, so they are never picked */
+    for (i = 0; i < SLAB_BITMAP_WORDS; i++) {
+        SLAB_BITMAP(page)[i] = 0;
+    }
+    for (i = n; i < SLAB_BITMAP_WORDS * 64; i++) {
+        SLAB_BITMAP(page)[i / 64] |= 1ul << (i % 64);
+    }
+    return page;
+}
+
+/*
+ * slab_malloc  - allocate a slot of at least size bytes. The heap must
+ *      be locked
+ */
+static void *slab_malloc(size_t size)
+{
+    size_t slot_size = ALIGN(size);
+    char *class_ptr = SLAB_LIST_REF(slot_size);
+    char *page = SUCC_BLKP(class_ptr);
+    unsigned long *bitmap;
+    int i, n;
+
+    if (page == class_ptr) {
+        if ((page = slab_new_page(slot_size)) == NULL) {
+            return NULL;
+        }
+        insert_free_block_after(class_ptr, page);
+    }
+    bitmap = SLAB_BITMAP(page);
+    for (i = 0; !~bitmap[i]; i++)
+        ;
+    n = i * 64 + __builtin_ctzl(~bitmap[i]);
+    bitmap[i] |= 1ul << (n % 64);
+    if (++SLAB_USED(page) == SLAB_SLOTS(slot_size)) {
+        unlink_block(page);
+    }
+    return page + SLAB_HDR_SIZE + n * slot_size;
+}
+
+/*
+ * slab_free  - give the slot back to its page, and free the page once
+ *      it is empty. The heap must be locked
+ */
+static void slab_free(void *p)
+{
+    char *page = SLAB_PAGE(p);
+    size_t slot_size = SLAB_SLOT_SIZE(page);
+    char *class_ptr = SLAB_LIST_REF(slot_size);
+    int n = ((char *)p - page - SLAB_HDR_SIZE) / slot_size;
+
+    SLAB_BITMAP(page)[n / 64] &= ~(1ul << (n % 64));
+    /* a full page has a free slot again */
+    if (SLAB_USED(page)-- == SLAB_SLOTS(slot_size)) {
+        insert_free_block_after(class_ptr, page);
+    }
+    if (SLAB_USED(page) == 0 &&
+            (PRED_BLKP(page) != class_ptr || SUCC_BLKP(page) != class_ptr)) {
+        unlink_block(page);
+        slab_map_set(page, 0);
+        heap_free(page);
+    }
+}
+
+#ifdef THREAD_SAFE
+/*
+ * tcache_flush  - give n blocks of bin i back to the free lists
+ */
+static void tcache_flush(tcache_t *tc, int i, int n)
+{
+    char *bp;
+    LOCK_HEAP();
+    while (n-- > 0 && tc->head[i]) {
+        bp = tc->head[i];
+        tc->head[i] = TCACHE_NEXT(bp);
+        tc->count[i]--;
+        heap_free(bp);
+    }
+    UNLOCK_HEAP();
+}
+
+/*
+ * tcache_exit  - flush the cache of an exiting thread
+ */
+static void tcache_exit(void *p)
+{
+    tcache_t *tc = p;
+    int i;
+    if (tc->gen != heap_gen) {
+        return;
+    }
+    for (i = 0; i < TCACHE_BINS; i++) {
+        tcache_flush(tc, i, tc->count[i]);
+    }
+}
+
+static void tcache_key_init(void)
+{
+    pthread_key_create(&tcache_key, tcache_exit);
+}
+
+/*
+ * get_tcache  - the cache of this thread, emptied if it holds blocks of
+ *      an older heap
+ */
+inline static tcache_t *get_tcache(void)
+{
+    if (tcache.gen != heap_gen) {
+        if (tcache.gen == 0) {
+            pthread_once(&tcache_once, tcache_key_init);
+            pthread_setspecific(tcache_key, &tcache);
+        }
+        memset(&tcache, 0, sizeof(tcache));
+        tcache.gen = heap_gen;
+    }
+    return &tcache;
+}
+
+/*
+ * tcache_malloc  - allocate a small block from the cache, refilling its
+ *      bin with TCACHE_BATCH blocks when it is empty
+ */
+static void *tcache_malloc(size_t asize)
+{
+    tcache_t *tc = get_tcache();
+    int i = TCACHE_BIN(asize);
+    char *bp;
+
+    if (!tc->head[i]) {
+        LOCK_HEAP();
+        while (tc->count[i] < TCACHE_BATCH && (bp = heap_malloc(asize))) {
+            TCACHE_NEXT(bp) = tc->head[i];
+            tc->head[i] = bp;
+            tc->count[i]++;
+        }
+        UNLOCK_HEAP();
+        if (!tc->head[i]) {
+            return NULL;
+        }
+    }
+    bp = tc->head[i];
+    tc->head[i] = TCACHE_NEXT(bp);
+    tc->count[i]--;
+    return bp;
+}
+
+/*
+ * tcache_free  - cache a small block, flushing TCACHE_BATCH blocks of its
+ *      bin when the bin is full. A block may be bigger than the size it
+ *      was asked for; it goes in the bin of its real size
+ */
+static void tcache_free(void *bp, size_t size)
+{
+    tcache_t *tc = get_tcache();
+    int i = TCACHE_BIN(size);
+
+    TCACHE_NEXT(bp) = tc->head[i];
+    tc->head[i] = bp;
+    if (++tc->count[i] > TCACHE_FILL) {
+        tcache_flush(tc, i, TCACHE_BATCH);
+    }
+}
+#endif
+
+/*
+ * malloc
+ */
+void *malloc (size_t size)
+{
+    size_t asize;
+    char *bp;
+    if (size <= 0) return NULL;
+
+    if (size <= SLAB_MAX_SIZE) {
+        LOCK_HEAP();
+        bp = slab_malloc(size);
+        UNLOCK_HEAP();
+        return bp;
+    }
+    asize = get_real_malloc_size(size);
+#ifdef THREAD_SAFE
+    if (asize <= TCACHE_MAX_SIZE) {
+        return tcache_malloc(asize);
+    }
+#endif
+    LOCK_HEAP();
+    bp = heap_malloc(asize);
+    UNLOCK_HEAP();
+    return bp;
+}
+
 
 
 /*
@@ -455,8 +1025,8 @@ static void place(void *bp, size_t size)
                 );
         insert_free_block(free_bp);
     } else {
-        PUT(HDRP(bp), PACK(total_size, 1));
-        PUT(FTRP(bp), PACK(total_size, 1));
+        PUT(HDRP(bp), PACK(total_size, 1) | GET_PREV_ALLOC(HDRP(bp)));
+        SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
     }
 }
 
@@ -464,6 +1034,9 @@ static void place(void *bp, size_t size)
  * assert the two blocks are not both free.
  * assert GET_SIZE(pack_v1) + GET_SIZE(pack_v2) = GET_SIZE(bp)
  * return the ptr of newly created block
+ *
+ * The PREV_ALLOC bits of both headers, and of the header after them,
+ * are set to match; footers are only written for a free block.
  */
 static void *split_block(
         void *bp,
@@ -471,33 +1044,62 @@ static void *split_block(
         size_t pack_v2) {
     // TODO: check pack_v1 and pack_v2
     void *next_bp;
-    PUT(HDRP(bp), pack_v1);
-    PUT(FTRP(bp), pack_v1);
+    PUT(HDRP(bp), pack_v1 | GET_PREV_ALLOC(HDRP(bp)));
+    if (!(pack_v1 & 0x1)) {
+        PUT(FTRP(bp), pack_v1);
+    }
     next_bp = NEXT_BLKP(bp);
-    PUT(HDRP(next_bp), pack_v2);
-    PUT(FTRP(next_bp), pack_v2);
+    PUT(HDRP(next_bp), pack_v2 | ((pack_v1 & 0x1) ? PREV_ALLOC : 0));
+    if (pack_v2 & 0x1) {
+        SET_PREV_ALLOC(HDRP(NEXT_BLKP(next_bp)));
+    } else {
+        PUT(FTRP(next_bp), pack_v2);
+        CLEAR_PREV_ALLOC(HDRP(NEXT_BLKP(next_bp)));
+    }
     return next_bp;
 }
 
 /*
  * find a block of memory with size >= "size"
- * We use first fit stratergy. I have tried other strategies,
- * but first fit works very well.
+ *
+ * The blocks in the class of "size" may be smaller than "size", so we
+ * look at the first FIT_SCAN of them, first fit (all of them in the last
+ * class, which is short). Any block of a higher class fits, and the
+ * bitmaps give the first non-empty one right away. Either way the time
+ * is bounded, whatever the free lists hold.
  */
 static void *find_fit(size_t size)
 {
-    void *begin_class_ptr = get_class_ptr(size);
-    void *class_ptr;
+    int k = get_class_index(size);
+    void *class_ptr = FREE_LIST_REF(k);
     void *bp;
-    /* enumerate all free list with blocksize >= "size" */
-    for_range_free_list(begin_class_ptr, END_CLASS_PTR, class_ptr) {
-        for_each_free_block(class_ptr, bp) {
-            size_t alloc = GET_ALLOC(HDRP(bp));
-            size_t size_of_bp = GET_SIZE(HDRP(bp));
-            if (!alloc && size_of_bp >= size) return bp;
-        }
+    int n = 0;
+
+    for_each_free_block(class_ptr, bp) {
+        if (GET_SIZE(HDRP(bp)) >= size) return bp;
+        if (++n == FIT_SCAN && k != FREE_LIST_LEN - 1) break;
     }
-    return NULL;
+    if ((class_ptr = find_class_from(k + 1)) == NULL) {
+        return NULL;
+    }
+    return SUCC_BLKP(class_ptr);
+}
+
+/*
+ * heap_free  - give the block back to the free lists, or the slot back
+ *      to its page. The heap must be locked
+ */
+static void heap_free(void *bp)
+{
+    if (is_slab_slot(bp)) {
+        slab_free(bp);
+        return;
+    }
+    size_t size = GET_SIZE(HDRP(bp));
+    PUT(HDRP(bp), PACK(size, 0) | GET_PREV_ALLOC(HDRP(bp)));
+    PUT(FTRP(bp), PACK(size, 0));
+    CLEAR_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+    coalesce(bp);
 }
 
 /*
@@ -506,25 +1108,131 @@ static void *find_fit(size_t size)
 void free (void *ptr)
 {
     if(!ptr) return;
+#ifdef THREAD_SAFE
     size_t size = GET_SIZE(HDRP(ptr));
-    PUT(HDRP(ptr), PACK(size, 0));
-    PUT(FTRP(ptr), PACK(size, 0));
-    coalesce(ptr);
+    if (size <= TCACHE_MAX_SIZE) {
+        tcache_free(ptr, size);
+        return;
+    }
+#endif
+    LOCK_HEAP();
+    heap_free(ptr);
+    UNLOCK_HEAP();
+}
+
+
+/*
+ * absorb_next  - merge the free block after the allocated block bp into
+ *      it, and return the new size of bp
+ */
+static size_t absorb_next(void *bp)
+{
+    void *next_bp = NEXT_BLKP(bp);
+    size_t size = GET_SIZE(HDRP(bp)) + GET_SIZE(HDRP(next_bp));
+    remove_free_block(next_bp);
+    PUT(HDRP(bp), PACK(size, 1) | GET_PREV_ALLOC(HDRP(bp)));
+    SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+    return size;
+}
+
+/*
+ * resize_block  - resize the block in place to asize bytes if it can,
+ *      merging the block next to it when that is free, and splitting
+ *      off what is left over. Return the new size of the block, which
+ *      is less than asize if it could not grow enough. The heap must be
+ *      locked
+ */
+static size_t resize_block(void *bp, size_t asize)
+{
+    size_t oldsize = GET_SIZE(HDRP(bp));
+    /* if the block next to bp is a free block, we merge it */
+    if (oldsize < asize && IS_FREE(NEXT_BLKP(bp))) {
+        oldsize = absorb_next(bp);
+    }
+
+    /* since oldsize is large enough, we don't need to find a new block
+     * of memory
+     */
+    if (oldsize >= asize + MIN_FREE_BLOCK_SIZE) {
+        void *free_bp = split_block(
+                bp,
+                PACK(asize, 1),
+                PACK(oldsize - asize, 0));
+        /* a block that shrinks may have a free block after it */
+        coalesce(free_bp);
+    }
+    return oldsize;
+}
+
+/*
+ * grow_last_block  - grow the block to asize bytes if it is the last
+ *      one, by extending the heap by what it lacks, but by no less than
+ *      CHUNKSIZE, as heap_malloc does. The block keeps up to rsize bytes,
+ *      resize_block splits off the rest of the extension. Return the new
+ *      size of the block. The heap must be locked
+ */
+static size_t grow_last_block(void *bp, size_t asize, size_t rsize)
+{
+    size_t size = GET_SIZE(HDRP(bp));
+    if (size < asize && IS_EPILOGUE(NEXT_BLKP(bp)) &&
+            extend_heap(MAX(asize - size, CHUNKSIZE) / WSIZE) != NULL) {
+        size = resize_block(bp, rsize);
+    }
+    return size;
+}
+
+/*
+ * slide_block  - grow the block into the free block before it, moving
+ *      its first copy bytes down, if the two hold asize bytes. Return
+ *      the new payload, or NULL if they do not. The heap must be locked
+ */
+static void *slide_block(void *bp, size_t asize, size_t copy)
+{
+    void *prev_bp;
+    size_t size;
+
+    if (GET_PREV_ALLOC(HDRP(bp))) {
+        return NULL;
+    }
+    prev_bp = PREV_BLKP(bp);
+    size = GET_SIZE(HDRP(prev_bp)) + GET_SIZE(HDRP(bp));
+    if (size < asize) {
+        return NULL;
+    }
+    remove_free_block(prev_bp);
+    PUT(HDRP(prev_bp), PACK(size, 1) | GET_PREV_ALLOC(HDRP(prev_bp)));
+    SET_PREV_ALLOC(HDRP(NEXT_BLKP(prev_bp)));
+    /* the old payload may overlap the new one */
+    memmove(prev_bp, bp, copy);
+    if (size >= asize + MIN_FREE_BLOCK_SIZE) {
+        void *free_bp = split_block(
+                prev_bp,
+                PACK(asize, 1),
+                PACK(size - asize, 0));
+        insert_free_block(free_bp);
+    }
+    return prev_bp;
 }
 
+/* room a growing block gets for the next time it grows */
+#define REALLOC_RESERVE(size) ((size) / 8)
 
 /*
  * realloc - Change the size of the block by mallocing a new block,
  *      copying its data, and freeing the old block.
  * 
- * This is an optimized realloc implementation, but it performs the same
- * as the unoptimized version...
+ * A block that grows once is likely to grow again, a bit at a time, so
+ * a block that grows gets REALLOC_RESERVE more than it asks for, and a
+ * block keeps up to that much room when it shrinks. It grows in place
+ * if it can: into the free block after it, into the heap when it is
+ * the last block, or into the free block before it, moving its data
+ * down. Only then is it copied to a new block.
  */
 void *realloc(void *oldptr, size_t size)
 {
     size_t oldsize;
     void *newptr;
-    size_t asize;
+    size_t asize, rsize;
 
     /* If size == 0 then this is just free, and we return NULL. */
     if(size == 0) {
@@ -537,47 +1245,51 @@ void *realloc(void *oldptr, size_t size)
         return malloc(size);
     }
 
-    oldsize = GET_SIZE(HDRP(oldptr));
-    /* if the block next to oldptr is a free block, we merge it */
-    void *next_bp = NEXT_BLKP(oldptr);
-    if (IS_FREE(next_bp)) {
-        // append next free block to the old block
-        remove_free_block(next_bp);
-        size_t next_bp_size = GET_SIZE(HDRP(next_bp));
-        PUT(HDRP(oldptr), PACK(oldsize+next_bp_size, 1));
-        PUT(FTRP(oldptr), PACK(oldsize+next_bp_size, 1));
-        oldsize += next_bp_size;
-    }
-
-    asize = get_real_malloc_size(size);
-
-    if (oldsize >= asize) {
-        /* since oldsize is large enough, we don't need to find a new block
-         * of memory
-         */
-        if (oldsize >= asize + MIN_FREE_BLOCK_SIZE) {
-            void *free_bp = split_block(
-                    oldptr,
-                    PACK(asize, 1),
-                    PACK(oldsize - asize, 0));
-            insert_free_block(free_bp);
+    rsize = size + REALLOC_RESERVE(size);
+    if (is_slab_slot(oldptr)) {
+        /* a slot cannot grow */
+        oldsize = SLAB_SLOT_SIZE(SLAB_PAGE(oldptr));
+        if (size <= oldsize) {
+            return oldptr;
         }
-        newptr = oldptr;
     } else {
-        newptr = malloc(size);
-
-        /* If realloc() fails the original block is left untouched  */
-        if(!newptr) {
-            return 0;
+        asize = get_real_malloc_size(size);
+        oldsize = GET_SIZE(HDRP(oldptr)) - WSIZE;
+        if (size <= oldsize) {
+            if (oldsize > rsize) {
+                LOCK_HEAP();
+                resize_block(oldptr, asize);
+                UNLOCK_HEAP();
+            }
+            return oldptr;
+        }
+        LOCK_HEAP();
+        if (resize_block(oldptr, get_real_malloc_size(rsize)) >= asize ||
+                grow_last_block(oldptr, asize,
+                    get_real_malloc_size(rsize)) >= asize) {
+            UNLOCK_HEAP();
+            return oldptr;
+        }
+        newptr = slide_block(oldptr, asize, oldsize);
+        UNLOCK_HEAP();
+        if (newptr) {
+            return newptr;
         }
+    }
 
-        /* Copy the old data. */
-        if(size < oldsize) oldsize = size;
-        memcpy(newptr, oldptr, oldsize);
+    newptr = malloc(rsize);
 
-        /* Free the old block. */
-        free(oldptr);
+    /* If realloc() fails the original block is left untouched  */
+    if(!newptr) {
+        return 0;
     }
+
+    /* Copy the old data, without holding the lock. */
+    if(size < oldsize) oldsize = size;
+    memcpy(newptr, oldptr, oldsize);
+
+    /* Free the old block. */
+    free(oldptr);
     return newptr;
 }
 
@@ -647,25 +1359,30 @@ static int aligned(const void *p) {
 
 
 /*
- * check_block_consistency  - check header/footer size and content, check
- *      minimum block size
+ * check_block_consistency  - check header/footer size and content of a
+ *      free block, check minimum block size, check the PREV_ALLOC bit
+ *      against the block before
  */
-static void check_block_consistency(const char *bp, int lineno)
+static void check_block_consistency(const char *bp, size_t prev_alloc,
+        int lineno)
 {
     const char *header, *footer;
     header = HDRP(bp);
-    footer = FTRP(bp);
-    CHECK_EQUAL(GET_SIZE(header), GET_SIZE(footer),
-        lineno,
-        "check header/footer size");
-    CHECK_EQUAL(GET_ALLOC(header), GET_ALLOC(footer),
+    CHECK_EQUAL(!!GET_PREV_ALLOC(header), prev_alloc,
         lineno,
-        "check header/footer alloc");
+        "check prev alloc bit");
     CHECK_GREATER_EQUAL(GET_SIZE(header),
         MIN_BLOCK_SIZE,
         lineno,
         "check minimum block size");
     if (IS_FREE(bp)) {
+        footer = FTRP(bp);
+        CHECK_EQUAL(GET_SIZE(header), GET_SIZE(footer),
+            lineno,
+            "check header/footer size");
+        CHECK_EQUAL(GET_ALLOC(header), GET_ALLOC(footer),
+            lineno,
+            "check header/footer alloc");
         CHECK_GREATER_EQUAL(GET_SIZE(header), MIN_FREE_BLOCK_SIZE, lineno,
                 "check minimum free block size");
     }
@@ -681,11 +1398,43 @@ static void check_coalescing(const char *bp, int lineno)
         CHECK_EQUAL(GET_ALLOC(HDRP(NEXT_BLKP(bp))), 1,
             lineno,
             "next block is free");
-        CHECK_EQUAL(GET_ALLOC(HDRP(PREV_BLKP(bp))), 1, lineno,
+        CHECK_TRUE(GET_PREV_ALLOC(HDRP(bp)), lineno,
             "prev block is free");
     }
 }
 
+/*
+ * check_slab_page  - check the page header of a slab page: its bit in
+ *      the slab map, slot size, and that the used count matches its
+ *      bitmap. Return 1 if the page has a free slot, so it must be on
+ *      its list
+ */
+static int check_slab_page(const char *page, int lineno)
+{
+    size_t slot_size = SLAB_SLOT_SIZE(page);
+    int i, used = 0, n;
+
+    CHECK_EQUAL((size_t)page % SLAB_PAGE_SIZE, 0, lineno,
+            "slab page aligned");
+    CHECK_GREATER_EQUAL(GET_SIZE(HDRP(page)), SLAB_BLOCK_SIZE, lineno,
+            "slab page block holds the page");
+    CHECK_TRUE(SLAB_INDEX(page) < slab_map_pages &&
+            (slab_map[SLAB_INDEX(page) / 8] >> (SLAB_INDEX(page) % 8) & 1),
+            lineno, "slab page in the slab map");
+    CHECK_TRUE(slot_size >= DSIZE && slot_size <= SLAB_MAX_SIZE &&
+            slot_size % DSIZE == 0, lineno, "slab slot size");
+    n = SLAB_SLOTS(slot_size);
+    for (i = 0; i < SLAB_BITMAP_WORDS * 64; i++) {
+        if (SLAB_BITMAP(page)[i / 64] & (1ul << (i % 64))) {
+            used += i < n;
+        } else {
+            CHECK_LESS(i, n, lineno, "slab bitmap bits past the last slot");
+        }
+    }
+    CHECK_EQUAL(used, SLAB_USED(page), lineno,
+            "slab used count matches the bitmap");
+    return used < n;
+}
 
 /*
  * return the size for this class
@@ -693,19 +1442,20 @@ static void check_coalescing(const char *bp, int lineno)
  */
 static void get_class_size_range(void *class_ptr, size_t *pmin_size, size_t *pmax_size)
 {
-    size_t ref_offset = ((char *)class_ptr - (char *)free_listp) /
-      FREE_LIST_SENTINEL_SIZE;
+    size_t ref_offset = FREE_LIST_IDX(class_ptr);
+    size_t fl = ref_offset / SL_COUNT, sl = ref_offset % SL_COUNT;
+    /* width of the classes of this first level */
+    size_t step = (size_t)DSIZE << (fl ? fl - 1 : 0);
+    if (fl == 0) {
+        *pmin_size = *pmax_size = ref_offset * DSIZE;
+    } else {
+        *pmin_size = (SL_COUNT + sl) * step;
+        *pmax_size = *pmin_size + step - DSIZE;
+    }
     if (ref_offset == FREE_LIST_LEN - 1) {
-        *pmin_size = 4097;
         *pmax_size = MAX_BLOCK_SIZE;
-    } else if (ref_offset == 0) {
-        *pmin_size = *pmax_size = MIN_BLOCK_SIZE;
-    } else {
-        *pmin_size = ((1<<ref_offset)+1) * DSIZE;
-        *pmax_size = (1<<(1+ref_offset)) * DSIZE;
     }
 }
-
 /*
  * mm_checkheap
  */
@@ -714,6 +1464,9 @@ void mm_checkheap(int lineno)
     char *bp, *class_ptr;
     size_t free_block_count_in_free_list;
     size_t free_block_count;
+    size_t slab_page_count, slab_page_count_in_lists;
+    size_t slab_pages, slab_map_bits, i;
+    size_t prev_alloc;
     /* free list block size range for each class*/
     size_t min_class_size;
     size_t max_class_size;
@@ -731,25 +1484,48 @@ void mm_checkheap(int lineno)
     CHECK_TRUE(aligned(heap_listp), lineno, "check prologue aligned");
     CHECK_TRUE(in_heap(heap_listp), lineno, "check prologue in heap");
 
-    free_block_count = 0;
+    free_block_count = slab_page_count = slab_pages = 0;
+    prev_alloc = 1;  /* the prologue */
     for_each_block(bp) {
         CHECK_TRUE(aligned(bp), lineno, "check block aligned");
         CHECK_TRUE(in_heap(bp), lineno, "check block in heap");
-        check_block_consistency(bp, lineno);
+        check_block_consistency(bp, prev_alloc, lineno);
+        prev_alloc = GET_ALLOC(HDRP(bp));
         check_coalescing(bp, lineno);
         if (IS_FREE(bp)) free_block_count += 1;
+        if (GET(HDRP(bp)) & SLAB_BIT) {
+            slab_page_count += check_slab_page(bp, lineno);
+            slab_pages++;
+        }
     }
+    /* and the map has no other page */
+    slab_map_bits = 0;
+    for (i = 0; i < slab_map_pages / 8; i++) {
+        slab_map_bits += __builtin_popcount(slab_map[i]);
+    }
+    CHECK_EQUAL(slab_pages, slab_map_bits, lineno,
+            "slab map bits match the slab pages");
 
     /* after forEach Iteration, bp points to epilogue block */
     CHECK_TRUE(aligned(bp), lineno, "check epilogue aligned");
     CHECK_FALSE(in_heap(bp), lineno, "check epilogue in heap");
-    CHECK_EQUAL(GET(HDRP(bp)), 1, lineno, "check epilogue header");
+    CHECK_EQUAL(GET(HDRP(bp)), PACK(0, 1) | (prev_alloc ? PREV_ALLOC : 0),
+            lineno, "check epilogue header");
 
 
     /* check free list */
     
     free_block_count_in_free_list = 0;
     for_each_free_list(class_ptr) {
+        size_t k = FREE_LIST_IDX(class_ptr);
+        CHECK_EQUAL(!!(SL_BITMAP(k / SL_COUNT) & (1u << (k % SL_COUNT))),
+                SUCC_BLKP(class_ptr) != class_ptr,
+                lineno,
+                "class bitmap bit set iff the free list is not empty");
+        CHECK_EQUAL(!!(fl_bitmap & (1u << (k / SL_COUNT))),
+                SL_BITMAP(k / SL_COUNT) != 0,
+                lineno,
+                "first level bit set iff one of its classes is not empty");
         get_class_size_range(class_ptr, &min_class_size, &max_class_size);
         for_each_free_block(class_ptr, bp) {
             free_block_count_in_free_list += 1;
@@ -779,4 +1555,24 @@ void mm_checkheap(int lineno)
 
     CHECK_EQUAL(free_block_count, free_block_count_in_free_list,
         lineno, "free block count consistency");
+
+    /* check slab lists: the pages with a free slot, by slot size */
+
+    slab_page_count_in_lists = 0;
+    for_range_free_list(END_CLASS_PTR, END_CLASS_PTR + SLAB_LISTS_SIZE,
+            class_ptr) {
+        size_t slot_size = (class_ptr - END_CLASS_PTR) /
+                FREE_LIST_SENTINEL_SIZE * DSIZE + DSIZE;
+        for_each_free_block(class_ptr, bp) {
+            slab_page_count_in_lists += 1;
+            CHECK_EQUAL(SUCC_BLKP(PRED_BLKP(bp)), bp, lineno,
+                    "slab page's previous's next points to it");
+            CHECK_TRUE(GET(HDRP(bp)) & SLAB_BIT, lineno,
+                    "slab lists hold only slab pages");
+            CHECK_EQUAL(SLAB_SLOT_SIZE(bp), slot_size, lineno,
+                    "slab page on the list of its slot size");
+        }
+    }
+    CHECK_EQUAL(slab_page_count, slab_page_count_in_lists,
+        lineno, "slab page count consistency");
 }
@@ -0,0 +1,476 @@
+/* $begin tinymain */
+/*
+ * tiny.c - A simple HTTP/1.0 Web server that uses the GET method to
+ *     serve static and dynamic content. It serves one connection at a
+ *     time, or several with pre-forked processes, pre-threaded workers
+ *     or epoll event loops (event.c).
+ */
+#include "tiny.h"
+#include "sbuf.h"
+
+#include <sys/prctl.h>
+#include <sys/sendfile.h>
+
+/* files kept open by default, see fdcache.h */
+#define FDCACHE_SIZE 256
+
+/* workers or event loops by default, and connections queued per thread */
+#define DEFAULT_WORKERS 4
+#define SBUF_PER_THREAD 16
+
+fdcache_t files;  /* open static files */
+int quiet = 0;    /* don't log requests */
+sbuf_t sbuf;      /* connections waiting for a worker thread */
+
+void doit(int fd);
+int read_requesthdrs(rio_t *rp);
+void serve_static(int fd, char *filename, fd_entry_t *file);
+void clienterror(int fd, char *cause, char *errnum, 
+		 char *shortmsg, char *longmsg);
+
+/*
+ * accept_client - accept a connection, and log where it comes from
+ */
+int accept_client(int listenfd)
+{
+    char hostname[MAXLINE], port[MAXLINE];
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+    int connfd;
+
+    clientlen = sizeof(clientaddr);
+    connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen); //line:netp:tiny:accept
+    if (!quiet) {
+        Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, 
+                    port, MAXLINE, 0);
+        printf("Accepted connection from (%s, %s)\n", hostname, port);
+    }
+    return connfd;
+}
+
+/*
+ * serve_iterative - serve the connections one at a time
+ */
+void serve_iterative(int listenfd)
+{
+    int connfd;
+
+    while (1) {
+	connfd = accept_client(listenfd);
+	doit(connfd);                                             //line:netp:tiny:doit
+	Close(connfd);                                            //line:netp:tiny:close
+    }
+}
+
+/*
+ * serve_forked - nworkers processes accept on the same socket, and
+ *     each serves its connections one at a time. A worker that dies
+ *     is replaced
+ */
+void serve_forked(int listenfd, int nworkers, int cached_files)
+{
+    int i;
+
+    for (i = 0; i < nworkers + 1; i++) {
+	if (i == nworkers) {
+	    if (wait(NULL) < 0)
+		unix_error("wait error");
+	    i--;
+	}
+	if (Fork() == 0) {
+	    /* workers go when the parent is killed */
+	    prctl(PR_SET_PDEATHSIG, SIGTERM);
+	    if (getppid() == 1)
+		exit(0);
+	    /* each worker has its own cache and inotify descriptor */
+	    fdcache_init(&files, cached_files);
+	    serve_iterative(listenfd);
+	}
+    }
+}
+
+/*
+ * worker - a thread serving the connections of the queue
+ */
+void *worker(void *vargp)
+{
+    Pthread_detach(pthread_self());
+    while (1) {
+	int connfd = sbuf_remove(&sbuf);
+	doit(connfd);
+	Close(connfd);
+    }
+    return NULL;
+}
+
+/*
+ * serve_threaded - nworkers threads take the accepted connections from
+ *     a queue
+ */
+void serve_threaded(int listenfd, int nworkers)
+{
+    pthread_t tid;
+    int i;
+
+    sbuf_init(&sbuf, nworkers * SBUF_PER_THREAD);
+    for (i = 0; i < nworkers; i++)
+	Pthread_create(&tid, NULL, worker, NULL);
+    while (1)
+	sbuf_insert(&sbuf, accept_client(listenfd));
+}
+
+void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-c cached_files] "
+	    "[-m iterative|fork|thread|epoll] [-n workers] [-q] <port>\n",
+	    prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) 
+{
+    int listenfd, opt;
+    int cached_files = FDCACHE_SIZE;
+    int nworkers = DEFAULT_WORKERS;
+    char *mode = "iterative";
+
+    /* Check command line args */
+    while ((opt = getopt(argc, argv, "c:m:n:q")) != -1) {
+	switch (opt) {
+	case 'c':
+	    if ((cached_files = atoi(optarg)) < 0)
+		usage(argv[0]);
+	    break;
+	case 'm':
+	    mode = optarg;
+	    break;
+	case 'n':
+	    if ((nworkers = atoi(optarg)) <= 0)
+		usage(argv[0]);
+	    break;
+	case 'q':
+	    quiet = 1;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (optind != argc - 1)
+	usage(argv[0]);
+
+    /* a client that goes away is an error of its request only */
+    Signal(SIGPIPE, SIG_IGN);
+    listenfd = Open_listenfd(argv[optind]);
+    if (strcmp(mode, "fork") == 0) {
+	serve_forked(listenfd, nworkers, cached_files);
+	return 0;
+    }
+    fdcache_init(&files, cached_files);
+    if (strcmp(mode, "iterative") == 0)
+	serve_iterative(listenfd);
+    else if (strcmp(mode, "thread") == 0)
+	serve_threaded(listenfd, nworkers);
+    else if (strcmp(mode, "epoll") == 0)
+	event_serve(listenfd, nworkers);
+    usage(argv[0]);
+    return 0;
+}
+/* $end tinymain */
+
+/*
+ * doit - handle one HTTP request/response transaction
+ */
+/* $begin doit */
+void doit(int fd) 
+{
+    int is_static;
+    struct stat sbuf;
+    char buf[MAXBUF], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    char filename[MAXLINE], cgiargs[MAXLINE];
+    size_t len;
+    rio_t rio;
+
+    /* Read request line and headers */
+    Rio_readinitb(&rio, fd);
+    if (rio_readlineb(&rio, buf, MAXLINE) <= 0)          //line:netp:doit:readrequest
+        return;
+    if (!quiet)
+	printf("%s", buf);
+    if (sscanf(buf, "%s %s %s", method, uri, version) != 3 || //line:netp:doit:parserequest
+	strcasecmp(method, "GET")) {                     //line:netp:doit:beginrequesterr
+        clienterror(fd, method, "501", "Not Implemented",
+                    "Tiny does not implement this method");
+        return;
+    }                                                    //line:netp:doit:endrequesterr
+    if (read_requesthdrs(&rio) < 0)                      //line:netp:doit:readrequesthdrs
+	return;
+
+    /* Parse URI from GET request */
+    is_static = parse_uri(uri, filename, cgiargs);       //line:netp:doit:staticcheck
+    if (is_static) { /* Serve static content, open files are cached */
+	fd_entry_t *file = open_static(filename, buf, sizeof(buf), &len);
+	if (file == NULL) {
+	    rio_writen(fd, buf, len);
+	    return;
+	}
+	serve_static(fd, filename, file);                //line:netp:doit:servestatic
+	fdcache_release(&files, file);
+	return;
+    }
+
+    if (stat(filename, &sbuf) < 0) {                     //line:netp:doit:beginnotfound
+	clienterror(fd, filename, "404", "Not found",
+		    "Tiny couldn't find this file");
+	return;
+    }                                                    //line:netp:doit:endnotfound
+
+    /* Serve dynamic content */
+    if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) { //line:netp:doit:executable
+	clienterror(fd, filename, "403", "Forbidden",
+		    "Tiny couldn't run the CGI program");
+	return;
+    }
+    serve_dynamic(fd, filename, cgiargs);                //line:netp:doit:servedynamic
+}
+/* $end doit */
+
+/*
+ * read_requesthdrs - read HTTP request headers. Return -1 if the
+ *     client goes away before the end of them
+ */
+/* $begin read_requesthdrs */
+int read_requesthdrs(rio_t *rp) 
+{
+    char buf[MAXLINE];
+
+    do {                                  
+	if (rio_readlineb(rp, buf, MAXLINE) <= 0)
+	    return -1;
+	if (!quiet)
+	    printf("%s", buf);
+    } while (strcmp(buf, "\r\n"));        //line:netp:readhdrs:checkterm
+    return 0;
+}
+/* $end read_requesthdrs */
+
+/*
+ * parse_uri - parse URI into filename and CGI args
+ *             return 0 if dynamic content, 1 if static
+ */
+/* $begin parse_uri */
+int parse_uri(char *uri, char *filename, char *cgiargs) 
+{
+    char *ptr;
+
+    if (!strstr(uri, "cgi-bin")) {  /* Static content */ //line:netp:parseuri:isstatic
+	strcpy(cgiargs, "");                             //line:netp:parseuri:clearcgi
+	if ((ptr = index(uri, '?')))  /* a file has no use for a query */
+	    *ptr = '\0';
+	strcpy(filename, ".");                           //line:netp:parseuri:beginconvert1
+	strcat(filename, uri);                           //line:netp:parseuri:endconvert1
+	if (uri[strlen(uri)-1] == '/')                   //line:netp:parseuri:slashcheck
+	    strcat(filename, "home.html");               //line:netp:parseuri:appenddefault
+	return 1;
+    }
+    else {  /* Dynamic content */                        //line:netp:parseuri:isdynamic
+	ptr = index(uri, '?');                           //line:netp:parseuri:beginextract
+	if (ptr) {
+	    strcpy(cgiargs, ptr+1);
+	    *ptr = '\0';
+	}
+	else 
+	    strcpy(cgiargs, "");                         //line:netp:parseuri:endextract
+	strcpy(filename, ".");                           //line:netp:parseuri:beginconvert2
+	strcat(filename, uri);                           //line:netp:parseuri:endconvert2
+	return 0;
+    }
+}
+/* $end parse_uri */
+
+/*
+ * send_head - send the response headers, telling the kernel that the
+ *     body follows so both can leave in the same segments
+ */
+static int send_head(int fd, char *buf, size_t n)
+{
+    ssize_t sent;
+
+    while (n > 0) {
+	if ((sent = send(fd, buf, n, MSG_MORE)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	buf += sent;
+	n -= sent;
+    }
+    return 0;
+}
+
+/*
+ * send_body - send size bytes of srcfd with sendfile, from offset 0.
+ *     The file offset of srcfd is not used, other requests may share it
+ */
+static int send_body(int fd, int srcfd, off_t size)
+{
+    off_t offset = 0;
+    ssize_t sent;
+
+    while (offset < size) {
+	if ((sent = sendfile(fd, srcfd, &offset, size - offset)) <= 0) {
+	    if (sent < 0 && errno == EINTR)
+		continue;
+	    return -1;  /* error, or the file got shorter */
+	}
+    }
+    return 0;
+}
+
+/*
+ * static_head - build the response headers for a file into buf, and
+ *     return their length
+ */
+size_t static_head(char *buf, size_t size, char *filename, off_t filesize)
+{
+    char filetype[64];
+    int n;
+
+    get_filetype(filename, filetype);       //line:netp:servestatic:getfiletype
+    n = snprintf(buf, size, "HTTP/1.0 200 OK\r\n" //line:netp:servestatic:beginserve
+		 "Server: Tiny Web Server\r\n"
+		 "Connection: close\r\n"
+		 "Content-length: %lld\r\n"
+		 "Content-type: %s\r\n\r\n", (long long)filesize, filetype);
+    if (!quiet) {
+	printf("Response headers:\n");
+	printf("%s", buf);
+    }
+    return n;
+}
+
+/*
+ * open_static - the open file of a static request. If it can't be
+ *     served, return NULL with the error response in buf
+ */
+fd_entry_t *open_static(char *filename, char *buf, size_t size, size_t *len)
+{
+    fd_entry_t *file;
+
+    if ((file = fdcache_open(&files, filename)) == NULL) { //line:netp:doit:beginnotfound
+	if (errno == ENOENT || errno == ENOTDIR)
+	    *len = error_response(buf, size, filename, "404", "Not found",
+				  "Tiny couldn't find this file");
+	else
+	    *len = error_response(buf, size, filename, "403", "Forbidden",
+				  "Tiny couldn't read the file");
+	return NULL;
+    }                                                    //line:netp:doit:endnotfound
+    if (!(S_ISREG(file->st.st_mode)) || !(S_IRUSR & file->st.st_mode)) { //line:netp:doit:readable
+	fdcache_release(&files, file);
+	*len = error_response(buf, size, filename, "403", "Forbidden",
+			      "Tiny couldn't read the file");
+	return NULL;
+    }
+    return file;
+}
+
+/*
+ * serve_static - copy a file back to the client 
+ */
+/* $begin serve_static */
+void serve_static(int fd, char *filename, fd_entry_t *file) 
+{
+    char buf[MAXBUF];
+    off_t filesize = file->st.st_size;
+    size_t n = static_head(buf, sizeof(buf), filename, filesize);
+
+    /* Send response headers, then the body straight from the open file */
+    if (send_head(fd, buf, n) < 0 ||
+	send_body(fd, file->fd, filesize) < 0)   //line:netp:servestatic:write
+	if (!quiet)
+	    fprintf(stderr, "serve_static: %s: %s\n", filename, strerror(errno));
+}
+
+/*
+ * get_filetype - derive file type from file name
+ */
+void get_filetype(char *filename, char *filetype) 
+{
+    if (strstr(filename, ".html"))
+	strcpy(filetype, "text/html");
+    else if (strstr(filename, ".gif"))
+	strcpy(filetype, "image/gif");
+    else if (strstr(filename, ".png"))
+	strcpy(filetype, "image/png");
+    else if (strstr(filename, ".jpg"))
+	strcpy(filetype, "image/jpeg");
+    else
+	strcpy(filetype, "text/plain");
+}  
+/* $end serve_static */
+
+/*
+ * serve_dynamic - run a CGI program on behalf of the client
+ */
+/* $begin serve_dynamic */
+void serve_dynamic(int fd, char *filename, char *cgiargs) 
+{
+    char buf[MAXLINE], *emptylist[] = { NULL };
+    pid_t pid;
+
+    /* Return first part of HTTP response */
+    sprintf(buf, "HTTP/1.0 200 OK\r\nServer: Tiny Web Server\r\n");
+    if (rio_writen(fd, buf, strlen(buf)) < 0)
+	return;
+  
+    if ((pid = Fork()) == 0) { /* Child */ //line:netp:servedynamic:fork
+	/* Real server would set all CGI vars here */
+	setenv("QUERY_STRING", cgiargs, 1); //line:netp:servedynamic:setenv
+	Dup2(fd, STDOUT_FILENO);         /* Redirect stdout to client */ //line:netp:servedynamic:dup2
+	Execve(filename, emptylist, environ); /* Run CGI program */ //line:netp:servedynamic:execve
+    }
+    /* Parent waits for and reaps its child, not those of other threads */
+    Waitpid(pid, NULL, 0); //line:netp:servedynamic:wait
+}
+/* $end serve_dynamic */
+
+/*
+ * error_response - build an error message for the client into buf,
+ *     and return its length
+ */
+size_t error_response(char *buf, size_t size, char *cause, char *errnum,
+		      char *shortmsg, char *longmsg)
+{
+    char body[MAXBUF];
+    int n;
+
+    /* Build the HTTP response body */
+    snprintf(body, sizeof(body), "<html><title>Tiny Error</title>"
+	     "<body bgcolor=""ffffff"">\r\n"
+	     "%s: %s\r\n"
+	     "<p>%s: %.1024s\r\n"
+	     "<hr><em>The Tiny Web server</em>\r\n",
+	     errnum, shortmsg, longmsg, cause);
+
+    /* Headers and body, cut short if they don't fit */
+    n = snprintf(buf, size, "HTTP/1.0 %s %s\r\n"
+		 "Content-type: text/html\r\n"
+		 "Content-length: %d\r\n\r\n%s",
+		 errnum, shortmsg, (int)strlen(body), body);
+    return (size_t)n < size ? (size_t)n : size - 1;
+}
+
+/*
+ * clienterror - returns an error message to the client
+ */
+/* $begin clienterror */
+void clienterror(int fd, char *cause, char *errnum, 
+		 char *shortmsg, char *longmsg) 
+{
+    char buf[MAXBUF];
+    size_t n = error_response(buf, sizeof(buf), cause, errnum,
+			      shortmsg, longmsg);
+
+    rio_writen(fd, buf, n);
+}
+/* $end clienterror */
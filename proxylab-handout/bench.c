@@ -0,0 +1,247 @@
+/*
+ * bench.c  -- micro benchmarks for the proxy building blocks
+ */
+#include "csapp.h"
+#include "cache.h"
+#include "dnscache.h"
+#include "http.h"
+#include "util.h"
+#include "stats.h"
+
+#include <stdio.h>
+
+/* report  -- print the result of a benchmark */
+static void report(const char *name, long long ops, long long ns)
+{
+    printf("%-28s %10lld ops %10.1f ns/op\n", name, ops, (double)ns / ops);
+}
+
+/* bench_cache_find  -- fill the cache with 10k small objects and look
+ * them up in a random order. Every lookup is a hit.
+ */
+void bench_cache_find()
+{
+    const int nobjs = 10000;
+    const int nlookups = 1000000;
+    lru_cache_t cache;
+    char (*keys)[64] = malloc(nobjs * sizeof(*keys));
+    int *order = malloc(nlookups * sizeof(int));
+    char value[512];
+    int i;
+
+    memset(value, 'x', sizeof(value));
+    lru_cache_init(&cache, (size_t)nobjs * sizeof(value));
+    for (i = 0; i < nobjs; i++) {
+        sprintf(keys[i], "localhost:8080/objects/%d.html", i);
+        lru_cache_insert(&cache, keys[i], value, sizeof(value));
+    }
+
+    /* generate the lookup order up front so only lookups are timed */
+    srand(15213);
+    for (i = 0; i < nlookups; i++) {
+        order[i] = rand() % nobjs;
+    }
+    long long start = now_ns();
+    for (i = 0; i < nlookups; i++) {
+        if (lru_cache_find(&cache, keys[order[i]]) == NULL) {
+            fprintf(stderr, "[ERROR] %s is not cached\n", keys[order[i]]);
+            exit(-1);
+        }
+    }
+    report("cache_find(10k objects)", nlookups, now_ns() - start);
+    lru_cache_free(&cache);
+    free(order);
+    free(keys);
+}
+
+/* rss_kb  -- resident memory of the process in KB */
+static long rss_kb()
+{
+    char line[MAXLINE];
+    long kb = 0;
+    FILE *fp = fopen("/proc/self/status", "r");
+    if (fp == NULL) return 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "VmRSS: %ld", &kb) == 1) break;
+    }
+    fclose(fp);
+    return kb;
+}
+
+/* bench_cache_memory  -- push 20 times the cache size of objects between
+ * min_size and max_size through a 1 MB cache, and report how much
+ * resident memory it takes to hold what is left. Runs in a child so
+ * that earlier benchmarks do not leave memory behind for it to reuse.
+ */
+void bench_cache_memory(size_t min_size, size_t max_size)
+{
+    if (Fork() != 0) {
+        Wait(NULL);
+        return;
+    }
+
+    const size_t max_cache_size = 1049000;
+    const int nobjs = 20 * max_cache_size / ((min_size + max_size) / 2);
+    shard_cache_t cache;
+    char key[MAXLINE], name[MAXLINE];
+    char *value = malloc(max_size);
+    int i, held = 0;
+
+    memset(value, 'x', max_size);
+    long before = rss_kb();
+    shard_cache_init(&cache, 8, max_cache_size, NULL);
+    srand(15213);
+    for (i = 0; i < nobjs; i++) {
+        size_t len = min_size + rand() % (max_size - min_size);
+        sprintf(key, "localhost:8080/objects/%d.html", i);
+        shard_cache_put(&cache, key, value, len);
+    }
+    for (i = 0; i < nobjs; i++) {
+        sprintf(key, "localhost:8080/objects/%d.html", i);
+        lru_cache_obj_t *obj = shard_cache_get(&cache, key);
+        if (obj) {
+            held++;
+            lru_cache_obj_release(obj);
+        }
+    }
+    long rss = rss_kb() - before;
+    sprintf(name, "cache_memory(%zu-%zu B)", min_size, max_size);
+    printf("%-28s %10d objs %10ld KB rss %6.1f objs/MB\n", name, held, rss,
+            rss > 0 ? held * 1024.0 / rss : 0.0);
+    shard_cache_free(&cache);
+    free(value);
+    exit(0);
+}
+
+/* bench_dns_lookup  -- resolve localhost with getaddrinfo, and through
+ * the dns cache where every lookup after the first is a hit
+ */
+void bench_dns_lookup()
+{
+    const int nlookups = 10000;
+    dns_addr_t addrs[DNS_MAX_ADDRS];
+    dnscache_t dc;
+    int i;
+
+    long long start = now_ns();
+    for (i = 0; i < nlookups; i++) {
+        dns_getaddrinfo("localhost", "80", addrs, DNS_MAX_ADDRS);
+    }
+    report("getaddrinfo(localhost)", nlookups, now_ns() - start);
+
+    dnscache_init(&dc, 16, 60 * 1000000000LL, 0, dns_getaddrinfo);
+    start = now_ns();
+    for (i = 0; i < nlookups; i++) {
+        dnscache_lookup(&dc, "localhost", "80", addrs, DNS_MAX_ADDRS);
+    }
+    report("dnscache_lookup(localhost)", nlookups, now_ns() - start);
+    dnscache_free(&dc);
+}
+
+/* bench_http_request  -- parse a browser-like request head and build the
+ * request forwarded to the server, as forward() does. One thread, so
+ * the rate is per core
+ */
+void bench_http_request()
+{
+    const int nrequests = 1000000;
+    const char *head = "GET http://www.cmu.edu:8080/hub/index.html HTTP/1.1\r\n"
+        "Host: www.cmu.edu:8080\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Firefox/120.0\r\n"
+        "Accept: text/html,application/xhtml+xml,*/*;q=0.8\r\n"
+        "Accept-Language: en-US,en;q=0.5\r\n"
+        "Accept-Encoding: gzip, deflate\r\n"
+        "Referer: http://www.cmu.edu/\r\n"
+        "Cookie: session=0123456789abcdef; theme=dark\r\n"
+        "Connection: keep-alive\r\n"
+        "Upgrade-Insecure-Requests: 1\r\n"
+        "\r\n";
+    size_t len = strlen(head);
+    char host[HTTP_HOST_MAX], port[HTTP_PORT_MAX], key[MAXLINE];
+    char request[MAXBUF];
+    size_t total = 0;
+    int i, j;
+
+    long long start = now_ns();
+    for (i = 0; i < nrequests; i++) {
+        http_request_t req;
+        http_writer_t w;
+        int has_host = 0, keep_alive = 1;
+        http_request_init(&req);
+        http_request_parse(&req, head, len);
+        http_request_target(&req, host, port, key, sizeof(key));
+        http_writer_init(&w, request, sizeof(request));
+        http_request_line(&w, &req, 1);
+        for (j = 0; j < req.nheaders; j++) {
+            http_request_header(&w, &req.headers[j], &has_host, &keep_alive);
+        }
+        http_request_end(&w, has_host, host, port, 1);
+        total += w.len;
+    }
+    long long ns = now_ns() - start;
+    report("http request parse+rewrite", nrequests, ns);
+    printf("%-28s %10.0f requests/s (%zu bytes out)\n", "",
+            nrequests * 1e9 / ns, total / nrequests);
+}
+
+/* bench_stats  -- the cost of counting: a per thread counter, and the
+ * shared atomic counter it replaces. Several threads, so the shared one
+ * bounces between cores
+ */
+#define STATS_THREADS 4
+#define STATS_OPS 10000000
+static long long shared_counter;
+
+static void *count_local(void *vargp)
+{
+    int i;
+    for (i = 0; i < STATS_OPS; i++) {
+        STATS_ADD(requests, 1);
+    }
+    return NULL;
+}
+
+static void *count_shared(void *vargp)
+{
+    int i;
+    for (i = 0; i < STATS_OPS; i++) {
+        __sync_fetch_and_add(&shared_counter, 1);
+    }
+    return NULL;
+}
+
+static void bench_counter(const char *name, void *(*fn)(void *))
+{
+    pthread_t tids[STATS_THREADS];
+    int i;
+    long long start = now_ns();
+    for (i = 0; i < STATS_THREADS; i++) {
+        Pthread_create(&tids[i], NULL, fn, NULL);
+    }
+    for (i = 0; i < STATS_THREADS; i++) {
+        Pthread_join(tids[i], NULL);
+    }
+    report(name, (long long)STATS_THREADS * STATS_OPS, now_ns() - start);
+}
+
+void bench_stats()
+{
+    stats_t total;
+    bench_counter("per thread counter", count_local);
+    bench_counter("shared atomic counter", count_shared);
+    stats_sum(&total);
+    if (total.requests != (long long)STATS_THREADS * STATS_OPS) {
+        printf("per thread counter: lost counts\n");
+    }
+}
+
+int main()
+{
+    bench_cache_find();
+    bench_cache_memory(64, 4 * 1024);
+    bench_cache_memory(256, 16 * 1024);
+    bench_dns_lookup();
+    bench_http_request();
+    bench_stats();
+    return 0;
+}
@@ -58,6 +58,7 @@ void bytes_appendn(Bytes *pstr, const char *buf, size_t buf_len)
         for (i = 0; i < buf_len; i++) {
             new_buf[pstr->len+i] = buf[i];
         }
+        free(pstr->buf);
         pstr->len += buf_len;
         pstr->size = new_size;
         pstr->buf = new_buf;
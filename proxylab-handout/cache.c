@@ -1,70 +1,209 @@
 /*
- * cache.c - lru cache
+ * cache.c - lru cache with pluggable eviction policies
  */
 
 #include "cache.h"
+#include "slab.h"
+#include "util.h"
 
 /* return the cache size of the node */
 #define node_cache_size(pnode) (((pnode)->value_len)*sizeof(char))
 
-/* create_empty_node */
-static lru_cache_node_t *create_empty_node()
+/* initial number of hash buckets. Must be a power of 2 */
+#define INIT_NBUCKETS 64
+
+/* return the bucket of the hash value */
+#define bucket_of(pcache, h) ((pcache)->buckets[(h) & ((pcache)->nbuckets-1)])
+
+/* create_empty_node  -- create a node with room for a key of key_len */
+static lru_cache_node_t *create_empty_node(size_t key_len)
 {
-    lru_cache_node_t *pnode = (lru_cache_node_t*)malloc(
-        sizeof(lru_cache_node_t));
+    lru_cache_node_t *pnode = (lru_cache_node_t*)slab_alloc(
+        sizeof(lru_cache_node_t) + key_len + 1);
     if (pnode == NULL) return NULL;
+    pnode->obj = NULL;
     pnode->value_len = 0;
+    pnode->freq = 0;
+    pnode->priority = 0;
+    pnode->priority_freq = 0;
+    pnode->heap_index = 0;
+    pnode->queue = 0;
     pnode->key[0] = '\0';
+    pnode->hash = 0;
     pnode->value = NULL;
     pnode->next = NULL;
     pnode->prev = NULL;
+    pnode->hnext = NULL;
     return pnode;
 }
 
-/* free_node */
+/* free_node  -- free the node and drop its reference to the content */
 static void free_node(lru_cache_node_t *pnode)
 {
-    free(pnode->value);
-    free(pnode);
+    if (pnode->obj) {
+        lru_cache_obj_release(pnode->obj);
+    }
+    slab_free(pnode);
+}
+
+/* lru_cache_obj_get  -- take a reference to the object */
+lru_cache_obj_t *lru_cache_obj_get(lru_cache_obj_t *obj)
+{
+    __sync_add_and_fetch(&obj->refcnt, 1);
+    return obj;
+}
+
+/* lru_cache_obj_release  -- drop a reference. The last one frees it */
+void lru_cache_obj_release(lru_cache_obj_t *obj)
+{
+    if (__sync_sub_and_fetch(&obj->refcnt, 1) == 0) {
+        slab_free(obj);
+    }
 }
 
-/* create_node_from  -- create a node from (key, value) pair */
+/* create_node_from  -- create a node from (key, value) pair. NULL if
+ * out of memory */
 static lru_cache_node_t *create_node_from(
         const char *key,
         const char *value,
         size_t value_len)
 {
-    lru_cache_node_t *pnode = create_empty_node();
-    pnode->value = (char *)malloc(value_len*sizeof(char));
-    pnode->value_len = value_len;
-    strcpy(pnode->key, key);
-    int i;
-    for (i = 0; i < value_len; i++) {
-        pnode->value[i] = value[i];
+    size_t key_len = strlen(key);
+    lru_cache_node_t *pnode = create_empty_node(key_len);
+    if (pnode == NULL) return NULL;
+    pnode->obj = (lru_cache_obj_t *)slab_alloc(sizeof(lru_cache_obj_t) +
+            value_len*sizeof(char));
+    if (pnode->obj == NULL) {
+        slab_free(pnode);
+        return NULL;
     }
+    pnode->obj->refcnt = 1;
+    pnode->obj->expires_ns = 0;
+    pnode->obj->len = value_len;
+    pnode->value = pnode->obj->data;
+    pnode->value_len = value_len;
+    memcpy(pnode->key, key, key_len + 1);
+    pnode->hash = lru_cache_hash(key);
+    memcpy(pnode->value, value, value_len);
     return pnode;
 }
 
-/* lru_cache_init  -- init lru cache */
+/* lru_cache_hash  -- FNV-1a hash of the lower case key. Keys are compared
+ * with strcasecmp, so the hash must ignore case as well.
+ */
+unsigned int lru_cache_hash(const char *key)
+{
+    unsigned int h = 2166136261u;
+    for (; *key != '\0'; key++) {
+        h ^= (unsigned char)tolower(*key);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* lru_cache_init  -- init lru cache with the lru policy */
 void lru_cache_init(lru_cache_t *pcache, size_t max_cache_size)
+{
+    lru_cache_init_policy(pcache, max_cache_size, &lru_cache_lru_policy);
+}
+
+/* lru_cache_init_policy  -- init the cache with an eviction policy */
+void lru_cache_init_policy(lru_cache_t *pcache, size_t max_cache_size,
+        const lru_cache_policy_t *policy)
 {
     pcache->max_cache_size = max_cache_size;
-    pcache->sentinel = create_empty_node();
+    pcache->cache_size = 0;
+    pcache->count = 0;
+    pcache->evictions = 0;
+    pcache->nbuckets = INIT_NBUCKETS;
+    pcache->buckets = (lru_cache_node_t **)calloc(pcache->nbuckets,
+            sizeof(lru_cache_node_t *));
+    pcache->sentinel = create_empty_node(0);
     pcache->sentinel->next = pcache->sentinel;
     pcache->sentinel->prev = pcache->sentinel;
+    pcache->policy = policy;
+    pcache->policy_data = NULL;
+    pcache->on_evict = NULL;
+    pcache->evict_arg = NULL;
+    policy->init(pcache);
 }
 
 /* lru_cache_free  -- free the lru cache */
 void lru_cache_free(lru_cache_t *pcache)
 {
     lru_cache_node_t *cur, *next = NULL;
-    cur = pcache->sentinel->next;
-    while (cur != pcache->sentinel) {
-        next = cur->next;
-        free_node(cur);
-        cur = next;
+    size_t i;
+    /* the policy may keep nodes out of the list, the buckets have all */
+    for (i = 0; i < pcache->nbuckets; i++) {
+        for (cur = pcache->buckets[i]; cur != NULL; cur = next) {
+            next = cur->hnext;
+            free_node(cur);
+        }
     }
+    pcache->policy->free(pcache);
     free_node(pcache->sentinel);
+    free(pcache->buckets);
+}
+
+/* hash_lookup  -- find the node with the key in the hash index */
+static lru_cache_node_t *hash_lookup(lru_cache_t *pcache,
+        const char *key, unsigned int h)
+{
+    lru_cache_node_t *cur;
+    for (cur = bucket_of(pcache, h); cur != NULL; cur = cur->hnext) {
+        if (cur->hash == h && strcasecmp(cur->key, key) == 0) {
+            return cur;
+        }
+    }
+    return NULL;
+}
+
+/* hash_grow  -- double the number of buckets and rehash every node */
+static void hash_grow(lru_cache_t *pcache)
+{
+    size_t nbuckets = pcache->nbuckets * 2;
+    lru_cache_node_t **buckets = (lru_cache_node_t **)calloc(nbuckets,
+            sizeof(lru_cache_node_t *));
+    if (buckets == NULL) return;  /* keep the old, longer chains */
+    lru_cache_node_t *cur, *next;
+    size_t i;
+    for (i = 0; i < pcache->nbuckets; i++) {
+        for (cur = pcache->buckets[i]; cur != NULL; cur = next) {
+            size_t j = cur->hash & (nbuckets-1);
+            next = cur->hnext;
+            cur->hnext = buckets[j];
+            buckets[j] = cur;
+        }
+    }
+    free(pcache->buckets);
+    pcache->buckets = buckets;
+    pcache->nbuckets = nbuckets;
+}
+
+/* hash_insert  -- add the node to the hash index. The node is in the
+ * cache from now on, and its size counts */
+static void hash_insert(lru_cache_t *pcache, lru_cache_node_t *pnode)
+{
+    if (pcache->count >= pcache->nbuckets) {
+        hash_grow(pcache);
+    }
+    pnode->hnext = bucket_of(pcache, pnode->hash);
+    bucket_of(pcache, pnode->hash) = pnode;
+    pcache->count += 1;
+    pcache->cache_size += node_cache_size(pnode);
+}
+
+/* hash_remove  -- remove the node from the hash index */
+static void hash_remove(lru_cache_t *pcache, lru_cache_node_t *pnode)
+{
+    lru_cache_node_t **pp = &bucket_of(pcache, pnode->hash);
+    while (*pp != pnode) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = pnode->hnext;
+    pnode->hnext = NULL;
+    pcache->count -= 1;
+    pcache->cache_size -= node_cache_size(pnode);
 }
 
 
@@ -78,7 +217,6 @@ static inline void lru_cache_insert_next(lru_cache_t *pcache,
     pnode->prev = prev;
     prev->next->prev = pnode;
     prev->next = pnode;
-    pcache->cache_size += node_cache_size(pnode);
 }
 
 /* lru_cache_remove  -- remove the node from the list */
@@ -87,7 +225,6 @@ static inline void lru_cache_remove(lru_cache_t *pcache,
 {
     cur->prev->next = cur->next;
     cur->next->prev = cur->prev;
-    pcache->cache_size -= node_cache_size(cur);
 }
 
 /*
@@ -102,19 +239,37 @@ static void lru_cache_raise(lru_cache_t *pcache, lru_cache_node_t *cur)
     lru_cache_insert_next(pcache, pcache->sentinel, cur);
 }
 
+/* lru_cache_evict  -- remove the node, already detached from the
+ * policy, from the cache and free it */
+static void lru_cache_evict(lru_cache_t *pcache, lru_cache_node_t *pnode)
+{
+    hash_remove(pcache, pnode);
+    free_node(pnode);
+}
+
 /* lru_cache_find  -- find a node according to the key */
 lru_cache_node_t *lru_cache_find(lru_cache_t *pcache, const char *key)
 {
-    lru_cache_node_t *cur;
-    for (cur = pcache->sentinel->next;
-            cur != pcache->sentinel; cur = cur->next) {
-        if (strcasecmp(cur->key, key) == 0) {
-            /* If a node is found, it's visited once */
-            lru_cache_raise(pcache, cur);
-            return cur;
-        }
+    lru_cache_node_t *cur = hash_lookup(pcache, key, lru_cache_hash(key));
+    if (cur) {
+        /* If a node is found, it's visited once */
+        pcache->policy->accessed(pcache, cur);
     }
-    return NULL;
+    return cur;
+}
+
+/* lru_cache_peek  -- find a node according to the key without changing
+ * the cache structure, so it is safe under a shared lock. Only the
+ * access count of the node is bumped; the policy looks at it when the
+ * node is a candidate for eviction.
+ */
+lru_cache_node_t *lru_cache_peek(lru_cache_t *pcache, const char *key)
+{
+    lru_cache_node_t *cur = hash_lookup(pcache, key, lru_cache_hash(key));
+    if (cur && cur->freq < LRU_CACHE_FREQ_MAX) {
+        __atomic_add_fetch(&cur->freq, 1, __ATOMIC_RELAXED);
+    }
+    return cur;
 }
 
 /* lru_cache_insert  -- insert a new node to the lru cache */
@@ -122,14 +277,587 @@ void lru_cache_insert(lru_cache_t *pcache,
         const char *key,
         const char *value,
         size_t value_len)
+{
+    lru_cache_insert_until(pcache, key, value, value_len, 0);
+}
+
+/* evict_victim  -- evict the node the policy picks, handing it to the
+ * eviction hook first */
+static void evict_victim(lru_cache_t *pcache)
+{
+    lru_cache_node_t *victim = pcache->policy->victim(pcache);
+    if (pcache->on_evict) {
+        pcache->on_evict(pcache->evict_arg, victim->key, victim->obj);
+    }
+    lru_cache_evict(pcache, victim);
+    pcache->evictions++;
+}
+
+/* lru_cache_insert_until  -- insert a node that is stale from expires_ns
+ * on */
+void lru_cache_insert_until(lru_cache_t *pcache,
+        const char *key,
+        const char *value,
+        size_t value_len,
+        long long expires_ns)
 {
     lru_cache_node_t *pnode = create_node_from(key, value, value_len);
-    lru_cache_insert_next(pcache, pcache->sentinel, pnode);
+    if (pnode == NULL) return;  /* not caching is always safe */
+    pnode->obj->expires_ns = expires_ns;
+    /* two clients may miss on the same key at the same time. The newer
+     * response replaces the old one instead of shadowing it */
+    lru_cache_node_t *old = hash_lookup(pcache, key, pnode->hash);
+    if (old) {
+        pcache->policy->removed(pcache, old);
+        lru_cache_evict(pcache, old);
+    }
+    /* make room before the node is added, so that the policy can't
+     * pick the newcomer itself: with second chances every older node
+     * may have been peeked. Only a node bigger than the whole cache is
+     * evicted right away */
+    while (pcache->cache_size > 0 && pcache->cache_size +
+            node_cache_size(pnode) > pcache->max_cache_size) {
+        evict_victim(pcache);
+    }
+    hash_insert(pcache, pnode);
+    pcache->policy->added(pcache, pnode);
     while (pcache->cache_size > pcache->max_cache_size) {
-        /* remove the least recently used node */
-        lru_cache_node_t *node_to_remove = lru_cache_tail(pcache);
-        lru_cache_remove(pcache, node_to_remove);
-        /* free the removed node */
-        free_node(node_to_remove);
+        evict_victim(pcache);
+    }
+}
+
+
+/*
+ * Eviction policies
+ */
+
+/* lru_init  -- the lru policy only uses the list of the cache */
+static void lru_init(lru_cache_t *pcache)
+{
+}
+
+static void lru_free(lru_cache_t *pcache)
+{
+}
+
+/* lru_added  -- a new node is the most recently used */
+static void lru_added(lru_cache_t *pcache, lru_cache_node_t *pnode)
+{
+    lru_cache_insert_next(pcache, pcache->sentinel, pnode);
+}
+
+/* lru_removed  -- take the node out of the list */
+static void lru_removed(lru_cache_t *pcache, lru_cache_node_t *pnode)
+{
+    lru_cache_remove(pcache, pnode);
+}
+
+/* lru_victim  -- the least recently used node. A node peeked since it
+ * was raised gets a second chance instead. Each node is raised at most
+ * once, so the loop ends
+ */
+static lru_cache_node_t *lru_victim(lru_cache_t *pcache)
+{
+    lru_cache_node_t *tail;
+    while ((tail = lru_cache_tail(pcache))->freq) {
+        tail->freq = 0;
+        lru_cache_raise(pcache, tail);
+    }
+    lru_cache_remove(pcache, tail);
+    return tail;
+}
+
+const lru_cache_policy_t lru_cache_lru_policy = {
+    "lru", lru_init, lru_free, lru_added, lru_cache_raise, lru_removed,
+    lru_victim
+};
+
+
+/* GreedyDual-Size-Frequency. The priority of a node is
+ *     clock + frequency / size
+ * and the node with the lowest priority is evicted, moving the clock up
+ * to its priority. Large objects need many more hits than small ones to
+ * stay. The nodes are in a binary min heap on the priority. Peeks only
+ * bump freq, so a priority is recomputed when its node reaches the top
+ * of the heap with a changed freq; that can only raise it.
+ */
+typedef struct gdsf_t {
+    lru_cache_node_t **heap;
+    size_t len;
+    size_t cap;
+    double clock;  /* priority of the last evicted node */
+} gdsf_t;
+
+#define gdsf_of(pcache) ((gdsf_t *)(pcache)->policy_data)
+
+static void gdsf_init(lru_cache_t *pcache)
+{
+    gdsf_t *g = (gdsf_t *)malloc(sizeof(gdsf_t));
+    g->cap = 64;
+    g->len = 0;
+    g->heap = (lru_cache_node_t **)malloc(g->cap * sizeof(*g->heap));
+    g->clock = 0;
+    pcache->policy_data = g;
+}
+
+static void gdsf_free(lru_cache_t *pcache)
+{
+    free(gdsf_of(pcache)->heap);
+    free(gdsf_of(pcache));
+}
+
+/* gdsf_priority  -- recompute the priority of the node */
+static void gdsf_priority(gdsf_t *g, lru_cache_node_t *pnode)
+{
+    size_t size = pnode->value_len ? pnode->value_len : 1;
+    pnode->priority_freq = pnode->freq;
+    pnode->priority = g->clock + (1.0 + pnode->freq) / size;
+}
+
+/* heap_set  -- put the node at position i of the heap */
+static inline void heap_set(gdsf_t *g, size_t i, lru_cache_node_t *pnode)
+{
+    g->heap[i] = pnode;
+    pnode->heap_index = i;
+}
+
+/* heap_up  -- move the node at i up to its place */
+static void heap_up(gdsf_t *g, size_t i)
+{
+    lru_cache_node_t *pnode = g->heap[i];
+    while (i > 0 && g->heap[(i-1)/2]->priority > pnode->priority) {
+        heap_set(g, i, g->heap[(i-1)/2]);
+        i = (i-1)/2;
+    }
+    heap_set(g, i, pnode);
+}
+
+/* heap_down  -- move the node at i down to its place */
+static void heap_down(gdsf_t *g, size_t i)
+{
+    lru_cache_node_t *pnode = g->heap[i];
+    size_t child;
+    while ((child = 2*i + 1) < g->len) {
+        if (child + 1 < g->len &&
+                g->heap[child+1]->priority < g->heap[child]->priority) {
+            child++;
+        }
+        if (g->heap[child]->priority >= pnode->priority) {
+            break;
+        }
+        heap_set(g, i, g->heap[child]);
+        i = child;
+    }
+    heap_set(g, i, pnode);
+}
+
+static void gdsf_added(lru_cache_t *pcache, lru_cache_node_t *pnode)
+{
+    gdsf_t *g = gdsf_of(pcache);
+    if (g->len == g->cap) {
+        g->cap *= 2;
+        g->heap = (lru_cache_node_t **)realloc(g->heap,
+                g->cap * sizeof(*g->heap));
+    }
+    gdsf_priority(g, pnode);
+    heap_set(g, g->len++, pnode);
+    heap_up(g, pnode->heap_index);
+}
+
+static void gdsf_accessed(lru_cache_t *pcache, lru_cache_node_t *pnode)
+{
+    gdsf_t *g = gdsf_of(pcache);
+    if (pnode->freq < LRU_CACHE_FREQ_MAX) {
+        pnode->freq++;
+    }
+    gdsf_priority(g, pnode);
+    heap_down(g, pnode->heap_index);
+}
+
+static void gdsf_removed(lru_cache_t *pcache, lru_cache_node_t *pnode)
+{
+    gdsf_t *g = gdsf_of(pcache);
+    size_t i = pnode->heap_index;
+    lru_cache_node_t *last = g->heap[--g->len];
+    if (last != pnode) {
+        heap_set(g, i, last);
+        heap_down(g, i);
+        heap_up(g, last->heap_index);
+    }
+}
+
+static lru_cache_node_t *gdsf_victim(lru_cache_t *pcache)
+{
+    gdsf_t *g = gdsf_of(pcache);
+    lru_cache_node_t *top = g->heap[0];
+    while (top->freq != top->priority_freq) {
+        /* peeked since its priority was set */
+        gdsf_priority(g, top);
+        heap_down(g, 0);
+        top = g->heap[0];
+    }
+    g->clock = top->priority;
+    gdsf_removed(pcache, top);
+    return top;
+}
+
+const lru_cache_policy_t lru_cache_gdsf_policy = {
+    "gdsf", gdsf_init, gdsf_free, gdsf_added, gdsf_accessed, gdsf_removed,
+    gdsf_victim
+};
+
+
+/* S3-FIFO. New nodes enter a small probation queue that gets a tenth
+ * of the cache. A node leaving it is moved to the main queue if it was
+ * used while there, and is forgotten otherwise, leaving only its hash
+ * in the ghost queue. A node whose hash is a ghost is let into the main
+ * queue directly. The main queue is a FIFO where a used node is
+ * reinserted with one less use instead of being evicted.
+ * The list of the cache is the main queue, freq saturates at 3.
+ */
+#define S3FIFO_SMALL 0
+#define S3FIFO_MAIN 1
+#define S3FIFO_FREQ_MAX 3
+
+typedef struct s3fifo_t {
+    lru_cache_node_t *small;  /* sentinel of the small queue */
+    size_t small_size;  /* bytes in the small queue */
+    size_t small_max;  /* small queue target, a tenth of the cache */
+
+    /* ghost queue: a ring of hashes and a count of the ring entries per
+     * slot of a table. A hash is a ghost if its slot count is nonzero;
+     * a collision only lets a node into main early */
+    unsigned int *ghosts;
+    size_t nghosts, ghost_cap, ghost_next;
+    unsigned char *ghost_counts;
+    size_t ghost_slots;  /* a power of 2 */
+} s3fifo_t;
+
+#define s3fifo_of(pcache) ((s3fifo_t *)(pcache)->policy_data)
+
+/* ghost queue length, about the number of objects of the cache assuming
+ * they are 4KB on average */
+#define S3FIFO_GHOST_OBJECT 4096
+#define S3FIFO_MIN_GHOSTS 64
+
+static void s3fifo_init(lru_cache_t *pcache)
+{
+    s3fifo_t *q = (s3fifo_t *)malloc(sizeof(s3fifo_t));
+    q->small = create_empty_node(0);
+    q->small->next = q->small->prev = q->small;
+    q->small_size = 0;
+    q->small_max = pcache->max_cache_size / 10;
+    q->ghost_cap = pcache->max_cache_size / S3FIFO_GHOST_OBJECT;
+    if (q->ghost_cap < S3FIFO_MIN_GHOSTS) {
+        q->ghost_cap = S3FIFO_MIN_GHOSTS;
+    }
+    q->ghosts = (unsigned int *)malloc(q->ghost_cap * sizeof(unsigned int));
+    q->nghosts = q->ghost_next = 0;
+    q->ghost_slots = 1;
+    while (q->ghost_slots < 4 * q->ghost_cap) {
+        q->ghost_slots <<= 1;
+    }
+    q->ghost_counts = (unsigned char *)calloc(q->ghost_slots, 1);
+    pcache->policy_data = q;
+}
+
+static void s3fifo_free(lru_cache_t *pcache)
+{
+    s3fifo_t *q = s3fifo_of(pcache);
+    free_node(q->small);
+    free(q->ghosts);
+    free(q->ghost_counts);
+    free(q);
+}
+
+#define ghost_slot(q, h) ((q)->ghost_counts[(h) & ((q)->ghost_slots - 1)])
+
+/* ghost_add  -- remember the hash, forgetting the oldest one if full */
+static void ghost_add(s3fifo_t *q, unsigned int hash)
+{
+    if (q->nghosts == q->ghost_cap) {
+        ghost_slot(q, q->ghosts[q->ghost_next])--;
+    } else {
+        q->nghosts++;
+    }
+    q->ghosts[q->ghost_next] = hash;
+    q->ghost_next = (q->ghost_next + 1) % q->ghost_cap;
+    /* the ring is shorter than 255 times the slots, but be safe */
+    if (ghost_slot(q, hash) < 255) {
+        ghost_slot(q, hash)++;
+    }
+}
+
+/* s3fifo_push  -- insert the node at the head of the queue */
+static void s3fifo_push(lru_cache_t *pcache, lru_cache_node_t *pnode,
+        int queue)
+{
+    s3fifo_t *q = s3fifo_of(pcache);
+    pnode->queue = queue;
+    if (queue == S3FIFO_SMALL) {
+        lru_cache_insert_next(pcache, q->small, pnode);
+        q->small_size += node_cache_size(pnode);
+    } else {
+        lru_cache_insert_next(pcache, pcache->sentinel, pnode);
+    }
+}
+
+static void s3fifo_added(lru_cache_t *pcache, lru_cache_node_t *pnode)
+{
+    s3fifo_t *q = s3fifo_of(pcache);
+    s3fifo_push(pcache, pnode,
+            ghost_slot(q, pnode->hash) ? S3FIFO_MAIN : S3FIFO_SMALL);
+}
+
+static void s3fifo_accessed(lru_cache_t *pcache, lru_cache_node_t *pnode)
+{
+    if (pnode->freq < S3FIFO_FREQ_MAX) {
+        pnode->freq++;
+    }
+}
+
+static void s3fifo_removed(lru_cache_t *pcache, lru_cache_node_t *pnode)
+{
+    lru_cache_remove(pcache, pnode);
+    if (pnode->queue == S3FIFO_SMALL) {
+        s3fifo_of(pcache)->small_size -= node_cache_size(pnode);
+    }
+}
+
+static lru_cache_node_t *s3fifo_victim(lru_cache_t *pcache)
+{
+    s3fifo_t *q = s3fifo_of(pcache);
+    lru_cache_node_t *tail;
+    while (1) {
+        int main_empty = pcache->sentinel->next == pcache->sentinel;
+        if (q->small->next != q->small &&
+                (q->small_size > q->small_max || main_empty)) {
+            tail = q->small->prev;
+            s3fifo_removed(pcache, tail);
+            if (tail->freq > 0) {
+                /* used while on probation */
+                tail->freq = 0;
+                s3fifo_push(pcache, tail, S3FIFO_MAIN);
+                continue;
+            }
+            ghost_add(q, tail->hash);
+            return tail;
+        }
+        tail = lru_cache_tail(pcache);
+        s3fifo_removed(pcache, tail);
+        if (tail->freq > 0) {
+            /* one use less, and another round */
+            tail->freq = (tail->freq > S3FIFO_FREQ_MAX ?
+                    S3FIFO_FREQ_MAX : tail->freq) - 1;
+            s3fifo_push(pcache, tail, S3FIFO_MAIN);
+            continue;
+        }
+        return tail;
+    }
+}
+
+const lru_cache_policy_t lru_cache_s3fifo_policy = {
+    "s3fifo", s3fifo_init, s3fifo_free, s3fifo_added, s3fifo_accessed,
+    s3fifo_removed, s3fifo_victim
+};
+
+/* lru_cache_policy_by_name  -- the policy called name */
+const lru_cache_policy_t *lru_cache_policy_by_name(const char *name)
+{
+    static const lru_cache_policy_t *policies[] = {
+        &lru_cache_lru_policy, &lru_cache_gdsf_policy,
+        &lru_cache_s3fifo_policy
+    };
+    size_t i;
+    for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        if (strcasecmp(policies[i]->name, name) == 0) {
+            return policies[i];
+        }
+    }
+    return NULL;
+}
+
+
+/* shard_of  -- the shard that the key belongs to */
+static cache_shard_t *shard_of(shard_cache_t *pcache, const char *key)
+{
+    /* the low bits pick the bucket inside the shard, use the high ones */
+    return &pcache->shards[(lru_cache_hash(key) >> 16) % pcache->nshards];
+}
+
+/* shard_cache_init  -- init the shard cache. Each shard gets an equal
+ * part of max_cache_size. policy NULL is lru
+ */
+void shard_cache_init(shard_cache_t *pcache, size_t nshards,
+        size_t max_cache_size, const lru_cache_policy_t *policy)
+{
+    size_t i;
+    pcache->nshards = nshards;
+    pcache->shards = (cache_shard_t *)malloc(nshards * sizeof(cache_shard_t));
+    pcache->on_evict = NULL;
+    pcache->evict_arg = NULL;
+    for (i = 0; i < nshards; i++) {
+        pthread_rwlock_init(&pcache->shards[i].lock, NULL);
+        pcache->shards[i].lock_waits = 0;
+        pcache->shards[i].lock_wait_ns = 0;
+        lru_cache_init_policy(&pcache->shards[i].lru,
+                max_cache_size / nshards,
+                policy ? policy : &lru_cache_lru_policy);
+    }
+}
+
+/* shard_cache_free  -- free the shard cache */
+void shard_cache_free(shard_cache_t *pcache)
+{
+    size_t i;
+    for (i = 0; i < pcache->nshards; i++) {
+        lru_cache_free(&pcache->shards[i].lru);
+        pthread_rwlock_destroy(&pcache->shards[i].lock);
+    }
+    free(pcache->shards);
+}
+
+/* lock_waited  -- count a wait of the time since start for the lock */
+static void lock_waited(cache_shard_t *shard, long long start)
+{
+    __sync_fetch_and_add(&shard->lock_waits, 1);
+    __sync_fetch_and_add(&shard->lock_wait_ns, now_ns() - start);
+}
+
+/* shard_rdlock, shard_wrlock  -- take the shard lock. Only a lock that
+ * is not free right away costs the clock reads of the wait statistics
+ */
+static void shard_rdlock(cache_shard_t *shard)
+{
+    if (pthread_rwlock_tryrdlock(&shard->lock) != 0) {
+        long long start = now_ns();
+        pthread_rwlock_rdlock(&shard->lock);
+        lock_waited(shard, start);
+    }
+}
+
+static void shard_wrlock(cache_shard_t *shard)
+{
+    if (pthread_rwlock_trywrlock(&shard->lock) != 0) {
+        long long start = now_ns();
+        pthread_rwlock_wrlock(&shard->lock);
+        lock_waited(shard, start);
+    }
+}
+
+/* shard_cache_get  -- look up the key under the shard's read lock */
+lru_cache_obj_t *shard_cache_get(shard_cache_t *pcache, const char *key)
+{
+    cache_shard_t *shard = shard_of(pcache, key);
+    lru_cache_obj_t *obj = NULL;
+    shard_rdlock(shard);
+    lru_cache_node_t *pnode = lru_cache_peek(&shard->lru, key);
+    if (pnode) {
+        obj = lru_cache_obj_get(pnode->obj);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    return obj;
+}
+
+/* shard_cache_put  -- insert the (key, value) pair under the shard's
+ * write lock
+ */
+void shard_cache_put(shard_cache_t *pcache,
+        const char *key, const char *value, size_t value_len)
+{
+    shard_cache_put_until(pcache, key, value, value_len, 0);
+}
+
+/* objects evicted by a put, told about once the shard lock is released */
+typedef struct evicted_t {
+    size_t n, cap;
+    char **keys;
+    lru_cache_obj_t **objs;
+} evicted_t;
+
+/* collect_evicted  -- the on_evict of the shards: keep the object */
+static void collect_evicted(void *arg, const char *key, lru_cache_obj_t *obj)
+{
+    evicted_t *ev = (evicted_t *)arg;
+    if (ev->n == ev->cap) {
+        ev->cap = ev->cap ? 2 * ev->cap : 8;
+        ev->keys = (char **)realloc(ev->keys, ev->cap * sizeof(char *));
+        ev->objs = (lru_cache_obj_t **)realloc(ev->objs,
+                ev->cap * sizeof(lru_cache_obj_t *));
+    }
+    ev->keys[ev->n] = strdup(key);
+    ev->objs[ev->n] = lru_cache_obj_get(obj);
+    ev->n++;
+}
+
+/* shard_cache_on_evict  -- register the eviction callback */
+void shard_cache_on_evict(shard_cache_t *pcache, lru_cache_evict_fn fn,
+        void *arg)
+{
+    pcache->on_evict = fn;
+    pcache->evict_arg = arg;
+}
+
+/* shard_cache_put_until  -- insert under the shard's write lock an
+ * object that is stale from expires_ns on
+ */
+void shard_cache_put_until(shard_cache_t *pcache,
+        const char *key, const char *value, size_t value_len,
+        long long expires_ns)
+{
+    cache_shard_t *shard = shard_of(pcache, key);
+    evicted_t ev = {0, 0, NULL, NULL};
+    size_t i;
+    shard_wrlock(shard);
+    if (pcache->on_evict) {
+        shard->lru.on_evict = collect_evicted;
+        shard->lru.evict_arg = &ev;
+    }
+    lru_cache_insert_until(&shard->lru, key, value, value_len, expires_ns);
+    shard->lru.on_evict = NULL;
+    pthread_rwlock_unlock(&shard->lock);
+
+    for (i = 0; i < ev.n; i++) {
+        pcache->on_evict(pcache->evict_arg, ev.keys[i], ev.objs[i]);
+        lru_cache_obj_release(ev.objs[i]);
+        free(ev.keys[i]);
+    }
+    free(ev.keys);
+    free(ev.objs);
+}
+
+/* shard_cache_foreach  -- visit the buckets of each shard, which have
+ * all the nodes whatever the policy */
+void shard_cache_foreach(shard_cache_t *pcache, lru_cache_evict_fn fn,
+        void *arg)
+{
+    lru_cache_node_t *cur;
+    size_t i, j;
+    for (i = 0; i < pcache->nshards; i++) {
+        cache_shard_t *shard = &pcache->shards[i];
+        shard_rdlock(shard);
+        for (j = 0; j < shard->lru.nbuckets; j++) {
+            for (cur = shard->lru.buckets[j]; cur != NULL; cur = cur->hnext) {
+                fn(arg, cur->key, cur->obj);
+            }
+        }
+        pthread_rwlock_unlock(&shard->lock);
+    }
+}
+
+/* shard_cache_stats  -- add up the shards, each under its read lock */
+void shard_cache_stats(shard_cache_t *pcache, shard_cache_stats_t *stats)
+{
+    size_t i;
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < pcache->nshards; i++) {
+        cache_shard_t *shard = &pcache->shards[i];
+        pthread_rwlock_rdlock(&shard->lock);
+        stats->cache_size += shard->lru.cache_size;
+        stats->count += shard->lru.count;
+        stats->evictions += shard->lru.evictions;
+        pthread_rwlock_unlock(&shard->lock);
+        stats->lock_waits += shard->lock_waits;
+        stats->lock_wait_ns += shard->lock_wait_ns;
     }
 }
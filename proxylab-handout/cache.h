@@ -1,5 +1,5 @@
 /*
- * cache.h - lru cache
+ * cache.h - lru cache with pluggable eviction policies
  */
 
 #ifndef __CACHE_H__
@@ -7,16 +7,55 @@
 
 #include "csapp.h"
 
+/* reference counted cache content. The node holds one reference, and
+ * a reader that keeps using the content after releasing the cache lock
+ * takes another one, so eviction never frees content that is still
+ * being written to a client. Nodes and contents live in the slab
+ * allocator, see slab.h.
+ */
+typedef struct lru_cache_obj_t {
+    int refcnt;  /* number of references. Updated atomically */
+    long long expires_ns;  /* stale from then on, see now_ns. 0 if it
+                              never is. A revalidation moves it */
+    size_t len;  /* length of data */
+    char data[];  /* This is not a null terminated string */
+} lru_cache_obj_t;
+
+/* lookups stop counting a node's accesses here */
+#define LRU_CACHE_FREQ_MAX 255
+
 typedef struct lru_cache_node_t {
-    char *value;   /* cache content. This is not a null terminated string */
+    lru_cache_obj_t *obj;  /* the content of the node */
+    char *value;   /* obj->data */
     size_t value_len;  /* size of the cache */
-    // for simplicity, assume key is a null terminated string
-    char key[MAXLINE];  /* key - value */
+    unsigned int freq;  /* accesses counted by lru_cache_peek, bumped
+                           atomically. Each policy decides what it means */
+    unsigned int hash;  /* hash of the key, see lru_cache_hash */
     struct lru_cache_node_t *next; /* next node */
     struct lru_cache_node_t *prev; /* prev node */
+    struct lru_cache_node_t *hnext; /* next node in the same hash bucket */
+
+    /* eviction policy state */
+    double priority;  /* gdsf: the priority */
+    unsigned int priority_freq;  /* gdsf: freq when priority was set */
+    size_t heap_index;  /* gdsf: position in the heap */
+    int queue;  /* s3fifo: the queue the node is in */
+
+    char key[];  /* null terminated key, allocated with the node */
 } lru_cache_node_t;
 
-/* lru cache is implemented as a bidirectional list */
+struct lru_cache_policy_t;
+
+/* lru_cache_evict_fn  -- told about every object evicted to make room */
+typedef void (*lru_cache_evict_fn)(void *arg, const char *key,
+        lru_cache_obj_t *obj);
+
+/* lru cache is implemented as a bidirectional list, indexed by a
+ * chained hash table so that find/insert/evict are O(1).
+ * The eviction policy owns the order of the nodes. With the default
+ * policy, the list is in lru order; the other policies may use it
+ * differently, or keep their own structures in policy_data.
+ */
 typedef struct lru_cache_t {
     size_t max_cache_size; /* maximum size allowed for the cache.
                               If this is exceeded,
@@ -25,17 +64,132 @@ typedef struct lru_cache_t {
     lru_cache_node_t *front; /* front points to most recently used */
     // lru_cache_node_t *tail;  /* tail points to least recently used */
     size_t cache_size;  /* the size of the cache */
+    lru_cache_node_t **buckets;  /* hash buckets. nbuckets is a power of 2 */
+    size_t nbuckets;  /* number of hash buckets */
+    size_t count;  /* number of nodes in the cache */
+    size_t evictions;  /* nodes evicted to make room */
+    const struct lru_cache_policy_t *policy;  /* eviction policy */
+    void *policy_data;  /* state of the policy */
+    lru_cache_evict_fn on_evict;  /* NULL, or called before an eviction */
+    void *evict_arg;
 } lru_cache_t;
 
+/* eviction policy. The cache calls these under its exclusive access;
+ * lookups under a shared lock only bump node->freq, so a policy must
+ * take changed frequencies into account lazily.
+ */
+typedef struct lru_cache_policy_t {
+    const char *name;
+    void (*init)(lru_cache_t *pcache);
+    void (*free)(lru_cache_t *pcache);
+    /* a new node entered the cache */
+    void (*added)(lru_cache_t *pcache, lru_cache_node_t *pnode);
+    /* the node was found by lru_cache_find */
+    void (*accessed)(lru_cache_t *pcache, lru_cache_node_t *pnode);
+    /* the node is about to leave the cache, e.g. replaced by a new value */
+    void (*removed)(lru_cache_t *pcache, lru_cache_node_t *pnode);
+    /* pick the next node to evict, and detach it like removed does */
+    lru_cache_node_t *(*victim)(lru_cache_t *pcache);
+} lru_cache_policy_t;
+
+/* least recently used, with a second chance for peeked nodes */
+extern const lru_cache_policy_t lru_cache_lru_policy;
+/* GreedyDual-Size-Frequency: keeps small and frequently used objects */
+extern const lru_cache_policy_t lru_cache_gdsf_policy;
+/* S3-FIFO: a small probation queue, a main queue and a ghost queue */
+extern const lru_cache_policy_t lru_cache_s3fifo_policy;
+
+/* the policy called name, or NULL */
+const lru_cache_policy_t *lru_cache_policy_by_name(const char *name);
+
 /* lru cache operations */
 void lru_cache_init(lru_cache_t *pcache, size_t max_cache_size);
+void lru_cache_init_policy(lru_cache_t *pcache, size_t max_cache_size,
+        const lru_cache_policy_t *policy);
 void lru_cache_free(lru_cache_t *pcache);
 
 lru_cache_node_t *lru_cache_find(lru_cache_t *pcache, const char *key);
+lru_cache_node_t *lru_cache_peek(lru_cache_t *pcache, const char *key);
 
 void lru_cache_insert(lru_cache_t *pcache,
         const char *key, const char *value, size_t value_len);
+void lru_cache_insert_until(lru_cache_t *pcache,
+        const char *key, const char *value, size_t value_len,
+        long long expires_ns);
+
+/* case insensitive hash of the key */
+unsigned int lru_cache_hash(const char *key);
 
 #define lru_cache_tail(pcache) ((pcache)->sentinel->prev)
 
+/* cache object references */
+lru_cache_obj_t *lru_cache_obj_get(lru_cache_obj_t *obj);
+void lru_cache_obj_release(lru_cache_obj_t *obj);
+
+/* whether the object is still fresh at now, see now_ns */
+#define lru_cache_obj_fresh(obj, now) \
+    ((obj)->expires_ns == 0 || (now) < (obj)->expires_ns)
+
+
+/* a shard is an lru cache with its own reader-writer lock */
+typedef struct cache_shard_t {
+    pthread_rwlock_t lock;
+    lru_cache_t lru;
+    long long lock_waits;  /* times the lock was taken after a wait */
+    long long lock_wait_ns;  /* and the total wait. Updated atomically */
+} cache_shard_t;
+
+/* shard cache splits the keys over independently locked lru caches.
+ * The hash of the key picks the shard. Lookups only take the shard
+ * lock for reading, so hits never block each other.
+ */
+typedef struct shard_cache_t {
+    size_t nshards;
+    cache_shard_t *shards;
+    lru_cache_evict_fn on_evict;  /* see shard_cache_on_evict */
+    void *evict_arg;
+} shard_cache_t;
+
+/* shard cache operations. They are thread safe */
+void shard_cache_init(shard_cache_t *pcache, size_t nshards,
+        size_t max_cache_size, const lru_cache_policy_t *policy);
+void shard_cache_free(shard_cache_t *pcache);
+
+/* return a referenced object, or NULL on a miss. The caller must
+ * lru_cache_obj_release it */
+lru_cache_obj_t *shard_cache_get(shard_cache_t *pcache, const char *key);
+
+void shard_cache_put(shard_cache_t *pcache,
+        const char *key, const char *value, size_t value_len);
+
+/* shard_cache_on_evict  -- call fn for the objects that puts evict to
+ * make room. It runs after the shard lock is released, so it may take
+ * its time, or put into the cache itself
+ */
+void shard_cache_on_evict(shard_cache_t *pcache, lru_cache_evict_fn fn,
+        void *arg);
+
+/* shard_cache_put_until  -- put an object that is stale from expires_ns
+ * on. Stale objects are still returned by shard_cache_get */
+void shard_cache_put_until(shard_cache_t *pcache,
+        const char *key, const char *value, size_t value_len,
+        long long expires_ns);
+
+/* shard_cache_foreach  -- call fn for every object in the cache. It runs
+ * under the read lock of the object's shard, so it must not use the cache
+ */
+void shard_cache_foreach(shard_cache_t *pcache, lru_cache_evict_fn fn,
+        void *arg);
+
+/* totals over the shards */
+typedef struct shard_cache_stats_t {
+    size_t cache_size;
+    size_t count;
+    size_t evictions;
+    long long lock_waits;
+    long long lock_wait_ns;
+} shard_cache_stats_t;
+
+void shard_cache_stats(shard_cache_t *pcache, shard_cache_stats_t *stats);
+
 #endif
@@ -0,0 +1,137 @@
+/*
+ * cachesim.c  -- replay a request log through the cache policies
+ *
+ * Every line of the log is a request: the key and the size of the
+ * response in bytes, separated by white space. The requests go through
+ * a shard cache the way the proxy uses it: a get, and a put of the
+ * response on a miss unless it is too large to cache. The object and
+ * byte hit ratios of each policy are reported.
+ */
+#include "csapp.h"
+#include "cache.h"
+
+#include <stdio.h>
+
+/* the proxy defaults */
+#define DEFAULT_CACHE_SIZE 1049000
+#define DEFAULT_OBJECT_SIZE 102400
+#define DEFAULT_SHARDS 8
+
+/* usage */
+void usage()
+{
+    printf("Usage: cachesim [-s cache_size] [-m max_object_size] "
+            "[-n shards] [-p policy] [log]\n");
+    exit(-1);
+}
+
+/* a request of the log */
+typedef struct request_t {
+    char *key;
+    size_t size;
+} request_t;
+
+/* read_log  -- read all the requests of the log */
+static request_t *read_log(FILE *fp, size_t *nrequests)
+{
+    char line[MAXLINE], key[MAXLINE];
+    size_t n = 0, cap = 1024;
+    unsigned long size;
+    request_t *requests = Malloc(cap * sizeof(request_t));
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%s %lu", key, &size) != 2) {
+            continue;
+        }
+        if (n == cap) {
+            cap *= 2;
+            requests = Realloc(requests, cap * sizeof(request_t));
+        }
+        requests[n].key = strdup(key);
+        requests[n].size = size;
+        n++;
+    }
+    *nrequests = n;
+    return requests;
+}
+
+/* simulate  -- replay the requests through a cache with the policy */
+static void simulate(const lru_cache_policy_t *policy, request_t *requests,
+        size_t nrequests, size_t cache_size, size_t max_object_size,
+        size_t nshards, const char *value)
+{
+    shard_cache_t cache;
+    size_t i, hits = 0;
+    unsigned long long bytes = 0, hit_bytes = 0;
+    shard_cache_init(&cache, nshards, cache_size, policy);
+    for (i = 0; i < nrequests; i++) {
+        lru_cache_obj_t *obj = shard_cache_get(&cache, requests[i].key);
+        bytes += requests[i].size;
+        if (obj) {
+            hits++;
+            hit_bytes += requests[i].size;
+            lru_cache_obj_release(obj);
+        } else if (requests[i].size < max_object_size) {
+            shard_cache_put(&cache, requests[i].key, value,
+                    requests[i].size);
+        }
+    }
+    shard_cache_free(&cache);
+    printf("%-8s %10zu requests  object hit ratio %6.2f%%  "
+            "byte hit ratio %6.2f%%\n", policy->name, nrequests,
+            nrequests ? 100.0 * hits / nrequests : 0.0,
+            bytes ? 100.0 * hit_bytes / bytes : 0.0);
+}
+
+int main(int argc, char **argv)
+{
+    size_t cache_size = DEFAULT_CACHE_SIZE;
+    size_t max_object_size = DEFAULT_OBJECT_SIZE;
+    size_t nshards = DEFAULT_SHARDS;
+    const lru_cache_policy_t *policy = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:m:n:p:")) != -1) {
+        switch (opt) {
+            case 's': cache_size = atol(optarg); break;
+            case 'm': max_object_size = atol(optarg); break;
+            case 'n': nshards = atol(optarg); break;
+            case 'p':
+                if ((policy = lru_cache_policy_by_name(optarg)) == NULL) {
+                    usage();
+                }
+                break;
+            default: usage();
+        }
+    }
+    if (optind < argc - 1 || nshards == 0) {
+        usage();
+    }
+    FILE *fp = optind == argc - 1 ? fopen(argv[optind], "r") : stdin;
+    if (fp == NULL) {
+        unix_error("open log failed");
+    }
+    size_t nrequests, i;
+    request_t *requests = read_log(fp, &nrequests);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+
+    /* the content doesn't matter, only its size */
+    char *value = Calloc(max_object_size, 1);
+    if (policy) {
+        simulate(policy, requests, nrequests, cache_size, max_object_size,
+                nshards, value);
+    } else {
+        simulate(&lru_cache_lru_policy, requests, nrequests, cache_size,
+                max_object_size, nshards, value);
+        simulate(&lru_cache_gdsf_policy, requests, nrequests, cache_size,
+                max_object_size, nshards, value);
+        simulate(&lru_cache_s3fifo_policy, requests, nrequests, cache_size,
+                max_object_size, nshards, value);
+    }
+    free(value);
+    for (i = 0; i < nrequests; i++) {
+        free(requests[i].key);
+    }
+    free(requests);
+    return 0;
+}
@@ -0,0 +1,162 @@
+/*
+ * connpool.c  -- pool of idle persistent connections to the servers
+ *
+ * The idle connections are kept in one list under one lock. The list
+ * is short, bounded by max_idle, and the lock is only held to unlink or
+ * link a connection, never during network I/O.
+ */
+
+#include "connpool.h"
+#include "util.h"
+
+/* connpool_init  -- initialize an empty pool */
+void connpool_init(connpool_t *pool, int max_idle, int max_idle_per_host,
+        long long idle_timeout_ns, dnscache_t *dns)
+{
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->idle = NULL;
+    pool->nidle = 0;
+    pool->max_idle = max_idle;
+    pool->max_idle_per_host = max_idle_per_host;
+    pool->idle_timeout_ns = idle_timeout_ns;
+    pool->dns = dns;
+    pool->opened = 0;
+    pool->reused = 0;
+}
+
+/* free_conn  -- close the connection and free the list node */
+static void free_conn(pool_conn_t *conn)
+{
+    close(conn->fd);
+    free(conn->key);
+    free(conn);
+}
+
+/* connpool_free  -- close all the idle connections */
+void connpool_free(connpool_t *pool)
+{
+    pool_conn_t *conn = pool->idle, *next;
+    while (conn) {
+        next = conn->next;
+        free_conn(conn);
+        conn = next;
+    }
+    pool->idle = NULL;
+    pool->nidle = 0;
+    pthread_mutex_destroy(&pool->lock);
+}
+
+/* make_key  -- "host:port" in buf */
+static void make_key(char *buf, const char *host, const char *port)
+{
+    snprintf(buf, MAXLINE, "%s:%s", host, port);
+}
+
+/* expire  -- close the connections idle for too long. Since the list
+ * is ordered by the time they were put back, they are all at the end.
+ * Called with the lock held
+ */
+static void expire(connpool_t *pool, long long now)
+{
+    pool_conn_t **pp = &pool->idle, *conn;
+    while (*pp && now - (*pp)->idle_since_ns < pool->idle_timeout_ns) {
+        pp = &(*pp)->next;
+    }
+    while ((conn = *pp) != NULL) {
+        *pp = conn->next;
+        free_conn(conn);
+        pool->nidle--;
+    }
+}
+
+/* is_alive  -- whether an idle connection can still be used. The server
+ * may have closed it, or sent something unexpected, while it was idle
+ */
+static int is_alive(int fd)
+{
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* connpool_take  -- take an idle connection to host:port */
+int connpool_take(connpool_t *pool, const char *host, const char *port)
+{
+    char key[MAXLINE];
+    pool_conn_t **pp, *conn;
+    int fd;
+    make_key(key, host, port);
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        expire(pool, now_ns());
+        for (pp = &pool->idle; *pp; pp = &(*pp)->next) {
+            if (strcmp((*pp)->key, key) == 0) {
+                break;
+            }
+        }
+        conn = *pp;
+        if (conn) {
+            *pp = conn->next;
+            pool->nidle--;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        if (!conn) {
+            return -1;
+        }
+        if (is_alive(conn->fd)) {
+            break;
+        }
+        free_conn(conn);
+    }
+    fd = conn->fd;
+    free(conn->key);
+    free(conn);
+    __sync_fetch_and_add(&pool->reused, 1);
+    return fd;
+}
+
+/* connpool_get  -- take an idle connection, or open a new one */
+int connpool_get(connpool_t *pool, char *host, char *port, int *reused)
+{
+    int fd = connpool_take(pool, host, port);
+    *reused = fd >= 0;
+    if (fd >= 0) {
+        return fd;
+    }
+    fd = pool->dns ? dnscache_connect(pool->dns, host, port) :
+        open_clientfd_ww(host, port);
+    if (fd >= 0) {
+        __sync_fetch_and_add(&pool->opened, 1);
+    }
+    return fd;
+}
+
+/* connpool_put  -- give back a connection after a complete response */
+void connpool_put(connpool_t *pool, const char *host, const char *port,
+        int fd)
+{
+    char key[MAXLINE];
+    pool_conn_t *conn, *p;
+    int nhost = 0;
+    make_key(key, host, port);
+
+    pthread_mutex_lock(&pool->lock);
+    expire(pool, now_ns());
+    for (p = pool->idle; p; p = p->next) {
+        nhost += strcmp(p->key, key) == 0;
+    }
+    if (pool->nidle >= pool->max_idle || nhost >= pool->max_idle_per_host) {
+        pthread_mutex_unlock(&pool->lock);
+        close(fd);
+        return;
+    }
+    conn = Malloc(sizeof(pool_conn_t));
+    conn->fd = fd;
+    conn->key = strdup(key);
+    conn->idle_since_ns = now_ns();
+    conn->next = pool->idle;
+    pool->idle = conn;
+    pool->nidle++;
+    pthread_mutex_unlock(&pool->lock);
+}
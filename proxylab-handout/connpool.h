@@ -0,0 +1,58 @@
+/*
+ * connpool.h  -- pool of idle persistent connections to the servers
+ */
+
+#ifndef __CONNPOOL_H__
+#define __CONNPOOL_H__
+
+#include "csapp.h"
+#include "dnscache.h"
+
+/* an idle connection to host:port */
+typedef struct pool_conn_t {
+    int fd;
+    char *key;  /* "host:port" */
+    long long idle_since_ns;  /* when it was put back, see now_ns */
+    struct pool_conn_t *next;
+} pool_conn_t;
+
+/* connection pool. Connections are taken out while a request uses
+ * them, and put back when the response is complete and the server
+ * keeps the connection open.
+ */
+typedef struct connpool_t {
+    pthread_mutex_t lock;  /* protects everything below */
+    pool_conn_t *idle;  /* idle connections, most recently used first */
+    int nidle;  /* number of idle connections */
+    int max_idle;  /* limit of idle connections in total */
+    int max_idle_per_host;  /* limit of idle connections to one host */
+    long long idle_timeout_ns;  /* idle connections older are closed */
+    dnscache_t *dns;  /* resolves the hosts of new connections, or NULL */
+
+    /* statistics */
+    long long opened;  /* connections opened by connpool_get */
+    long long reused;  /* connections taken from the pool */
+} connpool_t;
+
+void connpool_init(connpool_t *pool, int max_idle, int max_idle_per_host,
+        long long idle_timeout_ns, dnscache_t *dns);
+void connpool_free(connpool_t *pool);
+
+/* connpool_take  -- take an idle connection to host:port out of the
+ * pool. Return -1 if there is none
+ */
+int connpool_take(connpool_t *pool, const char *host, const char *port);
+
+/* connpool_get  -- take an idle connection to host:port, or open a new
+ * one. *reused tells which happened. Return -1 if the connection can't
+ * be opened
+ */
+int connpool_get(connpool_t *pool, char *host, char *port, int *reused);
+
+/* connpool_put  -- give back the connection to host:port after a
+ * complete response. It is closed if the pool is full
+ */
+void connpool_put(connpool_t *pool, const char *host, const char *port,
+        int fd);
+
+#endif
@@ -714,8 +714,12 @@ void Sem_init(sem_t *sem, int pshared, unsigned int value)
 
 void P(sem_t *sem) 
 {
-    if (sem_wait(sem) < 0)
-	unix_error("P error");
+    /* sem_wait is never restarted after a signal handler, even with
+     * SA_RESTART. Retry instead of exiting on EINTR */
+    while (sem_wait(sem) < 0) {
+        if (errno != EINTR)
+            unix_error("P error");
+    }
 }
 
 void V(sem_t *sem) 
@@ -778,6 +782,47 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+/*
+ * rio_writev - Robustly write all the bytes of the iovcnt buffers of
+ *    iov (unbuffered), gathering them into as few writev calls as
+ *    possible. iov is advanced past what a short write wrote.
+ */
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    size_t n = 0, nleft;
+    ssize_t nwritten;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+	n += iov[i].iov_len;
+    nleft = n;
+    while (nleft > 0) {
+	while (iov->iov_len == 0) { /* Skip the buffers already written */
+	    iov++;
+	    iovcnt--;
+	}
+	if ((nwritten = writev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX)) <= 0) {
+	    if (errno == EINTR)  /* Interrupted by sig handler return */
+		nwritten = 0;    /* and call writev() again */
+	    else
+		return -1;       /* errno set by writev() */
+	}
+	nleft -= nwritten;
+	while (nwritten > 0) {  /* Advance past the bytes written */
+	    size_t done = (size_t)nwritten < iov->iov_len ?
+		(size_t)nwritten : iov->iov_len;
+	    iov->iov_base = (char *)iov->iov_base + done;
+	    iov->iov_len -= done;
+	    nwritten -= done;
+	    if (iov->iov_len == 0 && nwritten > 0) {
+		iov++;
+		iovcnt--;
+	    }
+	}
+    }
+    return n;
+}
+
 
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
@@ -897,6 +942,12 @@ void Rio_writen(int fd, void *usrbuf, size_t n)
 	unix_error("Rio_writen error");
 }
 
+void Rio_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    if (rio_writev(fd, iov, iovcnt) < 0)
+	unix_error("Rio_writev error");
+}
+
 void Rio_readinitb(rio_t *rp, int fd)
 {
     rio_readinitb(rp, fd);
@@ -941,6 +992,16 @@ ssize_t rio_writen_ww(int fd, void *usrbuf, size_t n)
     return rc;
 }
 
+ssize_t rio_writev_ww(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t rc;
+    if ((rc = rio_writev(fd, iov, iovcnt)) < 0) {
+        fprintf(stderr, "[ERROR] write to %d failed\n",
+                fd);
+    }
+    return rc;
+}
+
 ssize_t rio_readnb_ww(rio_t *rp, void *usrbuf, size_t n)
 {
     ssize_t rc;
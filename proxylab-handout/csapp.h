@@ -20,6 +20,8 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include <errno.h>
 #include <math.h>
 #include <pthread.h>
@@ -59,6 +61,9 @@ extern char **environ; /* Defined by libc */
 #define	MAXLINE	 8192  /* Max text line length */
 #define MAXBUF   8192  /* Max I/O buffer size */
 #define LISTENQ  1024  /* Second argument to listen() */
+#ifndef IOV_MAX
+#define IOV_MAX 1024  /* Max buffers per writev, when limits.h hides it */
+#endif
 
 /* Our own error-handling functions */
 void unix_error(char *msg);
@@ -175,6 +180,7 @@ void V(sem_t *sem);
 /* Rio (Robust I/O) package */
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt);
 void rio_readinitb(rio_t *rp, int fd); 
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
@@ -182,6 +188,7 @@ ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
 void Rio_writen(int fd, void *usrbuf, size_t n);
+void Rio_writev(int fd, struct iovec *iov, int iovcnt);
 void Rio_readinitb(rio_t *rp, int fd); 
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
@@ -190,6 +197,7 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 /* rio read with warning message if error happended */
 ssize_t rio_readn_ww(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen_ww(int fd, void *usrbuf, size_t n);
+ssize_t rio_writev_ww(int fd, struct iovec *iov, int iovcnt);
 ssize_t rio_readnb_ww(rio_t *rp, void *usrbuf, size_t n);
 ssize_t rio_readlineb_ww(rio_t *rp, void *usrbuf, size_t maxlen);
 
@@ -0,0 +1,379 @@
+/*
+ * diskcache.c  -- second tier of the cache, in a file
+ *
+ * The file is a fixed size circular log. It starts with a header, and
+ * every record is aligned to DISK_ALIGN:
+ *
+ *   | file header | record | record | ...  free or old records ... |
+ *                                   ^ head
+ *
+ * A record is written at the head, which then moves past it. The records
+ * it overwrites are the oldest ones, so they are dropped from the front
+ * of the index list, and a record too long for the end of the file makes
+ * the head wrap around. The cache is thus FIFO: an object comes back to
+ * the memory tier on a hit, and is written again when it is evicted from
+ * there.
+ *
+ * The file is mapped shared, so records are written and read with
+ * memcpy, and what was written survives the proxy. Opening the file
+ * scans it for records with a valid checksum, and the one with the
+ * highest seq tells where the head was. A record that a later one
+ * overwrote in part lost its header or its checksum.
+ */
+
+#include "diskcache.h"
+#include "cache.h"
+#include "util.h"
+
+#include <stdint.h>
+
+#define DISK_MAGIC 0x43445850u  /* "PXDC" */
+#define DISK_RECORD_MAGIC 0x52445850u  /* "PXDR" */
+#define DISK_VERSION 1
+#define DISK_HEADER_SIZE 4096
+#define DISK_ALIGN 512
+
+/* the first bytes of the file */
+typedef struct disk_header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;
+} disk_header_t;
+
+/* every record starts with this, followed by the key and the value */
+typedef struct disk_record_t {
+    uint32_t magic;
+    uint32_t key_len;
+    uint64_t value_len;
+    uint64_t seq;
+    int64_t expires;  /* not covered by the checksum, it may change */
+    uint64_t checksum;  /* of the record with expires and checksum 0 */
+} disk_record_t;
+
+#define round_up(n, align) (((n) + (align) - 1) & ~((size_t)(align) - 1))
+
+/* record_size  -- bytes taken by a record */
+#define record_size(key_len, value_len) \
+    round_up(sizeof(disk_record_t) + (key_len) + (value_len), DISK_ALIGN)
+
+/* return the bucket of the hash value */
+#define bucket_of(dc, h) ((dc)->buckets[(h) & ((dc)->nbuckets-1)])
+
+/* checksum  -- FNV-1a over 8 bytes at a time, continuing from h */
+static uint64_t checksum(const char *p, size_t n, uint64_t h)
+{
+    uint64_t w;
+    for (; n >= 8; p += 8, n -= 8) {
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 1099511628211ULL;
+    }
+    for (; n > 0; p++, n--) {
+        h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    }
+    return h;
+}
+
+/* record_checksum  -- the checksum of the record at r */
+static uint64_t record_checksum(const disk_record_t *r)
+{
+    disk_record_t fixed = *r;
+    fixed.expires = 0;
+    fixed.checksum = 0;
+    uint64_t h = checksum((const char *)&fixed, sizeof(fixed),
+            14695981039346656037ULL);
+    return checksum((const char *)(r + 1), r->key_len + r->value_len, h);
+}
+
+/* lookup  -- the entry of the key, or NULL */
+static disk_entry_t *lookup(diskcache_t *dc, const char *key,
+        unsigned int h)
+{
+    disk_entry_t *e;
+    for (e = bucket_of(dc, h); e != NULL; e = e->hnext) {
+        if (e->hash == h && strcasecmp(e->key, key) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* add_entry  -- index a record, as the newest one */
+static disk_entry_t *add_entry(diskcache_t *dc, const char *key,
+        size_t pos, const disk_record_t *r)
+{
+    disk_entry_t *e = (disk_entry_t *)Malloc(sizeof(disk_entry_t));
+    e->key = strdup(key);
+    e->hash = lru_cache_hash(key);
+    e->pos = pos;
+    e->size = record_size(r->key_len, r->value_len);
+    e->value_len = r->value_len;
+    e->seq = r->seq;
+    e->expires = r->expires;
+    e->hnext = bucket_of(dc, e->hash);
+    bucket_of(dc, e->hash) = e;
+    e->next = NULL;
+    e->prev = dc->newest;
+    if (dc->newest) {
+        dc->newest->next = e;
+    } else {
+        dc->oldest = e;
+    }
+    dc->newest = e;
+    dc->count++;
+    return e;
+}
+
+/* drop_entry  -- remove the entry from the index. The record stays in
+ * the file until it is overwritten */
+static void drop_entry(diskcache_t *dc, disk_entry_t *e)
+{
+    disk_entry_t **pp;
+    for (pp = &bucket_of(dc, e->hash); *pp != e; pp = &(*pp)->hnext) {
+    }
+    *pp = e->hnext;
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        dc->oldest = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        dc->newest = e->prev;
+    }
+    dc->count--;
+    free(e->key);
+    free(e);
+}
+
+/* make_room  -- move the head to where size bytes can be written, and
+ * drop the records they overwrite
+ */
+static void make_room(diskcache_t *dc, size_t size)
+{
+    if (dc->head + size > dc->capacity) {
+        /* the records after the head are the oldest ones */
+        while (dc->oldest && dc->oldest->pos >= dc->head) {
+            drop_entry(dc, dc->oldest);
+        }
+        dc->head = DISK_HEADER_SIZE;
+    }
+    while (dc->oldest && dc->oldest->pos >= dc->head &&
+            dc->oldest->pos < dc->head + size) {
+        drop_entry(dc, dc->oldest);
+    }
+}
+
+/* valid_record  -- whether a whole record with a good checksum is at pos */
+static int valid_record(diskcache_t *dc, size_t pos)
+{
+    const disk_record_t *r = (const disk_record_t *)(dc->map + pos);
+    if (pos + sizeof(disk_record_t) > dc->capacity ||
+            r->magic != DISK_RECORD_MAGIC ||
+            r->key_len == 0 || r->key_len >= MAXLINE ||
+            r->value_len > dc->capacity ||
+            pos + record_size(r->key_len, r->value_len) > dc->capacity) {
+        return 0;
+    }
+    const char *key = (const char *)(r + 1);
+    if (memchr(key, '\0', r->key_len) != NULL) {
+        return 0;
+    }
+    return record_checksum(r) == r->checksum;
+}
+
+/* compare_seq  -- order records by their seq */
+static int compare_seq(const void *a, const void *b)
+{
+    uint64_t sa = ((const disk_record_t *)((const char **)a)[0])->seq;
+    uint64_t sb = ((const disk_record_t *)((const char **)b)[0])->seq;
+    return sa < sb ? -1 : sa > sb;
+}
+
+/* recover  -- rebuild the index from the records in the file */
+static void recover(diskcache_t *dc)
+{
+    size_t n = 0, cap = 64, i;
+    const char **records = (const char **)Malloc(cap * sizeof(char *));
+    size_t pos = DISK_HEADER_SIZE;
+    char key[MAXLINE];
+
+    while (pos + sizeof(disk_record_t) <= dc->capacity) {
+        if (!valid_record(dc, pos)) {
+            pos += DISK_ALIGN;
+            continue;
+        }
+        const disk_record_t *r = (const disk_record_t *)(dc->map + pos);
+        if (n == cap) {
+            cap *= 2;
+            records = (const char **)Realloc(records, cap * sizeof(char *));
+        }
+        records[n++] = dc->map + pos;
+        pos += record_size(r->key_len, r->value_len);
+    }
+
+    /* replay them in the order they were written */
+    qsort(records, n, sizeof(char *), compare_seq);
+    for (i = 0; i < n; i++) {
+        const disk_record_t *r = (const disk_record_t *)records[i];
+        disk_entry_t *old;
+        memcpy(key, r + 1, r->key_len);
+        key[r->key_len] = '\0';
+        if ((old = lookup(dc, key, lru_cache_hash(key))) != NULL) {
+            drop_entry(dc, old);
+        }
+        add_entry(dc, key, records[i] - dc->map, r);
+    }
+    if (dc->newest) {
+        dc->head = dc->newest->pos + dc->newest->size;
+        dc->seq = dc->newest->seq + 1;
+    }
+    dc->recovered = dc->count;
+    free(records);
+}
+
+/* diskcache_open  -- open or create the cache file */
+int diskcache_open(diskcache_t *dc, const char *path, size_t capacity)
+{
+    struct stat st;
+    capacity &= ~((size_t)DISK_ALIGN - 1);
+    if (capacity < DISK_HEADER_SIZE + DISK_ALIGN) {
+        return -1;
+    }
+    if ((dc->fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) {
+        return -1;
+    }
+    if (fstat(dc->fd, &st) < 0) {
+        close(dc->fd);
+        return -1;
+    }
+    if (st.st_size != capacity) {
+        /* start over, with a file of the right size */
+        if (ftruncate(dc->fd, 0) < 0 || ftruncate(dc->fd, capacity) < 0) {
+            close(dc->fd);
+            return -1;
+        }
+    }
+    dc->map = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED,
+            dc->fd, 0);
+    if (dc->map == MAP_FAILED) {
+        close(dc->fd);
+        return -1;
+    }
+
+    pthread_mutex_init(&dc->lock, NULL);
+    dc->capacity = capacity;
+    dc->head = DISK_HEADER_SIZE;
+    dc->seq = 1;
+    for (dc->nbuckets = 64; dc->nbuckets < capacity / 8192; dc->nbuckets *= 2) {
+    }
+    dc->buckets = (disk_entry_t **)Calloc(dc->nbuckets, sizeof(disk_entry_t *));
+    dc->oldest = dc->newest = NULL;
+    dc->count = 0;
+    dc->hits = dc->misses = dc->writes = dc->skipped = dc->recovered = 0;
+
+    disk_header_t *h = (disk_header_t *)dc->map;
+    if (h->magic == DISK_MAGIC && h->version == DISK_VERSION &&
+            h->capacity == capacity) {
+        recover(dc);
+    } else {
+        /* a new file, or one of another format. Records left by another
+         * format fail their checksum when the file is opened again */
+        h->magic = DISK_MAGIC;
+        h->version = DISK_VERSION;
+        h->capacity = capacity;
+    }
+    return 0;
+}
+
+/* diskcache_close  -- the records stay in the file */
+void diskcache_close(diskcache_t *dc)
+{
+    while (dc->oldest) {
+        drop_entry(dc, dc->oldest);
+    }
+    free(dc->buckets);
+    munmap(dc->map, dc->capacity);
+    close(dc->fd);
+    pthread_mutex_destroy(&dc->lock);
+}
+
+/* wall_expires  -- a now_ns time as seconds since the epoch, so that it
+ * means the same after a restart. 0 stays 0 */
+static long long wall_expires(long long expires_ns)
+{
+    if (expires_ns == 0) {
+        return 0;
+    }
+    long long t = time(NULL) + (expires_ns - now_ns()) / 1000000000LL;
+    return t > 0 ? t : 1;
+}
+
+/* diskcache_put  -- append the object to the file */
+void diskcache_put(diskcache_t *dc, const char *key, const char *value,
+        size_t len, long long expires_ns)
+{
+    size_t key_len = strlen(key);
+    size_t size = record_size(key_len, len);
+    long long expires = wall_expires(expires_ns);
+    if (key_len == 0 || key_len >= MAXLINE ||
+            size > dc->capacity - DISK_HEADER_SIZE) {
+        return;
+    }
+
+    pthread_mutex_lock(&dc->lock);
+    disk_entry_t *e = lookup(dc, key, lru_cache_hash(key));
+    if (e && e->value_len == len && memcmp(dc->map + e->pos +
+                sizeof(disk_record_t) + key_len, value, len) == 0) {
+        /* an object that came from here is evicted again */
+        e->expires = expires;
+        ((disk_record_t *)(dc->map + e->pos))->expires = expires;
+        dc->skipped++;
+        pthread_mutex_unlock(&dc->lock);
+        return;
+    }
+    if (e) {
+        drop_entry(dc, e);
+    }
+    make_room(dc, size);
+
+    disk_record_t *r = (disk_record_t *)(dc->map + dc->head);
+    r->magic = DISK_RECORD_MAGIC;
+    r->key_len = key_len;
+    r->value_len = len;
+    r->seq = dc->seq++;
+    memcpy(r + 1, key, key_len);
+    memcpy((char *)(r + 1) + key_len, value, len);
+    r->expires = expires;
+    r->checksum = record_checksum(r);
+    add_entry(dc, key, dc->head, r);
+    dc->head += size;
+    dc->writes++;
+    pthread_mutex_unlock(&dc->lock);
+}
+
+/* diskcache_get  -- copy the object out of the file */
+int diskcache_get(diskcache_t *dc, const char *key, Bytes *out,
+        long long *expires_ns)
+{
+    pthread_mutex_lock(&dc->lock);
+    disk_entry_t *e = lookup(dc, key, lru_cache_hash(key));
+    if (e == NULL) {
+        dc->misses++;
+        pthread_mutex_unlock(&dc->lock);
+        return 0;
+    }
+    bytes_appendn(out, dc->map + e->pos + sizeof(disk_record_t) +
+            strlen(e->key), e->value_len);
+    if (e->expires == 0) {
+        *expires_ns = 0;
+    } else {
+        *expires_ns = now_ns() + (e->expires - time(NULL)) * 1000000000LL;
+        if (*expires_ns == 0) {
+            *expires_ns = 1;
+        }
+    }
+    dc->hits++;
+    pthread_mutex_unlock(&dc->lock);
+    return 1;
+}
@@ -0,0 +1,67 @@
+/*
+ * diskcache.h  -- second tier of the cache, in a file
+ */
+
+#ifndef __DISKCACHE_H__
+#define __DISKCACHE_H__
+
+#include "csapp.h"
+#include "bytes.h"
+
+/* an object in the file, see diskcache.c */
+typedef struct disk_entry_t {
+    char *key;
+    unsigned int hash;
+    size_t pos;  /* offset of the record in the file */
+    size_t size;  /* bytes the record takes */
+    size_t value_len;
+    unsigned long long seq;  /* write order */
+    long long expires;  /* wall clock seconds, 0 if it never expires */
+    struct disk_entry_t *hnext;  /* next entry in the same hash bucket */
+    struct disk_entry_t *prev, *next;  /* file order, oldest first */
+} disk_entry_t;
+
+/* the disk cache. Records are appended to a fixed size file used as a
+ * circular log, overwriting the oldest ones. The index lives in memory
+ * and is rebuilt from the file when it is opened again.
+ */
+typedef struct diskcache_t {
+    pthread_mutex_t lock;  /* protects everything below */
+    int fd;
+    char *map;  /* the whole file, mapped shared */
+    size_t capacity;  /* size of the file */
+    size_t head;  /* where the next record goes */
+    unsigned long long seq;  /* seq of the next record */
+    disk_entry_t **buckets;  /* nbuckets is a power of 2 */
+    size_t nbuckets;
+    disk_entry_t *oldest, *newest;
+    size_t count;
+
+    /* statistics */
+    long long hits;
+    long long misses;
+    long long writes;  /* records written */
+    long long skipped;  /* puts of an object the file already had */
+    long long recovered;  /* records found when the file was opened */
+} diskcache_t;
+
+/* diskcache_open  -- open or create the cache file of capacity bytes.
+ * The records of an existing file of the same capacity are recovered.
+ * Return -1 on error
+ */
+int diskcache_open(diskcache_t *dc, const char *path, size_t capacity);
+void diskcache_close(diskcache_t *dc);
+
+/* diskcache_put  -- store the object. expires_ns is a now_ns time, 0 if
+ * it never expires
+ */
+void diskcache_put(diskcache_t *dc, const char *key, const char *value,
+        size_t len, long long expires_ns);
+
+/* diskcache_get  -- append the object of key to out, and tell when it
+ * expires. Return 1 on a hit, 0 on a miss
+ */
+int diskcache_get(diskcache_t *dc, const char *key, Bytes *out,
+        long long *expires_ns);
+
+#endif
@@ -0,0 +1,230 @@
+/*
+ * dnscache.c  -- cache of host name lookups
+ *
+ * getaddrinfo blocks for a network round trip on every cache miss of
+ * the proxy. The results are kept here for a while, failed lookups
+ * too, so requests to the same hosts resolve from memory.
+ *
+ * Entries are in a chained hash table, and also in a list in insertion
+ * order so the oldest one can be dropped when the cache is full. The
+ * resolver is called without the lock held.
+ */
+
+#include "dnscache.h"
+#include "cache.h"
+#include "util.h"
+
+/* initial number of hash buckets */
+#define DNS_NBUCKETS 64
+
+/* dns_getaddrinfo  -- the resolver of the system */
+int dns_getaddrinfo(const char *host, const char *port,
+        dns_addr_t *addrs, int max)
+{
+    struct addrinfo hints, *listp, *p;
+    int n = 0;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if (getaddrinfo(host, port, &hints, &listp) != 0) {
+        return 0;
+    }
+    for (p = listp; p && n < max; p = p->ai_next) {
+        if (p->ai_addrlen > sizeof(struct sockaddr_storage)) {
+            continue;
+        }
+        addrs[n].family = p->ai_family;
+        addrs[n].socktype = p->ai_socktype;
+        addrs[n].protocol = p->ai_protocol;
+        addrs[n].addrlen = p->ai_addrlen;
+        memcpy(&addrs[n].addr, p->ai_addr, p->ai_addrlen);
+        n++;
+    }
+    freeaddrinfo(listp);
+    return n;
+}
+
+/* dnscache_init  -- initialize an empty cache */
+void dnscache_init(dnscache_t *dc, size_t max_entries, long long ttl_ns,
+        long long negative_ttl_ns, dns_resolver_t resolve)
+{
+    pthread_mutex_init(&dc->lock, NULL);
+    dc->nbuckets = DNS_NBUCKETS;
+    while (dc->nbuckets < max_entries) {
+        dc->nbuckets <<= 1;
+    }
+    dc->buckets = Calloc(dc->nbuckets, sizeof(dns_entry_t *));
+    dc->oldest = dc->newest = NULL;
+    dc->count = 0;
+    dc->max_entries = max_entries;
+    dc->ttl_ns = ttl_ns;
+    dc->negative_ttl_ns = negative_ttl_ns;
+    dc->resolve = resolve ? resolve : dns_getaddrinfo;
+    dc->hits = 0;
+    dc->misses = 0;
+}
+
+/* dnscache_free  -- free all the entries */
+void dnscache_free(dnscache_t *dc)
+{
+    dns_entry_t *e = dc->oldest, *next;
+    while (e) {
+        next = e->next;
+        free(e->key);
+        free(e);
+        e = next;
+    }
+    free(dc->buckets);
+    dc->buckets = NULL;
+    dc->oldest = dc->newest = NULL;
+    dc->count = 0;
+    pthread_mutex_destroy(&dc->lock);
+}
+
+/* find  -- the entry of key. Called with the lock held */
+static dns_entry_t *find(dnscache_t *dc, const char *key, unsigned int hash)
+{
+    dns_entry_t *e = dc->buckets[hash & (dc->nbuckets - 1)];
+    while (e && (e->hash != hash || strcasecmp(e->key, key) != 0)) {
+        e = e->hnext;
+    }
+    return e;
+}
+
+/* unlink_entry  -- remove the entry from the hash table and the list.
+ * Called with the lock held */
+static void unlink_entry(dnscache_t *dc, dns_entry_t *e)
+{
+    dns_entry_t **pp = &dc->buckets[e->hash & (dc->nbuckets - 1)];
+    while (*pp != e) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = e->hnext;
+
+    dns_entry_t *prev = NULL, *p = dc->oldest;
+    while (p != e) {
+        prev = p;
+        p = p->next;
+    }
+    if (prev) {
+        prev->next = e->next;
+    } else {
+        dc->oldest = e->next;
+    }
+    if (dc->newest == e) {
+        dc->newest = prev;
+    }
+    dc->count--;
+}
+
+/* store  -- put the lookup result of key into the cache */
+static void store(dnscache_t *dc, const char *key, unsigned int hash,
+        const dns_addr_t *addrs, int naddrs)
+{
+    long long now = now_ns();
+    pthread_mutex_lock(&dc->lock);
+    dns_entry_t *e = find(dc, key, hash);
+    if (e == NULL) {
+        if (dc->max_entries == 0) {
+            pthread_mutex_unlock(&dc->lock);
+            return;
+        }
+        if (dc->count >= dc->max_entries) {
+            dns_entry_t *old = dc->oldest;
+            unlink_entry(dc, old);
+            free(old->key);
+            free(old);
+        }
+        e = Malloc(sizeof(dns_entry_t));
+        e->key = strdup(key);
+        e->hash = hash;
+        e->hnext = dc->buckets[hash & (dc->nbuckets - 1)];
+        dc->buckets[hash & (dc->nbuckets - 1)] = e;
+        e->next = NULL;
+        if (dc->newest) {
+            dc->newest->next = e;
+        } else {
+            dc->oldest = e;
+        }
+        dc->newest = e;
+        dc->count++;
+    }
+    e->naddrs = naddrs;
+    memcpy(e->addrs, addrs, naddrs * sizeof(dns_addr_t));
+    e->expires_ns = now + (naddrs ? dc->ttl_ns : dc->negative_ttl_ns);
+    pthread_mutex_unlock(&dc->lock);
+}
+
+/* dnscache_lookup  -- the addresses of host:port */
+int dnscache_lookup(dnscache_t *dc, const char *host, const char *port,
+        dns_addr_t *addrs, int max)
+{
+    char key[MAXLINE];
+    dns_addr_t resolved[DNS_MAX_ADDRS];
+    int n;
+    snprintf(key, sizeof(key), "%s:%s", host, port);
+    unsigned int hash = lru_cache_hash(key);
+
+    pthread_mutex_lock(&dc->lock);
+    dns_entry_t *e = find(dc, key, hash);
+    if (e && e->expires_ns > now_ns()) {
+        n = e->naddrs < max ? e->naddrs : max;
+        memcpy(addrs, e->addrs, n * sizeof(dns_addr_t));
+        dc->hits++;
+        pthread_mutex_unlock(&dc->lock);
+        return n;
+    }
+    dc->misses++;
+    pthread_mutex_unlock(&dc->lock);
+
+    n = dc->resolve(host, port, resolved, DNS_MAX_ADDRS);
+    store(dc, key, hash, resolved, n);
+    if (n > max) {
+        n = max;
+    }
+    memcpy(addrs, resolved, n * sizeof(dns_addr_t));
+    return n;
+}
+
+/* dnscache_forget  -- drop host:port */
+void dnscache_forget(dnscache_t *dc, const char *host, const char *port)
+{
+    char key[MAXLINE];
+    snprintf(key, sizeof(key), "%s:%s", host, port);
+    unsigned int hash = lru_cache_hash(key);
+
+    pthread_mutex_lock(&dc->lock);
+    dns_entry_t *e = find(dc, key, hash);
+    if (e) {
+        unlink_entry(dc, e);
+        free(e->key);
+        free(e);
+    }
+    pthread_mutex_unlock(&dc->lock);
+}
+
+/* dnscache_connect  -- open_clientfd through the cache */
+int dnscache_connect(dnscache_t *dc, const char *host, const char *port)
+{
+    dns_addr_t addrs[DNS_MAX_ADDRS];
+    int n = dnscache_lookup(dc, host, port, addrs, DNS_MAX_ADDRS), i, fd;
+    if (n == 0) {
+        fprintf(stderr, "Could not resolve host: %s\n", host);
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        if ((fd = socket(addrs[i].family, addrs[i].socktype,
+                        addrs[i].protocol)) < 0) {
+            continue;
+        }
+        if (connect(fd, (SA *)&addrs[i].addr, addrs[i].addrlen) == 0) {
+            return fd;
+        }
+        close(fd);
+    }
+    /* the host may have moved, look it up again next time */
+    dnscache_forget(dc, host, port);
+    fprintf(stderr, "[ERROR] open %s:%s failed\n", host, port);
+    return -1;
+}
@@ -0,0 +1,81 @@
+/*
+ * dnscache.h  -- cache of host name lookups
+ */
+
+#ifndef __DNSCACHE_H__
+#define __DNSCACHE_H__
+
+#include "csapp.h"
+
+/* most addresses kept for one host */
+#define DNS_MAX_ADDRS 4
+
+/* a resolved address, enough to create a socket and connect it */
+typedef struct dns_addr_t {
+    int family;
+    int socktype;
+    int protocol;
+    socklen_t addrlen;
+    struct sockaddr_storage addr;
+} dns_addr_t;
+
+/* dns_resolver_t  -- resolve host:port into at most max addresses.
+ * Return the number of addresses, 0 if the host does not resolve
+ */
+typedef int (*dns_resolver_t)(const char *host, const char *port,
+        dns_addr_t *addrs, int max);
+
+/* the lookup result of one host:port */
+typedef struct dns_entry_t {
+    char *key;  /* "host:port" */
+    unsigned int hash;
+    int naddrs;  /* 0 for a negative entry */
+    dns_addr_t addrs[DNS_MAX_ADDRS];
+    long long expires_ns;  /* see now_ns */
+    struct dns_entry_t *hnext;  /* next entry in the same hash bucket */
+    struct dns_entry_t *next;  /* next entry in insertion order */
+} dns_entry_t;
+
+/* dns cache. Entries live for ttl, failed lookups for negative_ttl.
+ * When max_entries is reached, the oldest entry is dropped.
+ */
+typedef struct dnscache_t {
+    pthread_mutex_t lock;  /* protects everything below */
+    dns_entry_t **buckets;  /* nbuckets is a power of 2 */
+    size_t nbuckets;
+    dns_entry_t *oldest, *newest;  /* insertion order */
+    size_t count;
+    size_t max_entries;
+    long long ttl_ns;
+    long long negative_ttl_ns;
+    dns_resolver_t resolve;
+
+    /* statistics */
+    long long hits;
+    long long misses;
+} dnscache_t;
+
+/* dns_getaddrinfo  -- the resolver of the system */
+int dns_getaddrinfo(const char *host, const char *port,
+        dns_addr_t *addrs, int max);
+
+void dnscache_init(dnscache_t *dc, size_t max_entries, long long ttl_ns,
+        long long negative_ttl_ns, dns_resolver_t resolve);
+void dnscache_free(dnscache_t *dc);
+
+/* dnscache_lookup  -- the addresses of host:port, from the cache or
+ * from the resolver. Return their number, 0 if the host doesn't resolve
+ */
+int dnscache_lookup(dnscache_t *dc, const char *host, const char *port,
+        dns_addr_t *addrs, int max);
+
+/* dnscache_forget  -- drop host:port, e.g. when none of its addresses
+ * accept connections any more */
+void dnscache_forget(dnscache_t *dc, const char *host, const char *port);
+
+/* dnscache_connect  -- open_clientfd with the lookup going through the
+ * cache. Return the connected socket, or -1
+ */
+int dnscache_connect(dnscache_t *dc, const char *host, const char *port);
+
+#endif
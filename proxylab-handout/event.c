@@ -0,0 +1,596 @@
+/*
+ * event.c  -- event driven proxy mode built on epoll
+ *
+ * Each event loop thread owns an epoll instance. The listening socket
+ * is registered in every loop with EPOLLEXCLUSIVE, so a new connection
+ * wakes up one loop, and that loop owns the connection until it is
+ * closed. All sockets are non-blocking and each connection is a small
+ * state machine:
+ *
+ *   READ_REQUEST -> (cache hit)  WRITE_CACHED
+ *                -> (cache miss) CONNECTING -> WRITE_REQUEST -> RELAY
+ *
+ * The request head is parsed as it arrives with http_request_parse and
+ * rewritten with the http_request_* helpers, like the threaded mode does.
+ */
+
+#include "event.h"
+#include "util.h"
+#include "bytes.h"
+#include "http.h"
+
+#include <sys/epoll.h>
+
+// #define DEBUG
+#undef DEBUG
+
+/* max number of events handled per epoll_wait */
+#define MAX_EVENTS 64
+
+typedef enum conn_state_t {
+    READ_REQUEST,   /* reading the request header block from the client */
+    CONNECTING,     /* waiting for the non-blocking connect to the server */
+    WRITE_REQUEST,  /* sending the forwarded request to the server */
+    RELAY,          /* relaying the response from the server to the client */
+    WRITE_CACHED    /* writing a cached object to the client */
+} conn_state_t;
+
+struct conn_t;
+
+/* one side of a connection. epoll_event.data.ptr points to it */
+typedef struct endpoint_t {
+    struct conn_t *conn;
+    int fd;  /* -1 if closed */
+    unsigned int events;  /* registered epoll events */
+    int registered;  /* whether fd is in the epoll set */
+} endpoint_t;
+
+typedef struct conn_t {
+    conn_state_t state;
+    endpoint_t client;
+    endpoint_t server;
+    char in[MAXBUF];  /* request header block from the client */
+    size_t in_len;
+    http_request_t req;  /* parsed from in as it arrives */
+    char *out;  /* forwarded request, then the relay buffer */
+    size_t out_off;  /* bytes of out already written */
+    size_t out_len;  /* bytes in out */
+    int server_eof;  /* the server has closed its side */
+    char *key;  /* formated uri, the cache key */
+    lru_cache_obj_t *obj;  /* cached object being written */
+    size_t obj_off;
+    Bytes response;  /* cache candidate. Freed once it gets too large */
+    int cacheable;
+    int authorized;  /* the request has Authorization */
+    int dead;  /* closed, freed at the end of the epoll_wait batch */
+    struct conn_t *next_dead;
+} conn_t;
+
+typedef struct event_loop_t {
+    int epfd;
+    int listenfd;
+    shard_cache_t *pcache;
+    size_t max_object_size;
+    long long default_ttl;
+    dnscache_t *pdns;
+    conn_t *dead;  /* closed connections not freed yet */
+} event_loop_t;
+
+
+/* set_events  -- register the endpoint for events. 0 keeps the fd in
+ * the epoll set without asking for any event
+ */
+static void set_events(event_loop_t *loop, endpoint_t *ep, unsigned int events)
+{
+    struct epoll_event ev;
+    if (ep->registered && ep->events == events) {
+        return;
+    }
+    ev.events = events;
+    ev.data.ptr = ep;
+    if (epoll_ctl(loop->epfd, ep->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                ep->fd, &ev) < 0) {
+        fprintf(stderr, "[ERROR] epoll_ctl on %d failed: %s\n",
+                ep->fd, strerror(errno));
+        return;
+    }
+    ep->registered = 1;
+    ep->events = events;
+}
+
+/* conn_create  -- create a connection for the accepted client fd */
+static conn_t *conn_create(int clientfd)
+{
+    conn_t *c = (conn_t *)malloc(sizeof(conn_t));
+    if (c == NULL) {
+        return NULL;
+    }
+    c->state = READ_REQUEST;
+    c->client.conn = c;
+    c->client.fd = clientfd;
+    c->client.events = 0;
+    c->client.registered = 0;
+    c->server.conn = c;
+    c->server.fd = -1;
+    c->server.events = 0;
+    c->server.registered = 0;
+    c->in_len = 0;
+    http_request_init(&c->req);
+    c->out = NULL;
+    c->out_off = c->out_len = 0;
+    c->server_eof = 0;
+    c->key = NULL;
+    c->obj = NULL;
+    c->obj_off = 0;
+    c->cacheable = 0;
+    c->authorized = 0;
+    c->dead = 0;
+    c->next_dead = NULL;
+    return c;
+}
+
+/* conn_close  -- close both sides of the connection. Closing an fd
+ * removes it from the epoll set, but the current epoll_wait batch may
+ * still hold an event for the other side, so the connection is only
+ * marked dead here and freed by conn_free_dead after the batch
+ */
+static void conn_close(event_loop_t *loop, conn_t *c)
+{
+    if (c->dead) {
+        return;
+    }
+    if (c->client.fd >= 0) {
+        close_ww(c->client.fd);
+        c->client.fd = -1;
+    }
+    if (c->server.fd >= 0) {
+        close_ww(c->server.fd);
+        c->server.fd = -1;
+    }
+    c->dead = 1;
+    c->next_dead = loop->dead;
+    loop->dead = c;
+}
+
+/* conn_free_dead  -- free the connections closed in this batch */
+static void conn_free_dead(event_loop_t *loop)
+{
+    conn_t *c;
+    while ((c = loop->dead) != NULL) {
+        loop->dead = c->next_dead;
+        if (c->obj) {
+            lru_cache_obj_release(c->obj);
+        }
+        if (c->cacheable) {
+            bytes_free(&c->response);
+        }
+        free(c->out);
+        free(c->key);
+        free(c);
+    }
+}
+
+/* send_nb  -- non-blocking write. Return the number of bytes written,
+ * 0 if the socket is full, or -1 on error
+ */
+static ssize_t send_nb(int fd, const char *buf, size_t n)
+{
+    ssize_t rc;
+    while ((rc = send(fd, buf, n, MSG_NOSIGNAL)) < 0) {
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        return -1;
+    }
+    return rc;
+}
+
+/* connect_nb  -- start a non-blocking connect to host:port.
+ * Return the socket, or -1 if no address could be tried.
+ * The address lookup itself is still blocking when it misses the
+ * dns cache.
+ */
+static int connect_nb(event_loop_t *loop, const char *host,
+        const char *port)
+{
+    dns_addr_t addrs[DNS_MAX_ADDRS];
+    int fd = -1, i;
+    int n = dnscache_lookup(loop->pdns, host, port, addrs, DNS_MAX_ADDRS);
+
+    if (n == 0) {
+        fprintf(stderr, "Could not resolve host: %s\n", host);
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        fd = socket(addrs[i].family, addrs[i].socktype | SOCK_NONBLOCK,
+                addrs[i].protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (connect(fd, (SA *)&addrs[i].addr, addrs[i].addrlen) == 0 ||
+                errno == EINPROGRESS) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/* finish  -- the response has been relayed completely */
+static void finish(event_loop_t *loop, conn_t *c)
+{
+    if (c->cacheable && bytes_length(c->response) < loop->max_object_size) {
+        http_cache_info_t info;
+        http_cache_info_init(&info);
+        http_cache_info_parse(&info, bytes_buf(c->response),
+                bytes_length(c->response));
+        long long expires_ns = http_cache_expires(&info, loop->default_ttl);
+        if (expires_ns >= 0 && (!c->authorized || info.shared)) {
+            shard_cache_put_until(loop->pcache, c->key,
+                    bytes_buf(c->response), bytes_length(c->response),
+                    expires_ns);
+        }
+    }
+    conn_close(loop, c);
+}
+
+/* write_cached  -- write the cached object to the client */
+static void write_cached(event_loop_t *loop, conn_t *c)
+{
+    while (c->obj_off < c->obj->len) {
+        ssize_t n = send_nb(c->client.fd, c->obj->data + c->obj_off,
+                c->obj->len - c->obj_off);
+        if (n < 0) {
+            conn_close(loop, c);
+            return;
+        }
+        if (n == 0) {
+            set_events(loop, &c->client, EPOLLOUT);
+            return;
+        }
+        c->obj_off += n;
+    }
+    conn_close(loop, c);
+}
+
+/* flush_out  -- write the pending relay bytes to the client.
+ * Return 1 if everything is written, 0 if the socket is full,
+ * -1 on error
+ */
+static int flush_out(conn_t *c)
+{
+    while (c->out_off < c->out_len) {
+        ssize_t n = send_nb(c->client.fd, c->out + c->out_off,
+                c->out_len - c->out_off);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        c->out_off += n;
+    }
+    c->out_off = c->out_len = 0;
+    return 1;
+}
+
+/* relay  -- move the response from the server to the client until one
+ * side would block. While the client is full, we stop reading from the
+ * server so that at most MAXBUF bytes are buffered per connection.
+ */
+static void relay(event_loop_t *loop, conn_t *c)
+{
+    while (1) {
+        int rc = flush_out(c);
+        if (rc < 0) {
+            conn_close(loop, c);
+            return;
+        }
+        if (rc == 0) {
+            /* wait for the client to drain */
+            set_events(loop, &c->server, 0);
+            set_events(loop, &c->client, EPOLLOUT);
+            return;
+        }
+        if (c->server_eof) {
+            finish(loop, c);
+            return;
+        }
+        ssize_t n = read(c->server.fd, c->out, MAXBUF);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                set_events(loop, &c->client, 0);
+                set_events(loop, &c->server, EPOLLIN);
+                return;
+            }
+            conn_close(loop, c);
+            return;
+        }
+        if (n == 0) {
+            c->server_eof = 1;
+            continue;
+        }
+        c->out_len = n;
+        if (c->cacheable) {
+            if (bytes_length(c->response) + n < loop->max_object_size) {
+                bytes_appendn(&c->response, c->out, n);
+            } else {
+                /* too large to cache, stop copying it */
+                bytes_free(&c->response);
+                c->cacheable = 0;
+            }
+        }
+    }
+}
+
+/* write_request  -- send the forwarded request to the server */
+static void write_request(event_loop_t *loop, conn_t *c)
+{
+    while (c->out_off < c->out_len) {
+        ssize_t n = send_nb(c->server.fd, c->out + c->out_off,
+                c->out_len - c->out_off);
+        if (n < 0) {
+            conn_close(loop, c);
+            return;
+        }
+        if (n == 0) {
+            set_events(loop, &c->server, EPOLLOUT);
+            return;
+        }
+        c->out_off += n;
+    }
+    /* the request buffer becomes the relay buffer */
+    c->out_off = c->out_len = 0;
+    c->state = RELAY;
+    bytes_malloc(&c->response);
+    c->cacheable = 1;
+    relay(loop, c);
+}
+
+/* start_request  -- the request header block is complete. Serve it from
+ * the cache or start connecting to the server
+ */
+static void start_request(event_loop_t *loop, conn_t *c)
+{
+    char host[HTTP_HOST_MAX], port[HTTP_PORT_MAX], formated_uri[MAXLINE];
+    const http_request_t *req = &c->req;
+    int has_host = 0;
+    int keep_alive = 0;  /* event mode always closes the client */
+    int i;
+
+    if (!http_view_equals(req->method, "GET")) {
+        fprintf(stderr, "[ERROR] method is not GET\n");
+        conn_close(loop, c);
+        return;
+    }
+    if (http_request_target(req, host, port, formated_uri,
+                sizeof(formated_uri)) < 0) {
+        fprintf(stderr, "[ERROR] uri too long\n");
+        conn_close(loop, c);
+        return;
+    }
+
+    /* stale objects are fetched again, there is no revalidation. A request
+     * with Authorization always goes to the server */
+    c->authorized = http_request_has(req, "Authorization");
+    lru_cache_obj_t *obj = c->authorized ? NULL :
+        shard_cache_get(loop->pcache, formated_uri);
+    if (obj && !lru_cache_obj_fresh(obj, now_ns())) {
+        lru_cache_obj_release(obj);
+        obj = NULL;
+    }
+    if (obj) {
+        c->obj = obj;
+        c->state = WRITE_CACHED;
+        write_cached(loop, c);
+        return;
+    }
+
+    c->out = (char *)malloc(MAXBUF);
+    c->key = strdup(formated_uri);
+    if (c->out == NULL || c->key == NULL) {
+        conn_close(loop, c);
+        return;
+    }
+    http_writer_t w;
+    http_writer_init(&w, c->out, MAXBUF);
+    http_request_line(&w, req, 0);
+    for (i = 0; i < req->nheaders; i++) {
+        http_request_header(&w, &req->headers[i], &has_host, &keep_alive);
+    }
+    http_request_end(&w, has_host, host, port, 0);
+    if (w.overflow) {
+        fprintf(stderr, "[ERROR] request too large\n");
+        conn_close(loop, c);
+        return;
+    }
+    c->out_len = w.len;
+    c->out_off = 0;
+
+    c->server.fd = connect_nb(loop, host, port);
+    if (c->server.fd < 0) {
+        conn_close(loop, c);
+        return;
+    }
+    c->state = CONNECTING;
+    set_events(loop, &c->client, 0);
+    set_events(loop, &c->server, EPOLLOUT);
+}
+
+/* read_request  -- read the request header block from the client */
+static void read_request(event_loop_t *loop, conn_t *c)
+{
+    while (1) {
+        ssize_t n = read(c->client.fd, c->in + c->in_len,
+                sizeof(c->in) - c->in_len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n <= 0) {
+            conn_close(loop, c);
+            return;
+        }
+        c->in_len += n;
+        int rc = http_request_parse(&c->req, c->in, c->in_len);
+        if (rc == HTTP_PARSE_DONE) {
+            start_request(loop, c);
+            return;
+        }
+        if (rc == HTTP_PARSE_ERROR) {
+            fprintf(stderr, "[ERROR] bad request head\n");
+            conn_close(loop, c);
+            return;
+        }
+        if (c->in_len == sizeof(c->in)) {
+            fprintf(stderr, "[ERROR] request header too large\n");
+            conn_close(loop, c);
+            return;
+        }
+    }
+}
+
+/* handle_client  -- an event on the client socket */
+static void handle_client(event_loop_t *loop, conn_t *c, unsigned int events)
+{
+    if ((events & EPOLLERR) ||
+            ((events & EPOLLHUP) && c->state != READ_REQUEST)) {
+        /* nobody is left to read the response */
+        conn_close(loop, c);
+        return;
+    }
+    switch (c->state) {
+        case READ_REQUEST:
+            read_request(loop, c);
+            break;
+        case WRITE_CACHED:
+            write_cached(loop, c);
+            break;
+        case RELAY:
+            relay(loop, c);
+            break;
+        default:
+            break;
+    }
+}
+
+/* handle_server  -- an event on the server socket */
+static void handle_server(event_loop_t *loop, conn_t *c, unsigned int events)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+    switch (c->state) {
+        case CONNECTING:
+            if (getsockopt(c->server.fd, SOL_SOCKET, SO_ERROR,
+                        &err, &len) < 0 || err != 0) {
+                fprintf(stderr, "[ERROR] connect failed: %s\n",
+                        strerror(err));
+                conn_close(loop, c);
+                return;
+            }
+            c->state = WRITE_REQUEST;
+            write_request(loop, c);
+            break;
+        case WRITE_REQUEST:
+            write_request(loop, c);
+            break;
+        case RELAY:
+            relay(loop, c);
+            break;
+        default:
+            break;
+    }
+}
+
+/* accept_all  -- accept every pending connection */
+static void accept_all(event_loop_t *loop)
+{
+    int connfd;
+    while ((connfd = accept(loop->listenfd, NULL, NULL)) >= 0) {
+        fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
+        conn_t *c = conn_create(connfd);
+        if (c == NULL) {
+            fprintf(stderr, "malloc failed\n");
+            close(connfd);
+            continue;
+        }
+        set_events(loop, &c->client, EPOLLIN);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        fprintf(stderr, "Accept failed: %d\n", loop->listenfd);
+    }
+}
+
+/* event_loop  -- the thread routine of an event loop */
+static void *event_loop(void *vargp)
+{
+    event_loop_t *loop = (event_loop_t *)vargp;
+    struct epoll_event events[MAX_EVENTS];
+    int i, n;
+    while (1) {
+        n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno != EINTR) {
+                unix_error("epoll_wait error");
+            }
+            continue;
+        }
+        for (i = 0; i < n; i++) {
+            endpoint_t *ep = (endpoint_t *)events[i].data.ptr;
+            if (ep == NULL) {
+                accept_all(loop);
+            } else if (ep->conn->dead) {
+                /* closed by an earlier event of this batch */
+                continue;
+            } else if (ep == &ep->conn->client) {
+                handle_client(loop, ep->conn, events[i].events);
+            } else {
+                handle_server(loop, ep->conn, events[i].events);
+            }
+        }
+        conn_free_dead(loop);
+    }
+    return NULL;
+}
+
+/* event_loops_run  -- start the event loops */
+void event_loops_run(int listenfd, int nloops, shard_cache_t *pcache,
+        size_t max_object_size, long long default_ttl, dnscache_t *pdns)
+{
+    int i;
+    pthread_t *tids = Malloc(nloops * sizeof(pthread_t));
+    event_loop_t *loops = Malloc(nloops * sizeof(event_loop_t));
+    struct epoll_event ev;
+
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    for (i = 0; i < nloops; i++) {
+        loops[i].listenfd = listenfd;
+        loops[i].pcache = pcache;
+        loops[i].max_object_size = max_object_size;
+        loops[i].dead = NULL;
+        loops[i].default_ttl = default_ttl;
+        loops[i].pdns = pdns;
+        if ((loops[i].epfd = epoll_create1(0)) < 0) {
+            unix_error("epoll_create1 error");
+        }
+        /* only one loop is woken up per new connection */
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) {
+            unix_error("epoll_ctl error");
+        }
+        Pthread_create(&tids[i], NULL, event_loop, &loops[i]);
+    }
+    for (i = 0; i < nloops; i++) {
+        Pthread_join(tids[i], NULL);
+    }
+}
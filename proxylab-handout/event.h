@@ -0,0 +1,20 @@
+/*
+ * event.h  -- event driven proxy mode built on epoll
+ */
+
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+#include "cache.h"
+#include "dnscache.h"
+
+/* event_loops_run  -- serve the connections of listenfd with nloops
+ * epoll event loops, one per thread. Responses shorter than
+ * max_object_size are put into pcache, for as long as they are fresh:
+ * default_ttl seconds if their headers don't say. Hosts are resolved
+ * through pdns. Never returns.
+ */
+void event_loops_run(int listenfd, int nloops, shard_cache_t *pcache,
+        size_t max_object_size, long long default_ttl, dnscache_t *pdns);
+
+#endif
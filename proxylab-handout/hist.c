@@ -0,0 +1,123 @@
+/*
+ * hist.c  -- latency histogram with a bounded relative error
+ *
+ * The buckets are log-linear, as in HdrHistogram: a value v whose top
+ * bit is bit m (m >= HIST_SUB_BITS) is counted in sub-bucket
+ * (v >> (m - HIST_SUB_BITS)) - HIST_SUB_BUCKETS of its power of two. A
+ * record is a few shifts and one increment, and the histogram has a
+ * fixed size however long the run is, so every client thread keeps its
+ * own and they are merged at the end.
+ */
+
+#include "hist.h"
+
+#include <string.h>
+
+/* bucket_index  -- the bucket of value */
+static int bucket_index(long long value)
+{
+    int m, shift;
+    if (value < HIST_SUB_BUCKETS) {
+        return (int)value;
+    }
+    m = 63 - __builtin_clzll((unsigned long long)value);  /* top bit */
+    if (m >= HIST_MAX_BITS) {
+        return HIST_BUCKETS - 1;
+    }
+    shift = m - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_BUCKETS +
+        (int)(value >> shift) - HIST_SUB_BUCKETS;
+}
+
+/* bucket_high  -- the largest value counted in bucket i */
+static long long bucket_high(int i)
+{
+    int shift = i / HIST_SUB_BUCKETS - 1;
+    long long sub = i % HIST_SUB_BUCKETS;
+    if (shift < 0) {
+        return i;
+    }
+    return ((HIST_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+void hist_init(hist_t *h)
+{
+    memset(h->counts, 0, sizeof(h->counts));
+    h->count = 0;
+    h->sum = 0;
+    h->min = 0;
+    h->max = 0;
+}
+
+void hist_record(hist_t *h, long long value)
+{
+    if (value < 0) {
+        value = 0;
+    }
+    h->counts[bucket_index(value)]++;
+    if (h->count == 0 || value < h->min) {
+        h->min = value;
+    }
+    if (value > h->max) {
+        h->max = value;
+    }
+    h->count++;
+    h->sum += value;
+}
+
+void hist_merge(hist_t *dst, const hist_t *src)
+{
+    int i;
+    if (src->count == 0) {
+        return;
+    }
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+    if (dst->count == 0 || src->min < dst->min) {
+        dst->min = src->min;
+    }
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+    dst->count += src->count;
+    dst->sum += src->sum;
+}
+
+long long hist_percentile(const hist_t *h, double percent)
+{
+    long long rank, seen = 0;
+    int i;
+    if (h->count == 0) {
+        return 0;
+    }
+    /* the rank-th smallest value, counting from 1 */
+    rank = (long long)(percent / 100.0 * h->count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > h->count) {
+        rank = h->count;
+    }
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            break;
+        }
+    }
+    /* no value is out of the range seen. The last bucket has no upper
+     * end but max */
+    long long value = i == HIST_BUCKETS - 1 ? h->max : bucket_high(i);
+    if (value > h->max) {
+        value = h->max;
+    }
+    if (value < h->min) {
+        value = h->min;
+    }
+    return value;
+}
+
+double hist_mean(const hist_t *h)
+{
+    return h->count ? (double)h->sum / h->count : 0.0;
+}
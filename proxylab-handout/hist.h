@@ -0,0 +1,42 @@
+/*
+ * hist.h  -- latency histogram with a bounded relative error
+ */
+
+#ifndef __HIST_H__
+#define __HIST_H__
+
+/* Values below HIST_SUB_BUCKETS are counted exactly. Above, every power
+ * of two is split into HIST_SUB_BUCKETS buckets, so a bucket is less
+ * than 1/HIST_SUB_BUCKETS (0.8%) of the values in it wide. Values up to
+ * 2^HIST_MAX_BITS (about 18 minutes in ns) are counted, larger ones go
+ * into the last bucket */
+#define HIST_SUB_BITS 7
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+typedef struct hist_t {
+    long long counts[HIST_BUCKETS];
+    long long count;
+    long long sum;
+    long long min;
+    long long max;
+} hist_t;
+
+void hist_init(hist_t *h);
+
+/* hist_record  -- count a value >= 0 */
+void hist_record(hist_t *h, long long value);
+
+/* hist_merge  -- add the values of src to dst */
+void hist_merge(hist_t *dst, const hist_t *src);
+
+/* hist_percentile  -- the value that percent (0 to 100) of the values
+ * are at most, to within the width of its bucket. 0 if h is empty
+ */
+long long hist_percentile(const hist_t *h, double percent);
+
+/* hist_mean  -- the exact mean of the values. 0 if h is empty */
+double hist_mean(const hist_t *h);
+
+#endif
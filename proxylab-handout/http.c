@@ -0,0 +1,909 @@
+/*
+ * http.c  -- parsing the request of a client, building the request that
+ * the proxy forwards to the server, and peeking at the response that
+ * comes back
+ *
+ * Both the threaded forward() and the event loop use these, so the two
+ * modes rewrite headers the same way.
+ */
+
+#include "http.h"
+#include "util.h"
+#include "csapp.h"
+
+#include <ctype.h>
+
+/* You won't lose style points for including these long lines in your code */
+static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
+static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
+static const char *accept_encoding_hdr = "Accept-Encoding: gzip, deflate\r\n";
+
+
+/* parts of a uri that has none */
+static const char default_port[] = "80";
+static const char default_dir[] = "/";
+
+/* http_view_equals  -- compare a view with a string, ignoring case */
+int http_view_equals(http_view_t v, const char *s)
+{
+    size_t n = strlen(s);
+    return v.len == n && strncasecmp(v.ptr, s, n) == 0;
+}
+
+/* is_blank  -- white space inside a line */
+static int is_blank(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+/* make_view  -- the view of [start, end) */
+static http_view_t make_view(const char *start, const char *end)
+{
+    http_view_t v;
+    v.ptr = start;
+    v.len = end - start;
+    return v;
+}
+
+/* parse_target  -- split the uri into host, port and dir, the way
+ * parse_uri does: a scheme is optional, and so are port and dir. A port
+ * is a number
+ */
+static int parse_target(http_request_t *req)
+{
+    const char *p = req->uri.ptr, *end = p + req->uri.len, *start;
+    if (end - p >= 7 && strncasecmp(p, "http://", 7) == 0) {
+        p += 7;
+    } else if (end - p >= 8 && strncasecmp(p, "https://", 8) == 0) {
+        p += 8;
+    }
+    for (start = p; p < end && *p != '/' && *p != ':'; p++) {
+    }
+    req->host = make_view(start, p);
+    if (p < end && *p == ':') {
+        for (start = ++p; p < end && *p != '/' && *p != ':'; p++) {
+            if (!isdigit((unsigned char)*p)) {
+                return -1;
+            }
+        }
+        req->port = make_view(start, p);
+    } else {
+        req->port = make_view(default_port, default_port + 2);
+    }
+    req->dir = p < end ? make_view(p, end) :
+        make_view(default_dir, default_dir + 1);
+    return req->host.len > 0 && req->port.len > 0 ? 0 : -1;
+}
+
+/* parse_request_line  -- "method uri version" */
+static int parse_request_line(http_request_t *req, const char *p,
+        const char *end)
+{
+    http_view_t *parts[3] = {&req->method, &req->uri, &req->version};
+    const char *start;
+    int i;
+    for (i = 0; i < 3; i++) {
+        while (p < end && is_blank(*p)) {
+            p++;
+        }
+        for (start = p; p < end && !is_blank(*p); p++) {
+        }
+        if (p == start) {
+            return -1;
+        }
+        *parts[i] = make_view(start, p);
+    }
+    while (p < end && is_blank(*p)) {
+        p++;
+    }
+    if (p != end || req->version.len < 5 ||
+            strncmp(req->version.ptr, "HTTP/", 5) != 0) {
+        return -1;
+    }
+    return parse_target(req);
+}
+
+/* parse_header_line  -- "name: value". White space before the colon or
+ * at the start of the line (a folded line) is not allowed, as servers
+ * disagree on what it means
+ */
+static int parse_header_line(http_request_t *req, const char *p,
+        const char *end)
+{
+    const char *colon = memchr(p, ':', end - p);
+    if (colon == NULL || colon == p || req->nheaders == HTTP_MAX_HEADERS) {
+        return -1;
+    }
+    http_header_t *h = &req->headers[req->nheaders++];
+    h->name = make_view(p, colon);
+    for (; p < colon; p++) {
+        if (is_blank(*p)) {
+            return -1;
+        }
+    }
+    for (p = colon + 1; p < end && is_blank(*p); p++) {
+    }
+    while (end > p && is_blank(end[-1])) {
+        end--;
+    }
+    h->value = make_view(p, end);
+    return 0;
+}
+
+void http_request_init(http_request_t *req)
+{
+    req->state = HTTP_PARSE_MORE;
+    req->pos = req->scanned = 0;
+    req->method.ptr = req->uri.ptr = NULL;
+    req->method.len = req->uri.len = 0;
+    req->nheaders = 0;
+}
+
+/* http_request_parse  -- parse the lines of the head that are complete.
+ * A line ends with "\r\n" or a bare "\n". A NUL or a CR anywhere else
+ * makes the request malformed, so that no server sees a different
+ * header than the one checked here
+ */
+int http_request_parse(http_request_t *req, const char *buf, size_t len)
+{
+    while (req->state == HTTP_PARSE_MORE) {
+        const char *line = buf + req->pos;
+        const char *p = buf + req->scanned, *end = buf + len;
+        while (p < end && *p != '\n') {
+            if (*p == '\0' || (*p == '\r' && p + 1 < end && p[1] != '\n')) {
+                return req->state = HTTP_PARSE_ERROR;
+            }
+            if (*p == '\r' && p + 1 == end) {
+                break;  /* look at it again with the next byte */
+            }
+            p++;
+        }
+        req->scanned = p - buf;
+        if (p == end || *p != '\n') {
+            break;
+        }
+        req->pos = req->scanned = p + 1 - buf;
+        if (p > line && p[-1] == '\r') {
+            p--;
+        }
+        if (req->method.ptr == NULL) {
+            if (parse_request_line(req, line, p) < 0) {
+                req->state = HTTP_PARSE_ERROR;
+            }
+        } else if (p == line) {
+            req->state = HTTP_PARSE_DONE;
+        } else if (parse_header_line(req, line, p) < 0) {
+            req->state = HTTP_PARSE_ERROR;
+        }
+    }
+    return req->state;
+}
+
+/* http_request_has  -- look for a header of the request */
+int http_request_has(const http_request_t *req, const char *name)
+{
+    int i;
+    for (i = 0; i < req->nheaders; i++) {
+        if (http_view_equals(req->headers[i].name, name)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* http_request_target  -- the host, port and cache key of the request */
+int http_request_target(const http_request_t *req, char *host, char *port,
+        char *key, size_t key_size)
+{
+    size_t i;
+    if (req->host.len >= HTTP_HOST_MAX || req->port.len >= HTTP_PORT_MAX ||
+            req->host.len + 1 + req->port.len + req->dir.len >= key_size) {
+        return -1;
+    }
+    for (i = 0; i < req->host.len; i++) {
+        host[i] = tolower((unsigned char)req->host.ptr[i]);
+    }
+    host[i] = '\0';
+    memcpy(port, req->port.ptr, req->port.len);
+    port[req->port.len] = '\0';
+
+    http_writer_t w;
+    http_writer_init(&w, key, key_size);
+    http_write_str(&w, host);
+    http_write(&w, ":", 1);
+    http_write_view(&w, req->port);
+    http_write_view(&w, req->dir);
+    return 0;
+}
+
+void http_writer_init(http_writer_t *w, char *buf, size_t cap)
+{
+    w->buf = buf;
+    w->len = 0;
+    w->cap = cap;
+    w->overflow = 0;
+    buf[0] = '\0';
+}
+
+/* http_write  -- append n bytes, or nothing if they don't fit */
+void http_write(http_writer_t *w, const char *s, size_t n)
+{
+    if (w->overflow || n >= w->cap - w->len) {
+        w->overflow = 1;
+        return;
+    }
+    memcpy(w->buf + w->len, s, n);
+    w->len += n;
+    w->buf[w->len] = '\0';
+}
+
+void http_write_str(http_writer_t *w, const char *s)
+{
+    http_write(w, s, strlen(s));
+}
+
+void http_write_view(http_writer_t *w, http_view_t v)
+{
+    http_write(w, v.ptr, v.len);
+}
+
+/* write_header  -- append "name: value\r\n" */
+static void write_header(http_writer_t *w, const http_header_t *h)
+{
+    http_write_view(w, h->name);
+    http_write(w, ": ", 2);
+    http_write_view(w, h->value);
+    http_write(w, "\r\n", 2);
+}
+
+/* http_request_line  -- start the forwarded request */
+void http_request_line(http_writer_t *w, const http_request_t *req,
+        int keep_alive)
+{
+    http_write_view(w, req->method);
+    http_write(w, " ", 1);
+    http_write_view(w, req->dir);
+    http_write_str(w, keep_alive ? " HTTP/1.1\r\n" : " HTTP/1.0\r\n");
+}
+
+/* http_request_header  -- append one header of the client's request.
+ * If the header is host, we forward it directly.
+ * Otherwise http_request_end fills the host according to the uri.
+ */
+void http_request_header(http_writer_t *w, const http_header_t *h,
+        int *has_host, int *keep_alive)
+{
+    if (http_view_equals(h->name, "Host")) {
+        *has_host = 1;
+        write_header(w, h);
+    } else if (http_view_equals(h->name, "Connection") ||
+            http_view_equals(h->name, "Proxy-Connection")) {
+        /* the connection to the client is not forwarded */
+        if (http_view_equals(h->value, "close")) {
+            *keep_alive = 0;
+        } else if (http_view_equals(h->value, "keep-alive")) {
+            *keep_alive = 1;
+        }
+    } else if (http_view_equals(h->name, "User-Agent") ||
+            http_view_equals(h->name, "Accept") ||
+            http_view_equals(h->name, "Accept-Encoding")) {
+        // we have default values for these headers
+    } else {
+        // for other headers, we forward it directly
+        write_header(w, h);
+    }
+}
+
+/* http_request_end  -- add the default headers and the empty line */
+void http_request_end(http_writer_t *w, int has_host,
+        const char *host, const char *port, int keep_alive)
+{
+    if (!has_host) {
+        /* add host according to uri parsing result */
+        http_write_str(w, "Host: ");
+        http_write_str(w, host);
+        http_write(w, ":", 1);
+        http_write_str(w, port);
+        http_write(w, "\r\n", 2);
+    }
+
+    /* add default value for these headers */
+    http_write_str(w, user_agent_hdr);
+    http_write_str(w, accept_hdr);
+    http_write_str(w, accept_encoding_hdr);
+    if (keep_alive) {
+        http_write_str(w, "Connection: keep-alive\r\n");
+    } else {
+        http_write_str(w, "Connection:close\r\n");
+        http_write_str(w, "Proxy-Connection:close\r\n");
+    }
+    http_write(w, "\r\n", 2);
+}
+
+/* http_framing_init  -- start following a new response */
+void http_framing_init(http_framing_t *f)
+{
+    f->state = FRAMING_STATUS_LINE;
+    f->status = 0;
+    f->keep_alive = 0;
+    f->chunked = 0;
+    f->content_length = -1;
+    f->remaining = 0;
+    f->header_len = 0;
+    f->nbytes = 0;
+    f->line_len = 0;
+}
+
+/* header_value  -- the value of the header line, without the leading
+ * spaces. Return NULL if the line is not the header name
+ */
+static const char *header_value(const char *line, const char *name)
+{
+    size_t name_len = strlen(name);
+    if (strncasecmp(line, name, name_len) != 0 || line[name_len] != ':') {
+        return NULL;
+    }
+    line += name_len + 1;
+    while (*line == ' ' || *line == '\t') {
+        line++;
+    }
+    return line;
+}
+
+/* give_up  -- the response can't be followed, so it ends when the
+ * server closes the connection */
+static void give_up(http_framing_t *f)
+{
+    f->keep_alive = 0;
+    f->state = FRAMING_UNTIL_CLOSE;
+}
+
+/* framing_line  -- handle a complete line of the response */
+static void framing_line(http_framing_t *f)
+{
+    const char *line = f->line, *value;
+    int empty = strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0;
+    char *end;
+    switch (f->state) {
+        case FRAMING_STATUS_LINE:
+            if (strncmp(line, "HTTP/1.", 7) != 0 || strlen(line) < 12) {
+                give_up(f);
+                return;
+            }
+            /* HTTP/1.1 connections are persistent by default */
+            f->keep_alive = line[7] == '1';
+            f->status = atoi(line + 9);
+            f->state = FRAMING_HEADERS;
+            break;
+        case FRAMING_HEADERS:
+            if (!empty) {
+                if ((value = header_value(line, "Content-Length"))) {
+                    f->content_length = strtoll(value, &end, 10);
+                    if (end == value || f->content_length < 0) {
+                        give_up(f);
+                    }
+                } else if ((value = header_value(line,
+                                "Transfer-Encoding"))) {
+                    /* chunked is always the last coding */
+                    size_t len = strcspn(value, "\r\n");
+                    f->chunked = len >= 7 &&
+                        strncasecmp(value + len - 7, "chunked", 7) == 0;
+                } else if ((value = header_value(line, "Connection"))) {
+                    if (strncasecmp(value, "close", 5) == 0) {
+                        f->keep_alive = 0;
+                    } else if (strncasecmp(value, "keep-alive", 10) == 0) {
+                        f->keep_alive = 1;
+                    }
+                }
+                return;
+            }
+            /* the end of the headers */
+            if (f->status >= 100 && f->status < 200) {
+                /* an interim response. GET requests without Expect
+                 * rarely get one, so just relay until close */
+                give_up(f);
+            } else if (f->status == 204 || f->status == 304) {
+                f->state = FRAMING_DONE;
+            } else if (f->chunked) {
+                /* chunked wins over Content-Length */
+                f->state = FRAMING_CHUNK_SIZE;
+            } else if (f->content_length >= 0) {
+                f->remaining = f->content_length;
+                f->state = f->remaining ? FRAMING_LENGTH : FRAMING_DONE;
+            } else {
+                give_up(f);
+            }
+            break;
+        case FRAMING_CHUNK_SIZE:
+            f->remaining = strtoll(line, &end, 16);
+            if (end == line || f->remaining < 0) {
+                give_up(f);
+            } else {
+                f->state = f->remaining ? FRAMING_CHUNK_DATA :
+                    FRAMING_TRAILERS;
+            }
+            break;
+        case FRAMING_CHUNK_END:
+            f->state = FRAMING_CHUNK_SIZE;
+            break;
+        case FRAMING_TRAILERS:
+            if (empty) {
+                f->state = FRAMING_DONE;
+            }
+            break;
+    }
+}
+
+/* http_framing_feed  -- pass the next n bytes of the response */
+size_t http_framing_feed(http_framing_t *f, const char *buf, size_t n)
+{
+    size_t used = 0, take;
+    const char *eol;
+    while (used < n && f->state != FRAMING_DONE) {
+        switch (f->state) {
+            case FRAMING_UNTIL_CLOSE:
+                used = n;
+                break;
+            case FRAMING_LENGTH:
+            case FRAMING_CHUNK_DATA:
+                take = n - used;
+                if ((long long)take > f->remaining) {
+                    take = f->remaining;
+                }
+                used += take;
+                f->remaining -= take;
+                if (f->remaining == 0) {
+                    f->state = f->state == FRAMING_LENGTH ?
+                        FRAMING_DONE : FRAMING_CHUNK_END;
+                }
+                break;
+            default:
+                /* the states that read lines */
+                eol = memchr(buf + used, '\n', n - used);
+                take = eol ? eol - (buf + used) + 1 : n - used;
+                if (f->line_len + take >= sizeof(f->line)) {
+                    give_up(f);
+                    break;
+                }
+                memcpy(f->line + f->line_len, buf + used, take);
+                f->line_len += take;
+                used += take;
+                if (eol) {
+                    int in_headers = f->state == FRAMING_HEADERS;
+                    f->line[f->line_len] = '\0';
+                    f->line_len = 0;
+                    framing_line(f);
+                    if (in_headers && f->state != FRAMING_HEADERS) {
+                        f->header_len = f->nbytes + used;
+                    }
+                }
+        }
+    }
+    f->nbytes += used;
+    return used;
+}
+
+/* http_dechunk_init  -- a chunked body starts with a size line */
+void http_dechunk_init(http_framing_t *f)
+{
+    http_framing_init(f);
+    f->chunked = 1;
+    f->state = FRAMING_CHUNK_SIZE;
+}
+
+/* http_dechunk  -- keep the chunk data of the body. The body is fed to
+ * the framing one line or one chunk at a time, so each piece is either
+ * all data or not data at all
+ */
+size_t http_dechunk(http_framing_t *f, const char *in, size_t n, char *out)
+{
+    size_t off = 0, len = 0, take;
+    const char *eol;
+    while (off < n && f->state != FRAMING_DONE) {
+        int data = f->state == FRAMING_CHUNK_DATA ||
+            f->state == FRAMING_UNTIL_CLOSE;
+        take = n - off;
+        if (f->state == FRAMING_CHUNK_DATA && (long long)take > f->remaining) {
+            take = f->remaining;
+        } else if (!data && (eol = memchr(in + off, '\n', take)) != NULL) {
+            take = eol + 1 - (in + off);
+        }
+        take = http_framing_feed(f, in + off, take);
+        if (data) {
+            memmove(out + len, in + off, take);
+            len += take;
+        }
+        off += take;
+    }
+    return len;
+}
+
+/* http_dechunk_head  -- the head of a chunked response, without chunks */
+size_t http_dechunk_head(char *out, const char *head, size_t head_len,
+        long long content_length)
+{
+    const char *line = head, *end = head + head_len, *eol;
+    char *p = out;
+    while (line < end && (eol = memchr(line, '\n', end - line)) != NULL) {
+        size_t len = eol + 1 - line;
+        if (len <= 2 && line != head) {
+            break;
+        }
+        if (line == head ||
+                (header_value(line, "Transfer-Encoding") == NULL &&
+                 header_value(line, "Content-Length") == NULL)) {
+            memcpy(p, line, len);
+            p += len;
+        }
+        line = eol + 1;
+    }
+    if (content_length >= 0) {
+        p += sprintf(p, "Content-Length: %lld\r\n", content_length);
+    }
+    memcpy(p, "\r\n", 2);
+    return p + 2 - out;
+}
+
+/* http_response_head  -- copy the response head for the client */
+size_t http_response_head(char *out, const char *head, size_t head_len,
+        int keep_alive, int hit)
+{
+    const char *line = head, *end = head + head_len, *eol;
+    char *p = out;
+    while (line < end && (eol = memchr(line, '\n', end - line)) != NULL) {
+        size_t len = eol + 1 - line;
+        if (len <= 2 && line != head) {
+            /* the empty line */
+            break;
+        }
+        if (line == head || (header_value(line, "Connection") == NULL &&
+                    header_value(line, "Proxy-Connection") == NULL &&
+                    header_value(line, "Keep-Alive") == NULL &&
+                    header_value(line, "X-Cache") == NULL)) {
+            memcpy(p, line, len);
+            p += len;
+        }
+        line = eol + 1;
+    }
+    p += sprintf(p, "X-Cache: %s\r\nConnection: %s\r\n\r\n",
+            hit ? "HIT" : "MISS", keep_alive ? "keep-alive" : "close");
+    return p - out;
+}
+
+/* merge_skips  -- headers of a 304 that don't describe the stored
+ * response */
+static int merge_skips(const char *line)
+{
+    return header_value(line, "Content-Length") != NULL ||
+        header_value(line, "Transfer-Encoding") != NULL ||
+        header_value(line, "Connection") != NULL ||
+        header_value(line, "Proxy-Connection") != NULL ||
+        header_value(line, "Keep-Alive") != NULL ||
+        header_value(line, "X-Cache") != NULL;
+}
+
+/* merge_replaces  -- whether the 304 sends a header of the same name as
+ * line that is laid over the stored response */
+static int merge_replaces(const char *update, size_t update_len,
+        const char *line)
+{
+    const char *colon = strchr(line, ':');
+    const char *end = update + update_len, *eol;
+    const char *cur = memchr(update, '\n', update_len);
+    size_t name_len;
+    if (colon == NULL || cur == NULL) {
+        return 0;
+    }
+    name_len = colon - line;
+    for (cur++; cur < end &&
+            (eol = memchr(cur, '\n', end - cur)) != NULL; cur = eol + 1) {
+        if (eol - cur <= 1) {
+            /* the empty line */
+            break;
+        }
+        if (strncasecmp(cur, line, name_len) == 0 && cur[name_len] == ':' &&
+                !merge_skips(cur)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* http_response_merge  -- the stored head updated by a 304 */
+size_t http_response_merge(char *out, const char *head, size_t head_len,
+        const char *update, size_t update_len)
+{
+    const char *line = head, *end = head + head_len, *eol;
+    char line_buf[MAXLINE];
+    char *p = out;
+    while (line < end && (eol = memchr(line, '\n', end - line)) != NULL) {
+        size_t len = eol + 1 - line;
+        if (len <= 2 && line != head) {
+            break;
+        }
+        if (line != head && len < sizeof(line_buf)) {
+            /* merge_replaces needs a string */
+            memcpy(line_buf, line, len);
+            line_buf[len] = '\0';
+        }
+        if (line == head || len >= sizeof(line_buf) ||
+                !merge_replaces(update, update_len, line_buf)) {
+            memcpy(p, line, len);
+            p += len;
+        }
+        line = eol + 1;
+    }
+    line = memchr(update, '\n', update_len);
+    end = update + update_len;
+    for (line = line ? line + 1 : end; line < end &&
+            (eol = memchr(line, '\n', end - line)) != NULL; line = eol + 1) {
+        size_t len = eol + 1 - line;
+        if (len <= 2) {
+            break;
+        }
+        if (!merge_skips(line)) {
+            memcpy(p, line, len);
+            p += len;
+        }
+    }
+    memcpy(p, "\r\n", 2);
+    return p + 2 - out;
+}
+
+
+/* the heuristic freshness of a response with Last-Modified is capped */
+#define HTTP_HEURISTIC_MAX (24 * 60 * 60)
+
+/* http_cache_info_init  -- a response without any caching header */
+void http_cache_info_init(http_cache_info_t *info)
+{
+    info->status = 0;
+    info->no_store = 0;
+    info->no_cache = 0;
+    info->set_cookie = 0;
+    info->vary = 0;
+    info->shared = 0;
+    info->max_age = -1;
+    info->age = 0;
+    info->has_expires = 0;
+    info->expires = -1;
+    info->date = -1;
+    info->last_modified = -1;
+    info->etag[0] = '\0';
+    info->last_modified_str[0] = '\0';
+}
+
+/* parse_http_date  -- an IMF-fixdate like "Sun, 06 Nov 1994 08:49:37 GMT".
+ * Return -1 if the date is invalid
+ */
+static time_t parse_http_date(const char *value)
+{
+    static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May",
+        "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    char wday[4], mon[4];
+    struct tm tm;
+    int i;
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(value, "%3s, %d %3s %d %d:%d:%d GMT", wday, &tm.tm_mday, mon,
+                &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 7) {
+        return -1;
+    }
+    for (i = 0; i < 12 && strcmp(mon, months[i]) != 0; i++) {
+    }
+    if (i == 12) {
+        return -1;
+    }
+    tm.tm_mon = i;
+    tm.tm_year -= 1900;
+    return timegm(&tm);
+}
+
+/* copy_value  -- copy a header value without its line end. Values that
+ * don't fit are dropped */
+static void copy_value(char *dst, const char *value, const char *eol)
+{
+    while (eol > value && (eol[-1] == '\r' || eol[-1] == '\n')) {
+        eol--;
+    }
+    if (eol - value >= HTTP_VALIDATOR_MAX) {
+        dst[0] = '\0';
+        return;
+    }
+    memcpy(dst, value, eol - value);
+    dst[eol - value] = '\0';
+}
+
+/* parse_cache_control  -- the directives of a Cache-Control value */
+static void parse_cache_control(http_cache_info_t *info, const char *value,
+        const char *eol)
+{
+    int has_s_maxage = 0;
+    while (value < eol) {
+        const char *end = memchr(value, ',', eol - value);
+        size_t len;
+        if (end == NULL) {
+            end = eol;
+        }
+        while (value < end && (*value == ' ' || *value == '\t')) {
+            value++;
+        }
+        len = end - value;
+        if (len >= 8 && strncasecmp(value, "no-store", 8) == 0) {
+            info->no_store = 1;
+        } else if (len >= 7 && strncasecmp(value, "private", 7) == 0) {
+            /* a shared cache must not store it */
+            info->no_store = 1;
+        } else if (len >= 8 && strncasecmp(value, "no-cache", 8) == 0) {
+            info->no_cache = 1;
+        } else if ((len >= 6 && strncasecmp(value, "public", 6) == 0) ||
+                (len >= 15 &&
+                 strncasecmp(value, "must-revalidate", 15) == 0)) {
+            info->shared = 1;
+        } else if (len > 9 && strncasecmp(value, "s-maxage=", 9) == 0) {
+            info->max_age = atoll(value + 9);
+            info->shared = 1;
+            has_s_maxage = 1;
+        } else if (len > 8 && strncasecmp(value, "max-age=", 8) == 0 &&
+                !has_s_maxage) {
+            info->max_age = atoll(value + 8);
+        }
+        value = end + 1;
+    }
+}
+
+/* parse_vary  -- the fields of a Vary value. The proxy sends its own
+ * Accept, Accept-Encoding and User-Agent, so those are the same for
+ * every client; any other field, or *, could differ */
+static void parse_vary(http_cache_info_t *info, const char *value,
+        const char *eol)
+{
+    static const char *forced[] = {"Accept", "Accept-Encoding",
+        "User-Agent"};
+    while (value < eol) {
+        const char *end = memchr(value, ',', eol - value);
+        size_t len, i;
+        if (end == NULL) {
+            end = eol;
+        }
+        while (value < end && (*value == ' ' || *value == '\t')) {
+            value++;
+        }
+        len = end - value;
+        while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t' ||
+                    value[len - 1] == '\r' || value[len - 1] == '\n')) {
+            len--;
+        }
+        if (len > 0) {
+            for (i = 0; i < 3; i++) {
+                if (strlen(forced[i]) == len &&
+                        strncasecmp(value, forced[i], len) == 0) {
+                    break;
+                }
+            }
+            if (i == 3) {
+                info->vary = 1;
+            }
+        }
+        value = end + 1;
+    }
+}
+
+/* http_cache_info_parse  -- read the caching headers of the response */
+void http_cache_info_parse(http_cache_info_t *info, const char *head,
+        size_t head_len)
+{
+    const char *line = head, *end = head + head_len, *eol, *value;
+    char line_buf[MAXLINE];
+    if (head_len > 12 && strncmp(head, "HTTP/1.", 7) == 0) {
+        info->status = atoi(head + 9);
+    }
+    while (line < end && (eol = memchr(line, '\n', end - line)) != NULL) {
+        line = eol + 1;
+        if (line >= end || *line == '\r' || *line == '\n') {
+            break;
+        }
+        eol = memchr(line, '\n', end - line);
+        if (eol == NULL || eol - line >= MAXLINE) {
+            continue;
+        }
+        /* header_value needs a string */
+        memcpy(line_buf, line, eol + 1 - line);
+        line_buf[eol + 1 - line] = '\0';
+        eol = line_buf + (eol - line);
+        if ((value = header_value(line_buf, "Cache-Control"))) {
+            parse_cache_control(info, value, eol);
+        } else if ((value = header_value(line_buf, "Pragma"))) {
+            if (strncasecmp(value, "no-cache", 8) == 0) {
+                info->no_cache = 1;
+            }
+        } else if ((value = header_value(line_buf, "Expires"))) {
+            info->has_expires = 1;
+            info->expires = parse_http_date(value);
+        } else if ((value = header_value(line_buf, "Date"))) {
+            info->date = parse_http_date(value);
+        } else if ((value = header_value(line_buf, "Age"))) {
+            info->age = atoll(value);
+        } else if ((value = header_value(line_buf, "Last-Modified"))) {
+            info->last_modified = parse_http_date(value);
+            copy_value(info->last_modified_str, value, eol);
+        } else if ((value = header_value(line_buf, "ETag"))) {
+            copy_value(info->etag, value, eol);
+        } else if (header_value(line_buf, "Set-Cookie")) {
+            info->set_cookie = 1;
+        } else if ((value = header_value(line_buf, "Vary"))) {
+            parse_vary(info, value, eol);
+        }
+    }
+}
+
+/* http_cacheable  -- only final responses that are cacheable by default
+ * and that the server lets a shared cache keep. A cookie would be
+ * handed to every client of the cache, and the cache keeps a single
+ * variant of each url */
+int http_cacheable(const http_cache_info_t *info)
+{
+    switch (info->status) {
+        case 200: case 203: case 300: case 301: case 404: case 410:
+            return !info->no_store && !info->set_cookie && !info->vary;
+        default:
+            return 0;
+    }
+}
+
+/* http_fresh_for  -- seconds left before the response is stale */
+long long http_fresh_for(const http_cache_info_t *info, time_t now,
+        long long default_ttl)
+{
+    time_t date = info->date >= 0 ? info->date : now;
+    long long lifetime, age;
+    if (info->no_cache) {
+        lifetime = 0;
+    } else if (info->max_age >= 0) {
+        lifetime = info->max_age;
+    } else if (info->has_expires) {
+        lifetime = info->expires < 0 ? 0 : info->expires - date;
+    } else if (info->last_modified >= 0) {
+        lifetime = (date - info->last_modified) / 10;
+        if (lifetime > HTTP_HEURISTIC_MAX) {
+            lifetime = HTTP_HEURISTIC_MAX;
+        }
+    } else {
+        lifetime = default_ttl;
+    }
+    /* the age the server says, or how long ago it was sent */
+    age = now - date > info->age ? now - date : info->age;
+    return lifetime - age;
+}
+
+/* http_cache_expires  -- when a response stored now goes stale */
+long long http_cache_expires(const http_cache_info_t *info,
+        long long default_ttl)
+{
+    if (!http_cacheable(info)) {
+        return -1;
+    }
+    long long now = now_ns();
+    long long fresh_for = http_fresh_for(info, time(NULL), default_ttl);
+    if (fresh_for > 0) {
+        return now + fresh_for * 1000000000LL;
+    }
+    /* stale already: keep it only to revalidate it */
+    return info->etag[0] || info->last_modified_str[0] ? now : -1;
+}
+
+/* http_request_conditional  -- ask the server whether the copy is valid */
+int http_request_conditional(http_writer_t *w,
+        const http_cache_info_t *info)
+{
+    if (info->etag[0]) {
+        http_write_str(w, "If-None-Match: ");
+        http_write_str(w, info->etag);
+        http_write(w, "\r\n", 2);
+    }
+    if (info->last_modified_str[0]) {
+        http_write_str(w, "If-Modified-Since: ");
+        http_write_str(w, info->last_modified_str);
+        http_write(w, "\r\n", 2);
+    }
+    return info->etag[0] || info->last_modified_str[0];
+}
@@ -0,0 +1,258 @@
+/*
+ * http.h  -- parsing the request of a client, building the request that
+ * the proxy forwards to the server, and peeking at the response that
+ * comes back
+ */
+
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <stddef.h>
+#include "csapp.h"
+
+/* http_view_t  -- a string that is not NUL terminated. Views point into
+ * the buffer they were parsed from, nothing is copied
+ */
+typedef struct http_view_t {
+    const char *ptr;
+    size_t len;
+} http_view_t;
+
+/* http_view_equals  -- whether the view is s, ignoring case */
+int http_view_equals(http_view_t v, const char *s);
+
+typedef struct http_header_t {
+    http_view_t name;
+    http_view_t value;  /* without the white space around it */
+} http_header_t;
+
+/* most header lines a request may have */
+#define HTTP_MAX_HEADERS 64
+
+/* longest host and port of a request uri */
+#define HTTP_HOST_MAX 256
+#define HTTP_PORT_MAX 16
+
+/* results of http_request_parse */
+enum {
+    HTTP_PARSE_ERROR = -1,  /* malformed, or too many headers */
+    HTTP_PARSE_MORE = 0,  /* the empty line is not there yet */
+    HTTP_PARSE_DONE = 1  /* the whole head is parsed */
+};
+
+/* http_request_t  -- the head of a client request. Lines are parsed as
+ * they complete, so the bytes of the head are looked at once
+ */
+typedef struct http_request_t {
+    int state;  /* the last result of http_request_parse */
+    size_t pos;  /* where the next line starts */
+    size_t scanned;  /* how far the next line was searched for its end */
+    http_view_t method;
+    http_view_t uri;
+    http_view_t version;
+    http_view_t host;  /* parts of the uri: [http://]host[:port][dir] */
+    http_view_t port;  /* "80" if absent */
+    http_view_t dir;  /* "/" if absent */
+    int nheaders;
+    http_header_t headers[HTTP_MAX_HEADERS];
+} http_request_t;
+
+void http_request_init(http_request_t *req);
+
+/* http_request_parse  -- parse the request head in the first len bytes
+ * of buf. Between calls buf may only grow at the end and must not
+ * move, as the views point into it; each call goes on from where the
+ * last one stopped. Once it is done, pos is the length of the head
+ */
+int http_request_parse(http_request_t *req, const char *buf, size_t len);
+
+/* http_request_target  -- copy the host of the uri, lower cased, and its
+ * port to host and port, which hold HTTP_HOST_MAX and HTTP_PORT_MAX
+ * bytes, and the cache key "host:port/dir" to key, which holds
+ * key_size. Return -1 if one of them doesn't fit
+ */
+int http_request_target(const http_request_t *req, char *host, char *port,
+        char *key, size_t key_size);
+
+/* http_request_has  -- whether the request has a header called name */
+int http_request_has(const http_request_t *req, const char *name);
+
+/* http_writer_t  -- appends to a fixed buffer, kept NUL terminated.
+ * What doesn't fit is dropped and sets overflow, so a request that is
+ * too large is noticed once at the end rather than at every append
+ */
+typedef struct http_writer_t {
+    char *buf;
+    size_t len;
+    size_t cap;  /* size of buf, with the NUL */
+    int overflow;
+} http_writer_t;
+
+void http_writer_init(http_writer_t *w, char *buf, size_t cap);
+void http_write(http_writer_t *w, const char *s, size_t n);
+void http_write_str(http_writer_t *w, const char *s);
+void http_write_view(http_writer_t *w, http_view_t v);
+
+/* http_request_line  -- start the forwarded request. Requests are
+ * forwarded as HTTP/1.0, or as HTTP/1.1 when keep_alive is set so that
+ * the server keeps the connection open for the next request
+ */
+void http_request_line(http_writer_t *w, const http_request_t *req,
+        int keep_alive);
+
+/* http_request_header  -- append one header of the client's request to
+ * the forwarded request. A Connection or Proxy-Connection header of the
+ * client sets *keep_alive, which the caller starts from the request
+ * version
+ */
+void http_request_header(http_writer_t *w, const http_header_t *h,
+        int *has_host, int *keep_alive);
+
+/* http_request_end  -- add the default headers and the empty line.
+ * keep_alive must match the one given to http_request_line
+ */
+void http_request_end(http_writer_t *w, int has_host,
+        const char *host, const char *port, int keep_alive);
+
+/* states of http_framing_t */
+enum {
+    FRAMING_STATUS_LINE,  /* reading the status line */
+    FRAMING_HEADERS,  /* reading the header lines */
+    FRAMING_LENGTH,  /* body with a Content-Length */
+    FRAMING_CHUNK_SIZE,  /* chunked body: the size line of a chunk */
+    FRAMING_CHUNK_DATA,  /* chunked body: the data of a chunk */
+    FRAMING_CHUNK_END,  /* chunked body: the CRLF after the data */
+    FRAMING_TRAILERS,  /* chunked body: trailers after the last chunk */
+    FRAMING_UNTIL_CLOSE,  /* body ends when the server closes */
+    FRAMING_DONE  /* the response is complete */
+};
+
+/* http_framing_t  -- follows the bytes of a response as they go by to
+ * find out where it ends, so the server connection can be reused
+ */
+typedef struct http_framing_t {
+    int state;
+    int status;  /* status code */
+    int keep_alive;  /* the server keeps the connection after the response */
+    int chunked;  /* Transfer-Encoding: chunked */
+    long long content_length;  /* -1 if there is no Content-Length */
+    long long remaining;  /* bytes left of the body or of the chunk */
+    size_t header_len;  /* length of the status line and headers, with the
+                           empty line. Set once the headers are read */
+    size_t nbytes;  /* bytes fed so far */
+    char line[MAXLINE];  /* the line being read */
+    size_t line_len;
+} http_framing_t;
+
+void http_framing_init(http_framing_t *f);
+
+/* http_framing_feed  -- pass the next n bytes of the response.
+ * Return how many of them belong to the response; fewer than n only
+ * when the response ends inside buf
+ */
+size_t http_framing_feed(http_framing_t *f, const char *buf, size_t n);
+
+/* http_dechunk_init  -- follow a chunked body from its first size line,
+ * to decode it with http_dechunk
+ */
+void http_dechunk_init(http_framing_t *f);
+
+/* http_dechunk  -- pass the next n bytes of a chunked body and copy the
+ * data of its chunks to out, which may be in. Size lines and trailers
+ * are dropped. A body that can't be followed is copied as it is.
+ * Return the number of bytes copied
+ */
+size_t http_dechunk(http_framing_t *f, const char *in, size_t n, char *out);
+
+/* http_dechunk_head  -- copy the head of a chunked response (head_len
+ * bytes with the empty line) to out without its Transfer-Encoding and
+ * Content-Length, for a client that can't read chunks. If
+ * content_length is not negative, it becomes the Content-Length of the
+ * copy. out must hold head_len + HTTP_RESPONSE_HEAD_EXTRA bytes. Return
+ * the length of the copy
+ */
+size_t http_dechunk_head(char *out, const char *head, size_t head_len,
+        long long content_length);
+
+/* http_response_head  -- copy the status line and headers of a response
+ * (head_len bytes with the empty line) to out, replacing the
+ * connection headers of the server with one telling the client whether
+ * the proxy keeps the connection, and adding X-Cache: HIT if the
+ * response comes from the cache, MISS if from the server. out must hold
+ * head_len + HTTP_RESPONSE_HEAD_EXTRA bytes. Return the length of the
+ * copy
+ */
+#define HTTP_RESPONSE_HEAD_EXTRA 64
+size_t http_response_head(char *out, const char *head, size_t head_len,
+        int keep_alive, int hit);
+
+/* http_response_merge  -- lay the headers of a 304 (update_len bytes)
+ * over the head of the stored response (head_len bytes with the empty
+ * line) and copy the result to out. A stored header that the 304 sends
+ * as well is replaced by it. The framing and connection headers of the
+ * 304 are left out. out must hold head_len + update_len bytes. Return
+ * the length of the new head
+ */
+size_t http_response_merge(char *out, const char *head, size_t head_len,
+        const char *update, size_t update_len);
+
+/* longest validator kept for revalidation */
+#define HTTP_VALIDATOR_MAX 256
+
+/* http_cache_info_t  -- what the headers of a response say about
+ * caching it. Times are seconds since the epoch, -1 if absent
+ */
+typedef struct http_cache_info_t {
+    int status;  /* status code */
+    int no_store;  /* Cache-Control: no-store or private */
+    int no_cache;  /* Cache-Control: no-cache, revalidate before any use */
+    int set_cookie;  /* Set-Cookie, the response is for one client */
+    int vary;  /* Vary names a header the proxy doesn't set itself */
+    int shared;  /* public, s-maxage or must-revalidate: it may be stored
+                    for a request with Authorization */
+    long long max_age;  /* s-maxage, or max-age. -1 if absent */
+    long long age;  /* Age. 0 if absent */
+    int has_expires;
+    time_t expires;  /* an invalid Expires is in the past */
+    time_t date;
+    time_t last_modified;
+    char etag[HTTP_VALIDATOR_MAX];  /* "" if absent */
+    char last_modified_str[HTTP_VALIDATOR_MAX];  /* "" if absent */
+} http_cache_info_t;
+
+void http_cache_info_init(http_cache_info_t *info);
+
+/* http_cache_info_parse  -- read the caching headers of the response
+ * head. Only the headers present change info, so the headers of a 304
+ * can be laid over those of the stored response
+ */
+void http_cache_info_parse(http_cache_info_t *info, const char *head,
+        size_t head_len);
+
+/* http_cacheable  -- whether the response may be stored at all. Those
+ * to requests with Authorization need info->shared as well */
+int http_cacheable(const http_cache_info_t *info);
+
+/* http_fresh_for  -- how many more seconds the response is fresh at now,
+ * 0 or less when it is stale. Without explicit freshness, a tenth of
+ * the time since Last-Modified is used, or default_ttl if there is no
+ * Last-Modified either
+ */
+long long http_fresh_for(const http_cache_info_t *info, time_t now,
+        long long default_ttl);
+
+/* http_cache_expires  -- when a response stored now goes stale, as a
+ * now_ns time. -1 if it must not be stored, or if it is stale already
+ * and can't be revalidated
+ */
+long long http_cache_expires(const http_cache_info_t *info,
+        long long default_ttl);
+
+/* http_request_conditional  -- append If-None-Match and
+ * If-Modified-Since headers for the validators in info to the request,
+ * before http_request_end. Return 0 if there is no validator
+ */
+int http_request_conditional(http_writer_t *w,
+        const http_cache_info_t *info);
+
+#endif
@@ -0,0 +1,161 @@
+/*
+ * inflight.c  -- single flight of concurrent cache misses
+ *
+ * When several clients miss on the same url at the same time, only the
+ * first one fetches it. The others join its flight and copy the response
+ * out of it as the leader publishes it, so they get the bytes as soon as
+ * the leader does, over one server connection.
+ *
+ * A flight is listed in the table until the leader closes or ends it. It
+ * stays alive until the table, the leader and every follower released
+ * it, so a slow follower can finish reading after the leader is gone.
+ */
+
+#include "inflight.h"
+#include "cache.h"
+
+/* return the bucket of the hash value */
+#define bucket_of(table, h) ((table)->buckets[(h) & ((table)->nbuckets-1)])
+
+/* inflight_init  -- nbuckets must be a power of 2 */
+void inflight_init(inflight_table_t *table, size_t nbuckets)
+{
+    pthread_mutex_init(&table->lock, NULL);
+    table->nbuckets = nbuckets;
+    table->buckets = (inflight_t **)Calloc(nbuckets, sizeof(inflight_t *));
+    table->leaders = 0;
+    table->followers = 0;
+}
+
+/* inflight_free  -- no flight may be in progress */
+void inflight_free(inflight_table_t *table)
+{
+    free(table->buckets);
+    pthread_mutex_destroy(&table->lock);
+}
+
+/* create_flight */
+static inflight_t *create_flight(const char *key, unsigned int hash)
+{
+    inflight_t *f = (inflight_t *)Malloc(sizeof(inflight_t));
+    f->key = strdup(key);
+    f->hash = hash;
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->cond, NULL);
+    bytes_malloc(&f->data);
+    f->state = INFLIGHT_RUNNING;
+    f->refcnt = 2;  /* the table and the leader */
+    f->listed = 1;
+    f->hnext = NULL;
+    return f;
+}
+
+/* inflight_join  -- join the flight of key, or start one */
+inflight_t *inflight_join(inflight_table_t *table, const char *key,
+        int *leader)
+{
+    unsigned int h = lru_cache_hash(key);
+    inflight_t *f;
+    pthread_mutex_lock(&table->lock);
+    for (f = bucket_of(table, h); f != NULL; f = f->hnext) {
+        if (f->hash == h && strcasecmp(f->key, key) == 0) {
+            break;
+        }
+    }
+    if (f) {
+        __sync_add_and_fetch(&f->refcnt, 1);
+        table->followers++;
+        *leader = 0;
+    } else {
+        f = create_flight(key, h);
+        f->hnext = bucket_of(table, h);
+        bucket_of(table, h) = f;
+        table->leaders++;
+        *leader = 1;
+    }
+    pthread_mutex_unlock(&table->lock);
+    return f;
+}
+
+/* inflight_release  -- drop a reference. The last one frees the flight */
+void inflight_release(inflight_t *f)
+{
+    if (__sync_sub_and_fetch(&f->refcnt, 1) == 0) {
+        bytes_free(&f->data);
+        pthread_cond_destroy(&f->cond);
+        pthread_mutex_destroy(&f->lock);
+        free(f->key);
+        free(f);
+    }
+}
+
+/* inflight_followers  -- the references beyond the table and the leader */
+int inflight_followers(inflight_t *f)
+{
+    pthread_mutex_lock(&f->lock);
+    int n = f->refcnt - 1 - f->listed;
+    pthread_mutex_unlock(&f->lock);
+    return n;
+}
+
+/* inflight_append  -- publish the next n bytes */
+size_t inflight_append(inflight_t *f, const char *buf, size_t n)
+{
+    pthread_mutex_lock(&f->lock);
+    bytes_appendn(&f->data, buf, n);
+    size_t len = bytes_length(f->data);
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+    return len;
+}
+
+/* inflight_close  -- take the flight out of the table */
+void inflight_close(inflight_table_t *table, inflight_t *f)
+{
+    inflight_t **pp;
+    pthread_mutex_lock(&table->lock);
+    if (!f->listed) {
+        pthread_mutex_unlock(&table->lock);
+        return;
+    }
+    for (pp = &bucket_of(table, f->hash); *pp != f; pp = &(*pp)->hnext) {
+    }
+    *pp = f->hnext;
+    pthread_mutex_lock(&f->lock);
+    f->listed = 0;
+    pthread_mutex_unlock(&f->lock);
+    pthread_mutex_unlock(&table->lock);
+    inflight_release(f);  /* the table's reference */
+}
+
+/* inflight_end  -- wake up the followers for the last time */
+void inflight_end(inflight_table_t *table, inflight_t *f, int ok)
+{
+    inflight_close(table, f);
+    pthread_mutex_lock(&f->lock);
+    if (f->state == INFLIGHT_RUNNING) {
+        f->state = ok ? INFLIGHT_DONE : INFLIGHT_FAILED;
+        pthread_cond_broadcast(&f->cond);
+    }
+    pthread_mutex_unlock(&f->lock);
+}
+
+/* inflight_read  -- copy the response from offset on */
+ssize_t inflight_read(inflight_t *f, size_t offset, char *buf, size_t n)
+{
+    ssize_t rc;
+    pthread_mutex_lock(&f->lock);
+    while (f->state == INFLIGHT_RUNNING &&
+            bytes_length(f->data) <= offset) {
+        pthread_cond_wait(&f->cond, &f->lock);
+    }
+    if (f->state == INFLIGHT_FAILED) {
+        rc = -1;
+    } else {
+        size_t avail = bytes_length(f->data) - offset;
+        rc = avail < n ? avail : n;
+        memcpy(buf, bytes_buf(f->data) + offset, rc);
+    }
+    pthread_mutex_unlock(&f->lock);
+    return rc;
+}
@@ -0,0 +1,80 @@
+/*
+ * inflight.h  -- single flight of concurrent cache misses
+ */
+
+#ifndef __INFLIGHT_H__
+#define __INFLIGHT_H__
+
+#include "csapp.h"
+#include "bytes.h"
+
+/* states of a flight */
+#define INFLIGHT_RUNNING 0  /* the leader is still fetching */
+#define INFLIGHT_DONE 1  /* all the response has been published */
+#define INFLIGHT_FAILED 2  /* the leader gave up, see inflight_read */
+
+/* one response being fetched by a leader, and read by its followers
+ * while it arrives
+ */
+typedef struct inflight_t {
+    char *key;
+    unsigned int hash;
+    pthread_mutex_t lock;  /* protects everything below */
+    pthread_cond_t cond;  /* signaled when bytes arrive or the state
+                             changes */
+    Bytes data;  /* the response so far */
+    int state;
+    int refcnt;  /* the table, the leader and every follower */
+    int listed;  /* whether new requests can still join */
+    struct inflight_t *hnext;  /* next flight in the same hash bucket */
+} inflight_t;
+
+/* the flights in progress, by key */
+typedef struct inflight_table_t {
+    pthread_mutex_t lock;  /* protects the buckets and the counters */
+    inflight_t **buckets;
+    size_t nbuckets;  /* a power of 2 */
+
+    /* statistics */
+    long long leaders;  /* fetches started */
+    long long followers;  /* requests that joined a fetch instead */
+} inflight_table_t;
+
+void inflight_init(inflight_table_t *table, size_t nbuckets);
+void inflight_free(inflight_table_t *table);
+
+/* inflight_join  -- join the flight of key, or start one. *leader tells
+ * which. Either way the caller holds a reference to the flight and
+ * gives it back with inflight_release.
+ */
+inflight_t *inflight_join(inflight_table_t *table, const char *key,
+        int *leader);
+
+/* inflight_release  -- drop a reference to the flight */
+void inflight_release(inflight_t *f);
+
+/* inflight_followers  -- number of requests reading the flight */
+int inflight_followers(inflight_t *f);
+
+/* inflight_append  -- publish the next n bytes of the response. Return
+ * the length published so far
+ */
+size_t inflight_append(inflight_t *f, const char *buf, size_t n);
+
+/* inflight_close  -- let later requests start their own flight. The
+ * ones that joined keep reading this one
+ */
+void inflight_close(inflight_table_t *table, inflight_t *f);
+
+/* inflight_end  -- end the flight. Closes it if it was not closed
+ * already. Ending a flight that has ended does nothing.
+ */
+void inflight_end(inflight_table_t *table, inflight_t *f, int ok);
+
+/* inflight_read  -- wait until the response goes beyond offset, and copy
+ * at most n bytes from there into buf. Return the number of bytes, 0 at
+ * the end of a complete response, or -1 if the leader gave up.
+ */
+ssize_t inflight_read(inflight_t *f, size_t offset, char *buf, size_t n);
+
+#endif
@@ -0,0 +1,413 @@
+/*
+ * loadgen.c  -- a simple http load generator
+ *
+ * Each of the concurrent clients repeatedly opens a connection, sends
+ * a GET request and reads the response until the server closes the
+ * connection. With -p, the requests go through the proxy. With -i, that
+ * many extra connections are opened first and kept idle for the whole
+ * run, to measure how the server copes with many open sockets. With -u,
+ * every request gets a unique query string, so a caching proxy always
+ * misses.
+ *
+ * With -o, every request is a page load instead: that many objects, the
+ * url with a query string for each. They are fetched one connection
+ * each, or over one persistent connection with -k, pipelined with -P.
+ * The latency is then the time to load the whole page.
+ *
+ * With -z, every request is for one of that many urls (the url with a
+ * query string for each), picked with Zipf popularity of exponent -s:
+ * the k-th most popular url is asked for in proportion to 1/k^s.
+ *
+ * Latencies go into a histogram per client (hist.c), merged at the end
+ * for the percentiles. Through the proxy, the X-Cache header of the
+ * responses gives the hit ratio.
+ */
+#include "csapp.h"
+#include "util.h"
+#include "http.h"
+#include "hist.h"
+
+#include <stdio.h>
+#include <math.h>
+
+/* usage */
+void usage()
+{
+    printf("Usage: loadgen [-c concurrency] [-n requests] [-i idle] "
+            "[-p proxy_host:proxy_port] [-u] [-o objects [-k] [-P]] "
+            "[-z urls [-s skew]] url\n");
+    exit(-1);
+}
+
+/* load generator settings */
+static int concurrency = 1;
+static long total_requests = 1000;
+static int idle_connections = 0;
+static int unique = 0;
+static int page_objects = 0;  /* objects per page, 0 for single requests */
+static int keep_alive = 0;  /* fetch a page over one connection */
+static int pipeline = 0;  /* send all the requests of a page at once */
+static int zipf_urls = 0;  /* urls to pick from, 0 for the url alone */
+static double zipf_skew = 1.0;
+static double *zipf_cdf;  /* chance that one of the first k+1 is picked */
+static char host[MAXLINE], port[MAXLINE], dir[MAXLINE];
+static char target[4*MAXLINE];  /* the uri in the request line */
+static char *connect_host, *connect_port;  /* proxy or origin */
+
+/* shared counters. Updated atomically */
+static long issued;
+static long completed;
+static long failed;
+static long long bytes_read;
+
+/* what a client thread measures */
+typedef struct client_t {
+    hist_t latency;  /* of the completed requests, in ns */
+    long hits;  /* responses with X-Cache: HIT */
+    long misses;  /* and with X-Cache: MISS */
+    unsigned long long rand;  /* state of the url picks */
+} client_t;
+
+/* zipf_init  -- the distribution of the url picks */
+static void zipf_init()
+{
+    double sum = 0;
+    int k;
+    zipf_cdf = Malloc(zipf_urls * sizeof(double));
+    for (k = 0; k < zipf_urls; k++) {
+        sum += 1.0 / pow(k + 1, zipf_skew);
+        zipf_cdf[k] = sum;
+    }
+    for (k = 0; k < zipf_urls; k++) {
+        zipf_cdf[k] /= sum;
+    }
+}
+
+/* zipf_pick  -- the rank of a url, 0 the most popular */
+static int zipf_pick(client_t *c)
+{
+    int lo = 0, hi = zipf_urls - 1;
+    /* xorshift64*, uniform in [0, 1) */
+    c->rand ^= c->rand >> 12;
+    c->rand ^= c->rand << 25;
+    c->rand ^= c->rand >> 27;
+    double u = ((c->rand * 2685821657736338717ULL) >> 11) * (1.0 / (1ULL << 53));
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] > u) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+/* count_cache  -- count the X-Cache header in the head of a response */
+static void count_cache(client_t *c, const char *head)
+{
+    const char *line = head;
+    while ((line = strstr(line, "\r\n")) != NULL && line[2] != '\r') {
+        line += 2;
+        if (strncasecmp(line, "X-Cache:", 8) == 0) {
+            line += 8;
+            line += strspn(line, " \t");
+            if (strncasecmp(line, "HIT", 3) == 0) {
+                c->hits++;
+            } else {
+                c->misses++;
+            }
+            return;
+        }
+    }
+}
+
+/* head_t  -- the head of a response, kept as it arrives */
+typedef struct head_t {
+    char buf[MAXBUF];
+    size_t len;
+    int done;
+} head_t;
+
+/* head_append  -- keep the first bytes of a response until its head is
+ * in, then count its X-Cache. Return whether the head is complete
+ */
+static int head_append(client_t *c, head_t *h, const char *buf, size_t n)
+{
+    if (h->done) {
+        return 1;
+    }
+    if (n > sizeof(h->buf) - 1 - h->len) {
+        n = sizeof(h->buf) - 1 - h->len;
+    }
+    memcpy(h->buf + h->len, buf, n);
+    h->len += n;
+    h->buf[h->len] = '\0';
+    if (strstr(h->buf, "\r\n\r\n") || h->len == sizeof(h->buf) - 1) {
+        count_cache(c, h->buf);
+        h->done = 1;
+    }
+    return h->done;
+}
+
+/* make_request  -- the request for object obj of request number seq.
+ * obj is -1 for single requests
+ */
+static void make_request(char *request, size_t size, long seq, int obj)
+{
+    char query[64] = "";
+    if (zipf_urls) {
+        snprintf(query, sizeof(query), "?z%d", obj);
+    } else if (unique && obj >= 0) {
+        snprintf(query, sizeof(query), "?%ld-%d", seq, obj);
+    } else if (unique) {
+        snprintf(query, sizeof(query), "?%ld", seq);
+    } else if (obj >= 0) {
+        snprintf(query, sizeof(query), "?o%d", obj);
+    }
+    snprintf(request, size, "GET %s%s %s\r\nHost: %s:%s\r\n\r\n",
+            target, query, keep_alive ? "HTTP/1.1" : "HTTP/1.0",
+            host, port);
+}
+
+/* fetch  -- send the request on a new connection and read the response
+ * until the server closes it. Return the number of bytes read, or -1
+ */
+static long fetch(client_t *c, const char *request)
+{
+    char buf[MAXBUF];
+    head_t head;
+    long nread = 0;
+    ssize_t n;
+    int fd = open_clientfd(connect_host, connect_port);
+    if (fd < 0) {
+        return -1;
+    }
+    if (rio_writen(fd, (char *)request, strlen(request)) < 0) {
+        close(fd);
+        return -1;
+    }
+    head.len = head.done = 0;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        head_append(c, &head, buf, n);
+        nread += n;
+    }
+    close(fd);
+    return (n < 0 || nread == 0) ? -1 : nread;
+}
+
+/* read_responses  -- read count responses from a persistent connection.
+ * Return the number of bytes read, or -1
+ */
+static long read_responses(client_t *c, int fd, int count)
+{
+    char buf[MAXBUF];
+    head_t head;
+    size_t off = 0, len = 0, used;
+    long nread = 0;
+    ssize_t n;
+    http_framing_t framing;
+    while (count-- > 0) {
+        http_framing_init(&framing);
+        head.len = head.done = 0;
+        while (framing.state != FRAMING_DONE) {
+            if (off == len) {
+                if ((n = read(fd, buf, sizeof(buf))) <= 0) {
+                    /* only the last response may end at close */
+                    return n == 0 && count == 0 &&
+                        framing.state == FRAMING_UNTIL_CLOSE ? nread : -1;
+                }
+                off = 0;
+                len = n;
+                nread += n;
+            }
+            used = http_framing_feed(&framing, buf + off, len - off);
+            head_append(c, &head, buf + off, used);
+            off += used;
+        }
+    }
+    return nread;
+}
+
+/* do_request  -- do request number seq: fetch the url, or load a page.
+ * Return the number of bytes read, or -1 on error
+ */
+static long do_request(client_t *c, long seq)
+{
+    char request[7*MAXLINE];
+    long nread = 0, n;
+    int i, fd;
+    if (page_objects == 0) {
+        make_request(request, sizeof(request), seq,
+                zipf_urls ? zipf_pick(c) : -1);
+        return fetch(c, request);
+    }
+    if (!keep_alive) {
+        for (i = 0; i < page_objects; i++) {
+            make_request(request, sizeof(request), seq, i);
+            if ((n = fetch(c, request)) < 0) {
+                return -1;
+            }
+            nread += n;
+        }
+        return nread;
+    }
+
+    if ((fd = open_clientfd(connect_host, connect_port)) < 0) {
+        return -1;
+    }
+    for (i = 0; i < page_objects; i++) {
+        make_request(request, sizeof(request), seq, i);
+        if (rio_writen(fd, request, strlen(request)) < 0) {
+            close(fd);
+            return -1;
+        }
+        /* without pipelining, wait for each response */
+        if (!pipeline) {
+            if ((n = read_responses(c, fd, 1)) < 0) {
+                close(fd);
+                return -1;
+            }
+            nread += n;
+        }
+    }
+    if (pipeline) {
+        nread = read_responses(c, fd, page_objects);
+    }
+    close(fd);
+    return nread;
+}
+
+/* client  -- issue requests until total_requests have been issued */
+void *client(void *vargp)
+{
+    client_t *c = (client_t *)vargp;
+    long seq;
+    while ((seq = __sync_fetch_and_add(&issued, 1)) < total_requests) {
+        long long start = now_ns();
+        long n = do_request(c, seq);
+        if (n < 0) {
+            __sync_fetch_and_add(&failed, 1);
+        } else {
+            __sync_fetch_and_add(&completed, 1);
+            __sync_fetch_and_add(&bytes_read, n);
+            hist_record(&c->latency, now_ns() - start);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    char proxy[MAXLINE] = "";
+    int opt, i;
+    while ((opt = getopt(argc, argv, "c:n:i:p:uo:kPz:s:")) != -1) {
+        switch (opt) {
+            case 'c': concurrency = atoi(optarg); break;
+            case 'i': idle_connections = atoi(optarg); break;
+            case 'n': total_requests = atol(optarg); break;
+            case 'p': strcpy(proxy, optarg); break;
+            case 'u': unique = 1; break;
+            case 'o': page_objects = atoi(optarg); break;
+            case 'k': keep_alive = 1; break;
+            case 'P': keep_alive = pipeline = 1; break;
+            case 'z': zipf_urls = atoi(optarg); break;
+            case 's': zipf_skew = atof(optarg); break;
+            default: usage();
+        }
+    }
+    if (optind != argc - 1 || concurrency <= 0 || page_objects < 0 ||
+            (keep_alive && page_objects == 0) || zipf_urls < 0 ||
+            (zipf_urls && (unique || page_objects)) || zipf_skew < 0) {
+        usage();
+    }
+    if (zipf_urls) {
+        zipf_init();
+    }
+    parse_uri(argv[optind], host, port, dir);
+    if (dir[0] == '\0') {
+        strcpy(dir, "/");
+    }
+
+    if (proxy[0] != '\0') {
+        /* through the proxy, the request line carries the full uri */
+        char *colon = strchr(proxy, ':');
+        if (colon == NULL) {
+            usage();
+        }
+        *colon = '\0';
+        connect_host = proxy;
+        connect_port = colon + 1;
+        snprintf(target, sizeof(target), "http://%s:%s%s", host, port, dir);
+    } else {
+        connect_host = host;
+        connect_port = port;
+        strcpy(target, dir);
+    }
+
+    Signal(SIGPIPE, SIG_IGN);
+    int *idlefds = Malloc((idle_connections + 1) * sizeof(int));
+    for (i = 0; i < idle_connections; i++) {
+        if ((idlefds[i] = open_clientfd(connect_host, connect_port)) < 0) {
+            unix_error("open idle connection failed");
+        }
+    }
+    pthread_t *tids = Malloc(concurrency * sizeof(pthread_t));
+    client_t *clients = Malloc(concurrency * sizeof(client_t));
+    for (i = 0; i < concurrency; i++) {
+        hist_init(&clients[i].latency);
+        clients[i].hits = clients[i].misses = 0;
+        clients[i].rand = 15213 + i;  /* the same picks every run */
+    }
+    long long start = now_ns();
+    for (i = 0; i < concurrency; i++) {
+        Pthread_create(&tids[i], NULL, client, &clients[i]);
+    }
+    for (i = 0; i < concurrency; i++) {
+        Pthread_join(tids[i], NULL);
+    }
+    double secs = (now_ns() - start) / 1e9;
+    free(tids);
+
+    static hist_t latency;
+    long hits = 0, misses = 0;
+    hist_init(&latency);
+    for (i = 0; i < concurrency; i++) {
+        hist_merge(&latency, &clients[i].latency);
+        hits += clients[i].hits;
+        misses += clients[i].misses;
+    }
+    free(clients);
+    free(zipf_cdf);
+    for (i = 0; i < idle_connections; i++) {
+        close(idlefds[i]);
+    }
+    free(idlefds);
+
+    printf("concurrency: %d (+%d idle)\n", concurrency, idle_connections);
+    printf("%s    %ld completed, %ld failed\n",
+            page_objects ? "pages:   " : "requests:", completed, failed);
+    printf("elapsed:     %.3f s\n", secs);
+    printf("throughput:  %.1f %s/s, %.1f MB/s\n",
+            completed / secs, page_objects ? "pages" : "requests", bytes_read / secs / (1 << 20));
+    if (page_objects) {
+        printf("objects:     %d per page, %s\n", page_objects,
+                pipeline ? "pipelined" :
+                keep_alive ? "one connection" : "one connection each");
+    }
+    if (zipf_urls) {
+        printf("urls:        %d, zipf skew %.2f\n", zipf_urls, zipf_skew);
+    }
+    printf("latency:     %.1f us mean\n", hist_mean(&latency) / 1e3);
+    printf("percentiles: %.1f us p50, %.1f us p99, %.1f us p99.9, "
+            "%.1f us max\n", hist_percentile(&latency, 50) / 1e3,
+            hist_percentile(&latency, 99) / 1e3,
+            hist_percentile(&latency, 99.9) / 1e3, latency.max / 1e3);
+    if (hits + misses > 0) {
+        printf("cache:       %.1f%% hits (%ld hits, %ld misses)\n",
+                100.0 * hits / (hits + misses), hits, misses);
+    } else if (proxy[0] != '\0') {
+        printf("cache:       no X-Cache header in the responses\n");
+    }
+    return 0;
+}
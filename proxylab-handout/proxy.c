@@ -5,10 +5,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <stdint.h>
 #include "csapp.h"
 #include "util.h"
 #include "bytes.h"
 #include "cache.h"
+#include "sbuf.h"
+#include "http.h"
+#include "event.h"
+#include "relay.h"
+#include "connpool.h"
+#include "dnscache.h"
+#include "inflight.h"
+#include "diskcache.h"
+#include "stats.h"
+
+#include <getopt.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 
 // #define DEBUG
 #undef DEBUG
@@ -17,224 +31,969 @@
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 
-/* global lru cache */
-lru_cache_t lru_cache;
+/* Seconds a response without freshness headers or Last-Modified stays
+ * fresh in the cache */
+#define DEFAULT_TTL 60
+
+/* Number of cache shards. Every shard gets MAX_CACHE_SIZE/CACHE_SHARDS
+ * bytes, which must stay above MAX_OBJECT_SIZE */
+#define CACHE_SHARDS 8
+
+/* global cache. Each shard has its own lock */
+shard_cache_t cache;
+
+/* Default number of worker threads and connection queue depth */
+#define DEFAULT_NTHREADS 16
+#define DEFAULT_QUEUE_DEPTH 64
+
+/* Seconds a persistent client connection may stay idle */
+#define CLIENT_IDLE_TIMEOUT 5
+/* Milliseconds it may stay idle while other connections wait for a
+ * worker, and how often that is checked */
+#define CLIENT_IDLE_BUSY_MS 100
+#define CLIENT_IDLE_POLL_MS 20
+
+/* Default number of event loops in event mode */
+#define DEFAULT_NLOOPS 2
+
+/* accepted connections waiting for a worker thread */
+sbuf_t sbuf;
+
+/* Limits of the idle server connections kept for reuse */
+#define POOL_MAX_IDLE 64
+#define POOL_MAX_IDLE_PER_HOST 8
+#define POOL_IDLE_TIMEOUT_NS (15 * 1000000000LL)
+
+/* idle keep-alive connections to the servers */
+connpool_t pool;
+
+/* Host name lookups are kept for DNS_TTL, failed ones for
+ * DNS_NEGATIVE_TTL */
+#define DEFAULT_DNS_ENTRIES 1024
+#define DNS_TTL_NS (60 * 1000000000LL)
+#define DNS_NEGATIVE_TTL_NS (5 * 1000000000LL)
+
+/* cache of host name lookups */
+dnscache_t dns;
+
+/* the optional second tier of the cache. Objects evicted from memory go
+ * there, and come back on a hit. The rest follow on SIGTERM or SIGINT */
+#define DEFAULT_DISK_MB 64
+diskcache_t disk;
+int disk_enabled = 0;
+
+/* concurrent misses on the same url, see inflight.c. Responses too
+ * large to cache are still published to the requests that joined, up
+ * to MAX_FLIGHT_SIZE. Those a shared cache must not store are not */
+#define FLIGHT_BUCKETS 256
+#define MAX_FLIGHT_SIZE (8 * 1024 * 1024)
+inflight_table_t flights;
 
-/* mutex to protect the lru cache update operations */
-sem_t mutex;
+/* results of forward_response */
+#define RESPONSE_DONE 0  /* complete, the server connection can be reused */
+#define RESPONSE_CLOSE 1  /* complete or failed, close the server connection */
+#define RESPONSE_EMPTY 2  /* the server closed before sending anything */
 
+/* results of follow_flight */
+#define FLIGHT_WRITTEN 0  /* the whole response was written */
+#define FLIGHT_FAILED 1  /* the response broke off */
+#define FLIGHT_MISSED 2  /* the leader gave up before anything arrived */
 
-/* You won't lose style points for including these long lines in your code */
-static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
-static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
-static const char *accept_encoding_hdr = "Accept-Encoding: gzip, deflate\r\n";
+/* the url a client asks the proxy itself for its statistics */
+#define STATS_URI "/__proxy/stats"
 
 
 /* usage */
 void usage()
 {
-    printf("Usage: proxy [port]\n");
+    printf("Usage: proxy [-t threads] [-q queue_depth] [-d dns_entries] "
+            "[-p lru|gdsf|s3fifo] [-D cache_file [-S disk_mb]] "
+            "[--event[=loops]] port\n");
     exit(-1);
 }
 
 
 
+/* read_counted, writen_counted  -- read and rio_writen_ww, counting the
+ * bytes that go through the proxy
+ */
+ssize_t read_counted(int fd, char *buf, size_t n)
+{
+    ssize_t rc = read(fd, buf, n);
+    if (rc > 0) {
+        STATS_ADD(bytes_in, rc);
+    }
+    return rc;
+}
+
+int writen_counted(int fd, const char *buf, size_t n)
+{
+    if (rio_writen_ww(fd, (char *)buf, n) < 0) {
+        return -1;
+    }
+    STATS_ADD(bytes_out, n);
+    return 0;
+}
+
+
+/* write_body  -- write n bytes of the response body in buf to the
+ * client. If dechunk is not NULL, the chunks are decoded in place first
+ */
+int write_body(int fd, char *buf, size_t n, http_framing_t *dechunk)
+{
+    if (dechunk) {
+        n = http_dechunk(dechunk, buf, n, buf);
+    }
+    return writen_counted(fd, buf, n);
+}
+
+
+/* relay_rest  -- copy the rest of the response from infd to outfd,
+ * following its framing, and decoding its chunks with dechunk if not
+ * NULL. Return -1 if the copy stops early
+ */
+int relay_rest(http_framing_t *framing, int infd, int outfd,
+        http_framing_t *dechunk)
+{
+    char buf[MAXBUF];
+    ssize_t num_bytes;
+    size_t used;
+    while (framing->state != FRAMING_DONE) {
+        if ((num_bytes = read_counted(infd, buf, MAXBUF)) < 0 &&
+                errno == EINTR) {
+            continue;
+        }
+        if (num_bytes <= 0) {
+            return framing->state == FRAMING_UNTIL_CLOSE && num_bytes == 0 ?
+                0 : -1;
+        }
+        used = http_framing_feed(framing, buf, num_bytes);
+        if (write_body(outfd, buf, used, dechunk) < 0) {
+            return -1;
+        }
+        if (used < num_bytes) {
+            /* more than one response, don't trust the connection */
+            framing->keep_alive = 0;
+        }
+    }
+    return 0;
+}
+
+
+/* write_response  -- write len bytes of a response, whose status line
+ * and headers are the first head_len bytes, to the client. The head
+ * tells the client whether keep_alive holds for its connection, and
+ * whether the response is a cache hit. The rewritten head and the body
+ * go out in one writev. If dechunk is not NULL, the response is chunked
+ * and the client can't read chunks: the head loses its framing headers
+ * and the body is decoded, so the client reads it until close
+ */
+int write_response(int fd, const char *data, size_t len, size_t head_len,
+        int keep_alive, int hit, http_framing_t *dechunk)
+{
+    char stack_head[MAXBUF];
+    size_t size = head_len + HTTP_RESPONSE_HEAD_EXTRA;
+    char *head = size <= sizeof(stack_head) ? stack_head : Malloc(size);
+    char *plain = NULL;
+    size_t body_len = len - head_len;
+    struct iovec iov[2];
+    if (dechunk) {
+        plain = Malloc(size + body_len);
+        body_len = http_dechunk(dechunk, data + head_len, body_len,
+                plain + size);
+        head_len = http_dechunk_head(plain, data, head_len, -1);
+        data = plain;
+    }
+    iov[0].iov_base = head;
+    iov[0].iov_len = http_response_head(head, data, head_len, keep_alive,
+            hit);
+    iov[1].iov_base = dechunk ? plain + size : (char *)data + head_len;
+    iov[1].iov_len = body_len;
+    /* rio_writev_ww uses up the iovec */
+    size_t total = iov[0].iov_len + iov[1].iov_len;
+    int rc = rio_writev_ww(fd, iov, 2) < 0 ? -1 : 0;
+    if (rc == 0) {
+        STATS_ADD(bytes_out, total);
+    }
+    if (head != stack_head) {
+        free(head);
+    }
+    free(plain);
+    return rc;
+}
+
+
+/* cache_response  -- put a complete response of len bytes into the
+ * cache. A chunked one is stored decoded, with a Content-Length, so that
+ * every client can read it
+ */
+void cache_response(const char *key, const char *data, size_t len,
+        const http_framing_t *framing, long long expires_ns)
+{
+    if (!framing->chunked || framing->header_len == 0) {
+        shard_cache_put_until(&cache, key, data, len, expires_ns);
+        return;
+    }
+    size_t head_len = framing->header_len;
+    size_t size = head_len + HTTP_RESPONSE_HEAD_EXTRA;
+    char *plain = Malloc(size + len - head_len);
+    http_framing_t dechunk;
+    http_dechunk_init(&dechunk);
+    /* the body is decoded behind room for the head, then moved */
+    size_t body_len = http_dechunk(&dechunk, data + head_len,
+            len - head_len, plain + size);
+    head_len = http_dechunk_head(plain, data, head_len, body_len);
+    memmove(plain + head_len, plain + size, body_len);
+    shard_cache_put_until(&cache, key, plain, head_len + body_len,
+            expires_ns);
+    free(plain);
+}
+
+
+int write_cached(lru_cache_obj_t *obj, int fd, int *keep_client);
+
+
+/* refresh_cached  -- a 304 says the cached object of key is still good.
+ * The headers of the 304 update the stored ones, and its Date restarts
+ * the freshness of the object. Objects in the cache are shared and
+ * never change, so the updated one replaces it. Return a reference to
+ * the object to write to the client
+ */
+lru_cache_obj_t *refresh_cached(const char *key, lru_cache_obj_t *obj,
+        const char *head, size_t head_len)
+{
+    http_cache_info_t info;
+    http_cache_info_init(&info);
+    http_cache_info_parse(&info, obj->data, obj->len);
+    int status = info.status;
+    info.date = -1;
+    info.age = 0;
+    http_cache_info_parse(&info, head, head_len);
+    info.status = status;
+    long long expires_ns = http_cache_expires(&info, DEFAULT_TTL);
+
+    http_framing_t framing;
+    http_framing_init(&framing);
+    http_framing_feed(&framing, obj->data, obj->len);
+    if (framing.header_len == 0) {
+        /* not a response we can parse, keep it as it is */
+        return lru_cache_obj_get(obj);
+    }
+    size_t body_len = obj->len - framing.header_len;
+    char *data = Malloc(framing.header_len + head_len + body_len);
+    size_t len = http_response_merge(data, obj->data, framing.header_len,
+            head, head_len);
+    memcpy(data + len, obj->data + framing.header_len, body_len);
+    len += body_len;
+    /* an object that may no longer be stored is revalidated every time
+     * until it is evicted */
+    shard_cache_put_until(&cache, key, data, len,
+            expires_ns < 0 ? now_ns() : expires_ns);
+    free(data);
+
+    lru_cache_obj_t *fresh = shard_cache_get(&cache, key);
+    if (fresh == NULL) {
+        /* too large for the cache, or evicted already */
+        return lru_cache_obj_get(obj);
+    }
+    return fresh;
+}
+
+
 /* forward_response  -- forward the response back to the client
  * key: the formatted url of the content. Used for lru_cache
  * infd: the file descriptor of remote server. We read response from infd
  * outfd: the client file descriptor. We write response back to outfd
+ * keep_client: whether the client wants to keep its connection. Cleared
+ *     if the response doesn't let it, or fails
+ * flight: the flight this request leads, or NULL. The response is
+ *     published to it for the requests that joined
+ * stale: the cached response that the request revalidates, or NULL. A
+ *     304 response refreshes it, and it is written to the client
+ * chunked_ok: whether the client reads chunked bodies. Those of HTTP/1.0
+ *     clients are decoded for them, and read until close
+ * authorized: whether the request has Authorization. The response is
+ *     only stored if the server says it may be shared
+ *
+ * Responses are cached for as long as their headers say they are fresh,
+ * or DEFAULT_TTL. Those the server doesn't let a shared cache store are
+ * only relayed.
+ *
+ * The response head is held until it is complete, so its connection
+ * headers can be rewritten. After that, bytes are relayed to the client
+ * as soon as they arrive. A copy is kept as the cache candidate until
+ * it grows beyond MAX_OBJECT_SIZE, so memory per request is bounded
+ * however large the response is. Once the response is known to be
+ * uncacheable, the rest of it is spliced from socket to socket without
+ * entering user space, unless followers are still reading it: then it
+ * is published up to MAX_FLIGHT_SIZE. If the client goes away, the
+ * response is still read for the followers.
+ *
+ * The framing of the response tells where it ends, so both connections
+ * can serve another request afterwards.
+ * Return one of the RESPONSE_* results.
  */
-void forward_response(const char *key, int infd, int outfd)
+int forward_response(const char *key, int infd, int outfd,
+        int *keep_client, inflight_t *flight, lru_cache_obj_t *stale,
+        int chunked_ok, int authorized)
 {
-    rio_t rio;
-    rio_readinitb(&rio, infd);
-
-    /* Since we don't know the length of the response, we extend
-     * the response buffer dynamically.
-     * First, we read MAXLINE number of bytes into the buffer.
-     * Then we append the buffer to the response buffer.
-     */
-
     /* temporary buffer */
-    char buf[MAXLINE];
+    char buf[MAXBUF];
 
-    /* response buffer */
+    /* response buffer, the cache candidate */
     struct Bytes response;
+    int cacheable = 1;
+    int publishing = flight != NULL;
+    int client_ok = 1;
+    int head_sent = 0;
+    int ended = 0;
+    int result = RESPONSE_CLOSE;
+    long long expires_ns = -1;
+
+    /* where the response ends */
+    http_framing_t framing;
+    http_framing_init(&framing);
+    /* the chunks of the body, if the client can't read them */
+    http_framing_t client_framing;
+    http_framing_t *dechunk = NULL;
 
     /* allocate and initialize the response buffer */
     bytes_malloc(&response);
 
-    /* num_bytes is the number of bytes read for each rio_readnb operation */
-    int num_bytes;
-    while ((num_bytes=rio_readnb_ww(&rio, buf, MAXLINE)) > 0) {
-        bytes_appendn(&response, buf, num_bytes);
+    /* num_bytes is the number of bytes read for each read operation.
+     * read returns whatever has arrived instead of waiting for a full
+     * buffer like rio_readnb does.
+     */
+    ssize_t num_bytes;
+    size_t used;
+    while (cacheable || publishing) {
+        if (framing.state == FRAMING_DONE) {
+            ended = 1;
+            break;
+        }
+        num_bytes = read_counted(infd, buf, MAXBUF);
+        if (num_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (num_bytes <= 0 && !head_sent && bytes_length(response) == 0) {
+            /* nothing at all. A pooled connection may have been closed
+             * by the server just before the request was sent */
+            result = RESPONSE_EMPTY;
+            bytes_free(&response);
+            return result;
+        }
+        if (num_bytes < 0) {
+            /* The remote connection may be closed during the read
+             * operation. A truncated response must not be cached.
+             */
+            fprintf(stderr, "[ERROR] read from %d failed\n", infd);
+            goto FORWARD_RESPONSE_RETURN;
+        }
+        if (num_bytes == 0) {
+            if (framing.state != FRAMING_UNTIL_CLOSE) {
+                /* truncated */
+                goto FORWARD_RESPONSE_RETURN;
+            }
+            ended = 1;
+            break;
+        }
+
+        used = http_framing_feed(&framing, buf, num_bytes);
+        if (used < num_bytes) {
+            /* more than one response, don't trust the connection */
+            framing.keep_alive = 0;
+        }
+        if (cacheable) {
+            bytes_appendn(&response, buf, used);
+        }
+
+        if (!head_sent) {
+            if (framing.header_len == 0 &&
+                    framing.state == FRAMING_UNTIL_CLOSE) {
+                /* the framing gave up inside the head, on a line longer
+                 * than MAXLINE or a status line that is not HTTP/1.x.
+                 * Relay the response as it is until the server closes.
+                 * It is neither cached nor shared */
+                *keep_client = 0;
+                if (publishing) {
+                    inflight_end(&flights, flight, 0);
+                    publishing = 0;
+                }
+                client_ok = writen_counted(outfd, bytes_buf(response),
+                        bytes_length(response)) == 0;
+                bytes_free(&response);
+                cacheable = 0;
+                head_sent = 1;
+                if (!client_ok) {
+                    goto FORWARD_RESPONSE_RETURN;
+                }
+                continue;
+            }
+            if (framing.header_len == 0) {
+                /* the head is not complete yet */
+                if (bytes_length(response) >= MAX_OBJECT_SIZE) {
+                    goto FORWARD_RESPONSE_RETURN;
+                }
+                continue;
+            }
+            http_cache_info_t info;
+            http_cache_info_init(&info);
+            http_cache_info_parse(&info, bytes_buf(response),
+                    framing.header_len);
+            if (stale && info.status == 304) {
+                /* the copy is still good. A 304 has no body */
+                lru_cache_obj_t *fresh = refresh_cached(key, stale,
+                        bytes_buf(response), framing.header_len);
+                bytes_free(&response);
+                if (write_cached(fresh, outfd, keep_client) < 0) {
+                    *keep_client = 0;
+                }
+                lru_cache_obj_release(fresh);
+                return framing.keep_alive ? RESPONSE_DONE : RESPONSE_CLOSE;
+            }
+            expires_ns = http_cache_expires(&info, DEFAULT_TTL);
+            if (authorized && !info.shared) {
+                expires_ns = -1;
+            }
+
+            /* a response that ends at close can't keep the client */
+            if (framing.state == FRAMING_UNTIL_CLOSE) {
+                *keep_client = 0;
+            }
+            if (framing.chunked && !chunked_ok) {
+                http_dechunk_init(&client_framing);
+                dechunk = &client_framing;
+                *keep_client = 0;
+            }
+            if (publishing && (!http_cacheable(&info) ||
+                        (authorized && !info.shared) ||
+                        framing.content_length > MAX_FLIGHT_SIZE)) {
+                /* private to this client, or too large: the followers
+                 * fetch it on their own */
+                inflight_end(&flights, flight, 0);
+                publishing = 0;
+            }
+            if (publishing) {
+                inflight_append(flight, bytes_buf(response),
+                        bytes_length(response));
+            }
+            if (write_response(outfd, bytes_buf(response),
+                        bytes_length(response), framing.header_len,
+                        *keep_client, 0, dechunk) < 0) {
+                client_ok = 0;
+            }
+            head_sent = 1;
+        } else {
+            if (publishing &&
+                    inflight_append(flight, buf, used) > MAX_FLIGHT_SIZE) {
+                inflight_end(&flights, flight, 0);
+                publishing = 0;
+            }
+            if (client_ok && write_body(outfd, buf, used, dechunk) < 0) {
+                /* the client may have closed the connection */
+                client_ok = 0;
+            }
+        }
+        if (!client_ok && !publishing) {
+            goto FORWARD_RESPONSE_RETURN;
+        }
+
+        if (cacheable && (expires_ns < 0 ||
+                    framing.content_length >= MAX_OBJECT_SIZE ||
+                    bytes_length(response) >= MAX_OBJECT_SIZE)) {
+            /* not to be stored, or too large to cache: stop copying it.
+             * Later requests don't join a flight that won't be cached */
+            bytes_free(&response);
+            cacheable = 0;
+            if (publishing) {
+                inflight_close(&flights, flight);
+                if (inflight_followers(flight) == 0) {
+                    inflight_end(&flights, flight, 0);
+                    publishing = 0;
+                }
+            }
+        }
     }
 
-    /* The remote connection may be closed during the read operation.
-     * The return value is < 0.
-     */
-    if (num_bytes < 0) {
-        /* goto is used here to make sure that response is freed
-         */
-        goto FORWARD_RESPONSE_RETURN;
+    if (!ended) {
+        /* uncacheable, and nobody else reads it: splice the rest when
+         * its end is known without looking at it. If the sockets don't
+         * support it, copy */
+        if (framing.state == FRAMING_LENGTH ||
+                framing.state == FRAMING_UNTIL_CLOSE) {
+            size_t len = framing.state == FRAMING_LENGTH ?
+                framing.remaining : SIZE_MAX;
+            num_bytes = splice_relay(infd, outfd, len);
+            if (num_bytes < 0 && errno != EINVAL) {
+                *keep_client = 0;
+                return RESPONSE_CLOSE;
+            }
+            if (num_bytes >= 0) {
+                STATS_ADD(bytes_in, num_bytes);
+                STATS_ADD(bytes_out, num_bytes);
+                if (num_bytes == len) {
+                    framing.state = FRAMING_DONE;
+                } else if (framing.state == FRAMING_LENGTH) {
+                    /* truncated */
+                    *keep_client = 0;
+                    return RESPONSE_CLOSE;
+                }
+            }
+        }
+        if (relay_rest(&framing, infd, outfd, dechunk) < 0) {
+            *keep_client = 0;
+            return RESPONSE_CLOSE;
+        }
+        return framing.keep_alive ? RESPONSE_DONE : RESPONSE_CLOSE;
     }
 
 #ifdef DEBUG
     fprintf(stderr, "response length: %zu\n", bytes_length(response));
 #endif
-    
-    /* the client may have closed the connection */
-    if (!rio_writen_ww(outfd,
-                bytes_buf(response),
-                bytes_length(response))) {
-        goto FORWARD_RESPONSE_RETURN;
-    }
 
-    /* cache the response if necessary */
-    if (bytes_length(response) < MAX_OBJECT_SIZE) {
-        sem_wait(&mutex);
-        lru_cache_insert(&lru_cache, key, bytes_buf(response),
-                bytes_length(response));
-        sem_post(&mutex);
+    /* cache the response before the flight ends, so that a request
+     * arriving after it finds it in the cache */
+    if (cacheable) {
+        cache_response(key, bytes_buf(response), bytes_length(response),
+                &framing, expires_ns);
+        bytes_free(&response);
+    }
+    if (flight) {
+        inflight_end(&flights, flight, publishing);
+    }
+    if (!client_ok) {
+        *keep_client = 0;
     }
+    return framing.keep_alive ? RESPONSE_DONE : RESPONSE_CLOSE;
 FORWARD_RESPONSE_RETURN:
     /* free the response */
-    bytes_free(&response);
+    if (cacheable) {
+        bytes_free(&response);
+    }
+    if (flight) {
+        inflight_end(&flights, flight, 0);
+    }
+    *keep_client = 0;
+    return result;
 }
 
 
-/* forward  -- forward the request to remote server and the response from
- * remote server
+/* follow_flight  -- write the response of a flight to the client, as the
+ * leader publishes it. keep_client is cleared if the response doesn't
+ * tell where it ends. Return FLIGHT_WRITTEN, FLIGHT_FAILED if the
+ * response broke off after something was written, or FLIGHT_MISSED if
+ * the leader gave up before: the request can still be sent on its own.
+ * A chunked response is decoded unless chunked_ok says the client reads
+ * chunks.
  */
-void forward(int fromfd)
+int follow_flight(inflight_t *flight, int fd, int *keep_client,
+        int chunked_ok)
 {
-    rio_t rio;
-    rio_readinitb(&rio, fromfd);
-    char linebuf[MAXLINE],  // temporary buffer for each line we read
-         method[MAXLINE],  // http method
-         uri[MAXLINE],  // uri
-         version[MAXLINE],  // http version.
-         host[MAXLINE],
-         port[MAXLINE],
-         dir[MAXLINE],  // the director after the host in the uri
-         /* TODO: is it necessary to use a dynamic buffer to store
-          * the request?
-          * For all the cases tested now, seems it's not necessary
-          */
-         request_buf[MAXBUF],  // The request is stored in the buffer
-         header_name[MAXLINE], // used for parsing the header
-         header_value[MAXLINE];
-
-    if (!rio_readlineb_ww(&rio, linebuf, MAXLINE)) {
-        return;
+    char buf[MAXBUF];
+    struct Bytes head;
+    size_t offset = 0;
+    ssize_t n;
+    int head_sent = 0;
+    int rc = FLIGHT_WRITTEN;
+
+    http_framing_t framing;
+    http_framing_init(&framing);
+    http_framing_t client_framing;
+    http_framing_t *dechunk = NULL;
+    bytes_malloc(&head);
+    while ((n = inflight_read(flight, offset, buf, MAXBUF)) > 0) {
+        offset += n;
+        http_framing_feed(&framing, buf, n);
+        if (head_sent) {
+            if (write_body(fd, buf, n, dechunk) < 0) {
+                rc = FLIGHT_FAILED;
+                break;
+            }
+            continue;
+        }
+        bytes_appendn(&head, buf, n);
+        if (framing.header_len == 0) {
+            continue;
+        }
+        if (framing.state == FRAMING_UNTIL_CLOSE) {
+            *keep_client = 0;
+        }
+        if (framing.chunked && !chunked_ok) {
+            http_dechunk_init(&client_framing);
+            dechunk = &client_framing;
+            *keep_client = 0;
+        }
+        head_sent = 1;
+        /* one fetch from the server serves the flight, the followers
+         * count as hits */
+        if (write_response(fd, bytes_buf(head), bytes_length(head),
+                    framing.header_len, *keep_client, 1, dechunk) < 0) {
+            rc = FLIGHT_FAILED;
+            break;
+        }
+    }
+    bytes_free(&head);
+    if (n < 0) {
+        rc = head_sent ? FLIGHT_FAILED : FLIGHT_MISSED;
+    } else if (n == 0 && framing.state != FRAMING_DONE) {
+        *keep_client = 0;
+    }
+    if (rc == FLIGHT_FAILED) {
+        *keep_client = 0;
+    }
+    return rc;
+}
+
+
+/* write_cached  -- write a cached response to the client. keep_client is
+ * cleared if the response doesn't tell where it ends
+ */
+int write_cached(lru_cache_obj_t *obj, int fd, int *keep_client)
+{
+    http_framing_t framing;
+    http_framing_init(&framing);
+    http_framing_feed(&framing, obj->data, obj->len);
+    if (framing.header_len == 0) {
+        /* not a response we can parse, send it as it is */
+        *keep_client = 0;
+        return writen_counted(fd, obj->data, obj->len);
+    }
+    if (framing.state != FRAMING_DONE) {
+        *keep_client = 0;
+    }
+    return write_response(fd, obj->data, obj->len, framing.header_len,
+            *keep_client, 1, NULL);
+}
+
+
+/* demote  -- an object evicted from memory goes to the disk tier */
+void demote(void *arg, const char *key, lru_cache_obj_t *obj)
+{
+    diskcache_put(&disk, key, obj->data, obj->len, obj->expires_ns);
+}
+
+
+/* promote  -- bring the object of key from the disk tier back into
+ * memory. Return a reference to it, or NULL on a miss
+ */
+lru_cache_obj_t *promote(const char *key)
+{
+    struct Bytes value;
+    long long expires_ns;
+    lru_cache_obj_t *obj = NULL;
+    bytes_malloc(&value);
+    if (diskcache_get(&disk, key, &value, &expires_ns)) {
+        shard_cache_put_until(&cache, key, bytes_buf(value),
+                bytes_length(value), expires_ns);
+        obj = shard_cache_get(&cache, key);
+    }
+    bytes_free(&value);
+    return obj;
+}
+
+
+/* serve_stats  -- answer a request for STATS_URI with the counters of
+ * the proxy, one "name: value" line each. They are added up now, the
+ * requests being served only count for what they did so far
+ */
+void serve_stats(int fd)
+{
+    char body[MAXBUF], head[MAXLINE];
+    stats_t s;
+    shard_cache_stats_t c;
+    hist_t *connect = Malloc(sizeof(hist_t));
+    struct iovec iov[2];
+
+    stats_sum(&s);
+    shard_cache_stats(&cache, &c);
+    stats_connect_hist(connect);
+    int len = snprintf(body, sizeof(body),
+            "requests: %lld\n"
+            "hits: %lld\n"
+            "ram_hits: %lld\n"
+            "disk_hits: %lld\n"
+            "misses: %lld\n"
+            "bytes_in: %lld\n"
+            "bytes_out: %lld\n"
+            "connections: %lld\n"
+            "active_connections: %lld\n"
+            "idle_closes: %lld\n"
+            "cache_size: %zu\n"
+            "cache_objects: %zu\n"
+            "evictions: %zu\n"
+            "server_connects: %lld\n"
+            "connect_us_p50: %.1f\n"
+            "connect_us_p99: %.1f\n"
+            "connect_us_max: %.1f\n"
+            "cache_lock_waits: %lld\n"
+            "cache_lock_wait_us: %.1f\n",
+            s.requests, s.ram_hits + s.disk_hits, s.ram_hits, s.disk_hits,
+            s.misses, s.bytes_in, s.bytes_out, s.connections, s.active,
+            s.idle_closes, c.cache_size, c.count, c.evictions, s.connects,
+            hist_percentile(connect, 50) / 1e3,
+            hist_percentile(connect, 99) / 1e3, connect->max / 1e3,
+            c.lock_waits, c.lock_wait_ns / 1e3);
+    free(connect);
+    iov[0].iov_base = head;
+    iov[0].iov_len = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain\r\n"
+            "Content-Length: %d\r\n"
+            "Cache-Control: no-store\r\n"
+            "Connection: close\r\n\r\n", len);
+    iov[1].iov_base = body;
+    iov[1].iov_len = len;
+    size_t total = iov[0].iov_len + len;
+    if (rio_writev_ww(fd, iov, 2) >= 0) {
+        STATS_ADD(bytes_out, total);
     }
-    sscanf(linebuf, "%s %s %s", method, uri, version);
-    if (strcasecmp(method, "GET") != 0) {
+}
+
+
+/* forward  -- read a request of the client on rio, and forward it to
+ * the remote server and the response back, or answer it from the
+ * cache. Return 1 if the client connection can serve another request
+ */
+int forward(rio_t *rio, int fromfd)
+{
+    char head[MAXBUF],  // the request head of the client, as read
+         host[HTTP_HOST_MAX],
+         port[HTTP_PORT_MAX],
+         formated_uri[MAXLINE],  // host:port/dir, the cache key
+         request_buf[MAXBUF];  // the request forwarded to the server
+    size_t head_len = 0;
+    ssize_t n;
+    http_request_t req;
+    http_writer_t w;
+    int i;
+
+    /* the head is read line by line into one buffer, which the views of
+     * req point into. rio keeps whatever follows it for the next request.
+     * An idle client times out on the request line, that is not an error */
+    http_request_init(&req);
+    do {
+        n = head_len == 0 ? rio_readlineb(rio, head, sizeof(head)) :
+            rio_readlineb_ww(rio, head + head_len, sizeof(head) - head_len);
+        if (n <= 0) {
+            return 0;
+        }
+        head_len += n;
+    } while (http_request_parse(&req, head, head_len) == HTTP_PARSE_MORE &&
+            head_len < sizeof(head) - 1);
+    STATS_ADD(requests, 1);
+    STATS_ADD(bytes_in, head_len);
+    if (http_view_equals(req.method, "GET") &&
+            http_view_equals(req.uri, STATS_URI)) {
+        /* asked of the proxy itself. There is no host in the uri, so the
+         * parse stopped at the request line: read the rest of the head,
+         * closing with unread input would reset the connection */
+        while ((n = rio_readlineb_ww(rio, head, sizeof(head))) > 0 &&
+                strcmp(head, "\r\n") && strcmp(head, "\n")) {
+        }
+        serve_stats(fromfd);
+        return 0;
+    }
+    if (req.state != HTTP_PARSE_DONE) {
+        fprintf(stderr, "[ERROR] bad request head\n");
+        return 0;
+    }
+    if (!http_view_equals(req.method, "GET")) {
         // TODO
         fprintf(stderr, "[ERROR] method is not GET\n");
-        return;
+        return 0;
+    }
+    if (http_request_target(&req, host, port, formated_uri,
+                sizeof(formated_uri)) < 0) {
+        fprintf(stderr, "[ERROR] uri too long\n");
+        return 0;
     }
-    parse_uri(uri, host, port, dir);
 #ifdef DEBUG
-    fprintf(stderr, "uri: %s\n", uri);
-    fprintf(stderr, "host: %s port: %s dir: %s\n", host, port, dir);
+    fprintf(stderr, "uri: %.*s\n", (int)req.uri.len, req.uri.ptr);
+    fprintf(stderr, "key: %s\n", formated_uri);
 #endif
 
-    char formated_uri[MAXLINE];
-    sprintf(formated_uri, "%s:%s%s", host, port, dir);
+    /* HTTP/1.1 connections are persistent unless the client says no.
+     * The whole request is read first, even for a cache hit, so the
+     * next request on the connection starts at its request line. */
+    int keep_client = http_view_equals(req.version, "HTTP/1.1");
+    int chunked_ok = keep_client;
+    http_writer_init(&w, request_buf, sizeof(request_buf));
+    http_request_line(&w, &req, 1);
+
+    int has_host = 0;
+    int client_conditional = 0;
+    for (i = 0; i < req.nheaders; i++) {
+        const http_header_t *h = &req.headers[i];
+        if (h->name.len >= 3 && strncasecmp(h->name.ptr, "If-", 3) == 0) {
+            client_conditional = 1;
+        }
+        http_request_header(&w, h, &has_host, &keep_client);
+    }
 
     /*
-     * if we find the content in the cache, we return it directly.
-     * TODO: What if the content has been modifed?
+     * if we find fresh content in the cache, we return it directly.
+     * We hold a reference to the content, so the write to a slow client
+     * happens without any lock. A request with Authorization always goes
+     * to the server, which checks the credentials.
      */
-    sem_wait(&mutex);
-
-    lru_cache_node_t *pnode = lru_cache_find(&lru_cache, formated_uri);
+    int authorized = http_request_has(&req, "Authorization");
+    lru_cache_obj_t *obj = NULL;
+    if (authorized) {
+        STATS_ADD(misses, 1);
+    } else if ((obj = shard_cache_get(&cache, formated_uri)) != NULL) {
+        STATS_ADD(ram_hits, 1);
+    } else if (disk_enabled && (obj = promote(formated_uri)) != NULL) {
+        STATS_ADD(disk_hits, 1);
+    } else {
+        STATS_ADD(misses, 1);
+    }
+    if (obj && lru_cache_obj_fresh(obj, now_ns())) {
+        int rc = write_cached(obj, fromfd, &keep_client);
+        lru_cache_obj_release(obj);
+        return rc == 0 && keep_client;
+    }
 
-    if (pnode) {
-        rio_writen_ww(fromfd, pnode->value, pnode->value_len);
-        sem_post(&mutex);
-        return;
+    /* stale content is revalidated with its validators, unless the
+     * client sent validators of its own: a 304 would be for those */
+    if (obj) {
+        http_cache_info_t info;
+        http_cache_info_init(&info);
+        http_cache_info_parse(&info, obj->data, obj->len);
+        if (client_conditional ||
+                !http_request_conditional(&w, &info)) {
+            lru_cache_obj_release(obj);
+            obj = NULL;
+        }
     }
-    sem_post(&mutex);
-    
-    /* According to the requirement, all requests are
-     * forwarded as HTTP/1.0
-     */
-    sprintf(request_buf, "%s %s %s\r\n", method, dir, "HTTP/1.0");
-    
-    /* if the header contains host, we forward it directly.
-     * Otherwise we fill the host according to the uri
-     */
-    int has_host = 0;
-    if (rio_readlineb_ww(&rio, linebuf, MAXLINE) < 0) {
-        return;
+    http_request_end(&w, has_host, host, port, 1);
+    if (w.overflow) {
+        fprintf(stderr, "[ERROR] request too large\n");
+        if (obj) {
+            lru_cache_obj_release(obj);
+        }
+        return 0;
     }
-    while (strcmp(linebuf, "\r\n") != 0) {
-        parse_header(linebuf, header_name, header_value);
-        if (strcasecmp(header_name, "Host") == 0) {
-            has_host = 1;
-            sprintf(request_buf, "%s%s", request_buf, linebuf);
-        } else if (strcasecmp(header_name, "User-Agent") == 0 ||
-                strcasecmp(header_name, "Accept") == 0 ||
-                strcasecmp(header_name, "Accept-Encoding") == 0 ||
-                strcasecmp(header_name, "Connection") == 0 ||
-                strcasecmp(header_name, "Proxy-Connection") == 0) {
-            // we have default values for these headers
-        } else {
-            // for other headers, we forward it directly
-            sprintf(request_buf, "%s%s", request_buf, linebuf);
-        }
-        if (rio_readlineb_ww(&rio, linebuf, MAXLINE) < 0) {
-            return;
-        }
-    }
-    if (!has_host) {
-        /* add host according to uri parsing result */
-        sprintf(request_buf, "%s%s: %s:%s\r\n", request_buf, "Host",
-                host, port);
-    }
-
-    /* add default value for these headers */
-    sprintf(request_buf, "%s%s", request_buf,
-            user_agent_hdr);
-    sprintf(request_buf, "%s%s", request_buf,
-            accept_hdr);
-    sprintf(request_buf, "%s%s", request_buf,
-            accept_encoding_hdr);
-    sprintf(request_buf, "%s%s:close\r\n", request_buf,
-            "Connection");
-    sprintf(request_buf, "%s%s:close\r\n", request_buf,
-            "Proxy-Connection");
-    sprintf(request_buf, "%s\r\n", request_buf);
 #ifdef DEBUG
     fprintf(stderr, "request buf:\n%s\n", request_buf);
 #endif
-    int clientfd = open_clientfd_ww(host, port);
-    if (clientfd < 0) {
-        // TODO: is it ok to directly return?
-        // Maybe better error handling expected.
-        return ;
-    }
-    if (rio_writen_ww(clientfd, request_buf, strlen(request_buf)) < 0) {
-        close_ww(clientfd);
-        return;
+
+    /* if the same url is being fetched for another client, take the
+     * response from there. The response to a request with credentials
+     * or cookies may be for that client only, it is never shared */
+    int leader;
+    inflight_t *flight = NULL;
+    if (obj == NULL && !authorized && !http_request_has(&req, "Cookie")) {
+        flight = inflight_join(&flights, formated_uri, &leader);
+        if (!leader) {
+            int rc = follow_flight(flight, fromfd, &keep_client,
+                    chunked_ok);
+            inflight_release(flight);
+            if (rc != FLIGHT_MISSED) {
+                return rc == FLIGHT_WRITTEN && keep_client;
+            }
+            flight = NULL;
+        }
+    }
+
+    /* send the request on a pooled connection. If the server closed
+     * it before answering, retry on another one */
+    int reused, rc = RESPONSE_EMPTY;
+    size_t request_len = w.len;
+    do {
+        long long start = now_ns();
+        int serverfd = connpool_get(&pool, host, port, &reused);
+        if (serverfd < 0) {
+            // TODO: is it ok to directly return?
+            // Maybe better error handling expected.
+            break;
+        }
+        if (!reused) {
+            stats_connect(now_ns() - start);
+        }
+        if (writen_counted(serverfd, request_buf, request_len) < 0) {
+            rc = RESPONSE_EMPTY;
+        } else {
+            /* forward the response of the server to the client */
+            rc = forward_response(formated_uri, serverfd, fromfd,
+                    &keep_client, flight, obj, chunked_ok, authorized);
+        }
+        if (rc == RESPONSE_DONE) {
+            connpool_put(&pool, host, port, serverfd);
+        } else {
+            close_ww(serverfd);
+        }
+    } while (rc == RESPONSE_EMPTY && reused);
+    if (flight) {
+        /* the followers fetch it on their own if it failed */
+        inflight_end(&flights, flight, 0);
+        inflight_release(flight);
+    }
+    if (obj) {
+        lru_cache_obj_release(obj);
     }
-    
-    /* forward the response of the server to the client */
-    forward_response(formated_uri, clientfd, fromfd);
-    close_ww(clientfd);
+    return rc != RESPONSE_EMPTY && keep_client;
 }
 
 
-/* thread  -- the things to do for each thread */
+/* client_wait  -- wait for the next request of a client, the first one
+ * included. The worker is held meanwhile, so a client that stays idle for
+ * CLIENT_IDLE_BUSY_MS while accepted connections are queued is closed;
+ * HTTP clients open a new connection then. Return 0 if the connection
+ * is to be closed, including after CLIENT_IDLE_TIMEOUT
+ */
+int client_wait(rio_t *rio, int fd)
+{
+    struct pollfd pfd;
+    int waited = 0, rc;
+    if (rio->rio_cnt > 0) {
+        /* a pipelined request is read already */
+        return 1;
+    }
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (waited < CLIENT_IDLE_TIMEOUT * 1000) {
+        rc = poll(&pfd, 1, CLIENT_IDLE_POLL_MS);
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rc != 0) {
+            /* a request, or an error that forward finds out about */
+            return 1;
+        }
+        waited += CLIENT_IDLE_POLL_MS;
+        if (waited >= CLIENT_IDLE_BUSY_MS && sbuf_waiting(&sbuf) > 0) {
+            STATS_ADD(idle_closes, 1);
+            return 0;
+        }
+    }
+    return 0;
+}
+
+
+/* thread  -- the things to do for each worker thread. A worker serves
+ * the connections in the queue one after another, and every request
+ * of a persistent connection in order, see client_wait
+ */
 void *thread(void *vargp)
 {
-    int connfd = *((int*)vargp);
     pthread_detach(pthread_self());
-    free(vargp);
-    forward(connfd);
-    close(connfd);
+    struct timeval timeout = {CLIENT_IDLE_TIMEOUT, 0};
+    int one = 1;
+    while (1) {
+        int connfd = sbuf_remove(&sbuf);
+        rio_t rio;
+        rio_readinitb(&rio, connfd);
+        /* an idle client gives up its worker after the timeout */
+        setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO,
+                &timeout, sizeof(timeout));
+        /* a response that is relayed goes out in several writes */
+        setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        STATS_ADD(connections, 1);
+        STATS_ADD(active, 1);
+        while (client_wait(&rio, connfd) && forward(&rio, connfd)) {
+        }
+        close(connfd);
+        STATS_ADD(active, -1);
+    }
     return NULL;
 }
 
@@ -248,40 +1007,163 @@ void sigpipe_handler(int sig)
 }
 
 
+/* sigusr1_handler  -- print the connection queue statistics.
+ * The counters are read without the lock; they are only a snapshot.
+ */
+void sigusr1_handler(int sig)
+{
+    long long count = sbuf.wait_count;
+    sio_puts("[STATS] queued connections: ");
+    sio_putl(count);
+    sio_puts(" mean wait(us): ");
+    sio_putl(count ? sbuf.wait_total_ns / count / 1000 : 0);
+    sio_puts(" max wait(us): ");
+    sio_putl(sbuf.wait_max_ns / 1000);
+    sio_puts("\n[STATS] server connections opened: ");
+    sio_putl(pool.opened);
+    sio_puts(" reused: ");
+    sio_putl(pool.reused);
+    sio_puts("\n[STATS] dns cache hits: ");
+    sio_putl(dns.hits);
+    sio_puts(" misses: ");
+    sio_putl(dns.misses);
+    stats_t stats;
+    stats_sum(&stats);
+    sio_puts("\n[STATS] cache lookups in memory: ");
+    sio_putl(stats.ram_hits);
+    sio_puts(" on disk: ");
+    sio_putl(stats.disk_hits);
+    sio_puts(" missed: ");
+    sio_putl(stats.misses);
+    if (disk_enabled) {
+        sio_puts("\n[STATS] disk objects: ");
+        sio_putl(disk.count);
+        sio_puts(" recovered: ");
+        sio_putl(disk.recovered);
+        sio_puts(" written: ");
+        sio_putl(disk.writes);
+        sio_puts(" already there: ");
+        sio_putl(disk.skipped);
+    }
+    sio_puts("\n[STATS] misses fetched: ");
+    sio_putl(flights.leaders);
+    sio_puts(" joined: ");
+    sio_putl(flights.followers);
+    sio_puts("\n");
+}
+
+
+/* flush_on_exit  -- the thread that takes SIGTERM and SIGINT when there
+ * is a disk tier. Only evicted objects go to disk while the proxy runs,
+ * so the memory tier is written there too before exiting: the next
+ * start is warm with everything that was cached. The signals are
+ * blocked in every thread, and taken here with sigwait, so the flush
+ * runs as a normal thread instead of in a handler.
+ */
+void *flush_on_exit(void *vargp)
+{
+    sigset_t *mask = (sigset_t *)vargp;
+    int sig;
+    sigwait(mask, &sig);
+    shard_cache_foreach(&cache, demote, NULL);
+    exit(0);
+}
+
+
 /* main */
 int main(int argc, char **argv)
 {
-    if (argc != 2) {
+    int nthreads = DEFAULT_NTHREADS;
+    int queue_depth = DEFAULT_QUEUE_DEPTH;
+    int nloops = 0;  /* 0: threaded mode */
+    int dns_entries = DEFAULT_DNS_ENTRIES;
+    const char *disk_path = NULL;
+    long disk_mb = DEFAULT_DISK_MB;
+    const lru_cache_policy_t *policy = &lru_cache_lru_policy;
+    int opt, i;
+    static struct option long_options[] = {
+        {"event", optional_argument, NULL, 'e'},
+        {NULL, 0, NULL, 0}
+    };
+    while ((opt = getopt_long(argc, argv, "t:q:d:p:D:S:",
+                    long_options, NULL)) != -1) {
+        switch (opt) {
+            case 't': nthreads = atoi(optarg); break;
+            case 'q': queue_depth = atoi(optarg); break;
+            case 'd': dns_entries = atoi(optarg); break;
+            case 'D': disk_path = optarg; break;
+            case 'S': disk_mb = atol(optarg); break;
+            case 'p':
+                if ((policy = lru_cache_policy_by_name(optarg)) == NULL) {
+                    usage();
+                }
+                break;
+            case 'e':
+                nloops = optarg ? atoi(optarg) : DEFAULT_NLOOPS;
+                if (nloops <= 0) usage();
+                break;
+            default: usage();
+        }
+    }
+    if (optind != argc - 1 || nthreads <= 0 || queue_depth <= 0 ||
+            dns_entries < 0 || disk_mb <= 0 ||
+            (disk_path && nloops > 0)) {
         usage();
     }
     Signal(SIGPIPE, sigpipe_handler);
-    int listenfd = Open_listenfd(argv[1]);
+    Signal(SIGUSR1, sigusr1_handler);
+    int listenfd = Open_listenfd(argv[optind]);
     struct sockaddr_storage clientaddr;
     socklen_t clientlen = sizeof(clientaddr);
-    int *connfdp;
-    lru_cache_init(&lru_cache, MAX_CACHE_SIZE);
-    sem_init(&mutex, 0, 1);
-    while (1) {
-        connfdp = malloc(sizeof(int));
-        if (connfdp == NULL) {
-            fprintf(stderr, "malloc failed\n");
-            continue;
+    int connfd;
+    shard_cache_init(&cache, CACHE_SHARDS, MAX_CACHE_SIZE, policy);
+    dnscache_init(&dns, dns_entries, DNS_TTL_NS, DNS_NEGATIVE_TTL_NS,
+            dns_getaddrinfo);
+    if (nloops > 0) {
+        event_loops_run(listenfd, nloops, &cache, MAX_OBJECT_SIZE, DEFAULT_TTL,
+                &dns);
+    }
+    if (disk_path) {
+        if (diskcache_open(&disk, disk_path, disk_mb * 1024 * 1024) < 0) {
+            unix_error("diskcache_open error");
         }
+        shard_cache_on_evict(&cache, demote, NULL);
+        disk_enabled = 1;
+
+        /* before any worker starts, so they all inherit the mask */
+        static sigset_t exit_mask;
+        pthread_t tid;
+        sigemptyset(&exit_mask);
+        sigaddset(&exit_mask, SIGTERM);
+        sigaddset(&exit_mask, SIGINT);
+        pthread_sigmask(SIG_BLOCK, &exit_mask, NULL);
+        Pthread_create(&tid, NULL, flush_on_exit, &exit_mask);
+    }
+    sbuf_init(&sbuf, queue_depth);
+    connpool_init(&pool, POOL_MAX_IDLE, POOL_MAX_IDLE_PER_HOST,
+            POOL_IDLE_TIMEOUT_NS, &dns);
+    inflight_init(&flights, FLIGHT_BUCKETS);
+    for (i = 0; i < nthreads; i++) {
+        pthread_t tid;
+        Pthread_create(&tid, NULL, thread, NULL);
+    }
+    while (1) {
 #ifdef DEBUG
         fprintf(stderr, "accepting...\n");
 #endif
-        *connfdp = accept(listenfd,
+        connfd = accept(listenfd,
                 (SA *)&clientaddr,
                 &clientlen);
-        if (*connfdp == -1) {
+        if (connfd == -1) {
             fprintf(stderr, "Accept failed: %d\n", listenfd);
-            free(connfdp);
         } else {
-            // TODO: use thread pool
-            pthread_t tid;
-            pthread_create(&tid, NULL, thread, connfdp);
+            /* blocks when the queue is full */
+            sbuf_insert(&sbuf, connfd);
         }
     }
-    lru_cache_free(&lru_cache);
+    sbuf_deinit(&sbuf);
+    connpool_free(&pool);
+    dnscache_free(&dns);
+    shard_cache_free(&cache);
     return 0;
 }
@@ -0,0 +1,63 @@
+/*
+ * relay.c  -- zero-copy relay between two sockets
+ *
+ * splice needs _GNU_SOURCE, which conflicts with the declarations in
+ * csapp.h, so this file only uses the system headers.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "relay.h"
+
+/* bytes moved per splice call */
+#define SPLICE_CHUNK (64*1024)
+
+/* Each thread keeps one pipe for its relays. -1 until it is created */
+static __thread int pipefd[2] = {-1, -1};
+
+/* reset_pipe  -- drop the thread's pipe, it may still hold bytes */
+static void reset_pipe()
+{
+    close(pipefd[0]);
+    close(pipefd[1]);
+    pipefd[0] = pipefd[1] = -1;
+}
+
+/* splice_relay  -- move up to len bytes from infd to outfd */
+ssize_t splice_relay(int infd, int outfd, size_t len)
+{
+    ssize_t total = 0, in = 0, out;
+    if (pipefd[0] < 0 && pipe(pipefd) < 0) {
+        return -1;
+    }
+    while (len > 0) {
+        in = splice(infd, NULL, pipefd[1], NULL,
+                len < SPLICE_CHUNK ? len : SPLICE_CHUNK,
+                SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0 && errno == EINTR) {
+            continue;
+        }
+        if (in <= 0) {
+            break;
+        }
+        len -= in;
+        /* drain the pipe into outfd */
+        while (in > 0) {
+            out = splice(pipefd[0], NULL, outfd, NULL, in,
+                    SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0 && errno == EINTR) {
+                continue;
+            }
+            if (out <= 0) {
+                reset_pipe();
+                return -1;
+            }
+            in -= out;
+            total += out;
+        }
+    }
+    return in < 0 ? -1 : total;
+}
@@ -0,0 +1,19 @@
+/*
+ * relay.h  -- zero-copy relay between two sockets
+ */
+
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+#include <sys/types.h>
+
+/* splice_relay  -- move up to len bytes from infd to outfd, stopping
+ * early when infd reaches end of file. The bytes go through a pipe with
+ * splice(2), so they never enter user space.
+ * Return the number of bytes moved, or -1 on error. If the descriptors
+ * do not support splice, -1 is returned with errno EINVAL before any
+ * byte has been moved, and the caller should copy instead.
+ */
+ssize_t splice_relay(int infd, int outfd, size_t len);
+
+#endif
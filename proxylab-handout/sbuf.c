@@ -0,0 +1,76 @@
+/*
+ * sbuf.c  -- bounded producer/consumer queue of connection descriptors
+ *
+ * The producer (the accept loop) blocks when all n slots are taken, so
+ * a flood of connections backs up in the listen queue instead of
+ * spawning unbounded work.
+ */
+
+#include "sbuf.h"
+#include "util.h"
+
+/* sbuf_init  -- create an empty, bounded, shared FIFO buffer
+ * with n slots
+ */
+void sbuf_init(sbuf_t *sp, int n)
+{
+    sp->buf = Calloc(n, sizeof(int));
+    sp->enqueue_ns = Calloc(n, sizeof(long long));
+    sp->n = n;
+    sp->front = sp->rear = 0;
+    Sem_init(&sp->mutex, 0, 1);
+    Sem_init(&sp->slots, 0, n);
+    Sem_init(&sp->items, 0, 0);
+    sp->wait_count = 0;
+    sp->wait_total_ns = 0;
+    sp->wait_max_ns = 0;
+}
+
+/* sbuf_deinit  -- clean up buffer sp */
+void sbuf_deinit(sbuf_t *sp)
+{
+    Free(sp->buf);
+    Free(sp->enqueue_ns);
+}
+
+/* sbuf_insert  -- insert item onto the rear of shared buffer sp */
+void sbuf_insert(sbuf_t *sp, int item)
+{
+    P(&sp->slots);
+    P(&sp->mutex);
+    sp->rear = (sp->rear + 1) % sp->n;
+    sp->buf[sp->rear] = item;
+    sp->enqueue_ns[sp->rear] = now_ns();
+    V(&sp->mutex);
+    V(&sp->items);
+}
+
+/* sbuf_remove  -- remove and return the first item from buffer sp */
+int sbuf_remove(sbuf_t *sp)
+{
+    int item;
+    long long wait_ns;
+    P(&sp->items);
+    P(&sp->mutex);
+    sp->front = (sp->front + 1) % sp->n;
+    item = sp->buf[sp->front];
+    wait_ns = now_ns() - sp->enqueue_ns[sp->front];
+    sp->wait_count += 1;
+    sp->wait_total_ns += wait_ns;
+    if (wait_ns > sp->wait_max_ns) {
+        sp->wait_max_ns = wait_ns;
+    }
+    V(&sp->mutex);
+    V(&sp->slots);
+    return item;
+}
+
+/* sbuf_waiting  -- the value of the items semaphore */
+int sbuf_waiting(sbuf_t *sp)
+{
+    int items;
+    if (sem_getvalue(&sp->items, &items) < 0) {
+        return 0;
+    }
+    return items;
+}
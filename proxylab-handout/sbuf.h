@@ -0,0 +1,34 @@
+/*
+ * sbuf.h  -- bounded producer/consumer queue of connection descriptors
+ */
+
+#ifndef __SBUF_H__
+#define __SBUF_H__
+
+#include "csapp.h"
+
+typedef struct sbuf_t {
+    int *buf;  /* buffer array */
+    long long *enqueue_ns;  /* when each slot was inserted */
+    int n;  /* maximum number of slots */
+    int front;  /* buf[(front+1)%n] is first item */
+    int rear;  /* buf[rear%n] is last item */
+    sem_t mutex;  /* protects accesses to buf and the statistics */
+    sem_t slots;  /* counts available slots */
+    sem_t items;  /* counts available items */
+
+    /* queue wait statistics: the time between insert and remove */
+    long long wait_count;
+    long long wait_total_ns;
+    long long wait_max_ns;
+} sbuf_t;
+
+void sbuf_init(sbuf_t *sp, int n);
+void sbuf_deinit(sbuf_t *sp);
+void sbuf_insert(sbuf_t *sp, int item);
+int sbuf_remove(sbuf_t *sp);
+/* sbuf_waiting  -- number of items waiting to be removed. Only a hint:
+ * it may change as soon as it is read */
+int sbuf_waiting(sbuf_t *sp);
+
+#endif
@@ -0,0 +1,262 @@
+/*
+ * slab.c  -- size class allocator for the cache
+ *
+ * Every request is rounded up to one of about 20 size classes that grow
+ * by a quarter, so no chunk wastes more than a fifth of itself. Each
+ * class carves its chunks from 16 KB pages mapped at an address aligned
+ * to their size, so the page of a chunk is found by masking its address.
+ * A page keeps its own free list and use count, and is unmapped once
+ * all its chunks are free, so memory held by a class that falls out of
+ * use goes back to the system. Each class keeps one empty page, so a
+ * class that hovers around zero chunks doesn't map and unmap a page on
+ * every allocation. Small pages keep the partly used pages
+ * of ~20 classes cheap in a cache of only 1 MB.
+ *
+ * Chunks stop at 4 KB, where per class pages start to cost more than
+ * they save: larger objects go to malloc, which sizes them exactly.
+ *
+ * Cached objects are released by whichever thread drops the last
+ * reference, so every class has its own lock.
+ */
+
+#include "slab.h"
+#include "csapp.h"
+
+#define SLAB_ALIGN 16
+#define SLAB_MIN_CHUNK 64
+#define SLAB_MAX_CLASSES 64
+
+/* class of the memory given to malloc */
+#define SLAB_LARGE (-1)
+
+/* every chunk starts with a header, so slab_free knows where it is from */
+typedef struct slab_header_t {
+    int cls;  /* size class, or SLAB_LARGE */
+    size_t size;  /* bytes of a large allocation */
+} __attribute__((aligned(SLAB_ALIGN))) slab_header_t;
+
+/* a free chunk links to the next free chunk of its page */
+typedef struct slab_chunk_t {
+    struct slab_chunk_t *next;
+} slab_chunk_t;
+
+/* the page header at the start of each page */
+typedef struct slab_page_t {
+    struct slab_page_t *next, *prev;  /* pages of the class with room */
+    slab_chunk_t *free;  /* freed chunks */
+    char *fresh;  /* chunks from here on were never handed out */
+    char *end;  /* end of the last chunk */
+    size_t used;  /* chunks in use */
+} __attribute__((aligned(SLAB_ALIGN))) slab_page_t;
+
+typedef struct slab_class_t {
+    pthread_mutex_t lock;
+    size_t chunk_size;
+    slab_page_t partial;  /* sentinel of the pages with room */
+    slab_page_t *empty;  /* a page with room and no chunk in use, kept
+                            instead of unmapped. NULL if none */
+} slab_class_t;
+
+static slab_class_t classes[SLAB_MAX_CLASSES];
+static int nclasses;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+
+/* statistics, updated atomically */
+static size_t npages;
+static size_t nempty;
+static size_t chunk_bytes;
+static size_t large_bytes;
+
+#define round_up(n, align) (((n) + (align) - 1) & ~((size_t)(align) - 1))
+
+/* slab_init  -- set up the size classes */
+static void slab_init()
+{
+    /* the largest class still fits 4 chunks next to the page header */
+    size_t max = ((SLAB_PAGE_SIZE - sizeof(slab_page_t)) / 4) &
+        ~((size_t)SLAB_ALIGN - 1);
+    size_t size = SLAB_MIN_CHUNK;
+    while (nclasses < SLAB_MAX_CLASSES) {
+        slab_class_t *c = &classes[nclasses++];
+        pthread_mutex_init(&c->lock, NULL);
+        c->chunk_size = size;
+        c->partial.next = c->partial.prev = &c->partial;
+        c->empty = NULL;
+        if (size == max) {
+            break;
+        }
+        size = round_up(size + size / 4, SLAB_ALIGN);
+        if (size > max) {
+            size = max;
+        }
+    }
+}
+
+/* class_of  -- the smallest class that holds size bytes */
+static int class_of(size_t size)
+{
+    int lo = 0, hi = nclasses - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (classes[mid].chunk_size < size) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* page_of  -- the page of a chunk */
+#define page_of(p) ((slab_page_t *)((size_t)(p) & ~((size_t)SLAB_PAGE_SIZE - 1)))
+
+/* page_map  -- map a page aligned to its size. NULL if out of memory */
+static slab_page_t *page_map()
+{
+    /* map twice the size and unmap what is around the aligned page */
+    char *mem = mmap(NULL, 2 * SLAB_PAGE_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return NULL;
+    }
+    char *page = (char *)round_up((size_t)mem, SLAB_PAGE_SIZE);
+    if (page > mem) {
+        munmap(mem, page - mem);
+    }
+    munmap(page + SLAB_PAGE_SIZE, mem + SLAB_PAGE_SIZE - page);
+    __sync_fetch_and_add(&npages, 1);
+    return (slab_page_t *)page;
+}
+
+/* page_unmap  -- give an empty page back to the system */
+static void page_unmap(slab_page_t *page)
+{
+    munmap(page, SLAB_PAGE_SIZE);
+    __sync_fetch_and_sub(&npages, 1);
+}
+
+/* page_reset  -- make all the chunks of the page fresh */
+static void page_reset(slab_class_t *c, slab_page_t *page)
+{
+    size_t nchunks = (SLAB_PAGE_SIZE - sizeof(slab_page_t)) / c->chunk_size;
+    page->free = NULL;
+    page->fresh = (char *)page + sizeof(slab_page_t);
+    page->end = page->fresh + nchunks * c->chunk_size;
+    page->used = 0;
+}
+
+/* page_link  -- add the page to the pages with room */
+static void page_link(slab_class_t *c, slab_page_t *page)
+{
+    page->next = c->partial.next;
+    page->prev = &c->partial;
+    c->partial.next->prev = page;
+    c->partial.next = page;
+}
+
+/* page_unlink  -- remove the page from the pages with room */
+static void page_unlink(slab_page_t *page)
+{
+    page->prev->next = page->next;
+    page->next->prev = page->prev;
+}
+
+/* page_full  -- whether no chunk of the page is left */
+#define page_full(page) ((page)->free == NULL && (page)->fresh == (page)->end)
+
+/* slab_alloc  -- allocate size bytes */
+void *slab_alloc(size_t size)
+{
+    slab_header_t *h;
+    size_t total = sizeof(slab_header_t) + size;
+    pthread_once(&slab_once, slab_init);
+
+    if (total > classes[nclasses - 1].chunk_size) {
+        if ((h = malloc(total)) == NULL) {
+            return NULL;
+        }
+        h->cls = SLAB_LARGE;
+        h->size = total;
+        __sync_fetch_and_add(&large_bytes, total);
+        return h + 1;
+    }
+
+    int cls = class_of(total);
+    slab_class_t *c = &classes[cls];
+    slab_page_t *page;
+    pthread_mutex_lock(&c->lock);
+    if (c->partial.next != &c->partial) {
+        page = c->partial.next;
+    } else {
+        if ((page = page_map()) == NULL) {
+            pthread_mutex_unlock(&c->lock);
+            return NULL;
+        }
+        page_reset(c, page);
+        page_link(c, page);
+    }
+    if (page->free) {
+        h = (slab_header_t *)page->free;
+        page->free = page->free->next;
+    } else {
+        h = (slab_header_t *)page->fresh;
+        page->fresh += c->chunk_size;
+    }
+    if (page->used++ == 0 && page == c->empty) {
+        c->empty = NULL;
+        __sync_fetch_and_sub(&nempty, 1);
+    }
+    if (page_full(page)) {
+        page_unlink(page);
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    h->cls = cls;
+    __sync_fetch_and_add(&chunk_bytes, c->chunk_size);
+    return h + 1;
+}
+
+/* slab_free  -- free memory from slab_alloc */
+void slab_free(void *p)
+{
+    if (p == NULL) {
+        return;
+    }
+    slab_header_t *h = (slab_header_t *)p - 1;
+    if (h->cls == SLAB_LARGE) {
+        __sync_fetch_and_sub(&large_bytes, h->size);
+        free(h);
+        return;
+    }
+
+    slab_class_t *c = &classes[h->cls];
+    slab_page_t *page = page_of(h);
+    slab_chunk_t *chunk = (slab_chunk_t *)h;
+    __sync_fetch_and_sub(&chunk_bytes, c->chunk_size);
+    pthread_mutex_lock(&c->lock);
+    if (page_full(page)) {
+        page_link(c, page);
+    }
+    chunk->next = page->free;
+    page->free = chunk;
+    if (--page->used == 0) {
+        if (c->empty == NULL) {
+            /* keep it on the pages with room */
+            c->empty = page;
+            __sync_fetch_and_add(&nempty, 1);
+        } else {
+            page_unlink(page);
+            page_unmap(page);
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* slab_stats  -- memory held by the allocator */
+void slab_stats(slab_stats_t *stats)
+{
+    stats->pages = npages;
+    stats->empty_pages = nempty;
+    stats->chunk_bytes = chunk_bytes;
+    stats->large_bytes = large_bytes;
+}
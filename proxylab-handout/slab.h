@@ -0,0 +1,32 @@
+/*
+ * slab.h  -- size class allocator for the cache
+ */
+
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stddef.h>
+
+/* Chunks are carved from pages of SLAB_PAGE_SIZE bytes. Requests of
+ * about SLAB_MAX_CHUNK or more go to malloc */
+#define SLAB_PAGE_SIZE (16 * 1024)
+#define SLAB_MAX_CHUNK (4 * 1024)
+
+/* slab_alloc  -- allocate size bytes, aligned to 16. NULL if out of
+ * memory. Thread safe */
+void *slab_alloc(size_t size);
+
+/* slab_free  -- free memory from slab_alloc, from any thread */
+void slab_free(void *p);
+
+/* memory held by the allocator */
+typedef struct slab_stats_t {
+    size_t pages;  /* slab pages allocated */
+    size_t empty_pages;  /* of which kept with no chunk in use */
+    size_t chunk_bytes;  /* bytes of the chunks in use */
+    size_t large_bytes;  /* bytes given to malloc for large requests */
+} slab_stats_t;
+
+void slab_stats(slab_stats_t *stats);
+
+#endif
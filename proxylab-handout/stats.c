@@ -0,0 +1,76 @@
+/*
+ * stats.c  -- per thread counters of the proxy
+ *
+ * Every thread that counts gets a block of counters, found through a
+ * thread local pointer and linked into a list on first use. Blocks are
+ * only ever added, with a compare and swap, so readers walk the list
+ * without a lock. A reader adds up counters that keep moving, which
+ * gives a snapshot good to within the requests in flight.
+ */
+
+#include "stats.h"
+#include "csapp.h"
+
+/* the counters of a thread, and its connect times */
+typedef struct stats_block_t {
+    stats_t counters;
+    hist_t connect_ns;
+    struct stats_block_t *next;
+} stats_block_t;
+
+static stats_block_t *blocks;  /* all the threads, newest first */
+static __thread stats_block_t *mine;
+
+/* stats_register  -- give this thread its block */
+static stats_block_t *stats_register(void)
+{
+    stats_block_t *b = Calloc(1, sizeof(stats_block_t));
+    hist_init(&b->connect_ns);
+    do {
+        b->next = blocks;
+    } while (!__sync_bool_compare_and_swap(&blocks, b->next, b));
+    mine = b;
+    return b;
+}
+
+stats_t *stats_local(void)
+{
+    return mine ? &mine->counters : &stats_register()->counters;
+}
+
+void stats_connect(long long ns)
+{
+    stats_block_t *b = mine ? mine : stats_register();
+    STATS_ADD(connects, 1);
+    hist_record(&b->connect_ns, ns);
+}
+
+void stats_sum(stats_t *total)
+{
+    stats_block_t *b;
+    memset(total, 0, sizeof(*total));
+    for (b = blocks; b; b = b->next) {
+        const stats_t *c = &b->counters;
+        total->requests += __atomic_load_n(&c->requests, __ATOMIC_RELAXED);
+        total->ram_hits += __atomic_load_n(&c->ram_hits, __ATOMIC_RELAXED);
+        total->disk_hits += __atomic_load_n(&c->disk_hits, __ATOMIC_RELAXED);
+        total->misses += __atomic_load_n(&c->misses, __ATOMIC_RELAXED);
+        total->bytes_in += __atomic_load_n(&c->bytes_in, __ATOMIC_RELAXED);
+        total->bytes_out += __atomic_load_n(&c->bytes_out, __ATOMIC_RELAXED);
+        total->connections +=
+            __atomic_load_n(&c->connections, __ATOMIC_RELAXED);
+        total->active += __atomic_load_n(&c->active, __ATOMIC_RELAXED);
+        total->idle_closes +=
+            __atomic_load_n(&c->idle_closes, __ATOMIC_RELAXED);
+        total->connects += __atomic_load_n(&c->connects, __ATOMIC_RELAXED);
+    }
+}
+
+void stats_connect_hist(hist_t *total)
+{
+    stats_block_t *b;
+    hist_init(total);
+    for (b = blocks; b; b = b->next) {
+        hist_merge(total, &b->connect_ns);
+    }
+}
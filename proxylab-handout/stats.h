@@ -0,0 +1,47 @@
+/*
+ * stats.h  -- per thread counters of the proxy
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "hist.h"
+
+/* what the threads count. Each thread only writes its own counters, so
+ * counting takes no lock and no atomic read-modify-write; stats_sum
+ * adds them up when they are read */
+typedef struct stats_t {
+    long long requests;  /* requests read from the clients */
+    long long ram_hits;  /* answered from the memory cache */
+    long long disk_hits;  /* from the disk tier */
+    long long misses;  /* not in the cache */
+    long long bytes_in;  /* read from clients and servers */
+    long long bytes_out;  /* written to clients and servers */
+    long long connections;  /* client connections served */
+    long long active;  /* client connections being served */
+    long long idle_closes;  /* idle clients closed for queued ones */
+    long long connects;  /* new connections to servers */
+} stats_t;
+
+/* stats_local  -- the counters of this thread, created on first use */
+stats_t *stats_local(void);
+
+/* STATS_ADD  -- add n to a counter of this thread. The store is atomic
+ * so readers never see a torn value, but it is a plain add and store */
+#define STATS_ADD(field, n) do { \
+    stats_t *s_ = stats_local(); \
+    __atomic_store_n(&s_->field, s_->field + (n), __ATOMIC_RELAXED); \
+} while (0)
+
+/* stats_connect  -- count a new server connection that took ns */
+void stats_connect(long long ns);
+
+/* stats_sum  -- the counters of all the threads added up. Takes no lock,
+ * so it may be called from a signal handler
+ */
+void stats_sum(stats_t *total);
+
+/* stats_connect_hist  -- the connect times of all the threads */
+void stats_connect_hist(hist_t *total);
+
+#endif
@@ -5,6 +5,15 @@
 #include "bytes.h"
 #include "csapp.h"
 #include "cache.h"
+#include "sbuf.h"
+#include "http.h"
+#include "connpool.h"
+#include "dnscache.h"
+#include "slab.h"
+#include "inflight.h"
+#include "diskcache.h"
+#include "hist.h"
+#include "stats.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -133,11 +142,1319 @@ void test_cache()
     lru_cache_free(&cache);
 }
 
+/* test_cache_find  -- lookup goes through the hash index, keys are
+ * case insensitive and reinserting a key replaces the old value
+ */
+void test_cache_find()
+{
+    lru_cache_t cache;
+    lru_cache_init(&cache, 1 << 20);
+    char key[MAXLINE];
+    int i;
+    /* enough keys to force the hash index to grow several times */
+    for (i = 0; i < 1000; i++) {
+        sprintf(key, "localhost:80/%d", i);
+        lru_cache_insert(&cache, key, key, strlen(key));
+    }
+    CHECK_EQUAL(cache.count, 1000);
+    for (i = 0; i < 1000; i++) {
+        sprintf(key, "LOCALHOST:80/%d", i);
+        lru_cache_node_t *pnode = lru_cache_find(&cache, key);
+        CHECK_EQUAL(pnode != NULL, 1);
+        CHECK_EQUAL(pnode, cache.sentinel->next);
+    }
+    CHECK_EQUAL(lru_cache_find(&cache, "localhost:80/1000"), NULL);
+
+    lru_cache_insert(&cache, "localhost:80/0", "x", 1);
+    CHECK_EQUAL(cache.count, 1000);
+    CHECK_EQUAL(lru_cache_find(&cache, "localhost:80/0")->value[0], 'x');
+    lru_cache_free(&cache);
+
+    /* evicted nodes must leave the hash index as well */
+    lru_cache_init(&cache, 4);
+    lru_cache_insert(&cache, "a", "aa", 2);
+    lru_cache_insert(&cache, "b", "bb", 2);
+    lru_cache_insert(&cache, "c", "cc", 2);
+    CHECK_EQUAL(lru_cache_find(&cache, "a"), NULL);
+    CHECK_EQUAL(cache.count, 2);
+    lru_cache_free(&cache);
+}
+
+/* test_cache_peek  -- a peeked node gets a second chance before it is
+ * evicted, and a referenced object outlives its eviction
+ */
+void test_cache_peek()
+{
+    lru_cache_t cache;
+    lru_cache_init(&cache, 3);
+    lru_cache_insert(&cache, "a", "a", 1);
+    lru_cache_insert(&cache, "b", "b", 1);
+    lru_cache_insert(&cache, "c", "c", 1);
+
+    /* peek doesn't change the order */
+    lru_cache_node_t *pnode = lru_cache_peek(&cache, "a");
+    CHECK_EQUAL(pnode, lru_cache_tail(&cache));
+    lru_cache_obj_t *obj = lru_cache_obj_get(pnode->obj);
+
+    /* "a" was peeked, so "b" is evicted instead */
+    lru_cache_insert(&cache, "d", "d", 1);
+    CHECK_EQUAL(lru_cache_find(&cache, "b"), NULL);
+    CHECK_EQUAL(lru_cache_tail(&cache)->value[0], 'c');
+
+    /* "a" is evicted this time, but we still hold the object */
+    lru_cache_insert(&cache, "e", "e", 1);
+    lru_cache_insert(&cache, "f", "f", 1);
+    lru_cache_insert(&cache, "g", "g", 1);
+    CHECK_EQUAL(lru_cache_find(&cache, "a"), NULL);
+    CHECK_EQUAL(obj->refcnt, 1);
+    CHECK_EQUAL(obj->data[0], 'a');
+    lru_cache_obj_release(obj);
+
+    /* with every node peeked, the new one still stays */
+    lru_cache_peek(&cache, "e");
+    lru_cache_peek(&cache, "f");
+    lru_cache_peek(&cache, "g");
+    lru_cache_insert(&cache, "h", "h", 1);
+    CHECK_EQUAL(lru_cache_find(&cache, "h") != NULL, 1);
+    lru_cache_free(&cache);
+}
+
+/* test_cache_policies  -- every policy keeps the cache within its size
+ * under random use, and each keeps what it is meant to keep
+ */
+void test_cache_policies()
+{
+    const char *names[] = {"lru", "gdsf", "s3fifo"};
+    char key[MAXLINE], value[1000];
+    lru_cache_t cache;
+    int i, j;
+    memset(value, 'v', sizeof(value));
+    srand(15213);
+    for (i = 0; i < 3; i++) {
+        const lru_cache_policy_t *policy = lru_cache_policy_by_name(names[i]);
+        CHECK_EQUAL(policy != NULL, 1);
+        lru_cache_init_policy(&cache, 2000, policy);
+        for (j = 0; j < 5000; j++) {
+            sprintf(key, "localhost:80/%d", rand() % 100);
+            if (rand() % 2) {
+                lru_cache_peek(&cache, key);
+            } else if (rand() % 2) {
+                lru_cache_find(&cache, key);
+            } else {
+                lru_cache_insert(&cache, key, value, rand() % 200 + 1);
+            }
+            CHECK_EQUAL(cache.cache_size <= 2000, 1);
+        }
+        lru_cache_free(&cache);
+    }
+    CHECK_EQUAL(lru_cache_policy_by_name("fifo"), NULL);
+
+    /* gdsf evicts the large object before small ones that are older */
+    lru_cache_init_policy(&cache, 1000, &lru_cache_gdsf_policy);
+    for (i = 0; i < 5; i++) {
+        sprintf(key, "small/%d", i);
+        lru_cache_insert(&cache, key, value, 10);
+    }
+    lru_cache_insert(&cache, "large", value, 900);
+    lru_cache_insert(&cache, "medium", value, 100);
+    CHECK_EQUAL(lru_cache_find(&cache, "large"), NULL);
+    CHECK_EQUAL(lru_cache_find(&cache, "small/0") != NULL, 1);
+    lru_cache_free(&cache);
+
+    /* s3fifo keeps a used object through a scan of one hit wonders, and
+     * lets a recently evicted key straight into the main queue */
+    lru_cache_init_policy(&cache, 100, &lru_cache_s3fifo_policy);
+    lru_cache_insert(&cache, "hot", value, 10);
+    lru_cache_peek(&cache, "hot");
+    for (i = 0; i < 50; i++) {
+        sprintf(key, "scan/%d", i);
+        lru_cache_insert(&cache, key, value, 10);
+        lru_cache_peek(&cache, "hot");
+    }
+    CHECK_EQUAL(lru_cache_peek(&cache, "hot") != NULL, 1);
+    CHECK_EQUAL(lru_cache_peek(&cache, "scan/0"), NULL);
+    lru_cache_insert(&cache, "scan/0", value, 10);
+    CHECK_EQUAL(lru_cache_peek(&cache, "scan/0")->queue, 1);  /* main */
+    lru_cache_free(&cache);
+}
+
+/* test_shard_cache  -- get/put through the shards */
+void test_shard_cache()
+{
+    shard_cache_t cache;
+    shard_cache_init(&cache, 4, 4 * 1024, NULL);
+    char key[MAXLINE];
+    int i;
+    for (i = 0; i < 64; i++) {
+        sprintf(key, "localhost:80/%d", i);
+        shard_cache_put(&cache, key, key, strlen(key));
+    }
+    for (i = 0; i < 64; i++) {
+        sprintf(key, "localhost:80/%d", i);
+        lru_cache_obj_t *obj = shard_cache_get(&cache, key);
+        CHECK_EQUAL(obj != NULL, 1);
+        CHECK_EQUAL(obj->len, strlen(key));
+        CHECK_EQUAL(memcmp(obj->data, key, obj->len), 0);
+        lru_cache_obj_release(obj);
+    }
+    CHECK_EQUAL(shard_cache_get(&cache, "localhost:80/64"), NULL);
+
+    /* stale objects are still returned, it is up to the caller */
+    lru_cache_obj_t *obj = shard_cache_get(&cache, "localhost:80/0");
+    CHECK_EQUAL(lru_cache_obj_fresh(obj, now_ns()), 1);
+    lru_cache_obj_release(obj);
+    shard_cache_put_until(&cache, "localhost:80/0", "v2", 2, now_ns() - 1);
+    obj = shard_cache_get(&cache, "localhost:80/0");
+    CHECK_EQUAL(obj->len, 2);
+    CHECK_EQUAL(lru_cache_obj_fresh(obj, now_ns()), 0);
+    lru_cache_obj_release(obj);
+    shard_cache_free(&cache);
+}
+
+/* count_evicted  -- an on_evict callback that counts the bytes */
+static void count_evicted(void *arg, const char *key, lru_cache_obj_t *obj)
+{
+    *(size_t *)arg += obj->len;
+}
+
+/* test_shard_cache_evict  -- puts tell about what they evicted */
+void test_shard_cache_evict()
+{
+    shard_cache_t cache;
+    char key[MAXLINE], value[100];
+    size_t evicted = 0;
+    int i;
+    memset(value, 'v', sizeof(value));
+    shard_cache_init(&cache, 1, 1000, NULL);
+    shard_cache_on_evict(&cache, count_evicted, &evicted);
+    for (i = 0; i < 10; i++) {
+        sprintf(key, "localhost:80/%d", i);
+        shard_cache_put(&cache, key, value, sizeof(value));
+    }
+    CHECK_EQUAL(evicted, 0);
+    /* a replaced object is not evicted */
+    shard_cache_put(&cache, "localhost:80/0", value, sizeof(value));
+    CHECK_EQUAL(evicted, 0);
+    shard_cache_put(&cache, "localhost:80/10", value, sizeof(value));
+    CHECK_EQUAL(evicted, sizeof(value));
+
+    /* the totals of the shards */
+    shard_cache_stats_t stats;
+    shard_cache_stats(&cache, &stats);
+    CHECK_EQUAL(stats.evictions, 1);
+    CHECK_EQUAL(stats.count, 10);
+    CHECK_EQUAL(stats.cache_size, 10 * sizeof(value));
+
+    /* and every object, the way shutdown writes them to disk */
+    evicted = 0;
+    shard_cache_foreach(&cache, count_evicted, &evicted);
+    CHECK_EQUAL(evicted, 10 * sizeof(value));
+    shard_cache_free(&cache);
+}
+
+/* test_diskcache  -- objects survive reopening the file, the oldest
+ * ones are overwritten when it is full, and damaged records are not
+ * recovered
+ */
+void test_diskcache()
+{
+    const char *path = "/tmp/proxy-test-diskcache";
+    const size_t capacity = 4096 + 8 * 1024;  /* 8 records of 1 KB */
+    diskcache_t dc;
+    Bytes out;
+    long long expires_ns;
+    char key[MAXLINE], value[600];
+    int i;
+
+    unlink(path);
+    CHECK_EQUAL(diskcache_open(&dc, path, capacity), 0);
+    bytes_malloc(&out);
+    CHECK_EQUAL(diskcache_get(&dc, "localhost:80/0", &out, &expires_ns), 0);
+    for (i = 0; i < 6; i++) {
+        sprintf(key, "localhost:80/%d", i);
+        memset(value, 'a' + i, sizeof(value));
+        diskcache_put(&dc, key, value, sizeof(value),
+                i == 0 ? 0 : now_ns() + 60 * 1000000000LL);
+    }
+    CHECK_EQUAL(dc.count, 6);
+    CHECK_EQUAL(diskcache_get(&dc, "LOCALHOST:80/5", &out, &expires_ns), 1);
+    CHECK_EQUAL(bytes_length(out), sizeof(value));
+    CHECK_EQUAL(bytes_buf(out)[599], 'f');
+    CHECK_EQUAL(expires_ns > now_ns() + 58 * 1000000000LL, 1);
+    /* the same object again is not written again */
+    diskcache_put(&dc, "localhost:80/5", bytes_buf(out), bytes_length(out),
+            0);
+    CHECK_EQUAL(dc.writes, 6);
+    CHECK_EQUAL(dc.skipped, 1);
+    diskcache_close(&dc);
+
+    /* reopen: everything is there */
+    CHECK_EQUAL(diskcache_open(&dc, path, capacity), 0);
+    CHECK_EQUAL(dc.recovered, 6);
+    bytes_free(&out);
+    bytes_malloc(&out);
+    CHECK_EQUAL(diskcache_get(&dc, "localhost:80/0", &out, &expires_ns), 1);
+    CHECK_EQUAL(bytes_buf(out)[0], 'a');
+    CHECK_EQUAL(expires_ns, 0);
+    bytes_free(&out);
+    bytes_malloc(&out);
+    CHECK_EQUAL(diskcache_get(&dc, "localhost:80/5", &out, &expires_ns), 1);
+    CHECK_EQUAL(expires_ns, 0);  /* updated by the skipped put */
+
+    /* 4 more wrap around and overwrite the 2 oldest */
+    for (i = 6; i < 10; i++) {
+        sprintf(key, "localhost:80/%d", i);
+        memset(value, 'a' + i, sizeof(value));
+        diskcache_put(&dc, key, value, sizeof(value), 0);
+    }
+    CHECK_EQUAL(dc.count, 8);
+    CHECK_EQUAL(diskcache_get(&dc, "localhost:80/0", &out, &expires_ns), 0);
+    CHECK_EQUAL(diskcache_get(&dc, "localhost:80/1", &out, &expires_ns), 0);
+    CHECK_EQUAL(diskcache_get(&dc, "localhost:80/2", &out, &expires_ns), 1);
+    CHECK_EQUAL(diskcache_get(&dc, "localhost:80/9", &out, &expires_ns), 1);
+    /* damage the newest record */
+    dc.map[dc.newest->pos + 100] ^= 1;
+    diskcache_close(&dc);
+
+    CHECK_EQUAL(diskcache_open(&dc, path, capacity), 0);
+    CHECK_EQUAL(dc.recovered, 7);
+    CHECK_EQUAL(diskcache_get(&dc, "localhost:80/9", &out, &expires_ns), 0);
+    CHECK_EQUAL(diskcache_get(&dc, "localhost:80/8", &out, &expires_ns), 1);
+    /* the head is after the newest good record */
+    diskcache_put(&dc, "localhost:80/10", value, sizeof(value), 0);
+    CHECK_EQUAL(dc.count, 8);
+    CHECK_EQUAL(diskcache_get(&dc, "localhost:80/2", &out, &expires_ns), 1);
+    diskcache_close(&dc);
+
+    /* another capacity starts over */
+    CHECK_EQUAL(diskcache_open(&dc, path, 2 * capacity), 0);
+    CHECK_EQUAL(dc.count, 0);
+    diskcache_close(&dc);
+    bytes_free(&out);
+    unlink(path);
+}
+
+/* test_slab  -- chunks of every size keep their contents, and pages go
+ * back to the system once their chunks are all freed, except for one
+ * empty page per class
+ */
+void test_slab()
+{
+    const int n = 1000;
+    char *p[1000];
+    slab_stats_t before, stats;
+    int i;
+    size_t j;
+
+    slab_stats(&before);
+    for (i = 0; i < n; i++) {
+        size_t size = (i * 37) % (SLAB_MAX_CHUNK + 512);
+        p[i] = slab_alloc(size);
+        CHECK_EQUAL(p[i] != NULL, 1);
+        CHECK_EQUAL((size_t)p[i] % 16, 0);
+        memset(p[i], i & 0xff, size);
+    }
+    for (i = 0; i < n; i++) {
+        size_t size = (i * 37) % (SLAB_MAX_CHUNK + 512);
+        for (j = 0; j < size; j++) {
+            CHECK_EQUAL((unsigned char)p[i][j], i & 0xff);
+        }
+    }
+    slab_stats(&stats);
+    CHECK_EQUAL(stats.pages > before.pages, 1);
+    CHECK_EQUAL(stats.large_bytes > before.large_bytes, 1);
+    /* free every other chunk, then reuse the holes */
+    for (i = 0; i < n; i += 2) {
+        slab_free(p[i]);
+    }
+    for (i = 0; i < n; i += 2) {
+        p[i] = slab_alloc(100);
+        memset(p[i], 0, 100);
+    }
+    for (i = 0; i < n; i++) {
+        slab_free(p[i]);
+    }
+    slab_stats(&stats);
+    CHECK_EQUAL(stats.pages - stats.empty_pages,
+            before.pages - before.empty_pages);
+    CHECK_EQUAL(stats.chunk_bytes, before.chunk_bytes);
+    CHECK_EQUAL(stats.large_bytes, before.large_bytes);
+
+    /* a class going back and forth between zero and one chunk reuses
+     * its empty page */
+    slab_stats(&before);
+    for (i = 0; i < 100; i++) {
+        p[0] = slab_alloc(100);
+        slab_stats(&stats);
+        CHECK_EQUAL(stats.pages, before.pages);
+        slab_free(p[0]);
+    }
+    slab_stats(&stats);
+    CHECK_EQUAL(stats.pages, before.pages);
+    CHECK_EQUAL(stats.empty_pages, before.empty_pages);
+}
+
+/* test_sbuf  -- items come out in FIFO order and every removal is
+ * counted in the wait statistics
+ */
+void test_sbuf()
+{
+    sbuf_t sbuf;
+    int i;
+    sbuf_init(&sbuf, 4);
+    for (i = 0; i < 10; i++) {
+        sbuf_insert(&sbuf, i);
+        sbuf_insert(&sbuf, i + 100);
+        CHECK_EQUAL(sbuf_waiting(&sbuf), 2);
+        CHECK_EQUAL(sbuf_remove(&sbuf), i);
+        CHECK_EQUAL(sbuf_remove(&sbuf), i + 100);
+    }
+    CHECK_EQUAL(sbuf_waiting(&sbuf), 0);
+    CHECK_EQUAL(sbuf.wait_count, 20);
+    CHECK_EQUAL(sbuf.wait_max_ns >= 0, 1);
+    CHECK_EQUAL(sbuf.wait_total_ns >= sbuf.wait_max_ns, 1);
+    sbuf_deinit(&sbuf);
+}
+
+/* feed_bytewise  -- feed the response one byte at a time. Return the
+ * number of bytes that belong to it */
+size_t feed_bytewise(http_framing_t *f, const char *resp)
+{
+    size_t i, used = 0;
+    for (i = 0; resp[i]; i++) {
+        used += http_framing_feed(f, resp + i, 1);
+    }
+    return used;
+}
+
+/* test_http_framing  -- test finding the end of responses */
+void test_http_framing()
+{
+    http_framing_t f;
+
+    /* Content-Length, with the next response right behind */
+    const char *length = "HTTP/1.1 200 OK\r\n"
+        "Content-Length: 5\r\n"
+        "\r\n"
+        "helloHTTP/1.1";
+    http_framing_init(&f);
+    CHECK_EQUAL(http_framing_feed(&f, length, strlen(length)),
+            strlen(length) - 8);
+    CHECK_EQUAL(f.state, FRAMING_DONE);
+    CHECK_EQUAL(f.keep_alive, 1);
+    CHECK_EQUAL(f.content_length, 5);
+
+    /* chunked, split at every byte */
+    const char *chunked = "HTTP/1.1 200 OK\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "\r\n"
+        "5\r\nhello\r\n"
+        "a;ext=1\r\n0123456789\r\n"
+        "0\r\n"
+        "Trailer: x\r\n"
+        "\r\n";
+    http_framing_init(&f);
+    CHECK_EQUAL(feed_bytewise(&f, chunked), strlen(chunked));
+    CHECK_EQUAL(f.state, FRAMING_DONE);
+    CHECK_EQUAL(f.keep_alive, 1);
+
+    /* HTTP/1.0 without a length ends at close */
+    const char *until_close = "HTTP/1.0 200 OK\r\n"
+        "\r\n"
+        "hello";
+    http_framing_init(&f);
+    CHECK_EQUAL(http_framing_feed(&f, until_close, strlen(until_close)),
+            strlen(until_close));
+    CHECK_EQUAL(f.state, FRAMING_UNTIL_CLOSE);
+    CHECK_EQUAL(f.keep_alive, 0);
+
+    /* Connection: close and keep-alive override the version default */
+    const char *close = "HTTP/1.1 200 OK\r\n"
+        "connection: close\r\n"
+        "Content-length: 0\r\n"
+        "\r\n";
+    http_framing_init(&f);
+    CHECK_EQUAL(feed_bytewise(&f, close), strlen(close));
+    CHECK_EQUAL(f.state, FRAMING_DONE);
+    CHECK_EQUAL(f.keep_alive, 0);
+    const char *keep = "HTTP/1.0 304 Not Modified\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n";
+    http_framing_init(&f);
+    CHECK_EQUAL(feed_bytewise(&f, keep), strlen(keep));
+    CHECK_EQUAL(f.state, FRAMING_DONE);
+    CHECK_EQUAL(f.keep_alive, 1);
+
+    /* a header line longer than MAXLINE gives up inside the head, which
+     * forward_response relays as it is */
+    char long_head[MAXLINE + 64];
+    sprintf(long_head, "HTTP/1.1 200 OK\r\nX-Long: %0*d\r\n\r\n",
+            MAXLINE, 0);
+    http_framing_init(&f);
+    http_framing_feed(&f, long_head, strlen(long_head));
+    CHECK_EQUAL(f.state, FRAMING_UNTIL_CLOSE);
+    CHECK_EQUAL(f.header_len, 0);
+    CHECK_EQUAL(f.keep_alive, 0);
+}
+
+/* test_http_dechunk  -- decoding a chunked response for an HTTP/1.0
+ * client */
+void test_http_dechunk()
+{
+    http_framing_t f;
+    char out[MAXBUF];
+    size_t i, len;
+    const char *head = "HTTP/1.1 200 OK\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "Content-Length: 99\r\n"
+        "Server: tiny\r\n"
+        "\r\n";
+    const char *body = "5\r\nhello\r\n"
+        "a;ext=1\r\n0123456789\r\n"
+        "0\r\n"
+        "Trailer: x\r\n"
+        "\r\n";
+
+    len = http_dechunk_head(out, head, strlen(head), -1);
+    out[len] = '\0';
+    CHECK_STREQUAL(out, "HTTP/1.1 200 OK\r\nServer: tiny\r\n\r\n");
+    len = http_dechunk_head(out, head, strlen(head), 15);
+    out[len] = '\0';
+    CHECK_STREQUAL(out, "HTTP/1.1 200 OK\r\nServer: tiny\r\n"
+            "Content-Length: 15\r\n\r\n");
+
+    /* at once, and in place */
+    http_dechunk_init(&f);
+    strcpy(out, body);
+    len = http_dechunk(&f, out, strlen(out), out);
+    out[len] = '\0';
+    CHECK_STREQUAL(out, "hello0123456789");
+    CHECK_EQUAL(f.state, FRAMING_DONE);
+
+    /* split at every byte */
+    http_dechunk_init(&f);
+    for (i = 0, len = 0; body[i]; i++) {
+        len += http_dechunk(&f, body + i, 1, out + len);
+    }
+    out[len] = '\0';
+    CHECK_STREQUAL(out, "hello0123456789");
+    CHECK_EQUAL(f.state, FRAMING_DONE);
+}
+
+/* view_is  -- whether the view is exactly s */
+static int view_is(http_view_t v, const char *s)
+{
+    return v.len == strlen(s) && memcmp(v.ptr, s, v.len) == 0;
+}
+
+/* parse_all  -- parse a whole request head at once */
+static int parse_all(http_request_t *req, const char *head)
+{
+    http_request_init(req);
+    return http_request_parse(req, head, strlen(head));
+}
+
+static char writev_big[256 * 1024];
+
+/* writev_thread  -- write "<", nothing, the big buffer and ">>" in one
+ * gathered write to the pipe fd, and close it
+ */
+static void *writev_thread(void *arg)
+{
+    int fd = *(int *)arg;
+    struct iovec iov[4];
+    iov[0].iov_base = "<";
+    iov[0].iov_len = 1;
+    iov[1].iov_base = "";
+    iov[1].iov_len = 0;
+    iov[2].iov_base = writev_big;
+    iov[2].iov_len = sizeof(writev_big);
+    iov[3].iov_base = ">>";
+    iov[3].iov_len = 2;
+    CHECK_EQUAL(rio_writev(fd, iov, 4), sizeof(writev_big) + 3);
+    close(fd);
+    return NULL;
+}
+
+/* test_rio_writev  -- the buffers of a gathered write arrive in order,
+ * empty ones included, also when they don't fit the pipe at once
+ */
+void test_rio_writev()
+{
+    static char got[sizeof(writev_big) + 3];
+    pthread_t tid;
+    int fds[2];
+    size_t i;
+
+    for (i = 0; i < sizeof(writev_big); i++) {
+        writev_big[i] = 'a' + i % 26;
+    }
+    CHECK_EQUAL(pipe(fds), 0);
+    pthread_create(&tid, NULL, writev_thread, &fds[1]);
+    CHECK_EQUAL(rio_readn(fds[0], got, sizeof(got)), sizeof(got));
+    pthread_join(tid, NULL);
+    CHECK_EQUAL(got[0], '<');
+    CHECK_EQUAL(memcmp(got + 1, writev_big, sizeof(writev_big)), 0);
+    CHECK_EQUAL(got[sizeof(got) - 1], '>');
+    CHECK_EQUAL(got[sizeof(got) - 2], '>');
+    close(fds[0]);
+}
+
+/* test_http_request_parse  -- requests are parsed into views of the
+ * head and forwarded with the connection headers rewritten
+ */
+void test_http_request_parse()
+{
+    http_request_t req;
+    const char *head = "GET http://WWW.cmu.edu:8080/hub/index.html HTTP/1.1\r\n"
+        "Host: www.cmu.edu:8080\r\n"
+        "User-Agent: curl\r\n"
+        "X-Spaces:   a b  \r\n"
+        "Empty:\r\n"
+        "\r\n"
+        "GET /next HTTP/1.1\r\n";
+    CHECK_EQUAL(parse_all(&req, head), HTTP_PARSE_DONE);
+    CHECK_EQUAL(req.pos, strlen(head) - strlen("GET /next HTTP/1.1\r\n"));
+    CHECK_EQUAL(view_is(req.method, "GET"), 1);
+    CHECK_EQUAL(view_is(req.version, "HTTP/1.1"), 1);
+    CHECK_EQUAL(view_is(req.host, "WWW.cmu.edu"), 1);
+    CHECK_EQUAL(view_is(req.port, "8080"), 1);
+    CHECK_EQUAL(view_is(req.dir, "/hub/index.html"), 1);
+    CHECK_EQUAL(req.nheaders, 4);
+    CHECK_EQUAL(view_is(req.headers[2].name, "X-Spaces"), 1);
+    CHECK_EQUAL(view_is(req.headers[2].value, "a b"), 1);
+    CHECK_EQUAL(view_is(req.headers[3].value, ""), 1);
+    /* views point into the head */
+    CHECK_EQUAL(req.headers[0].name.ptr, strstr(head, "Host"));
+    CHECK_EQUAL(http_request_has(&req, "user-agent"), 1);
+    CHECK_EQUAL(http_request_has(&req, "Authorization"), 0);
+
+    char host[HTTP_HOST_MAX], port[HTTP_PORT_MAX], key[MAXLINE];
+    CHECK_EQUAL(http_request_target(&req, host, port, key, sizeof(key)), 0);
+    CHECK_STREQUAL(host, "www.cmu.edu");
+    CHECK_STREQUAL(port, "8080");
+    CHECK_STREQUAL(key, "www.cmu.edu:8080/hub/index.html");
+    CHECK_EQUAL(http_request_target(&req, host, port, key, 10), -1);
+
+    char request[MAXBUF];
+    http_writer_t w;
+    int i, has_host = 0, keep_alive = 1;
+    http_writer_init(&w, request, sizeof(request));
+    http_request_line(&w, &req, 1);
+    for (i = 0; i < req.nheaders; i++) {
+        http_request_header(&w, &req.headers[i], &has_host, &keep_alive);
+    }
+    CHECK_EQUAL(has_host, 1);
+    http_request_end(&w, has_host, host, port, 1);
+    CHECK_EQUAL(w.overflow, 0);
+    CHECK_EQUAL(w.len, strlen(request));
+    CHECK_EQUAL(strncmp(request, "GET /hub/index.html HTTP/1.1\r\n"
+                "Host: www.cmu.edu:8080\r\n"
+                "X-Spaces: a b\r\n"
+                "Empty: \r\n"
+                "User-Agent: Mozilla", 87), 0);
+    CHECK_STREQUAL(request + w.len - 26, "Connection: keep-alive\r\n\r\n");
+
+    /* a request that doesn't fit is cut, and says so */
+    char small[32];
+    http_writer_init(&w, small, sizeof(small));
+    http_request_line(&w, &req, 1);
+    http_request_end(&w, 0, host, port, 1);
+    CHECK_EQUAL(w.overflow, 1);
+    CHECK_EQUAL(strlen(small), w.len);
+
+    /* the port and dir are optional, and lines may end with "\n" */
+    CHECK_EQUAL(parse_all(&req, "GET example.com HTTP/1.0\n\n"),
+            HTTP_PARSE_DONE);
+    CHECK_EQUAL(view_is(req.port, "80"), 1);
+    CHECK_EQUAL(view_is(req.dir, "/"), 1);
+
+    /* fed a byte at a time, it is done at the last byte only */
+    http_request_init(&req);
+    size_t len = strlen(head) - strlen("GET /next HTTP/1.1\r\n");
+    for (i = 1; i < (int)len; i++) {
+        CHECK_EQUAL(http_request_parse(&req, head, i), HTTP_PARSE_MORE);
+    }
+    CHECK_EQUAL(http_request_parse(&req, head, len), HTTP_PARSE_DONE);
+    CHECK_EQUAL(req.nheaders, 4);
+
+    /* malformed heads */
+    const char *bad[] = {
+        "GET / HTTP/1.1\r\n\r\n",  /* no host */
+        "GET http://a.com\r\n\r\n",  /* no version */
+        "GET http://a.com HTTP/1.1 x\r\n\r\n",
+        "GET http://a.com FTP/1.1\r\n\r\n",
+        "GET http://a.com HTTP/1.1\r\nHost\r\n\r\n",  /* no colon */
+        "GET http://a.com HTTP/1.1\r\n: x\r\n\r\n",  /* no name */
+        "GET http://a.com HTTP/1.1\r\nHost : a.com\r\n\r\n",
+        "GET http://a.com HTTP/1.1\r\nA: b\r\n folded\r\n\r\n",
+        "GET http://a.com HTTP/1.1\r\nA: b\rB: c\r\n\r\n",  /* bare CR */
+        "GET http://a.com: HTTP/1.1\r\n\r\n",  /* empty port */
+        "GET http://a.com:http/ HTTP/1.1\r\n\r\n",
+    };
+    for (i = 0; i < (int)(sizeof(bad) / sizeof(bad[0])); i++) {
+        CHECK_EQUAL(parse_all(&req, bad[i]), HTTP_PARSE_ERROR);
+    }
+    const char nul[] = "GET http://a.com HTTP/1.1\r\nA: \0b\r\n\r\n";
+    http_request_init(&req);
+    CHECK_EQUAL(http_request_parse(&req, nul, sizeof(nul) - 1),
+            HTTP_PARSE_ERROR);
+
+    /* too many headers */
+    Bytes many;
+    bytes_malloc(&many);
+    bytes_append(&many, "GET http://a.com HTTP/1.1\r\n");
+    for (i = 0; i <= HTTP_MAX_HEADERS; i++) {
+        bytes_append(&many, "A: b\r\n");
+    }
+    bytes_append(&many, "\r\n");
+    http_request_init(&req);
+    CHECK_EQUAL(http_request_parse(&req, bytes_buf(many),
+                bytes_length(many)), HTTP_PARSE_ERROR);
+    bytes_free(&many);
+}
+
+/* check_view  -- a view of a parsed head lies inside it, or is one of
+ * the defaults, and holds no line break or NUL
+ */
+static void check_view(http_view_t v, const char *buf, size_t len)
+{
+    size_t i;
+    CHECK_EQUAL((v.ptr >= buf && v.ptr + v.len <= buf + len) ||
+            view_is(v, "80") || view_is(v, "/"), 1);
+    for (i = 0; i < v.len; i++) {
+        CHECK_EQUAL(v.ptr[i] != '\r' && v.ptr[i] != '\n' &&
+                v.ptr[i] != '\0', 1);
+    }
+}
+
+/* test_http_request_fuzz  -- parse random mutations of valid heads.
+ * Each input is in a buffer of its exact size, so that a sanitizer
+ * build catches reads past it. Parsing in random pieces must give what
+ * parsing at once gives, and whatever is accepted must be forwarded
+ * as a request that parses again with the same headers
+ */
+void test_http_request_fuzz()
+{
+    const char *seeds[] = {
+        "GET http://localhost:8080/a/b.html?x=1 HTTP/1.1\r\n"
+            "Host: localhost:8080\r\nAccept: */*\r\n"
+            "Connection: keep-alive\r\nIf-None-Match: \"v1\"\r\n\r\n",
+        "GET localhost/ HTTP/1.0\nUser-Agent: x\n\n",
+        "GET https://a.com:443 HTTP/1.1\r\nX: \t y \t\r\n\r\n",
+    };
+    const char alphabet[] = " \t:\r\n\0aZ/\xff";
+    const int rounds = 200000;
+    char input[512], request[MAXBUF];
+    int round;
+
+    srand(15213);
+    for (round = 0; round < rounds; round++) {
+        const char *seed = seeds[rand() % 3];
+        size_t len = strlen(seed), i;
+        int nmut = rand() % 4, m;
+        memcpy(input, seed, len);
+        for (m = 0; m < nmut; m++) {
+            size_t at = rand() % len;
+            char c = rand() % 2 ? alphabet[rand() % (sizeof(alphabet) - 1)] :
+                (char)rand();
+            switch (rand() % 3) {
+            case 0:  /* replace a byte */
+                input[at] = c;
+                break;
+            case 1:  /* insert a byte */
+                if (len < sizeof(input)) {
+                    memmove(input + at + 1, input + at, len - at);
+                    input[at] = c;
+                    len++;
+                }
+                break;
+            default:  /* cut the head */
+                len = at + 1;
+            }
+        }
+        char *buf = malloc(len);
+        memcpy(buf, input, len);
+
+        http_request_t whole, pieces;
+        http_request_init(&whole);
+        int rc = http_request_parse(&whole, buf, len);
+        http_request_init(&pieces);
+        size_t fed = 0;
+        while (fed < len && http_request_parse(&pieces, buf, fed)
+                == HTTP_PARSE_MORE) {
+            fed += 1 + rand() % 16;
+            fed = fed > len ? len : fed;
+        }
+        CHECK_EQUAL(http_request_parse(&pieces, buf, len), rc);
+
+        if (rc == HTTP_PARSE_DONE) {
+            CHECK_EQUAL(pieces.pos, whole.pos);
+            CHECK_EQUAL(pieces.nheaders, whole.nheaders);
+            check_view(whole.method, buf, whole.pos);
+            check_view(whole.uri, buf, whole.pos);
+            check_view(whole.host, buf, whole.pos);
+            check_view(whole.port, buf, whole.pos);
+            check_view(whole.dir, buf, whole.pos);
+            for (i = 0; i < (size_t)whole.nheaders; i++) {
+                check_view(whole.headers[i].name, buf, whole.pos);
+                check_view(whole.headers[i].value, buf, whole.pos);
+                CHECK_EQUAL(whole.headers[i].value.ptr,
+                        pieces.headers[i].value.ptr);
+            }
+
+            char host[HTTP_HOST_MAX], port[HTTP_PORT_MAX], key[MAXLINE];
+            http_writer_t w;
+            int has_host = 0, keep_alive = 1;
+            if (http_request_target(&whole, host, port, key,
+                        sizeof(key)) < 0) {
+                free(buf);
+                continue;
+            }
+            http_writer_init(&w, request, sizeof(request));
+            http_request_line(&w, &whole, 1);
+            for (i = 0; i < (size_t)whole.nheaders; i++) {
+                http_request_header(&w, &whole.headers[i], &has_host,
+                        &keep_alive);
+            }
+            http_request_end(&w, has_host, host, port, 1);
+            CHECK_EQUAL(w.overflow, 0);
+
+            /* the forwarded request line has no scheme or host, so
+             * parse it in origin form: put the host back in front */
+            char again[MAXBUF + HTTP_HOST_MAX];
+            char *sp = strchr(request, ' ');
+            sprintf(again, "%.*s http://%s:%s%s", (int)(sp - request),
+                    request, host, port, sp + 1);
+            http_request_t fwd;
+            CHECK_EQUAL(parse_all(&fwd, again), HTTP_PARSE_DONE);
+            CHECK_EQUAL(fwd.pos, strlen(again));
+        }
+        free(buf);
+    }
+}
+
+/* test_http_connection  -- test the connection headers of requests
+ * and responses */
+void test_http_connection()
+{
+    char request[MAXBUF];
+    const char *client = "GET http://Example.com/ HTTP/1.1\r\n"
+        "Proxy-Connection: close\r\n"
+        "Connection:  keep-alive \r\n"
+        "\r\n";
+    http_request_t req;
+    http_writer_t w;
+    int has_host = 0, keep_alive = 1;
+    http_request_init(&req);
+    CHECK_EQUAL(http_request_parse(&req, client, strlen(client)),
+            HTTP_PARSE_DONE);
+    http_writer_init(&w, request, sizeof(request));
+    http_request_header(&w, &req.headers[0], &has_host, &keep_alive);
+    CHECK_EQUAL(keep_alive, 0);
+    http_request_header(&w, &req.headers[1], &has_host, &keep_alive);
+    CHECK_EQUAL(keep_alive, 1);
+    CHECK_STREQUAL(request, "");
+
+    const char *head = "HTTP/1.1 200 OK\r\n"
+        "Connection: close\r\n"
+        "Content-Length: 2\r\n"
+        "Keep-Alive: timeout=5\r\n"
+        "\r\n";
+    char out[MAXBUF];
+    size_t len = http_response_head(out, head, strlen(head), 1, 0);
+    out[len] = '\0';
+    CHECK_STREQUAL(out, "HTTP/1.1 200 OK\r\n"
+            "Content-Length: 2\r\n"
+            "X-Cache: MISS\r\n"
+            "Connection: keep-alive\r\n"
+            "\r\n");
+
+    /* the X-Cache of a server behind the proxy is replaced */
+    const char *cached = "HTTP/1.0 200 OK\r\n"
+        "X-Cache: MISS\r\n"
+        "\r\n";
+    len = http_response_head(out, cached, strlen(cached), 0, 1);
+    out[len] = '\0';
+    CHECK_STREQUAL(out, "HTTP/1.0 200 OK\r\n"
+            "X-Cache: HIT\r\n"
+            "Connection: close\r\n"
+            "\r\n");
+
+    /* header_len covers the head of a response fed in pieces */
+    http_framing_t f;
+    http_framing_init(&f);
+    feed_bytewise(&f, head);
+    CHECK_EQUAL(f.header_len, strlen(head));
+}
+
+/* test_http_cache_info  -- freshness and validators of responses */
+void test_http_cache_info()
+{
+    http_cache_info_t info;
+    char request_buf[MAXBUF];
+    http_writer_t w;
+    time_t now = 784111777;  /* Sun, 06 Nov 1994 08:49:37 GMT */
+    const char *fresh =
+        "HTTP/1.1 200 OK\r\n"
+        "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+        "Cache-Control: public, max-age=300\r\n"
+        "ETag: \"v1\"\r\n"
+        "Last-Modified: Sat, 05 Nov 1994 08:49:37 GMT\r\n"
+        "\r\n"
+        "Cache-Control: no-store\r\n";  /* the body, not a header */
+
+    http_cache_info_init(&info);
+    http_cache_info_parse(&info, fresh, strlen(fresh));
+    CHECK_EQUAL(info.status, 200);
+    CHECK_EQUAL(info.max_age, 300);
+    CHECK_EQUAL(info.date, now);
+    CHECK_EQUAL(info.last_modified, now - 24 * 60 * 60);
+    CHECK_STREQUAL(info.etag, "\"v1\"");
+    CHECK_EQUAL(http_cacheable(&info), 1);
+    CHECK_EQUAL(info.shared, 1);
+    CHECK_EQUAL(http_fresh_for(&info, now, 60), 300);
+    CHECK_EQUAL(http_fresh_for(&info, now + 100, 60), 200);
+    CHECK_EQUAL(http_fresh_for(&info, now + 400, 60), -100);
+
+    /* a 304 laid over it restarts the freshness */
+    const char *not_modified =
+        "HTTP/1.1 304 Not Modified\r\n"
+        "Date: Sun, 06 Nov 1994 08:59:37 GMT\r\n"
+        "\r\n";
+    http_cache_info_parse(&info, not_modified, strlen(not_modified));
+    CHECK_EQUAL(info.status, 304);
+    CHECK_EQUAL(http_fresh_for(&info, now + 600, 60), 300);
+
+    /* and its headers replace the stored ones, except for framing */
+    const char *updated =
+        "HTTP/1.1 304 Not Modified\r\n"
+        "date: Sun, 06 Nov 1994 08:59:37 GMT\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: keep-alive\r\n"
+        "ETag: \"v1\"\r\n"
+        "\r\n";
+    const char *stored =
+        "HTTP/1.1 200 OK\r\n"
+        "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+        "Content-Length: 2\r\n"
+        "ETag: \"v1\"\r\n"
+        "Server: tiny\r\n"
+        "\r\n";
+    char merged[MAXBUF];
+    size_t merged_len = http_response_merge(merged, stored, strlen(stored),
+            updated, strlen(updated));
+    merged[merged_len] = '\0';
+    CHECK_STREQUAL(merged, "HTTP/1.1 200 OK\r\n"
+            "Content-Length: 2\r\n"
+            "Server: tiny\r\n"
+            "date: Sun, 06 Nov 1994 08:59:37 GMT\r\n"
+            "ETag: \"v1\"\r\n"
+            "\r\n");
+
+    http_writer_init(&w, request_buf, sizeof(request_buf));
+    http_write_str(&w, "GET / HTTP/1.1\r\n");
+    CHECK_EQUAL(http_request_conditional(&w, &info), 1);
+    CHECK_STREQUAL(request_buf, "GET / HTTP/1.1\r\n"
+            "If-None-Match: \"v1\"\r\n"
+            "If-Modified-Since: Sat, 05 Nov 1994 08:49:37 GMT\r\n");
+
+    /* s-maxage wins over max-age, Age counts against it */
+    http_cache_info_init(&info);
+    const char *shared =
+        "HTTP/1.0 200 OK\r\n"
+        "Cache-Control: s-maxage=100,max-age=10\r\n"
+        "Age: 30\r\n"
+        "\r\n";
+    http_cache_info_parse(&info, shared, strlen(shared));
+    CHECK_EQUAL(http_fresh_for(&info, now, 60), 70);
+    CHECK_EQUAL(info.shared, 1);
+
+    /* Expires, and the heuristic of Last-Modified */
+    http_cache_info_init(&info);
+    const char *expires =
+        "HTTP/1.0 200 OK\r\n"
+        "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+        "Expires: Sun, 06 Nov 1994 09:49:37 GMT\r\n"
+        "\r\n";
+    http_cache_info_parse(&info, expires, strlen(expires));
+    CHECK_EQUAL(http_fresh_for(&info, now, 60), 3600);
+    CHECK_EQUAL(info.shared, 0);
+    info.has_expires = 0;
+    info.last_modified = now - 1000;
+    CHECK_EQUAL(http_fresh_for(&info, now, 60), 100);
+    info.last_modified = -1;
+    CHECK_EQUAL(http_fresh_for(&info, now, 60), 60);
+
+    /* an invalid Expires is in the past, and no validator means it is
+     * not worth storing */
+    http_cache_info_init(&info);
+    const char *expired = "HTTP/1.0 200 OK\r\nExpires: 0\r\n\r\n";
+    http_cache_info_parse(&info, expired, strlen(expired));
+    CHECK_EQUAL(http_fresh_for(&info, now, 60) <= 0, 1);
+    CHECK_EQUAL(http_cache_expires(&info, 60), -1);
+    http_writer_init(&w, request_buf, sizeof(request_buf));
+    CHECK_EQUAL(http_request_conditional(&w, &info), 0);
+    CHECK_EQUAL(w.len, 0);
+
+    /* responses a shared cache must not store */
+    const char *private = "HTTP/1.1 200 OK\r\n"
+        "Cache-Control: private, max-age=60\r\n\r\n";
+    const char *no_store = "HTTP/1.1 200 OK\r\n"
+        "cache-control: no-store\r\n\r\n";
+    const char *cookie = "HTTP/1.1 200 OK\r\n"
+        "Set-Cookie: id=1\r\nCache-Control: max-age=60\r\n\r\n";
+    const char *vary = "HTTP/1.1 200 OK\r\n"
+        "Vary: Accept-Encoding, Cookie\r\n\r\n";
+    const char *vary_all = "HTTP/1.1 200 OK\r\nVary: *\r\n\r\n";
+    const char *server_error = "HTTP/1.1 500 Oops\r\n\r\n";
+    const char *no_cache = "HTTP/1.1 200 OK\r\n"
+        "Pragma: no-cache\r\nETag: \"x\"\r\n\r\n";
+    http_cache_info_init(&info);
+    http_cache_info_parse(&info, private, strlen(private));
+    CHECK_EQUAL(http_cacheable(&info), 0);
+    http_cache_info_init(&info);
+    http_cache_info_parse(&info, no_store, strlen(no_store));
+    CHECK_EQUAL(http_cacheable(&info), 0);
+    http_cache_info_init(&info);
+    http_cache_info_parse(&info, cookie, strlen(cookie));
+    CHECK_EQUAL(http_cacheable(&info), 0);
+    http_cache_info_init(&info);
+    http_cache_info_parse(&info, vary, strlen(vary));
+    CHECK_EQUAL(http_cacheable(&info), 0);
+    http_cache_info_init(&info);
+    http_cache_info_parse(&info, vary_all, strlen(vary_all));
+    CHECK_EQUAL(http_cacheable(&info), 0);
+    http_cache_info_init(&info);
+    http_cache_info_parse(&info, server_error, strlen(server_error));
+    CHECK_EQUAL(http_cache_expires(&info, 60), -1);
+    /* the proxy sends the same Accept-Encoding and User-Agent for every
+     * client, so those don't make variants */
+    const char *vary_forced = "HTTP/1.1 200 OK\r\n"
+        "Vary: accept-encoding,User-Agent \r\n\r\n";
+    http_cache_info_init(&info);
+    http_cache_info_parse(&info, vary_forced, strlen(vary_forced));
+    CHECK_EQUAL(http_cacheable(&info), 1);
+    /* no-cache is stored, but stale from the start */
+    http_cache_info_init(&info);
+    http_cache_info_parse(&info, no_cache, strlen(no_cache));
+    long long before = now_ns();
+    long long expires_ns = http_cache_expires(&info, 60);
+    CHECK_EQUAL(expires_ns >= before && expires_ns <= now_ns(), 1);
+}
+
+/* test_connpool  -- test keeping idle connections. Socket pairs stand
+ * in for server connections */
+void test_connpool()
+{
+    connpool_t pool;
+    int sv[3][2], i;
+    for (i = 0; i < 3; i++) {
+        CHECK_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i]), 0);
+    }
+
+    connpool_init(&pool, 4, 1, 1000000000LL, NULL);
+    CHECK_EQUAL(connpool_take(&pool, "a", "80"), -1);
+    connpool_put(&pool, "a", "80", sv[0][0]);
+    CHECK_EQUAL(pool.nidle, 1);
+    /* over the per host limit, closed */
+    connpool_put(&pool, "a", "80", sv[1][0]);
+    CHECK_EQUAL(pool.nidle, 1);
+    connpool_put(&pool, "b", "80", sv[2][0]);
+    CHECK_EQUAL(connpool_take(&pool, "a", "8080"), -1);
+    CHECK_EQUAL(connpool_take(&pool, "a", "80"), sv[0][0]);
+    CHECK_EQUAL(connpool_take(&pool, "a", "80"), -1);
+    CHECK_EQUAL(pool.reused, 1);
+
+    /* a connection closed by the server is dropped */
+    close(sv[2][1]);
+    CHECK_EQUAL(connpool_take(&pool, "b", "80"), -1);
+    CHECK_EQUAL(pool.nidle, 0);
+    connpool_free(&pool);
+
+    /* idle connections time out */
+    connpool_init(&pool, 4, 4, 0, NULL);
+    connpool_put(&pool, "a", "80", sv[0][0]);
+    CHECK_EQUAL(connpool_take(&pool, "a", "80"), -1);
+    connpool_free(&pool);
+    close(sv[0][1]);
+    close(sv[1][1]);
+}
+
+/* a hosts file standing in for the resolver of the system */
+static const char *test_hosts =
+    "# address names\n"
+    "127.0.0.1 localhost loopback\n"
+    "10.0.0.2 www.example.com example.com\n";
+static int test_resolves;  /* calls of hosts_resolve */
+
+/* hosts_resolve  -- resolve from test_hosts */
+int hosts_resolve(const char *host, const char *port,
+        dns_addr_t *addrs, int max)
+{
+    char buf[MAXLINE], *line, *saveptr, *name;
+    test_resolves++;
+    strcpy(buf, test_hosts);
+    for (line = strtok_r(buf, "\n", &saveptr); line;
+            line = strtok_r(NULL, "\n", &saveptr)) {
+        char *saveptr2, *address = strtok_r(line, " ", &saveptr2);
+        if (address[0] == '#') {
+            continue;
+        }
+        while ((name = strtok_r(NULL, " ", &saveptr2)) != NULL) {
+            if (strcasecmp(name, host) == 0 && max > 0) {
+                struct sockaddr_in *sin =
+                    (struct sockaddr_in *)&addrs[0].addr;
+                memset(&addrs[0], 0, sizeof(dns_addr_t));
+                addrs[0].family = AF_INET;
+                addrs[0].socktype = SOCK_STREAM;
+                addrs[0].addrlen = sizeof(struct sockaddr_in);
+                sin->sin_family = AF_INET;
+                sin->sin_port = htons(atoi(port));
+                inet_pton(AF_INET, address, &sin->sin_addr);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* test_dnscache  -- test caching lookups, failed ones too */
+void test_dnscache()
+{
+    dnscache_t dc;
+    dns_addr_t addr;
+    struct sockaddr_in *sin = (struct sockaddr_in *)&addr.addr;
+    test_resolves = 0;
+
+    dnscache_init(&dc, 2, 1000000000LL, 1000000000LL, hosts_resolve);
+    CHECK_EQUAL(dnscache_lookup(&dc, "Example.com", "80", &addr, 1), 1);
+    CHECK_EQUAL(sin->sin_addr.s_addr, htonl(0x0a000002));
+    CHECK_EQUAL(ntohs(sin->sin_port), 80);
+    /* from memory, the host name is case insensitive */
+    CHECK_EQUAL(dnscache_lookup(&dc, "example.com", "80", &addr, 1), 1);
+    CHECK_EQUAL(test_resolves, 1);
+    /* the port is part of the key */
+    CHECK_EQUAL(dnscache_lookup(&dc, "example.com", "8080", &addr, 1), 1);
+    CHECK_EQUAL(test_resolves, 2);
+    CHECK_EQUAL(dc.hits, 1);
+    CHECK_EQUAL(dc.misses, 2);
+
+    /* a failed lookup is cached, and drops the oldest entry */
+    CHECK_EQUAL(dnscache_lookup(&dc, "nowhere", "80", &addr, 1), 0);
+    CHECK_EQUAL(dnscache_lookup(&dc, "nowhere", "80", &addr, 1), 0);
+    CHECK_EQUAL(test_resolves, 3);
+    CHECK_EQUAL(dc.count, 2);
+    CHECK_EQUAL(dnscache_lookup(&dc, "example.com", "80", &addr, 1), 1);
+    CHECK_EQUAL(test_resolves, 4);
+
+    dnscache_forget(&dc, "example.com", "80");
+    CHECK_EQUAL(dc.count, 1);
+    dnscache_free(&dc);
+
+    /* entries expire */
+    dnscache_init(&dc, 8, 0, 0, hosts_resolve);
+    dnscache_lookup(&dc, "localhost", "80", &addr, 1);
+    dnscache_lookup(&dc, "localhost", "80", &addr, 1);
+    CHECK_EQUAL(test_resolves, 6);
+    CHECK_EQUAL(dc.hits, 0);
+    dnscache_free(&dc);
+}
+
+/* a stand-in for a slow server, shared by the inflight_client threads */
+#define INFLIGHT_CLIENTS 100
+static inflight_table_t flights;
+static pthread_barrier_t flight_start;
+static int origin_fetches;
+static const char *origin_response =
+    "HTTP/1.0 200 OK\r\nContent-Length: 10\r\n\r\n0123456789";
+
+/* inflight_client  -- request the url once. The leader fetches it from
+ * the slow server a few bytes at a time, the others copy it from the
+ * flight
+ */
+static void *inflight_client(void *vargp)
+{
+    char buf[MAXLINE];
+    size_t len = 0, total = strlen(origin_response);
+    ssize_t n;
+    int leader;
+
+    pthread_barrier_wait(&flight_start);
+    inflight_t *f = inflight_join(&flights, "localhost:80/slow", &leader);
+    if (leader) {
+        __sync_add_and_fetch(&origin_fetches, 1);
+        usleep(200000);  /* time to first byte */
+        while (len < total) {
+            size_t chunk = total - len < 7 ? total - len : 7;
+            inflight_append(f, origin_response + len, chunk);
+            len += chunk;
+            usleep(10000);
+        }
+        inflight_end(&flights, f, 1);
+    } else {
+        while ((n = inflight_read(f, len, buf + len, 5)) > 0) {
+            len += n;
+        }
+        CHECK_EQUAL(n, 0);
+    }
+    CHECK_EQUAL(len, total);
+    inflight_release(f);
+    return NULL;
+}
+
+/* test_inflight  -- 100 concurrent requests for one url make a single
+ * fetch, and all of them get the whole response. A flight that fails
+ * before any byte lets the followers know
+ */
+void test_inflight()
+{
+    pthread_t tids[INFLIGHT_CLIENTS];
+    int i, leader;
+
+    inflight_init(&flights, 16);
+    pthread_barrier_init(&flight_start, NULL, INFLIGHT_CLIENTS);
+    for (i = 0; i < INFLIGHT_CLIENTS; i++) {
+        pthread_create(&tids[i], NULL, inflight_client, NULL);
+    }
+    for (i = 0; i < INFLIGHT_CLIENTS; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    CHECK_EQUAL(origin_fetches, 1);
+    CHECK_EQUAL(flights.leaders, 1);
+    CHECK_EQUAL(flights.followers, INFLIGHT_CLIENTS - 1);
+    pthread_barrier_destroy(&flight_start);
+
+    /* the flight has ended, the next request starts another */
+    char buf[16];
+    inflight_t *f = inflight_join(&flights, "localhost:80/slow", &leader);
+    CHECK_EQUAL(leader, 1);
+    inflight_t *g = inflight_join(&flights, "LOCALHOST:80/slow", &leader);
+    CHECK_EQUAL(leader, 0);
+    CHECK_EQUAL(f == g, 1);
+    CHECK_EQUAL(inflight_followers(f), 1);
+    inflight_end(&flights, f, 0);
+    CHECK_EQUAL(inflight_read(g, 0, buf, sizeof(buf)), -1);
+    inflight_release(g);
+    inflight_release(f);
+    inflight_free(&flights);
+}
+
+#define STATS_THREADS 8
+#define STATS_COUNTS 10000
+
+/* stats_client  -- count like a worker thread does */
+static void *stats_client(void *vargp)
+{
+    int i;
+    for (i = 0; i < STATS_COUNTS; i++) {
+        STATS_ADD(requests, 1);
+        STATS_ADD(bytes_in, 10);
+        STATS_ADD(active, 1);
+        STATS_ADD(active, -1);
+    }
+    stats_connect(1000);
+    return NULL;
+}
+
+/* test_stats  -- the per thread counters add up to what all the threads
+ * counted
+ */
+void test_stats()
+{
+    pthread_t tids[STATS_THREADS];
+    stats_t before, after;
+    static hist_t connect;
+    int i;
+
+    stats_sum(&before);
+    for (i = 0; i < STATS_THREADS; i++) {
+        pthread_create(&tids[i], NULL, stats_client, NULL);
+    }
+    for (i = 0; i < STATS_THREADS; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    stats_sum(&after);
+    CHECK_EQUAL(after.requests - before.requests, STATS_THREADS * STATS_COUNTS);
+    CHECK_EQUAL(after.bytes_in - before.bytes_in,
+            10LL * STATS_THREADS * STATS_COUNTS);
+    CHECK_EQUAL(after.active, before.active);
+    CHECK_EQUAL(after.connects - before.connects, STATS_THREADS);
+    stats_connect_hist(&connect);
+    CHECK_EQUAL(connect.count >= STATS_THREADS, 1);
+    CHECK_EQUAL(hist_percentile(&connect, 50), 1000);
+}
+
+/* test_hist  -- small values are exact, the percentiles of larger ones
+ * are within a bucket of the true value, and merging adds histograms
+ */
+void test_hist()
+{
+    static hist_t h, g;
+    long long i, p;
+
+    hist_init(&h);
+    CHECK_EQUAL(hist_percentile(&h, 50), 0);
+    for (i = 1; i <= 100; i++) {
+        hist_record(&h, i);
+    }
+    CHECK_EQUAL(hist_percentile(&h, 50), 50);
+    CHECK_EQUAL(hist_percentile(&h, 99), 99);
+    CHECK_EQUAL(hist_percentile(&h, 0), 1);
+    CHECK_EQUAL(hist_percentile(&h, 100), 100);
+
+    /* 1 us to 1 s in ns */
+    hist_init(&h);
+    for (i = 1; i <= 1000000; i++) {
+        hist_record(&h, i * 1000);
+    }
+    CHECK_EQUAL(h.count, 1000000);
+    CHECK_EQUAL(hist_mean(&h), 500000500.0);
+    p = hist_percentile(&h, 50);
+    CHECK_EQUAL(p >= 500000000 && p < 500000000 + 500000000 / HIST_SUB_BUCKETS, 1);
+    p = hist_percentile(&h, 99.9);
+    CHECK_EQUAL(p >= 999000000 && p < 999000000 + 999000000 / HIST_SUB_BUCKETS, 1);
+    CHECK_EQUAL(hist_percentile(&h, 100), 1000000000);
+
+    /* too large for the buckets, but max is still exact */
+    hist_init(&g);
+    hist_record(&g, 1LL << 50);
+    hist_record(&g, -5);
+    CHECK_EQUAL(g.min, 0);
+    CHECK_EQUAL(hist_percentile(&g, 100), 1LL << 50);
+    hist_merge(&h, &g);
+    CHECK_EQUAL(h.count, 1000002);
+    CHECK_EQUAL(h.min, 0);
+    CHECK_EQUAL(h.max, 1LL << 50);
+    p = hist_percentile(&h, 50);
+    CHECK_EQUAL(p >= 500000000 && p < 500000000 + 500000000 / HIST_SUB_BUCKETS, 1);
+}
+
 int main()
 {
     test_parse_uri();
     test_bytes_append();
     test_bytes_resizing();
     test_cache();
+    test_cache_find();
+    test_cache_peek();
+    test_cache_policies();
+    test_shard_cache();
+    test_shard_cache_evict();
+    test_slab();
+    test_diskcache();
+    test_sbuf();
+    test_http_framing();
+    test_http_dechunk();
+    test_connpool();
+    test_rio_writev();
+    test_http_request_parse();
+    test_http_request_fuzz();
+    test_http_connection();
+    test_http_cache_info();
+    test_dnscache();
+    test_inflight();
+    test_hist();
+    test_stats();
     return 0;
 }
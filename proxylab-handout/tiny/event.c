@@ -0,0 +1,293 @@
+/*
+ * event.c - the epoll mode of tiny
+ *
+ * Each of nloops threads runs an epoll loop. The listening socket is in
+ * every loop with EPOLLEXCLUSIVE, so a new connection wakes up one
+ * loop, which keeps it until it is closed. Connections are non-blocking
+ * and go through
+ *
+ *   READ_REQUEST -> WRITE_HEAD -> WRITE_BODY
+ *
+ * A CGI request makes its connection blocking and is served in place
+ * by serve_dynamic, holding up the other connections of its loop.
+ */
+#include "tiny.h"
+
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+
+/* max number of events handled per epoll_wait */
+#define MAX_EVENTS 64
+
+typedef enum conn_state_t {
+    READ_REQUEST,  /* reading the request line and headers */
+    WRITE_HEAD,    /* sending the response headers, or an error */
+    WRITE_BODY     /* sending the file with sendfile */
+} conn_state_t;
+
+typedef struct conn_t {
+    conn_state_t state;
+    int fd;
+    char in[MAXBUF];    /* request line and headers */
+    size_t in_len;
+    char out[MAXBUF];   /* response headers, or the whole error response */
+    size_t out_off;
+    size_t out_len;
+    fd_entry_t *file;   /* file of a static response, NULL for an error */
+    off_t file_off;
+} conn_t;
+
+typedef struct event_loop_t {
+    int epfd;
+    int listenfd;
+} event_loop_t;
+
+/*
+ * conn_close - close the connection. Closing the fd takes it out of
+ *     the epoll set
+ */
+static void conn_close(conn_t *c)
+{
+    if (c->file)
+	fdcache_release(&files, c->file);
+    close(c->fd);
+    free(c);
+}
+
+/*
+ * set_events - wait for events on the connection
+ */
+static void set_events(event_loop_t *loop, conn_t *c, unsigned int events)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+	unix_error("epoll_ctl error");
+}
+
+/*
+ * write_response - send what is left of the response. Return 1 once it
+ *     is all sent, 0 if the socket is full, or -1 on error
+ */
+static int write_response(conn_t *c)
+{
+    ssize_t n;
+
+    while (c->state == WRITE_HEAD) {
+	if (c->out_off == c->out_len) {
+	    c->state = WRITE_BODY;
+	    break;
+	}
+	/* with a body to come, the headers can wait for it */
+	n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off,
+		 c->file ? MSG_MORE : 0);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+	}
+	c->out_off += n;
+    }
+    while (c->file && c->file_off < c->file->st.st_size) {
+	n = sendfile(c->fd, c->file->fd, &c->file_off,
+		     c->file->st.st_size - c->file_off);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+	}
+	if (n == 0)
+	    return -1;  /* the file got shorter */
+    }
+    return 1;
+}
+
+/*
+ * start_response - build the response of the request in c->in. Return
+ *     0 once the response is ready to be sent, or -1 if the connection
+ *     is done with (a CGI program has served it)
+ */
+static int start_response(conn_t *c)
+{
+    char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    char filename[MAXLINE], cgiargs[MAXLINE];
+    struct stat sbuf;
+    size_t len;
+
+    if (!quiet)
+	printf("%s", c->in);
+    if (sscanf(c->in, "%s %s %s", method, uri, version) != 3 ||
+	strcasecmp(method, "GET")) {
+	c->out_len = error_response(c->out, sizeof(c->out), method, "501",
+				    "Not Implemented",
+				    "Tiny does not implement this method");
+	return 0;
+    }
+
+    if (parse_uri(uri, filename, cgiargs)) {
+	if ((c->file = open_static(filename, c->out, sizeof(c->out), &len)))
+	    len = static_head(c->out, sizeof(c->out), filename,
+			      c->file->st.st_size);
+	c->out_len = len;
+	return 0;
+    }
+
+    if (stat(filename, &sbuf) < 0) {
+	c->out_len = error_response(c->out, sizeof(c->out), filename, "404",
+				    "Not found",
+				    "Tiny couldn't find this file");
+	return 0;
+    }
+    if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
+	c->out_len = error_response(c->out, sizeof(c->out), filename, "403",
+				    "Forbidden",
+				    "Tiny couldn't run the CGI program");
+	return 0;
+    }
+    /* the CGI program writes to the socket itself, with blocking writes */
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) & ~O_NONBLOCK);
+    serve_dynamic(c->fd, filename, cgiargs);
+    return -1;
+}
+
+/*
+ * read_request - read the request until the blank line after the
+ *     headers. Return 1 once it is all in, 0 if more is to come, or -1
+ *     if the client went away or sent too much
+ */
+static int read_request(conn_t *c)
+{
+    ssize_t n;
+
+    while (1) {
+	if (c->in_len == sizeof(c->in) - 1)
+	    return -1;
+	n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - 1 - c->in_len, 0);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+	}
+	if (n == 0)
+	    return -1;
+	/* the blank line may straddle the previous read */
+	size_t from = c->in_len > 3 ? c->in_len - 3 : 0;
+	c->in_len += n;
+	c->in[c->in_len] = '\0';
+	char *end = strstr(c->in + from, "\r\n\r\n");
+	if (end) {
+	    end[4] = '\0';
+	    return 1;
+	}
+    }
+}
+
+/*
+ * handle - move the connection on after an event
+ */
+static void handle(event_loop_t *loop, conn_t *c)
+{
+    int rc;
+
+    if (c->state == READ_REQUEST) {
+	if ((rc = read_request(c)) == 0)
+	    return;
+	if (rc < 0 || start_response(c) < 0) {
+	    conn_close(c);
+	    return;
+	}
+	c->state = WRITE_HEAD;
+    }
+    /* most responses fit in the socket buffer, try right away */
+    if ((rc = write_response(c)) == 0) {
+	set_events(loop, c, EPOLLOUT);
+	return;
+    }
+    conn_close(c);
+}
+
+/*
+ * accept_all - accept every pending connection
+ */
+static void accept_all(event_loop_t *loop)
+{
+    struct epoll_event ev;
+    conn_t *c;
+    int connfd;
+
+    while ((connfd = accept(loop->listenfd, NULL, NULL)) >= 0) {
+	fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
+	if ((c = malloc(sizeof(conn_t))) == NULL) {
+	    fprintf(stderr, "accept_all: out of memory\n");
+	    close(connfd);
+	    continue;
+	}
+	c->state = READ_REQUEST;
+	c->fd = connfd;
+	c->in_len = 0;
+	c->out_off = c->out_len = 0;
+	c->file = NULL;
+	c->file_off = 0;
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, connfd, &ev) < 0)
+	    unix_error("epoll_ctl error");
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+	errno != ECONNABORTED)
+	fprintf(stderr, "accept_all: %s\n", strerror(errno));
+}
+
+/*
+ * event_loop - the thread routine of an event loop
+ */
+static void *event_loop(void *vargp)
+{
+    event_loop_t *loop = (event_loop_t *)vargp;
+    struct epoll_event events[MAX_EVENTS];
+    int i, n;
+
+    while (1) {
+	if ((n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1)) < 0) {
+	    if (errno != EINTR)
+		unix_error("epoll_wait error");
+	    continue;
+	}
+	for (i = 0; i < n; i++) {
+	    if (events[i].data.ptr == NULL)
+		accept_all(loop);
+	    else
+		handle(loop, (conn_t *)events[i].data.ptr);
+	}
+    }
+    return NULL;
+}
+
+/*
+ * event_serve - serve the connections of listenfd with nloops event
+ *     loops, one per thread. Never returns
+ */
+void event_serve(int listenfd, int nloops)
+{
+    event_loop_t *loops = Malloc(nloops * sizeof(event_loop_t));
+    pthread_t tid;
+    struct epoll_event ev;
+    int i;
+
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    for (i = 0; i < nloops; i++) {
+	loops[i].listenfd = listenfd;
+	if ((loops[i].epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+	    unix_error("epoll_create1 error");
+	/* only one loop is woken up per new connection */
+	ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+	    unix_error("epoll_ctl error");
+	if (i > 0)
+	    Pthread_create(&tid, NULL, event_loop, &loops[i]);
+    }
+    event_loop(&loops[0]);
+}
@@ -0,0 +1,248 @@
+/*
+ * fdcache.c  -- cache of open files for serving static content
+ *
+ * A hit costs no open, stat or mmap: the entry has the descriptor and
+ * the stat of the file. Each file is watched with inotify, and the
+ * pending events are read (without blocking) before every lookup, so a
+ * file that was written, replaced or removed is opened again.
+ */
+
+#include "fdcache.h"
+
+#include <sys/inotify.h>
+
+/* what makes a cached descriptor or stat out of date. Unlinking or
+ * renaming over the file changes its link count, which is IN_ATTRIB */
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | \
+        IN_MOVE_SELF | IN_DELETE_SELF)
+
+/* hash_path  -- FNV-1a of the path */
+static unsigned int hash_path(const char *path)
+{
+    unsigned int h = 2166136261u;
+    while (*path) {
+        h = (h ^ (unsigned char)*path++) * 16777619u;
+    }
+    return h;
+}
+
+/* lru_unlink  -- take the entry out of the lru list */
+static void lru_unlink(fd_entry_t *e)
+{
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+}
+
+/* lru_push  -- make the entry the most recently used */
+static void lru_push(fdcache_t *fc, fd_entry_t *e)
+{
+    e->prev = fc->lru.prev;
+    e->next = &fc->lru;
+    fc->lru.prev->next = e;
+    fc->lru.prev = e;
+}
+
+/* entry_put  -- drop a reference, closing the file with the last one */
+static void entry_put(fd_entry_t *e)
+{
+    if (--e->refcnt == 0) {
+        close(e->fd);
+        free(e->path);
+        free(e);
+    }
+}
+
+/* unwatch  -- remove the watch of e, unless another entry (another path
+ * of the same file) shares it
+ */
+static void unwatch(fdcache_t *fc, fd_entry_t *e)
+{
+    fd_entry_t *other;
+    if (e->wd < 0) {
+        return;
+    }
+    for (other = fc->lru.next; other != &fc->lru; other = other->next) {
+        if (other != e && other->wd == e->wd) {
+            return;
+        }
+    }
+    inotify_rm_watch(fc->inotify_fd, e->wd);
+}
+
+/* drop  -- take the entry out of the cache. Senders still holding it
+ * finish with the old file
+ */
+static void drop(fdcache_t *fc, fd_entry_t *e)
+{
+    fd_entry_t **pp = &fc->buckets[e->hash & (fc->nbuckets - 1)];
+    while (*pp != e) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = e->hnext;
+    lru_unlink(e);
+    unwatch(fc, e);
+    fc->count--;
+    entry_put(e);
+}
+
+/* read_events  -- drop the entries whose files changed since the last
+ * lookup. The inotify descriptor is non-blocking
+ */
+static void read_events(fdcache_t *fc)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(fc->inotify_fd, buf, sizeof(buf))) > 0) {
+        char *p = buf;
+        while (p < buf + n) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            fd_entry_t *e = fc->lru.next, *next;
+            for (; e != &fc->lru; e = next) {
+                next = e->next;
+                if (e->wd == ev->wd) {
+                    drop(fc, e);
+                    fc->invalidated++;
+                }
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+}
+
+/* changed  -- without inotify, whether the file at the path of e is not
+ * the one e has open any more
+ */
+static int changed(fd_entry_t *e)
+{
+    struct stat st;
+    return stat(e->path, &st) < 0 || st.st_ino != e->st.st_ino ||
+        st.st_dev != e->st.st_dev || st.st_size != e->st.st_size ||
+        st.st_mtim.tv_sec != e->st.st_mtim.tv_sec ||
+        st.st_mtim.tv_nsec != e->st.st_mtim.tv_nsec;
+}
+
+void fdcache_init(fdcache_t *fc, size_t max_entries)
+{
+    pthread_mutex_init(&fc->lock, NULL);
+    fc->nbuckets = 16;
+    while (fc->nbuckets < max_entries * 2) {
+        fc->nbuckets *= 2;
+    }
+    fc->buckets = Calloc(fc->nbuckets, sizeof(fd_entry_t *));
+    fc->lru.prev = fc->lru.next = &fc->lru;
+    fc->count = 0;
+    fc->max_entries = max_entries;
+    fc->inotify_fd = max_entries > 0 ?
+        inotify_init1(IN_NONBLOCK | IN_CLOEXEC) : -1;
+    fc->hits = fc->misses = fc->invalidated = 0;
+}
+
+void fdcache_free(fdcache_t *fc)
+{
+    while (fc->lru.next != &fc->lru) {
+        drop(fc, fc->lru.next);
+    }
+    if (fc->inotify_fd >= 0) {
+        close(fc->inotify_fd);
+    }
+    free(fc->buckets);
+    pthread_mutex_destroy(&fc->lock);
+}
+
+/* open_entry  -- open path into a new entry with one reference */
+static fd_entry_t *open_entry(const char *path, unsigned int hash)
+{
+    fd_entry_t *e;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    e = Malloc(sizeof(fd_entry_t));
+    if (fstat(fd, &e->st) < 0) {
+        close(fd);
+        free(e);
+        return NULL;
+    }
+    e->path = strdup(path);
+    e->hash = hash;
+    e->fd = fd;
+    e->refcnt = 1;
+    e->wd = -1;
+    return e;
+}
+
+fd_entry_t *fdcache_open(fdcache_t *fc, const char *path)
+{
+    unsigned int hash = hash_path(path);
+    fd_entry_t *e;
+
+    pthread_mutex_lock(&fc->lock);
+    if (fc->inotify_fd >= 0) {
+        read_events(fc);
+    }
+    for (e = fc->buckets[hash & (fc->nbuckets - 1)]; e; e = e->hnext) {
+        if (e->hash == hash && strcmp(e->path, path) == 0) {
+            break;
+        }
+    }
+    if (e && fc->inotify_fd < 0 && changed(e)) {
+        drop(fc, e);
+        fc->invalidated++;
+        e = NULL;
+    }
+    if (e) {
+        fc->hits++;
+        lru_unlink(e);
+        lru_push(fc, e);
+        e->refcnt++;
+        pthread_mutex_unlock(&fc->lock);
+        return e;
+    }
+    fc->misses++;
+    pthread_mutex_unlock(&fc->lock);
+
+    /* open it outside the lock, a slow disk only holds up this request */
+    if ((e = open_entry(path, hash)) == NULL || fc->max_entries == 0) {
+        return e;
+    }
+
+    pthread_mutex_lock(&fc->lock);
+    if (fc->inotify_fd >= 0) {
+        e->wd = inotify_add_watch(fc->inotify_fd, path, WATCH_MASK);
+    }
+    /* a change between the open and the watch would go unseen, so
+     * check once more. Out of watches, serve it but don't keep it */
+    if (fc->inotify_fd >= 0 && (e->wd < 0 || changed(e))) {
+        unwatch(fc, e);
+        pthread_mutex_unlock(&fc->lock);
+        return e;
+    }
+    fd_entry_t **bucket = &fc->buckets[hash & (fc->nbuckets - 1)];
+    fd_entry_t *old;
+    for (old = *bucket; old; old = old->hnext) {
+        if (old->hash == hash && strcmp(old->path, path) == 0) {
+            /* listed by another thread meanwhile, which shares the
+             * watch. Ours is used once */
+            unwatch(fc, e);
+            pthread_mutex_unlock(&fc->lock);
+            return e;
+        }
+    }
+    if (fc->count == fc->max_entries) {
+        drop(fc, fc->lru.next);
+    }
+    e->hnext = *bucket;
+    *bucket = e;
+    lru_push(fc, e);
+    fc->count++;
+    e->refcnt++;
+    pthread_mutex_unlock(&fc->lock);
+    return e;
+}
+
+void fdcache_release(fdcache_t *fc, fd_entry_t *e)
+{
+    pthread_mutex_lock(&fc->lock);
+    entry_put(e);
+    pthread_mutex_unlock(&fc->lock);
+}
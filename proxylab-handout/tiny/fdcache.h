@@ -0,0 +1,55 @@
+/*
+ * fdcache.h  -- cache of open files for serving static content
+ */
+
+#ifndef __FDCACHE_H__
+#define __FDCACHE_H__
+
+#include "csapp.h"
+
+/* an open file and what stat said about it */
+typedef struct fd_entry_t {
+    char *path;
+    unsigned int hash;
+    int fd;
+    struct stat st;
+    int refcnt;  /* the cache holds one while the entry is listed */
+    int wd;  /* inotify watch of the file, -1 without inotify */
+    struct fd_entry_t *hnext;  /* next entry in the same hash bucket */
+    struct fd_entry_t *prev, *next;  /* least recently used first */
+} fd_entry_t;
+
+/* fd cache. At most max_entries files are kept open; the least recently
+ * used one is closed to make room. A file changed on disk is dropped
+ * when inotify tells, or, without inotify, when a stat of its path
+ * finds another inode, size or mtime.
+ */
+typedef struct fdcache_t {
+    pthread_mutex_t lock;  /* protects everything below */
+    fd_entry_t **buckets;  /* nbuckets is a power of 2 */
+    size_t nbuckets;
+    fd_entry_t lru;  /* sentinel of the list */
+    size_t count;
+    size_t max_entries;
+    int inotify_fd;  /* -1 if inotify is not available */
+
+    /* statistics */
+    long long hits;
+    long long misses;
+    long long invalidated;
+} fdcache_t;
+
+void fdcache_init(fdcache_t *fc, size_t max_entries);
+void fdcache_free(fdcache_t *fc);
+
+/* fdcache_open  -- the open file at path, from the cache or opened now.
+ * The caller reads it with pread or sendfile, which leave the shared
+ * file offset alone, and gives it back with fdcache_release. Return
+ * NULL with errno set if the file can't be opened. With max_entries 0
+ * every call opens the file
+ */
+fd_entry_t *fdcache_open(fdcache_t *fc, const char *path);
+
+void fdcache_release(fdcache_t *fc, fd_entry_t *e);
+
+#endif
@@ -0,0 +1,24 @@
+/*
+ * tiny.h - what the serving modes of tiny share
+ */
+#ifndef __TINY_H__
+#define __TINY_H__
+
+#include "csapp.h"
+#include "fdcache.h"
+
+extern fdcache_t files;  /* open static files */
+extern int quiet;        /* don't log requests */
+
+int parse_uri(char *uri, char *filename, char *cgiargs);
+void get_filetype(char *filename, char *filetype);
+size_t static_head(char *buf, size_t size, char *filename, off_t filesize);
+size_t error_response(char *buf, size_t size, char *cause, char *errnum,
+		      char *shortmsg, char *longmsg);
+fd_entry_t *open_static(char *filename, char *buf, size_t size, size_t *len);
+void serve_dynamic(int fd, char *filename, char *cgiargs);
+
+/* event.c */
+void event_serve(int listenfd, int nloops);
+
+#endif /* __TINY_H__ */
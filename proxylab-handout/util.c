@@ -1,6 +1,7 @@
 #include "util.h"
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
 
 
 /* match  -- match the string with the pattern. The match
@@ -94,3 +95,11 @@ void parse_header(const char *line, char *name, char *value)
     cur = copy_until(line, cur, ":", name);
     copy_until(line, cur+1, "\r\n", value);
 }
+
+/* now_ns  -- monotonic clock in nanoseconds */
+long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
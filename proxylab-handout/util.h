@@ -18,5 +18,9 @@ void parse_uri(const char *uri, char *host, char *port, char *dir);
 
 void parse_header(const char *line, char *name, char *value);
 
+/* time utilities */
+
+long long now_ns();
+
 
 #endif